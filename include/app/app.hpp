@@ -13,17 +13,6 @@
 #include "app/image.hpp"
 #include "app/macros.hpp"
 
-typedef void*(*pthread_callback)(void*);
-
-#define MAX_NSEC 999999999
-
-/**
- * @brief get current time from CLOCK_MONOTONIC as single value (seconds as double)
- * 
- * @return double 
- */
-double current_time(void);
-
 #define MASK(LENGTH) ((1<<(LENGTH))-1)
 
 typedef enum InputKeyCode{
@@ -3,10 +3,6 @@
 #include <cstdint>
 #include <cstdlib>
 
-#ifdef VK_USE_PLATFORM_XCB_KHR
-#include <x86intrin.h>
-#endif
-
 namespace bitUtil {
 
 #define UINT32_1 ((uint32_t)1u)
@@ -191,16 +187,16 @@ static inline T reverse_bits(
     return ret;
 }
 
-#ifdef VK_USE_PLATFORM_XCB_KHR
+/// number of trailing zero bits, 32 for v==0
 [[maybe_unused,gnu::hot]]
 constexpr static inline uint32_t tzcnt_32(const uint32_t v){
-    #ifdef __clang__
-        return (uint32_t)_mm_tzcnt_32(v);
-    #elif defined(__GNUC__)
-        return __builtin_ia32_lzcnt_u32(v);
-    #endif
+    return v==0?32:(uint32_t)__builtin_ctz(v);
+}
+/// number of trailing zero bits, 64 for v==0
+[[maybe_unused,gnu::hot]]
+constexpr static inline uint32_t tzcnt_64(const uint64_t v){
+    return v==0?64:(uint32_t)__builtin_ctzll(v);
 }
-#endif
 
 template<typename T>
 constexpr static inline T byteswap(T v, uint8_t num_bytes){
@@ -4,6 +4,7 @@
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 
 #include "app/macros.hpp"
 #include "app/bit_util.hpp"
@@ -17,17 +18,33 @@ enum Direction{
     BITSTREAM_DIRECTION_LEFT_TO_RIGHT,
 };
 
+/// a contiguous part of the data of a stream, see BitStream::BitStream_newFromSegments
+typedef struct Segment{
+    uint8_t* data;
+    uint64_t size;
+}Segment;
+
 template <Direction DIRECTION,bool REMOVE_JPEG_BYTE_STUFFING>
 class BitStream{
     public:
+        /// the current segment of data (all data, if the stream was not created from segments)
         uint8_t* data;
         uint64_t data_size;
 
         uint64_t next_data_index;
 
+        /// the segments that follow the current one
+        const Segment* next_segments;
+        uint64_t num_next_segments;
+
         uint64_t buffer;
         uint64_t buffer_bits_filled;
 
+        /// number of zero bytes appended to the buffer after the end of data was reached (they are always the last bytes in the buffer)
+        uint64_t num_padding_bytes;
+        /// number of calls to fill_buffer, see ImageDecodeStats
+        uint64_t num_refills;
+
     /**
     * @brief initialise stream
     * 
@@ -37,6 +54,35 @@ class BitStream{
     */
     static void BitStream_new(BitStream* stream,void* const data,const uint64_t data_size)noexcept;
 
+    /**
+    * @brief initialise stream over data that is split into segments, e.g. the payloads of consecutive chunks of a file
+    *
+    * the stream continues with the next segment once a segment is consumed, so the segments are read as if they
+    * were one contiguous buffer. the segments must outlive the stream.
+    *
+    * @param stream
+    * @param segments
+    * @param num_segments
+    */
+    static void BitStream_newFromSegments(BitStream* stream,const Segment* const segments,const uint64_t num_segments)noexcept;
+
+    /// continue with the next (non-empty) segment, returns false if there is none
+    inline bool next_segment()noexcept{
+        while(this->num_next_segments>0){
+            const Segment* const segment=this->next_segments;
+            this->next_segments++;
+            this->num_next_segments--;
+
+            if(segment->size>0){
+                this->data=segment->data;
+                this->data_size=segment->size;
+                this->next_data_index=0;
+                return true;
+            }
+        }
+        return false;
+    }
+
     /**
     * @brief advance stream
     * 
@@ -60,21 +106,84 @@ class BitStream{
 
     /// advance stream by some bits
     ///
-    /// may not skip more bits than are present in the buffer currently
-    [[gnu::always_inline,gnu::flatten,maybe_unused]]
-    inline void advance(
+    /// may not skip more bits than are present in the buffer currently, returns false (without advancing) if n_bits is larger
+    [[gnu::always_inline,gnu::flatten,maybe_unused,nodiscard]]
+    inline bool advance(
         const uint8_t n_bits
     )noexcept{
-        if (n_bits>this->buffer_bits_filled) {
-            fprintf(stderr, "bitstream advance by %d bits invalid with %" PRIu64 " current buffer length\n",n_bits,this->buffer_bits_filled);
-            exit(-50);
-        }
+        if (n_bits>this->buffer_bits_filled)
+            return false;
 
         this->advance_unsafe(n_bits);
+        return true;
+    }
+
+    /// true if bits past the end of data have been consumed, i.e. the data was truncated
+    ///
+    /// reading past the end of data is safe: the stream then returns zero bits. so a decoder can run its fast path
+    /// without bounds checks, and only needs to check this once in a while (e.g. after each block or row).
+    [[gnu::always_inline,maybe_unused]]
+    inline bool overrun()const noexcept{
+        return this->num_padding_bytes*8>this->buffer_bits_filled;
+    }
+
+    /// true if all bits of the data have been consumed, i.e. the buffer holds nothing but padding (see overrun)
+    [[maybe_unused]]
+    inline bool at_end()const noexcept{
+        if(this->buffer_bits_filled>this->num_padding_bytes*8 || this->next_data_index<this->data_size)
+            return false;
+        for(uint64_t i=0;i<this->num_next_segments;i++)
+            if(this->next_segments[i].size>0)
+                return false;
+        return true;
     }
 
     inline void fill_buffer()noexcept;
 
+    /// skip the bits up to the next byte boundary (no-op if the stream is at a byte boundary)
+    [[gnu::always_inline,maybe_unused]]
+    inline void align_to_byte()noexcept{
+        // whole bytes are added to the buffer, so the bits of a partially consumed byte are the last few bits in it
+        this->advance_unsafe((uint8_t)(this->buffer_bits_filled%8));
+    }
+
+    /// copy the next num_bytes bytes of the stream to dst, the stream must be at a byte boundary (see align_to_byte)
+    ///
+    /// returns false if the data ends before, in which case the stream is overrun
+    [[nodiscard,maybe_unused]]
+    inline bool read_bytes(uint8_t* dst,uint64_t num_bytes)noexcept{
+        static_assert(!REMOVE_JPEG_BYTE_STUFFING,"stuffing bytes would be copied");
+
+        // the bytes in the buffer come first
+        while(num_bytes>0 && this->buffer_bits_filled>=8){
+            *dst++=(uint8_t)this->get_bits_unsafe(8);
+            this->advance_unsafe(8);
+            num_bytes--;
+        }
+        if(this->overrun())
+            return false;
+        if(num_bytes==0)
+            return true;
+
+        // the buffer is empty now, apart from bits of the following bytes (see fill_buffer), which are copied from data below
+        this->buffer=0;
+
+        while(num_bytes>0){
+            if(this->next_data_index>=this->data_size && !this->next_segment()){
+                // mark the stream as overrun
+                this->num_padding_bytes=1;
+                return false;
+            }
+
+            const uint64_t num_segment_bytes=bitUtil::min(num_bytes,this->data_size-this->next_data_index);
+            memcpy(dst,this->data+this->next_data_index,num_segment_bytes);
+            dst+=num_segment_bytes;
+            num_bytes-=num_segment_bytes;
+            this->next_data_index+=num_segment_bytes;
+        }
+        return true;
+    }
+
     /// skip bits in stream
     ///
     /// number may be much larger than cache size
@@ -84,10 +193,21 @@ class BitStream{
     )noexcept{
         if(n_bits>this->buffer_bits_filled){
             uint64_t remaining_bits=n_bits-this->buffer_bits_filled;
-            this->next_data_index+=remaining_bits/8;
+
+            uint64_t remaining_bytes=remaining_bits/8;
+            while(remaining_bytes>this->data_size-this->next_data_index && this->num_next_segments>0){
+                remaining_bytes-=this->data_size-this->next_data_index;
+                this->next_data_index=this->data_size;
+                discard this->next_segment();
+            }
+            this->next_data_index+=remaining_bytes;
 
             this->buffer_bits_filled=0;
             this->buffer=0;
+            this->num_padding_bytes=0;
+            // skipped past the end of data: mark the stream as overrun
+            if(this->next_data_index>this->data_size)
+                this->num_padding_bytes=9;
 
             remaining_bits=remaining_bits%8;
             if(remaining_bits>0){
@@ -170,50 +290,95 @@ void BitStream<DIR,REM_JPG_STUFF>::BitStream_new(BitStream* stream,void* const d
     stream->data=static_cast<uint8_t*>(data);
     stream->data_size=data_size;
     stream->next_data_index=0;
+    stream->next_segments=NULL;
+    stream->num_next_segments=0;
     stream->buffer=0;
     stream->buffer_bits_filled=0;
+    stream->num_padding_bytes=0;
+    stream->num_refills=0;
+}
+
+template <Direction DIR,bool REM_JPG_STUFF>
+void BitStream<DIR,REM_JPG_STUFF>::BitStream_newFromSegments(BitStream* stream,const Segment* const segments,const uint64_t num_segments)noexcept{
+    BitStream_new(stream,NULL,0);
+    stream->next_segments=segments;
+    stream->num_next_segments=num_segments;
+    discard stream->next_segment();
 }
 
 /**
 * @brief fill internal bit buffer (used for fast lookup)
-* this function is called automatically (internally) when required
+* this function is called automatically (internally) when required.
+* continues with the next segment at the end of a segment, and past the end of data, zero bytes are appended (and counted in num_padding_bytes), see overrun.
 * @param stream 
 */
 template <Direction DIRECTION,bool REMOVE_JPEG_BYTE_STUFFING>
 [[gnu::hot,gnu::flatten]]
 inline void BitStream<DIRECTION,REMOVE_JPEG_BYTE_STUFFING>::fill_buffer(
 )noexcept{
-    uint64_t num_bytes_missing = (64-this->buffer_bits_filled)/8;
+    this->num_refills++;
 
-    if(this->next_data_index+num_bytes_missing>this->data_size){
-        num_bytes_missing=this->data_size-this->next_data_index;
-    }
+    const uint64_t num_bytes_missing = (64-this->buffer_bits_filled)/8;
 
     if constexpr(DIRECTION==BITSTREAM_DIRECTION_RIGHT_TO_LEFT){
         uint64_t new_bytes=0;
         for(uint64_t i=0; i<num_bytes_missing; i++){
+            if(this->next_data_index>=this->data_size && !this->next_segment()){
+                this->num_padding_bytes++;
+                continue;
+            }
+
             const uint64_t next_byte = this->data[this->next_data_index++];
 
             const uint64_t shift_by = i*8;
             new_bytes |= next_byte << shift_by;
 
             if constexpr(REMOVE_JPEG_BYTE_STUFFING)
-                if(next_byte==0xFF && this->data[this->next_data_index]==0){
+                if(next_byte==0xFF && this->next_data_index<this->data_size && this->data[this->next_data_index]==0){
                     this->next_data_index++;
                 }
         }
         this->buffer |= new_bytes << this->buffer_bits_filled;
         this->buffer_bits_filled += num_bytes_missing*8;
     }else if constexpr(DIRECTION==BITSTREAM_DIRECTION_LEFT_TO_RIGHT){
+        if constexpr(REMOVE_JPEG_BYTE_STUFFING){
+            // fast path: if none of the next 8 bytes is 0xFF, there is no stuffing to remove, and the bytes are appended at once
+            if(num_bytes_missing>0 && this->next_data_index+8<=this->data_size){
+                uint64_t next_bytes;
+                memcpy(&next_bytes,this->data+this->next_data_index,8);
+
+                // a byte is 0xFF iff the inverted byte is zero
+                const uint64_t inverted=~next_bytes;
+                const bool contains_0xff=((inverted-0x0101010101010101ull)&~inverted&0x8080808080808080ull)!=0;
+
+                if(!contains_0xff){
+                    const uint64_t num_bits_missing=num_bytes_missing*8;
+
+                    // first byte in the most significant position, and only the missing bytes
+                    const uint64_t new_bytes=(__builtin_bswap64(next_bytes)>>(64-num_bits_missing))<<(64-num_bits_missing);
+
+                    this->next_data_index+=num_bytes_missing;
+                    this->buffer |= new_bytes >> this->buffer_bits_filled;
+                    this->buffer_bits_filled += num_bits_missing;
+                    return;
+                }
+            }
+        }
+
         uint64_t new_bytes=0;
         for(uint64_t i=0; i<num_bytes_missing; i++){
+            if(this->next_data_index>=this->data_size && !this->next_segment()){
+                this->num_padding_bytes++;
+                continue;
+            }
+
             const uint64_t next_byte = this->data[this->next_data_index++];
 
             const uint64_t shift_by = (7-i)*8;
             new_bytes |= next_byte << shift_by;
 
             if constexpr(REMOVE_JPEG_BYTE_STUFFING)
-                if(next_byte==0xFF && this->data[this->next_data_index]==0){
+                if(next_byte==0xFF && this->next_data_index<this->data_size && this->data[this->next_data_index]==0){
                     this->next_data_index++;
                 }
         }
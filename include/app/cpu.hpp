@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <initializer_list>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <cpuid.h>
+    #include <x86intrin.h>
+#endif
+
+namespace cpu{
+
+/// instruction set levels that kernels are specialised for, in increasing order
+enum class Isa:uint8_t{
+    /// no vector instructions beyond what the compiler targets by default
+    GENERIC,
+
+    SSSE3,
+    /// avx2, and carry-less multiplication (pclmul, which every cpu with avx2 has)
+    AVX2,
+    /// avx-512 foundation and byte/word instructions
+    AVX512,
+
+    NEON,
+};
+
+[[maybe_unused]]
+static const char* Isa_name(const Isa isa){
+    switch(isa){
+        case Isa::GENERIC: return "generic";
+        case Isa::SSSE3: return "ssse3";
+        case Isa::AVX2: return "avx2";
+        case Isa::AVX512: return "avx512";
+        case Isa::NEON: return "neon";
+    }
+    return "unknown";
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+    /// query cpuid (and whether the os saves the extended registers, via xgetbv) for the highest supported isa
+    [[maybe_unused]]
+    static Isa detect_isa(){
+        uint32_t eax,ebx,ecx,edx;
+        if(!__get_cpuid(1,&eax,&ebx,&ecx,&edx))
+            return Isa::GENERIC;
+
+        const bool has_ssse3=(ecx&bit_SSSE3)!=0;
+        const bool has_osxsave=(ecx&bit_OSXSAVE)!=0;
+        const bool has_avx=(ecx&bit_AVX)!=0;
+        const bool has_pclmul=(ecx&bit_PCLMUL)!=0;
+
+        if(!has_ssse3)
+            return Isa::GENERIC;
+        if(!has_osxsave || !has_avx)
+            return Isa::SSSE3;
+
+        uint32_t xcr0_low,xcr0_high;
+        __asm__("xgetbv":"=a"(xcr0_low),"=d"(xcr0_high):"c"(0));
+
+        // xmm and ymm state
+        const bool os_saves_ymm=(xcr0_low&0x6)==0x6;
+        // additionally opmask and zmm state
+        const bool os_saves_zmm=(xcr0_low&0xE6)==0xE6;
+
+        if(!os_saves_ymm || !__get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx))
+            return Isa::SSSE3;
+
+        const bool has_avx2=(ebx&bit_AVX2)!=0;
+        const bool has_avx512=(ebx&bit_AVX512F)!=0 && (ebx&bit_AVX512BW)!=0;
+
+        if(!has_avx2 || !has_pclmul)
+            return Isa::SSSE3;
+        if(!has_avx512 || !os_saves_zmm)
+            return Isa::AVX2;
+
+        return Isa::AVX512;
+    }
+#elif defined(__aarch64__)
+    [[maybe_unused]]
+    static Isa detect_isa(){
+        // neon is part of the armv8-a baseline
+        return Isa::NEON;
+    }
+#else
+    [[maybe_unused]]
+    static Isa detect_isa(){
+        return Isa::GENERIC;
+    }
+#endif
+
+/**
+ * @brief instruction set used by the kernels in this process, detected once on first use
+ *
+ * the environment variable CPU_MAX_ISA (one of the Isa_name values) caps the detected level, e.g. to compare kernels
+ * on one machine. it is ignored if it names an isa the cpu does not support.
+ */
+[[maybe_unused]]
+inline Isa isa(){
+    static const Isa selected_isa=[]{
+        const Isa detected=detect_isa();
+
+        const char* const max_isa_name=getenv("CPU_MAX_ISA");
+        if(max_isa_name==nullptr)
+            return detected;
+
+        for(const Isa candidate:{Isa::GENERIC,Isa::SSSE3,Isa::AVX2,Isa::AVX512,Isa::NEON}){
+            if(strcmp(max_isa_name,Isa_name(candidate))!=0)
+                continue;
+
+            // neon and the x86 levels are not comparable
+            if(candidate==Isa::GENERIC || (candidate!=Isa::NEON && detected!=Isa::NEON && candidate<detected))
+                return candidate;
+        }
+        return detected;
+    }();
+
+    return selected_isa;
+}
+
+/**
+ * @brief cycle counter, e.g. for microbenchmarks
+ *
+ * this is the time stamp counter on x86 (which ticks at the nominal frequency of the cpu, independent of the current one),
+ * the virtual counter on arm64 (which ticks at a fixed, lower frequency), and nanoseconds otherwise.
+ * the counter is not serializing, and not synchronised between cores on all systems.
+ */
+[[gnu::always_inline,maybe_unused]]
+inline uint64_t timestamp()noexcept{
+    #if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+    #elif defined(__aarch64__)
+        uint64_t ticks;
+        __asm__ volatile("mrs %0, cntvct_el0":"=r"(ticks));
+        return ticks;
+    #else
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        return (uint64_t)now.tv_sec*1000000000ull+(uint64_t)now.tv_nsec;
+    #endif
+}
+
+};
@@ -7,8 +7,11 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <mutex>
+#include <atomic>
+#include <new>
 
-#include "app.hpp"
+#include "macros.hpp"
 #include "bitstream.hpp"
 #include "bit_util.hpp"
 #include "error.hpp"
@@ -30,7 +33,18 @@ namespace huffman{
             };
 
             uint8_t max_code_length_bits;
-            struct LookupLeaf* lookup_table;
+            const struct LookupLeaf* lookup_table;
+            /// false if lookup_table is shared with other tables (e.g. a compile-time table, or one held by a CodingTableCache), in which case destroy does not free it
+            bool owns_lookup_table;
+            /// number of tables that share lookup_table, if it is held by a CodingTableCache (NULL otherwise). destroy drops one reference,
+            /// and the last one frees the lookup table.
+            std::atomic<uint32_t>* lookup_table_references;
+
+            /// lookup table of a code that is known at compile time, see build_static_lookup_table
+            template<uint8_t MAX_CODE_LENGTH_BITS>
+            struct StaticLookupTable{
+                struct LookupLeaf leaves[1u<<MAX_CODE_LENGTH_BITS];
+            };
 
         private:
             struct ParseLeaf{
@@ -59,12 +73,17 @@ namespace huffman{
 
         /**
         * @brief create a new huffman coding table at the target location based on the input values
+        *
+        * returns false (without allocating anything) if the code lengths do not describe a valid prefix code, i.e. if
+        * there are more codes of some length than fit into the code space.
+        * an incomplete code is valid, bit sequences that are not assigned to any value decode to value 0.
         * 
         * @param table
         * @param value_code_lengths 
         * @param values 
         */
-        static void CodingTable_new(
+        [[nodiscard]]
+        static bool CodingTable_new(
             CodingTable* const  table,
 
             int total_num_values,
@@ -73,27 +92,24 @@ namespace huffman{
         ){
             uint8_t value_code_lengths[MAX_HUFFMAN_TABLE_ENTRIES];
             VALUE values[MAX_HUFFMAN_TABLE_ENTRIES];
-            uint8_t num_values_of_length[MAX_HUFFMAN_TABLE_CODE_LENGTH];
 
             int num_filtered_leafs=0;
             for(int i=0;i<total_num_values;i++){
                 auto len=unfiltered_value_code_lengths[i];
                 if(len==0)
                     continue;
+                if(len>MAX_HUFFMAN_TABLE_CODE_LENGTH)
+                    return false;
 
                 value_code_lengths[num_filtered_leafs]=len;
                 values[num_filtered_leafs]=unfiltered_values[i];
 
-                num_values_of_length[len-1]++;
-
                 num_filtered_leafs++;
             }
             total_num_values=num_filtered_leafs;
 
-            for(int i=total_num_values;i<MAX_HUFFMAN_TABLE_CODE_LENGTH;i++)
-                num_values_of_length[i]=0;
-
-            table->max_code_length_bits=0;
+            // at least one bit is looked up, even if the code is empty
+            table->max_code_length_bits=1;
 
             struct ParseLeaf parse_leafs[MAX_HUFFMAN_TABLE_ENTRIES];
             for (int i=0; i<total_num_values; i++) {
@@ -112,6 +128,14 @@ namespace huffman{
                 bl_count[parse_leafs[i].len]++;
             }
 
+            // kraft inequality: the codes of all lengths must fit into the code space of the longest code
+            uint64_t code_space_used=0;
+            for (uint32_t i=1; i<=MAX_HUFFMAN_TABLE_CODE_LENGTH; i++) {
+                code_space_used+=(uint64_t)bl_count[i]<<(MAX_HUFFMAN_TABLE_CODE_LENGTH-i);
+            }
+            if(code_space_used>(1ull<<MAX_HUFFMAN_TABLE_CODE_LENGTH))
+                return false;
+
             uint32_t next_code[MAX_HUFFMAN_TABLE_CODE_LENGTH+1];
             memset(next_code,0,(MAX_HUFFMAN_TABLE_CODE_LENGTH+1)*4);
             for (uint32_t i=1; i<=table->max_code_length_bits; i++) {
@@ -127,14 +151,20 @@ namespace huffman{
             }
 
             uint32_t num_possible_leafs=1<<table->max_code_length_bits;
-            table->lookup_table=static_cast<struct LookupLeaf*>(malloc(num_possible_leafs*sizeof(struct LookupLeaf)));
-            //memset(table->lookup_table,0,num_possible_leafs*sizeof(struct LookupLeaf));
+            struct LookupLeaf* const lookup_table=static_cast<struct LookupLeaf*>(malloc(num_possible_leafs*sizeof(struct LookupLeaf)));
+            if(!lookup_table)
+                return false;
+
+            // unassigned bit sequences (of an incomplete code) consume all looked up bits
+            for (uint32_t i=0; i<num_possible_leafs; i++) {
+                lookup_table[i].value=VALUE{};
+                lookup_table[i].len=table->max_code_length_bits;
+            }
+
             for (int i=0; i<total_num_values; i++) {
                 struct ParseLeaf* leaf=&parse_leafs[i];
 
                 uint32_t mask_len=table->max_code_length_bits - leaf->len;
-                if(leaf->len>table->max_code_length_bits)
-                    bail(FATAL_UNEXPECTED_ERROR,"this should not be possible %d > %d",leaf->len,table->max_code_length_bits);
                 uint32_t mask=bitUtil::get_mask_u32(mask_len);
 
                 for (uint32_t j=0; j<=mask; j++) {
@@ -144,17 +174,222 @@ namespace huffman{
                     else
                         leaf_index=(j<<leaf->len)+leaf->code;
                     
-                    table->lookup_table[leaf_index].value=leaf->value;
-                    table->lookup_table[leaf_index].len=leaf->len;
+                    lookup_table[leaf_index].value=leaf->value;
+                    lookup_table[leaf_index].len=leaf->len;
+                }
+            }
+
+            table->lookup_table=lookup_table;
+            table->owns_lookup_table=true;
+            table->lookup_table_references=nullptr;
+
+            return true;
+        }
+
+        /**
+        * @brief build the lookup table of a code at compile time
+        *
+        * the code is defined like a jpeg DHT table: 16 bytes with the number of codes of length 1 to 16 bits,
+        * followed by the values in order of increasing code length. MAX_CODE_LENGTH_BITS must be the length of the longest code.
+        *
+        * @param definition
+        */
+        template<uint8_t MAX_CODE_LENGTH_BITS>
+        static constexpr StaticLookupTable<MAX_CODE_LENGTH_BITS> build_static_lookup_table(
+            const uint8_t* const definition
+        ){
+            static_assert(BITSTREAM_DIRECTION==bitStream::BITSTREAM_DIRECTION_LEFT_TO_RIGHT,"static lookup tables are only implemented for left-to-right bitstreams");
+            static_assert(MAX_CODE_LENGTH_BITS>0 && MAX_CODE_LENGTH_BITS<=MAX_HUFFMAN_TABLE_CODE_LENGTH);
+
+            StaticLookupTable<MAX_CODE_LENGTH_BITS> table{};
+
+            const uint8_t* const values=definition+MAX_HUFFMAN_TABLE_CODE_LENGTH;
+            uint32_t value_index=0;
+            uint32_t code=0;
+            for(uint32_t len=1;len<=MAX_CODE_LENGTH_BITS;len++){
+                const uint32_t mask_len=MAX_CODE_LENGTH_BITS-len;
+                for(uint32_t i=0;i<definition[len-1];i++){
+                    const struct LookupLeaf leaf={values[value_index++],static_cast<uint8_t>(len)};
+
+                    const uint32_t first_leaf_index=code<<mask_len;
+                    for(uint32_t j=0;j<(1u<<mask_len);j++)
+                        table.leaves[first_leaf_index+j]=leaf;
+
+                    code++;
                 }
+                code<<=1;
             }
+
+            return table;
+        }
+
+        /// use a lookup table built by build_static_lookup_table (which is not freed by destroy)
+        template<uint8_t MAX_CODE_LENGTH_BITS>
+        void use_static_lookup_table(const StaticLookupTable<MAX_CODE_LENGTH_BITS>* const static_table)noexcept{
+            this->max_code_length_bits=MAX_CODE_LENGTH_BITS;
+            this->lookup_table=static_table->leaves;
+            this->owns_lookup_table=false;
+            this->lookup_table_references=nullptr;
         }
         
         void destroy()noexcept{
-            if(this->lookup_table){
-                free(this->lookup_table);
-                this->lookup_table=nullptr;
-            }
+            if(this->lookup_table_references){
+                // the last of the tables that share the lookup table frees it
+                if(this->lookup_table_references->fetch_sub(1,std::memory_order_acq_rel)==1){
+                    free(const_cast<struct LookupLeaf*>(this->lookup_table));
+                    delete this->lookup_table_references;
+                }
+            }else if(this->lookup_table && this->owns_lookup_table)
+                free(const_cast<struct LookupLeaf*>(this->lookup_table));
+
+            this->lookup_table=nullptr;
+            this->owns_lookup_table=false;
+            this->lookup_table_references=nullptr;
         }
     };
+
+    /**
+    * @brief process-wide cache of coding tables, keyed by the bytes that define a table (e.g. a jpeg DHT table definition)
+    *
+    * tables are built once per distinct definition, then shared (read-only) by all users. the lookup tables are reference counted
+    * (see CodingTable::lookup_table_references): once all slots are used, the table that was used least recently is evicted, and
+    * freed when the last table that shares it is destroyed. tables are built without holding the lock, i.e. a miss does not stall
+    * the threads that look up other tables.
+    * safe to use from multiple threads.
+    */
+    template<typename CODING_TABLE,uint32_t MAX_KEY_SIZE,uint32_t NUM_SLOTS=32>
+    class CodingTableCache{
+        private:
+            struct Entry{
+                bool used;
+                uint64_t hash;
+                /// value of use_counter at the last use of the entry
+                uint64_t last_use;
+                uint32_t key_size;
+                uint8_t key[MAX_KEY_SIZE];
+
+                /// holds one reference to the shared lookup table
+                CODING_TABLE table;
+            };
+
+            static inline Entry entries[NUM_SLOTS]={};
+            static inline uint64_t use_counter=0;
+            static inline std::mutex mutex;
+
+            /// 64 bit FNV-1a
+            static uint64_t hash_key(const uint8_t* const key,const uint32_t key_size)noexcept{
+                uint64_t hash=0xcbf29ce484222325ull;
+                for(uint32_t i=0;i<key_size;i++){
+                    hash^=key[i];
+                    hash*=0x100000001b3ull;
+                }
+                return hash;
+            }
+
+            /// the entry of key, NULL if it is not cached. with mutex held.
+            static Entry* find(const uint64_t hash,const uint8_t* const key,const uint32_t key_size)noexcept{
+                for(uint32_t i=0;i<NUM_SLOTS;i++){
+                    Entry* const entry=&entries[i];
+                    if(entry->used && entry->hash==hash && entry->key_size==key_size && memcmp(entry->key,key,key_size)==0)
+                        return entry;
+                }
+                return nullptr;
+            }
+
+            /// set table to (a new reference of) the table of entry. with mutex held.
+            static void share(Entry* const entry,CODING_TABLE* const table)noexcept{
+                entry->table.lookup_table_references->fetch_add(1,std::memory_order_relaxed);
+                entry->last_use=++use_counter;
+                *table=entry->table;
+            }
+
+        public:
+            typedef void(*CreateTable)(CODING_TABLE* table,const uint8_t* key,uint32_t key_size);
+
+            /**
+            * @brief set table to the cached table defined by key, creating (and caching) it with create_table on first use
+            *
+            * the table must be destroyed as usual, which frees it once no other table (and the cache) shares it.
+            *
+            * @param table
+            * @param key
+            * @param key_size
+            * @param create_table
+            */
+            static void get(
+                CODING_TABLE* const table,
+                const uint8_t* const key,
+                const uint32_t key_size,
+                const CreateTable create_table
+            ){
+                if(key_size>MAX_KEY_SIZE){
+                    create_table(table,key,key_size);
+                    return;
+                }
+
+                const uint64_t hash=hash_key(key,key_size);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+
+                    Entry* const entry=find(hash,key,key_size);
+                    if(entry){
+                        share(entry,table);
+                        return;
+                    }
+                }
+
+                // build the table without holding the lock (a table of 16 bit codes has 64K entries)
+                CODING_TABLE created;
+                create_table(&created,key,key_size);
+
+                // one reference for the cache, one for the caller. if it cannot be allocated, the table is only owned by the caller.
+                std::atomic<uint32_t>* const references=new(std::nothrow) std::atomic<uint32_t>(2);
+                if(!references){
+                    *table=created;
+                    return;
+                }
+
+                CODING_TABLE evicted{};
+                bool cached_meanwhile=false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+
+                    // another thread may have cached the same table while this one was built
+                    Entry* entry=find(hash,key,key_size);
+                    if(entry){
+                        share(entry,table);
+                        cached_meanwhile=true;
+                    }else{
+                        // an unused slot, or the one used least recently
+                        entry=&entries[0];
+                        for(uint32_t i=0;i<NUM_SLOTS && entry->used;i++)
+                            if(!entries[i].used || entries[i].last_use<entry->last_use)
+                                entry=&entries[i];
+
+                        // the cache drops its reference once the lock is released, users of the evicted table keep theirs
+                        if(entry->used)
+                            evicted=entry->table;
+
+                        created.owns_lookup_table=false;
+                        created.lookup_table_references=references;
+
+                        entry->used=true;
+                        entry->hash=hash;
+                        entry->last_use=++use_counter;
+                        entry->key_size=key_size;
+                        memcpy(entry->key,key,key_size);
+                        entry->table=created;
+
+                        *table=created;
+                    }
+                }
+
+                if(cached_meanwhile){
+                    delete references;
+                    created.destroy();
+                }
+                evicted.destroy();
+            }
+    };
 };
@@ -4,12 +4,14 @@
 #include <cstdint>
 #include <cstring>
 #include <cstdlib>
+#include <cinttypes>
 
 #include "app/macros.hpp"
 #include "app/error.hpp"
 #include "app/bitstream.hpp"
 
 typedef enum PixelFormat{
+    /// 8 bit samples, stored in b,g,r,a order in memory (the order of the usual bgra swapchain formats) by all decoders and precisions
     PIXEL_FORMAT_Ru8Gu8Bu8Au8
 }PixelFormat;
 struct ImageFileMetadata{
@@ -21,6 +23,8 @@ typedef struct ImageData{
 
     uint32_t height;
     uint32_t width;
+    /// number of bytes between the starts of two consecutive rows in data (at least width*bytes per pixel)
+    uint64_t stride;
 
     PixelFormat pixel_format;
     bool interleaved;
@@ -28,10 +32,294 @@ typedef struct ImageData{
     struct ImageFileMetadata image_file_metadata;
 }ImageData;
 
+/// rectangular pixel region of an image
+typedef struct ImageRegion{
+    uint32_t x=0;
+    uint32_t y=0;
+    /// a width or height of zero selects the whole image (in that dimension)
+    uint32_t width=0;
+    uint32_t height=0;
+}ImageRegion;
+
+/// receives a band of num_rows decoded pixel rows, starting at output row first_row
+///
+/// rows points to the first pixel of the band, consecutive rows are stride bytes apart.
+/// the memory is only valid for the duration of the call.
+typedef void(*ImageRowCallback)(void* user_data,const uint8_t* rows,uint32_t first_row,uint32_t num_rows,uint64_t stride);
+/// receives a tile of width x height decoded pixels, whose top left pixel is at output pixel x,y
+///
+/// consecutive rows of the tile are stride bytes apart. the memory is only valid for the duration of the call.
+/// tiles in the same row of tiles may be passed to the callback concurrently, from different threads.
+typedef void(*ImageTileCallback)(void* user_data,const uint8_t* pixels,uint32_t x,uint32_t y,uint32_t width,uint32_t height,uint64_t stride);
+/// receives the whole image of width x height pixels after pass (counted from zero) of the num_passes passes of a progressive decode
+///
+/// pixels that have not been decoded yet are filled with the decoded pixel above and to the left of them, i.e. early passes show as a
+/// coarse block image. consecutive rows are stride bytes apart. the memory is only valid for the duration of the call.
+typedef void(*ImagePassCallback)(void* user_data,const uint8_t* pixels,uint32_t width,uint32_t height,uint64_t stride,uint32_t pass,uint32_t num_passes);
+
+/// tile width and height used when none is specified in the decode options
+const uint32_t IMAGE_DEFAULT_TILE_SIZE=256;
+
+/// arithmetic used to reconstruct pixel values from the (lossy) encoded data. currently only used for jpeg images.
+typedef enum ImageDecodePrecision{
+    /// 16 bit fixed-point arithmetic, fastest
+    IMAGE_DECODE_PRECISION_FIXED,
+    /// single precision floating point arithmetic, about 10-20% slower than fixed-point
+    IMAGE_DECODE_PRECISION_FLOAT,
+    /// 32 bit integer arithmetic (the accurate integer idct and colour conversion of the jpeg reference implementation),
+    /// i.e. the pixel values are reproducible across platforms and implementations. slowest.
+    IMAGE_DECODE_PRECISION_EXACT,
+}ImageDecodePrecision;
+
+/// stages of a decode, see ImageDecodeStats
+typedef enum ImageDecodeStage{
+    /// reading the file, and parsing the headers (jpeg segments, png chunks)
+    IMAGE_DECODE_STAGE_PARSE,
+    /// decoding the entropy-coded data (jpeg scans, png zlib stream).
+    /// for jpeg images this includes the work that is pipelined with it, i.e. streamed rows, and the idct when decoding with multiple threads.
+    IMAGE_DECODE_STAGE_ENTROPY_DECODE,
+    /// jpeg: idct (that has not been pipelined with the entropy decoding). png: scanline unfiltering
+    IMAGE_DECODE_STAGE_RECONSTRUCT,
+    /// conversion to the output pixel format (jpeg: upsampling and colour conversion, png: channel order)
+    IMAGE_DECODE_STAGE_CONVERT,
+    /// handing a completely decoded image to the row or tile callback
+    IMAGE_DECODE_STAGE_EMIT,
+
+    IMAGE_DECODE_NUM_STAGES,
+}ImageDecodeStage;
+
+const char* ImageDecodeStage_name(const ImageDecodeStage stage);
+
+/// time spent in a stage of a decode, in seconds
+typedef struct ImageDecodeStageTime{
+    double wall;
+    /// cpu time of the process, i.e. of all threads (which includes other work that runs concurrently to the decode)
+    double cpu;
+}ImageDecodeStageTime;
+
+/// hardware performance counters that can be read around the stages of a decode, see ImageDecodePerfCounters
+typedef enum ImageDecodeCounter{
+    IMAGE_DECODE_COUNTER_CYCLES,
+    IMAGE_DECODE_COUNTER_INSTRUCTIONS,
+    IMAGE_DECODE_COUNTER_BRANCHES,
+    IMAGE_DECODE_COUNTER_BRANCH_MISSES,
+    /// level 1 data cache read misses
+    IMAGE_DECODE_COUNTER_L1D_MISSES,
+    /// last level cache misses
+    IMAGE_DECODE_COUNTER_LLC_MISSES,
+    /// cycles in which the backend did not make progress (not available on all cpus)
+    IMAGE_DECODE_COUNTER_STALLED_CYCLES,
+
+    IMAGE_DECODE_NUM_COUNTERS,
+}ImageDecodeCounter;
+
+const char* ImageDecodeCounter_name(const ImageDecodeCounter counter);
+
+/// values of the hardware performance counters, zero for counters that are not available
+typedef struct ImageDecodeCounterValues{
+    uint64_t count[IMAGE_DECODE_NUM_COUNTERS];
+}ImageDecodeCounterValues;
+
+/// hardware performance counters (linux perf_event) of the calling process, see ImageDecodeOptions::perf_counters
+///
+/// the counters include all threads that are created after they have been opened, but the counts of a thread are only added
+/// once it exits. the decoder joins its threads before the end of each stage, so the counts are attributed to the right stage.
+/// if the cpu has fewer counter registers than counters, the kernel multiplexes them and the counts are extrapolated.
+typedef struct ImageDecodePerfCounters{
+    /// file descriptor per counter, -1 if the counter is not available (on this cpu, kernel or operating system)
+    int fd[IMAGE_DECODE_NUM_COUNTERS];
+}ImageDecodePerfCounters;
+
+/// open the counters. returns false if none of them is available (e.g. not on linux, or because of /proc/sys/kernel/perf_event_paranoid).
+/// counters must be closed with ImageDecodePerfCounters_close, even if none is available.
+bool ImageDecodePerfCounters_open(ImageDecodePerfCounters* const counters);
+void ImageDecodePerfCounters_close(ImageDecodePerfCounters* const counters);
+/// bit (1<<counter) is set for each available counter
+uint32_t ImageDecodePerfCounters_available(const ImageDecodePerfCounters* const counters);
+/// read the current value of each counter (since opening)
+void ImageDecodePerfCounters_read(const ImageDecodePerfCounters* const counters,ImageDecodeCounterValues* const values);
+
+/// statistics of a single decode, see ImageDecodeOptions
+typedef struct ImageDecodeStats{
+    ImageDecodeStageTime stage_time[IMAGE_DECODE_NUM_STAGES];
+    /// sum of all stages
+    ImageDecodeStageTime total_time;
+
+    /// size of the file
+    uint64_t file_bytes;
+    /// bytes of entropy-coded data that have been decoded (jpeg scans, png zlib stream)
+    uint64_t entropy_coded_bytes;
+
+    /// jpeg: number of mcus and blocks whose coefficients have been decoded, summed over all scans
+    uint64_t num_mcus;
+    uint64_t num_blocks;
+    /// jpeg: number of blocks of baseline scans without ac coefficients
+    uint64_t num_dc_only_blocks;
+    /// jpeg: number of end-of-band runs that span more than one block (progressive scans)
+    uint64_t num_eob_runs;
+
+    /// number of times the bit buffer of the entropy decoder has been refilled
+    uint64_t num_bitstream_refills;
+    /// largest amount of memory held by the decoder at once (file contents, coefficients, intermediate and output pixels), in bytes
+    uint64_t peak_memory_bytes;
+
+    /// hardware performance counters per stage, only if ImageDecodeOptions::perf_counters is set.
+    /// bit (1<<counter) of available_counters is set for each counter that has been read.
+    uint32_t available_counters;
+    ImageDecodeCounterValues stage_counters[IMAGE_DECODE_NUM_STAGES];
+    ImageDecodeCounterValues total_counters;
+}ImageDecodeStats;
+
+/// print stats to f, in a human readable format
+void ImageDecodeStats_print(const ImageDecodeStats* const stats,FILE* const f);
+
+/// derived metrics of the hardware performance counters of a stage (or the total), see ImageDecodeStats.
+/// metrics whose counters are not available are zero.
+typedef struct ImageDecodeCounterMetrics{
+    /// instructions per cycle
+    double ipc;
+    /// fraction of branches that have been mispredicted
+    double branch_miss_rate;
+    /// fraction of cycles in which the backend stalled
+    double stalled_cycle_rate;
+    /// cache misses per mcu (jpeg), or per 1024 bytes of the file (png, which has no mcus)
+    double l1d_misses_per_unit;
+    double llc_misses_per_unit;
+}ImageDecodeCounterMetrics;
+
+void ImageDecodeStats_counterMetrics(const ImageDecodeStats* const stats,const ImageDecodeCounterValues* const values,ImageDecodeCounterMetrics* const metrics);
+
+/// measures the wall and cpu time (and optionally the hardware performance counters) of the stages of a decode
+///
+/// does nothing (i.e. does not even read the clocks) if constructed without stats
+class ImageDecodeStageTimer{
+    private:
+        ImageDecodeStats* const stats;
+        /// wall and cpu clock at the end of the previous stage
+        ImageDecodeStageTime last;
+
+        /// NULL if the counters are not read
+        const ImageDecodePerfCounters* const counters;
+        /// counter values at the end of the previous stage
+        ImageDecodeCounterValues last_counters;
+
+        static ImageDecodeStageTime now()noexcept;
+
+    public:
+        ImageDecodeStageTimer(ImageDecodeStats* const stats,const ImageDecodePerfCounters* const counters=nullptr)noexcept:stats(stats),counters(stats?counters:nullptr){
+            this->last=stats?now():ImageDecodeStageTime{0.0,0.0};
+
+            this->last_counters=ImageDecodeCounterValues{};
+            if(this->counters){
+                this->stats->available_counters=ImageDecodePerfCounters_available(this->counters);
+                ImageDecodePerfCounters_read(this->counters,&this->last_counters);
+            }
+        }
+
+        /// add the time since the end of the previous stage (or since construction) to stage
+        void lap(const ImageDecodeStage stage)noexcept{
+            if(!this->stats)
+                return;
+
+            const ImageDecodeStageTime current=now();
+            const ImageDecodeStageTime elapsed={current.wall-this->last.wall,current.cpu-this->last.cpu};
+
+            this->stats->stage_time[stage].wall+=elapsed.wall;
+            this->stats->stage_time[stage].cpu+=elapsed.cpu;
+            this->stats->total_time.wall+=elapsed.wall;
+            this->stats->total_time.cpu+=elapsed.cpu;
+
+            this->last=current;
+
+            if(this->counters){
+                ImageDecodeCounterValues current_counters;
+                ImageDecodePerfCounters_read(this->counters,&current_counters);
+
+                for(int counter=0;counter<IMAGE_DECODE_NUM_COUNTERS;counter++){
+                    // extrapolated (multiplexed) counts are not strictly monotonic
+                    const uint64_t elapsed_count=current_counters.count[counter]>this->last_counters.count[counter]?current_counters.count[counter]-this->last_counters.count[counter]:0;
+                    this->stats->stage_counters[stage].count[counter]+=elapsed_count;
+                    this->stats->total_counters.count[counter]+=elapsed_count;
+                }
+
+                this->last_counters=current_counters;
+            }
+        }
+};
+
+/// optional per-decode settings. default-initialised options decode the whole image.
+typedef struct ImageDecodeOptions{
+    /// only decode the pixels inside this region (clamped to the image size). currently only supported for jpeg images.
+    ///
+    /// the decoded image_data then only contains this region, i.e. width and height are those of the region
+    ImageRegion region;
+
+    /// if set, the decoded pixels are handed to this callback in bands of rows (from top to bottom) instead of being returned in image_data,
+    /// i.e. image_data->data is NULL after decoding.
+    ///
+    /// for baseline jpeg images only the mcu row currently being decoded is kept in memory, so the memory usage is proportional to the image width.
+    /// other images are decoded completely, then passed to the callback.
+    ImageRowCallback row_callback=nullptr;
+    void* row_callback_user_data=nullptr;
+
+    /// if set (and no row_callback is set), the decoded pixels are handed to this callback in tiles of tile_width x tile_height pixels
+    /// (tiles at the right and bottom edge may be smaller) instead of being returned in image_data, i.e. image_data->data is NULL after decoding.
+    ///
+    /// for baseline jpeg images only the mcu rows of the current row of tiles are kept in memory, and the tiles of a row are processed in parallel.
+    /// other images are decoded completely, then passed to the callback.
+    ImageTileCallback tile_callback=nullptr;
+    void* tile_callback_user_data=nullptr;
+    /// zero selects IMAGE_DEFAULT_TILE_SIZE
+    uint32_t tile_width=0;
+    uint32_t tile_height=0;
+
+    /// if set, the pixels decoded so far are handed to this callback after each pass of an interlaced image (see ImagePassCallback),
+    /// e.g. to show a preview before the image is complete. currently only used for png images: adam7 interlaced images have seven
+    /// passes, other images have a single pass that is reported once decoding is complete. independent of the row and tile callbacks.
+    ImagePassCallback pass_callback=nullptr;
+    void* pass_callback_user_data=nullptr;
+
+    ImageDecodePrecision precision=IMAGE_DECODE_PRECISION_FIXED;
+    /// number of threads used for decoding (including the calling thread). one (and zero) decode on the calling thread only.
+    ///
+    /// with more than one thread, jpeg images are decoded in a pipeline: the idct runs on one worker thread per colour component
+    /// while the entropy-coded data is parsed, and the colour conversion (or the tiles of a row of tiles) is split across num_threads threads.
+    /// png images are inflated on the calling thread, and unfiltered and converted on a second thread as the scanlines arrive.
+    /// png images with restart points (see Image_write_png) are instead decoded in parts, on up to num_threads threads.
+    uint32_t num_threads=1;
+
+    /// verify the checksums of png images, i.e. the crc-32 of every chunk and the adler-32 checksum of the decompressed image data.
+    /// a mismatch fails the decode with IMAGE_PARSE_RESULT_DATA_CORRUPT. the checksums are computed while the data is parsed and
+    /// decompressed, which costs a few percent of the decode time.
+    bool verify_checksums=true;
+
+    /// if set, statistics of the decode are written to this struct once decoding succeeded (the counters are cheap, the clocks are only read if requested)
+    ImageDecodeStats* stats=nullptr;
+    /// if set (and stats is set), the hardware performance counters are read at the end of each stage, see ImageDecodeStats::stage_counters.
+    /// the counters are shared by all decodes of the process, so at most one decode may use them at a time.
+    const ImageDecodePerfCounters* perf_counters=nullptr;
+}ImageDecodeOptions;
+
+/// override the precision, number of threads and checksum verification in options with the values of the environment variables
+/// IMAGE_DECODE_PRECISION (fixed, float or exact), IMAGE_DECODE_NUM_THREADS and IMAGE_DECODE_VERIFY_CHECKSUMS (0 or 1), if they are set
+void ImageDecodeOptions_fromEnvironment(ImageDecodeOptions* const options);
+
+/**
+ * @brief get current time from CLOCK_MONOTONIC as single value (seconds as double)
+ * 
+ * @return double 
+ */
+double current_time(void);
+
 /// initialise all fields to their zero-equivalent
 void ImageData_initEmpty(struct ImageData* const image_data);
 void ImageData_destroy(struct ImageData* const image_data);
+/// hand a completely decoded image to the row or tile callback in options (if one is set), then free the pixel data
+///
+/// rows are passed to the row callback in bands of band_height rows
+void ImageData_emitToCallbacks(struct ImageData* const image_data,const ImageDecodeOptions* const options,const uint32_t band_height);
 
+/// result of decoding an image. on failure, all memory of the decode has been freed, and image_data is empty.
 typedef enum ImageParseResult{
     IMAGE_PARSE_RESULT_OK,
     IMAGE_PARSE_RESULT_FILE_NOT_FOUND,
@@ -41,8 +329,29 @@ typedef enum ImageParseResult{
     IMAGE_PARSE_RESULT_SIGNATURE_INVALID,
 
     IMAGE_PARSE_RESULT_PNG_CHUNK_SIZE_EXCEEDED,
+
+    /// the file ends before the image is complete
+    IMAGE_PARSE_RESULT_DATA_TRUNCATED,
+    /// the file contains invalid or inconsistent data
+    IMAGE_PARSE_RESULT_DATA_CORRUPT,
+    /// the file is valid, but uses a feature that is not implemented
+    IMAGE_PARSE_RESULT_UNSUPPORTED,
+    /// the decode options are invalid for this image, e.g. a region outside of the image
+    IMAGE_PARSE_RESULT_INVALID_OPTIONS,
+    /// memory could not be allocated, or a thread could not be started
+    IMAGE_PARSE_RESULT_RESOURCE_FAILURE,
 }ImageParseResult;
 
+const char* ImageParseResult_name(const ImageParseResult result);
+
+/// print the message, then abort decoding the current image with the given ImageParseResult
+///
+/// the result is thrown, and returned by Image_read_jpeg/Image_read_png after the resources of the decode have been freed
+#define parse_fail(PARSE_RESULT,...) { \
+    fprintln(stderr,__VA_ARGS__); \
+    throw (ImageParseResult)(PARSE_RESULT); \
+}
+
 class FileParser{
     public:
         uint64_t file_size;
@@ -56,31 +365,44 @@ class FileParser{
         const char* file_path,
         ImageData* image_data
     ):image_data(image_data){
+        ImageData_initEmpty(this->image_data);
+
         FILE* const file=fopen(file_path, "rb");
         if (!file) {
             fprintf(stderr, "file '%s' not found\n",file_path);
             throw IMAGE_PARSE_RESULT_FILE_NOT_FOUND;
         }
 
-        ImageData_initEmpty(this->image_data);
-
         discard fseek(file,0,SEEK_END);
         const long ftell_res=ftell(file);
         if(ftell_res<0){
+            fclose(file);
             fprintf(stderr,"could not get file size\n");
             throw IMAGE_PARSE_RESULT_FILESIZE_UNKNOWN;
         }
         this->file_size=static_cast<uint64_t>(ftell_res);
         rewind(file);
 
-        this->file_contents=static_cast<uint8_t*>(aligned_alloc(64,ROUND_UP(this->file_size,64)));
-        discard fread(this->file_contents, 1, this->file_size, file);
+        this->file_contents=static_cast<uint8_t*>(aligned_alloc(64,ROUND_UP(this->file_size+1,64)));
+        if(!this->file_contents){
+            fclose(file);
+            fprintf(stderr,"could not allocate %" PRIu64 " bytes for file '%s'\n",this->file_size,file_path);
+            throw IMAGE_PARSE_RESULT_RESOURCE_FAILURE;
+        }
+        this->file_size=fread(this->file_contents, 1, this->file_size, file);
         
         fclose(file);
 
         this->current_file_content_index=0;
     }
 
+    /// throw IMAGE_PARSE_RESULT_DATA_TRUNCATED if fewer than num_bytes bytes are left in the file
+    void require_bytes(const uint64_t num_bytes)const{
+        if(this->current_file_content_index>this->file_size || num_bytes>this->file_size-this->current_file_content_index)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"file ends %" PRIu64 " bytes after offset %" PRIu64 ", expected %" PRIu64 " more bytes",
+                this->file_size-bitUtil::min(this->current_file_content_index,this->file_size),this->current_file_content_index,num_bytes);
+    }
+
     uint8_t* data_ptr()const noexcept{
         return this->file_contents+this->current_file_content_index;
     }
@@ -99,6 +421,7 @@ class FileParser{
 
     template<bool ADVANCE=true>
     void expect_signature(const uint8_t* signature,const uint64_t signature_len){
+        this->require_bytes(signature_len);
         if(this->test_signature(signature, signature_len)==TEST_SIGNATURE_FAILURE){
             throw IMAGE_PARSE_RESULT_SIGNATURE_INVALID;
         }
@@ -108,6 +431,8 @@ class FileParser{
 
     template<typename T,bool ADVANCE=true>
     T get_mem(){
+        this->require_bytes(sizeof(T));
+
         T ret;
         memcpy(&ret,this->data_ptr(),sizeof(T));
         if constexpr(ADVANCE)
@@ -116,7 +441,17 @@ class FileParser{
     }
 };
 
-ImageParseResult Image_read_jpeg(const char* filepath,ImageData* image_data);
-ImageParseResult Image_read_png(const char* const filepath,ImageData* const image_data);
+ImageParseResult Image_read_jpeg(const char* filepath,ImageData* image_data,const ImageDecodeOptions* options=nullptr);
+ImageParseResult Image_read_png(const char* const filepath,ImageData* const image_data,const ImageDecodeOptions* const options=nullptr);
+
+/// write the decoded pixels of image_data (8 bit samples, in b,g,r,a order in memory) to filepath as an 8 bit rgba png image. returns false (after printing the reason to stderr) on failure.
+///
+/// with num_parts>1, the image data is compressed in num_parts parts of (about) equal numbers of scanlines: the zlib stream is fully
+/// flushed at the start of each part, and the first scanline of each part uses the None or Sub filter, i.e. a part can be inflated
+/// and unfiltered without the ones before it. the starts of the parts (but the first) are stored in a private rsPT chunk before the
+/// first IDAT chunk, as pairs of big-endian 32 bit values: the first scanline of the part, and the offset of its data in the zlib stream
+/// (i.e. in the concatenated IDAT payloads). Image_read_png decodes the parts of such images in parallel (see ImageDecodeOptions::num_threads),
+/// other decoders ignore the chunk, i.e. the file remains a standard png image.
+bool Image_write_png(const char* const filepath,const ImageData* const image_data,uint32_t num_parts);
 
 
@@ -5,6 +5,10 @@
 /// utility macro
 #define discard (void)
 
+typedef void*(*pthread_callback)(void*);
+
+#define MAX_NSEC 999999999
+
 #define fprintln(stream,...) { \
     fprintf(stream,"%s : %d | ",__FILE__,__LINE__); \
     fprintf(stream,__VA_ARGS__); \
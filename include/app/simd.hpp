@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if defined(__x86_64__)
+    #include <x86intrin.h>
+#elif defined(__aarch64__)
+    #include <arm_neon.h>
+#endif
+
+/**
+ * portable fixed-width vector operations, for kernels that are written once and compiled for every instruction set
+ *
+ * each backend is a namespace with the same types and functions, selected by the cpu architecture the compiler targets
+ * (not by the window system):
+ *   - scalar: plain arrays and loops, available everywhere (the compiler may still vectorise them)
+ *   - sse2: x86_64 (sse2 is part of the x86_64 baseline)
+ *   - avx2, avx512: sse2, plus wider vectors for the operations that profit from them (currently the test for non-zero lanes).
+ *     their functions carry the matching target attribute, i.e. they can only be used by kernels compiled for that target.
+ *   - neon: arm64 (neon is part of the armv8-a baseline)
+ *
+ * i16_wide is the widest vector of 16 bit integers of a backend (with NUM_I16_WIDE_LANES lanes). it supports load_i16_wide and
+ * nonzero_lanes only.
+ *
+ * kernels refer to the backend through a namespace alias (vec), which is set per instruction set in the file that includes them.
+ * all operations have the same results on all backends, i.e. kernels produce identical output with every backend.
+ */
+namespace simd{
+
+namespace scalar{
+    /// 8 signed 16 bit integers
+    struct i16x8{ int16_t lanes[8]; };
+    /// 4 signed 32 bit integers
+    struct i32x4{ int32_t lanes[4]; };
+    /// 4 single precision floats
+    struct f32x4{ float lanes[4]; };
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 load_i16x8(const int16_t* const p){
+        i16x8 ret;
+        memcpy(ret.lanes,p,sizeof(ret.lanes));
+        return ret;
+    }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 load_f32x4(const float* const p){
+        f32x4 ret;
+        memcpy(ret.lanes,p,sizeof(ret.lanes));
+        return ret;
+    }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 set1_i16x8(const int16_t v){
+        i16x8 ret;
+        for(int i=0;i<8;i++) ret.lanes[i]=v;
+        return ret;
+    }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 set1_f32x4(const float v){
+        f32x4 ret;
+        for(int i=0;i<4;i++) ret.lanes[i]=v;
+        return ret;
+    }
+
+    /// wrapping addition, subtraction and multiplication (low 16 bits of the product)
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 add(const i16x8 a,const i16x8 b){
+        i16x8 ret;
+        for(int i=0;i<8;i++) ret.lanes[i]=static_cast<int16_t>(a.lanes[i]+b.lanes[i]);
+        return ret;
+    }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 sub(const i16x8 a,const i16x8 b){
+        i16x8 ret;
+        for(int i=0;i<8;i++) ret.lanes[i]=static_cast<int16_t>(a.lanes[i]-b.lanes[i]);
+        return ret;
+    }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 mul(const i16x8 a,const i16x8 b){
+        i16x8 ret;
+        for(int i=0;i<8;i++) ret.lanes[i]=static_cast<int16_t>(a.lanes[i]*b.lanes[i]);
+        return ret;
+    }
+    /// arithmetic shift right
+    template<int N>
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 shift_right(const i16x8 a){
+        i16x8 ret;
+        for(int i=0;i<8;i++) ret.lanes[i]=static_cast<int16_t>(a.lanes[i]>>N);
+        return ret;
+    }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 add(const f32x4 a,const f32x4 b){
+        f32x4 ret;
+        for(int i=0;i<4;i++) ret.lanes[i]=a.lanes[i]+b.lanes[i];
+        return ret;
+    }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 sub(const f32x4 a,const f32x4 b){
+        f32x4 ret;
+        for(int i=0;i<4;i++) ret.lanes[i]=a.lanes[i]-b.lanes[i];
+        return ret;
+    }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 mul(const f32x4 a,const f32x4 b){
+        f32x4 ret;
+        for(int i=0;i<4;i++) ret.lanes[i]=a.lanes[i]*b.lanes[i];
+        return ret;
+    }
+
+    /// interleave the lower halves of a and b, i.e. a0 b0 a1 b1 ..
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 zip_lo(const i16x8 a,const i16x8 b){
+        i16x8 ret;
+        for(int i=0;i<4;i++){ ret.lanes[i*2]=a.lanes[i]; ret.lanes[i*2+1]=b.lanes[i]; }
+        return ret;
+    }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 zip_lo(const f32x4 a,const f32x4 b){
+        return {{a.lanes[0],b.lanes[0],a.lanes[1],b.lanes[1]}};
+    }
+    /// interleave the upper halves of a and b
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 zip_hi(const f32x4 a,const f32x4 b){
+        return {{a.lanes[2],b.lanes[2],a.lanes[3],b.lanes[3]}};
+    }
+
+    /// round to the nearest integer (ties to even)
+    [[gnu::always_inline,maybe_unused]]
+    static inline i32x4 round_to_i32(const f32x4 a){
+        i32x4 ret;
+        for(int i=0;i<4;i++) ret.lanes[i]=static_cast<int32_t>(lrintf(a.lanes[i]));
+        return ret;
+    }
+    /// narrow to 16 bits with signed saturation, lo in lanes 0-3 and hi in lanes 4-7
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 narrow_saturate(const i32x4 lo,const i32x4 hi){
+        i16x8 ret;
+        for(int i=0;i<4;i++){
+            ret.lanes[i]=static_cast<int16_t>(lo.lanes[i]<INT16_MIN?INT16_MIN:lo.lanes[i]>INT16_MAX?INT16_MAX:lo.lanes[i]);
+            ret.lanes[i+4]=static_cast<int16_t>(hi.lanes[i]<INT16_MIN?INT16_MIN:hi.lanes[i]>INT16_MAX?INT16_MAX:hi.lanes[i]);
+        }
+        return ret;
+    }
+
+    /// bit i is set iff lane i is non-zero
+    [[gnu::always_inline,maybe_unused]]
+    static inline uint32_t nonzero_lanes(const i16x8 a){
+        uint32_t ret=0;
+        for(int i=0;i<8;i++) ret|=(uint32_t)(a.lanes[i]!=0)<<i;
+        return ret;
+    }
+
+    typedef i16x8 i16_wide;
+    static constexpr uint32_t NUM_I16_WIDE_LANES=8;
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16_wide load_i16_wide(const int16_t* const p){ return load_i16x8(p); }
+
+    /// store 8 pixels (32 bytes) of interleaved channels c0 c1 c2 c3, each clamped to [0;255]
+    [[gnu::always_inline,maybe_unused]]
+    static inline void store_interleaved_u8(uint8_t* const out,const i16x8 c0,const i16x8 c1,const i16x8 c2,const i16x8 c3){
+        const i16x8 channels[4]={c0,c1,c2,c3};
+        for(int i=0;i<8;i++)
+            for(int c=0;c<4;c++){
+                const int16_t v=channels[c].lanes[i];
+                out[i*4+c]=static_cast<uint8_t>(v<0?0:v>255?255:v);
+            }
+    }
+};
+
+#if defined(__x86_64__)
+namespace sse2{
+    typedef __m128i i16x8;
+    typedef __m128i i32x4;
+    typedef __m128 f32x4;
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 load_i16x8(const int16_t* const p){ return _mm_loadu_si128((const __m128i*)p); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 load_f32x4(const float* const p){ return _mm_loadu_ps(p); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 set1_i16x8(const int16_t v){ return _mm_set1_epi16(v); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 set1_f32x4(const float v){ return _mm_set1_ps(v); }
+
+    // i16x8 and i32x4 are the same type here, so the integer operations are 16 bit only
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 add(const i16x8 a,const i16x8 b){ return _mm_add_epi16(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 sub(const i16x8 a,const i16x8 b){ return _mm_sub_epi16(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 mul(const i16x8 a,const i16x8 b){ return _mm_mullo_epi16(a,b); }
+    template<int N>
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 shift_right(const i16x8 a){ return _mm_srai_epi16(a,N); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 add(const f32x4 a,const f32x4 b){ return _mm_add_ps(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 sub(const f32x4 a,const f32x4 b){ return _mm_sub_ps(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 mul(const f32x4 a,const f32x4 b){ return _mm_mul_ps(a,b); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 zip_lo(const i16x8 a,const i16x8 b){ return _mm_unpacklo_epi16(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 zip_lo(const f32x4 a,const f32x4 b){ return _mm_unpacklo_ps(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 zip_hi(const f32x4 a,const f32x4 b){ return _mm_unpackhi_ps(a,b); }
+
+    /// uses the default rounding mode, i.e. to nearest (ties to even)
+    [[gnu::always_inline,maybe_unused]]
+    static inline i32x4 round_to_i32(const f32x4 a){ return _mm_cvtps_epi32(a); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 narrow_saturate(const i32x4 lo,const i32x4 hi){ return _mm_packs_epi32(lo,hi); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline uint32_t nonzero_lanes(const i16x8 a){
+        const __m128i lanes_zero=_mm_cmpeq_epi16(a,_mm_setzero_si128());
+        // one byte per lane
+        const __m128i lanes_zero_u8=_mm_packs_epi16(lanes_zero,lanes_zero);
+        return ~(uint32_t)_mm_movemask_epi8(lanes_zero_u8)&0xFFu;
+    }
+
+    typedef i16x8 i16_wide;
+    static constexpr uint32_t NUM_I16_WIDE_LANES=8;
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16_wide load_i16_wide(const int16_t* const p){ return load_i16x8(p); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline void store_interleaved_u8(uint8_t* const out,const i16x8 c0,const i16x8 c1,const i16x8 c2,const i16x8 c3){
+        // saturating pack to u8 clamps to [0;255]
+        const __m128i c0c1=_mm_packus_epi16(c0,c1);
+        const __m128i c2c3=_mm_packus_epi16(c2,c3);
+
+        const __m128i c0c2=_mm_unpacklo_epi8(c0c1,c2c3);
+        const __m128i c1c3=_mm_unpackhi_epi8(c0c1,c2c3);
+
+        _mm_storeu_si128((__m128i*)out,_mm_unpacklo_epi8(c0c2,c1c3));
+        _mm_storeu_si128((__m128i*)(out+16),_mm_unpackhi_epi8(c0c2,c1c3));
+    }
+};
+
+namespace avx2{
+    using namespace sse2;
+    using sse2::nonzero_lanes;
+
+    /// 16 signed 16 bit integers
+    typedef __m256i i16x16;
+
+    [[gnu::always_inline,gnu::target("avx2"),maybe_unused]]
+    static inline i16x16 load_i16x16(const int16_t* const p){ return _mm256_loadu_si256((const __m256i*)p); }
+
+    [[gnu::always_inline,gnu::target("avx2"),maybe_unused]]
+    static inline uint32_t nonzero_lanes(const i16x16 a){
+        const __m256i lanes_zero=_mm256_cmpeq_epi16(a,_mm256_setzero_si256());
+        // one byte per lane, in lane order
+        const __m128i lanes_zero_u8=_mm_packs_epi16(_mm256_castsi256_si128(lanes_zero),_mm256_extracti128_si256(lanes_zero,1));
+        return ~(uint32_t)_mm_movemask_epi8(lanes_zero_u8)&0xFFFFu;
+    }
+
+    typedef i16x16 i16_wide;
+    static constexpr uint32_t NUM_I16_WIDE_LANES=16;
+    [[gnu::always_inline,gnu::target("avx2"),maybe_unused]]
+    static inline i16_wide load_i16_wide(const int16_t* const p){ return load_i16x16(p); }
+};
+
+namespace avx512{
+    using namespace avx2;
+    using avx2::nonzero_lanes;
+
+    /// 32 signed 16 bit integers
+    typedef __m512i i16x32;
+
+    [[gnu::always_inline,gnu::target("avx512f"),maybe_unused]]
+    static inline i16x32 load_i16x32(const int16_t* const p){ return _mm512_loadu_si512((const void*)p); }
+
+    [[gnu::always_inline,gnu::target("avx512f,avx512bw"),maybe_unused]]
+    static inline uint32_t nonzero_lanes(const i16x32 a){ return (uint32_t)_mm512_test_epi16_mask(a,a); }
+
+    typedef i16x32 i16_wide;
+    static constexpr uint32_t NUM_I16_WIDE_LANES=32;
+    [[gnu::always_inline,gnu::target("avx512f"),maybe_unused]]
+    static inline i16_wide load_i16_wide(const int16_t* const p){ return load_i16x32(p); }
+};
+#endif
+
+#if defined(__aarch64__)
+namespace neon{
+    typedef int16x8_t i16x8;
+    typedef int32x4_t i32x4;
+    typedef float32x4_t f32x4;
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 load_i16x8(const int16_t* const p){ return vld1q_s16(p); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 load_f32x4(const float* const p){ return vld1q_f32(p); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 set1_i16x8(const int16_t v){ return vdupq_n_s16(v); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 set1_f32x4(const float v){ return vdupq_n_f32(v); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 add(const i16x8 a,const i16x8 b){ return vaddq_s16(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 sub(const i16x8 a,const i16x8 b){ return vsubq_s16(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 mul(const i16x8 a,const i16x8 b){ return vmulq_s16(a,b); }
+    template<int N>
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 shift_right(const i16x8 a){ return vshrq_n_s16(a,N); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 add(const f32x4 a,const f32x4 b){ return vaddq_f32(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 sub(const f32x4 a,const f32x4 b){ return vsubq_f32(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 mul(const f32x4 a,const f32x4 b){ return vmulq_f32(a,b); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 zip_lo(const i16x8 a,const i16x8 b){ return vzip1q_s16(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 zip_lo(const f32x4 a,const f32x4 b){ return vzip1q_f32(a,b); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline f32x4 zip_hi(const f32x4 a,const f32x4 b){ return vzip2q_f32(a,b); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline i32x4 round_to_i32(const f32x4 a){ return vcvtnq_s32_f32(a); }
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16x8 narrow_saturate(const i32x4 lo,const i32x4 hi){ return vcombine_s16(vqmovn_s32(lo),vqmovn_s32(hi)); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline uint32_t nonzero_lanes(const i16x8 a){
+        static const uint16_t lane_bits[8]={1,2,4,8,16,32,64,128};
+        return vaddvq_u16(vandq_u16(vtstq_s16(a,a),vld1q_u16(lane_bits)));
+    }
+
+    typedef i16x8 i16_wide;
+    static constexpr uint32_t NUM_I16_WIDE_LANES=8;
+    [[gnu::always_inline,maybe_unused]]
+    static inline i16_wide load_i16_wide(const int16_t* const p){ return load_i16x8(p); }
+
+    [[gnu::always_inline,maybe_unused]]
+    static inline void store_interleaved_u8(uint8_t* const out,const i16x8 c0,const i16x8 c1,const i16x8 c2,const i16x8 c3){
+        // saturating narrow to u8 clamps to [0;255]
+        const uint8x8x4_t channels={{vqmovun_s16(c0),vqmovun_s16(c1),vqmovun_s16(c2),vqmovun_s16(c3)}};
+        vst4_u8(out,channels);
+    }
+};
+#endif
+
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+#include "app/cpu.hpp"
+
+/// opt-in timeline of what each thread of the process does, e.g. to see when decoder threads run, wait or sleep
+///
+/// events are intervals (begin and end timestamp, see cpu::timestamp) with a name and a range argument. each thread records into a ring
+/// buffer that it holds while it runs (the oldest events are overwritten once it is full), so recording takes no lock and only a few
+/// nanoseconds. when a thread exits, its buffer is reused by the next thread with the same name, i.e. the memory of a trace and the rows
+/// of its timeline are bounded by the number of threads that run at the same time, and workers that are started anew for each decode
+/// keep their thread id (per name, e.g. role and index). while tracing is not started, recording an event costs a single load and branch.
+///
+/// the recorded events are written in the chrome trace event format (json), which can be opened in chrome://tracing or ui.perfetto.dev.
+
+/// number of events per thread that are kept by default
+const uint32_t TRACE_DEFAULT_EVENTS_PER_THREAD=1<<14;
+
+/// a recorded interval
+typedef struct TraceEvent{
+    /// name of the event, must be a string that outlives the trace (e.g. a string literal)
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+    /// range of items the event covers (e.g. mcu rows), written as event arguments
+    uint32_t range_start;
+    uint32_t range_end;
+}TraceEvent;
+
+/// whether events are currently recorded, see Trace_start
+extern std::atomic<bool> trace_enabled;
+
+/// start recording events on all threads, with a ring buffer of events_per_thread events per thread
+///
+/// the calling thread is named "main" in the trace. events of a previous trace are discarded, i.e. like Trace_destroy, this must not
+/// be called while threads that recorded events of a previous trace are recording (their buffers are freed).
+void Trace_start(const uint32_t events_per_thread=TRACE_DEFAULT_EVENTS_PER_THREAD);
+/// stop recording events. the recorded events are kept until the next Trace_start or Trace_destroy.
+void Trace_stop();
+/// continue recording events after Trace_stop, keeping the events recorded so far
+void Trace_resume();
+/// write the recorded events in the chrome trace event format to filepath. returns false if the file cannot be written.
+///
+/// must not be called while traced threads are running, i.e. after Trace_stop or while no other thread records events.
+bool Trace_write(const char* const filepath);
+/// free all recorded events
+///
+/// must not be called while traced threads are running, like Trace_write: a thread that is recording an event would write to a freed
+/// buffer. threads that only exit afterwards are fine.
+void Trace_destroy();
+
+/// name the calling thread in the trace (the name is copied). threads that are not named are called "thread <n>".
+///
+/// a thread that has not recorded events yet takes over the buffer (and thread id) of an exited thread with the same name, if there is one.
+void Trace_setThreadName(const char* const name);
+/// name the calling thread "<name> <index>", e.g. for the index of a worker in a pool of workers with the same role
+void Trace_setThreadName(const char* const name,const uint32_t index);
+
+/// record an event that began at begin (see cpu::timestamp) and ends now on the calling thread, if tracing is enabled
+void Trace_record(const char* const name,const uint64_t begin,const uint32_t range_start=0,const uint32_t range_end=0);
+
+/// records an event from construction to destruction, if tracing was enabled when it was constructed
+class TraceScope{
+    private:
+        const char* const name;
+        const uint32_t range_start;
+        const uint32_t range_end;
+        /// 0 if tracing was disabled when constructed
+        uint64_t begin;
+
+    public:
+        TraceScope(const char* const name,const uint32_t range_start=0,const uint32_t range_end=0)noexcept
+            :name(name),range_start(range_start),range_end(range_end)
+        {
+            this->begin=trace_enabled.load(std::memory_order_relaxed)?cpu::timestamp():0;
+        }
+        ~TraceScope(){
+            if(this->begin)
+                Trace_record(this->name,this->begin,this->range_start,this->range_end);
+        }
+
+        TraceScope(const TraceScope&)=delete;
+        TraceScope& operator=(const TraceScope&)=delete;
+};
@@ -1,5 +1,6 @@
 #include "app/app.hpp"
 #include "app/error.hpp"
+#include "app/trace.hpp"
 #include <cstdlib>
 #include <cstdint>
 #include <cstdio>
@@ -11,35 +12,6 @@
 #include <cstdio>
 #include <unistd.h>
 
-double current_time(){
-    struct timespec current_time;
-    int time_get_result=clock_gettime(CLOCK_MONOTONIC, &current_time);
-    if (time_get_result != 0) {
-        fprintf(stderr, "failed to get start time because %d\n",time_get_result);
-        exit(-66);
-    }
-
-    double ret=(double)current_time.tv_sec;
-    ret+=((double)current_time.tv_nsec)/(double)(MAX_NSEC+1);
-    return ret;
-}
-
-void ImageData_initEmpty(struct ImageData* const image_data){
-    image_data->data=NULL;
-    image_data->height=0;
-    image_data->width=0;
-    image_data->pixel_format=(PixelFormat)0;
-
-    image_data->image_file_metadata.file_comment=NULL;
-}
-void ImageData_destroy(struct ImageData* const image_data){
-    if(image_data->image_file_metadata.file_comment){
-        free(static_cast<void*>(image_data->image_file_metadata.file_comment));
-        image_data->image_file_metadata.file_comment=NULL;
-    }
-    free(image_data->data);
-}
-
 /**
  * @brief get string representation of VkResult value
  * 
@@ -344,8 +316,9 @@ void App_upload_texture(
     VkPhysicalDeviceProperties physical_device_properties;
     vkGetPhysicalDeviceProperties(app->physical_device,&physical_device_properties);
 
-    VkDeviceSize image_memory_size=image_data->height*image_data->width*4;
-    image_memory_size=ROUND_UP(image_memory_size, physical_device_properties.limits.nonCoherentAtomSize);
+    // upload the rows including their padding, the copy command skips the padding via bufferRowLength
+    const VkDeviceSize image_data_size=image_data->height*image_data->stride;
+    const VkDeviceSize image_memory_size=ROUND_UP(image_data_size, physical_device_properties.limits.nonCoherentAtomSize);
 
     const VkDeviceSize image_offset_into_staging_buffer=app->staging_buffer_size_occupied;
 
@@ -367,7 +340,7 @@ void App_upload_texture(
         exit(ERROR_STAGING_BUFFER_OVERFLOW);
     }
 
-    memcpy(staging_buffer_cpu_memory,image_data->data,image_memory_size);
+    memcpy(staging_buffer_cpu_memory,image_data->data,image_data_size);
 
     VkMappedMemoryRange flush_memory_range={
         .sType=VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
@@ -386,7 +359,7 @@ void App_upload_texture(
 
     VkBufferImageCopy buffer_image_copy={
         .bufferOffset=image_offset_into_staging_buffer,
-        .bufferRowLength=0,
+        .bufferRowLength=static_cast<uint32_t>(image_data->stride/4),
         .bufferImageHeight=0,
         .imageSubresource={
             .aspectMask=VK_IMAGE_ASPECT_COLOR_BIT,
@@ -1451,11 +1424,23 @@ void App_run(Application* app){
         exit(ERROR_NO_ARGUMENT_IMAGE);
     }
 
+    // decode settings (precision, number of threads) can be changed at runtime via environment variables
+    ImageDecodeOptions decode_options{};
+    ImageDecodeOptions_fromEnvironment(&decode_options);
+
+    // IMAGE_DECODE_TRACE=<file> writes a timeline of the decoder threads (chrome trace format, see app/trace.hpp) once all images are decoded
+    const char* const trace_filepath=getenv("IMAGE_DECODE_TRACE");
+    if(trace_filepath)
+        Trace_start();
+
+    // images are decoded repeatedly for benchmarking in debug builds (the number of repetitions can be changed via IMAGE_BENCHMARK_NUM_REPEATS)
     #ifdef DEBUG
-        static const int num_iterations=IMAGE_BENCHMARK_NUM_REPEATS;
+        int num_iterations=5;
     #else
-        static const int num_iterations=1;
+        int num_iterations=1;
     #endif
+    if(const char* const num_repeats=getenv("IMAGE_BENCHMARK_NUM_REPEATS"))
+        num_iterations=bitUtil::max(atoi(num_repeats),1);
 
     const uint32_t num_images=app->cli_num_args-1;
 
@@ -1493,13 +1478,13 @@ void App_run(Application* app){
             ImageParseResult image_parse_res;
             auto start_time=current_time();
             if(strncmp(PNG_FILE_ENDING,&file_path[file_path_len-PNG_FILE_ENDING_LEN],PNG_FILE_ENDING_LEN)==0){
-                image_parse_res=Image_read_png(file_path,image_data);
+                image_parse_res=Image_read_png(file_path,image_data,&decode_options);
                 if (image_parse_res!=IMAGE_PARSE_RESULT_OK)
-                    bail(-31, "failed to parse png");
+                    bail(-31, "failed to parse png: %s",ImageParseResult_name(image_parse_res));
             }else if(strncmp(JPEG_FILE_ENDING,&file_path[file_path_len-JPEG_FILE_ENDING_LEN],JPEG_FILE_ENDING_LEN)==0){
-                image_parse_res=Image_read_jpeg(file_path,image_data);
+                image_parse_res=Image_read_jpeg(file_path,image_data,&decode_options);
                 if (image_parse_res!=IMAGE_PARSE_RESULT_OK)
-                    bail(-31, "failed to parse jpeg");
+                    bail(-31, "failed to parse jpeg: %s",ImageParseResult_name(image_parse_res));
             }else{
                 bail(FATAL_UNEXPECTED_ERROR,"invalid file ending of supposed image file %s",file_path);
             }
@@ -1549,6 +1534,14 @@ void App_run(Application* app){
         };
         vkUpdateDescriptorSets(app->device, 1, &write_descriptor_set, 0, NULL);
     }
+
+    if(trace_filepath){
+        Trace_stop();
+        if(Trace_write(trace_filepath))
+            println("wrote decoder trace to %s",trace_filepath);
+        Trace_destroy();
+    }
+
     int32_t left_button_down_x=0;
     int32_t left_button_down_y=0;
 
@@ -0,0 +1,543 @@
+// headless decoder benchmark. links only the image decoders (no vulkan, no window), plus libjpeg(-turbo) and libpng as references.
+//
+// usage: image_bench [-w num_warmup_iterations] [-n num_iterations] [-o results.json] [-c] [-t trace.json] [-r num_parts] image files...
+//
+// each file is decoded num_warmup_iterations times (untimed), then num_iterations times (timed), by this project's decoder and
+// by the reference library for its format. each timed decode includes reading the file (which is in the page cache after the
+// warm-up), and allocating and freeing the output.
+//
+// with -c, the hardware performance counters (linux perf_event) are read around each stage of the additional decode that
+// measures the stages, and ipc, branch miss rate, stalled cycles and cache misses per mcu are reported per stage.
+//
+// with -t, the threads of the decode that measures the stages are traced (see app/trace.hpp), and the timeline of all files is written
+// to trace.json in the chrome trace format.
+//
+// with -r, each file is decoded once and re-encoded as png with restart points between num_parts parts (see Image_write_png)
+// into a temporary file, which is then benchmarked in place of the file (e.g. to measure the decoding of the parts in parallel).
+//
+// the decode options are read from the environment, like in the application (IMAGE_DECODE_PRECISION, IMAGE_DECODE_NUM_THREADS, CPU_MAX_ISA).
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <csetjmp>
+
+#include <unistd.h>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include "app/image.hpp"
+#include "app/bit_util.hpp"
+#include "app/cpu.hpp"
+#include "app/trace.hpp"
+
+static const uint32_t DEFAULT_NUM_WARMUP_ITERATIONS=3;
+static const uint32_t DEFAULT_NUM_ITERATIONS=20;
+/// path of the temporary files written with -r, the suffix keeps them png files for bench_is_png
+static const char BENCH_RESTART_PATH_TEMPLATE[]="/tmp/image_bench_XXXXXX.png";
+
+/// decode the image at filepath once (output is discarded). returns false if decoding failed.
+///
+/// width and height receive the size of the decoded image.
+typedef bool(*BenchDecodeFunction)(const char* filepath,const ImageDecodeOptions* options,uint32_t* width,uint32_t* height);
+
+typedef struct BenchDecoder{
+    const char* name;
+    BenchDecodeFunction decode;
+}BenchDecoder;
+
+/// timing of one decoder on one file
+typedef struct BenchResult{
+    const char* filepath;
+    const char* decoder_name;
+
+    uint32_t width,height;
+    uint64_t file_size;
+
+    uint32_t num_iterations;
+    /// seconds per decode
+    double min,median,p99;
+
+    /// stages of a single additional decode, only for this project's decoder (has_stats).
+    /// includes the hardware performance counters if they have been requested.
+    bool has_stats;
+    ImageDecodeStats stats;
+}BenchResult;
+
+/// files are decoded as png if their name ends in .png, and as jpeg otherwise (like in the application)
+static bool bench_is_png(const char* const filepath){
+    static const char* const PNG_FILE_ENDING=".png";
+    const size_t filepath_len=strlen(filepath);
+    return filepath_len>=strlen(PNG_FILE_ENDING) && strcmp(filepath+filepath_len-strlen(PNG_FILE_ENDING),PNG_FILE_ENDING)==0;
+}
+
+static bool bench_decode_image(const char* const filepath,const ImageDecodeOptions* const options,uint32_t* const width,uint32_t* const height){
+    ImageData image_data;
+    const ImageParseResult result=bench_is_png(filepath)?Image_read_png(filepath,&image_data,options):Image_read_jpeg(filepath,&image_data,options);
+    if(result!=IMAGE_PARSE_RESULT_OK){
+        fprintf(stderr,"failed to decode %s: %s\n",filepath,ImageParseResult_name(result));
+        return false;
+    }
+
+    *width=image_data.width;
+    *height=image_data.height;
+
+    ImageData_destroy(&image_data);
+    return true;
+}
+
+/// decode the image at filepath, and write it with num_parts restart parts (see -r) to a new temporary file, whose path is written
+/// to restart_path (which holds at least sizeof(BENCH_RESTART_PATH_TEMPLATE) bytes). returns false if decoding or writing failed.
+static bool bench_write_restart_png(const char* const filepath,const uint32_t num_parts,char* const restart_path){
+    ImageData image_data;
+    const ImageParseResult result=bench_is_png(filepath)?Image_read_png(filepath,&image_data):Image_read_jpeg(filepath,&image_data);
+    if(result!=IMAGE_PARSE_RESULT_OK){
+        fprintf(stderr,"failed to decode %s: %s\n",filepath,ImageParseResult_name(result));
+        return false;
+    }
+
+    memcpy(restart_path,BENCH_RESTART_PATH_TEMPLATE,sizeof(BENCH_RESTART_PATH_TEMPLATE));
+    const int fd=mkstemps(restart_path,(int)strlen(".png"));
+    if(fd<0){
+        fprintf(stderr,"failed to create a temporary file for %s\n",filepath);
+        ImageData_destroy(&image_data);
+        return false;
+    }
+    close(fd);
+
+    const bool written=Image_write_png(restart_path,&image_data,num_parts);
+    ImageData_destroy(&image_data);
+    if(!written)
+        unlink(restart_path);
+    return written;
+}
+
+/// libjpeg reports errors through a callback that must not return
+typedef struct BenchJpegErrorManager{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump_buffer;
+}BenchJpegErrorManager;
+
+static void bench_jpeg_error_exit(j_common_ptr cinfo){
+    BenchJpegErrorManager* const error_manager=(BenchJpegErrorManager*)cinfo->err;
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(error_manager->jump_buffer,1);
+}
+
+static bool bench_decode_libjpeg(const char* const filepath,const ImageDecodeOptions* const options,uint32_t* const width,uint32_t* const height){
+    discard options;
+
+    FILE* const file=fopen(filepath,"rb");
+    if(!file){
+        fprintf(stderr,"failed to open %s\n",filepath);
+        return false;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    BenchJpegErrorManager error_manager;
+    // allocated before setjmp, so that the error path can free it
+    uint8_t* volatile pixels=NULL;
+
+    cinfo.err=jpeg_std_error(&error_manager.pub);
+    error_manager.pub.error_exit=bench_jpeg_error_exit;
+    if(setjmp(error_manager.jump_buffer)){
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        free(pixels);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo,file);
+    jpeg_read_header(&cinfo,TRUE);
+
+    // same output format as the decoder of this project (if the library supports it)
+    #ifdef JCS_EXTENSIONS
+        cinfo.out_color_space=JCS_EXT_RGBA;
+    #endif
+
+    jpeg_start_decompress(&cinfo);
+
+    const uint64_t stride=(uint64_t)cinfo.output_width*(uint64_t)cinfo.output_components;
+    pixels=(uint8_t*)malloc(stride*cinfo.output_height);
+    if(!pixels){
+        jpeg_destroy_decompress(&cinfo);
+        fclose(file);
+        return false;
+    }
+
+    while(cinfo.output_scanline<cinfo.output_height){
+        JSAMPROW row=pixels+cinfo.output_scanline*stride;
+        jpeg_read_scanlines(&cinfo,&row,1);
+    }
+
+    *width=cinfo.output_width;
+    *height=cinfo.output_height;
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(file);
+    free(pixels);
+
+    return true;
+}
+
+static bool bench_decode_libpng(const char* const filepath,const ImageDecodeOptions* const options,uint32_t* const width,uint32_t* const height){
+    discard options;
+
+    png_image image;
+    memset(&image,0,sizeof(image));
+    image.version=PNG_IMAGE_VERSION;
+
+    if(!png_image_begin_read_from_file(&image,filepath)){
+        fprintf(stderr,"libpng failed to read %s: %s\n",filepath,image.message);
+        return false;
+    }
+
+    image.format=PNG_FORMAT_RGBA;
+    uint8_t* const pixels=(uint8_t*)malloc(PNG_IMAGE_SIZE(image));
+    if(!pixels){
+        png_image_free(&image);
+        return false;
+    }
+
+    const bool success=png_image_finish_read(&image,NULL,pixels,0,NULL)!=0;
+    if(!success)
+        fprintf(stderr,"libpng failed to decode %s: %s\n",filepath,image.message);
+
+    *width=image.width;
+    *height=image.height;
+
+    free(pixels);
+    png_image_free(&image);
+
+    return success;
+}
+
+static int bench_compare_double(const void* const a,const void* const b){
+    const double lhs=*(const double*)a;
+    const double rhs=*(const double*)b;
+    return (lhs>rhs)-(lhs<rhs);
+}
+
+/// value at quantile q (in [0;1]) of num_values sorted values, nearest rank
+static double bench_quantile(const double* const sorted_values,const uint32_t num_values,const double q){
+    uint32_t rank=(uint32_t)(q*(double)num_values+0.999999);
+    rank=bitUtil::clamp(1u,num_values,rank);
+    return sorted_values[rank-1];
+}
+
+/// decode filepath with decoder, see the description at the top of this file
+static bool bench_run(
+    const char* const filepath,
+    const BenchDecoder* const decoder,
+    const ImageDecodeOptions* const options,
+    const uint32_t num_warmup_iterations,
+    const uint32_t num_iterations,
+    const bool trace,
+    double* const times,
+    BenchResult* const result
+){
+    memset(result,0,sizeof(*result));
+    result->filepath=filepath;
+    result->decoder_name=decoder->name;
+    result->num_iterations=num_iterations;
+
+    FILE* const file=fopen(filepath,"rb");
+    if(!file){
+        fprintf(stderr,"failed to open %s\n",filepath);
+        return false;
+    }
+    fseek(file,0,SEEK_END);
+    const long file_size=ftell(file);
+    fclose(file);
+    if(file_size<0)
+        return false;
+    result->file_size=(uint64_t)file_size;
+
+    for(uint32_t i=0;i<num_warmup_iterations;i++)
+        if(!decoder->decode(filepath,options,&result->width,&result->height))
+            return false;
+
+    for(uint32_t i=0;i<num_iterations;i++){
+        const double start_time=current_time();
+        if(!decoder->decode(filepath,options,&result->width,&result->height))
+            return false;
+        times[i]=current_time()-start_time;
+    }
+
+    qsort(times,num_iterations,sizeof(double),bench_compare_double);
+    result->min=times[0];
+    result->median=bench_quantile(times,num_iterations,0.5);
+    result->p99=bench_quantile(times,num_iterations,0.99);
+
+    // the stage times (and counters) are taken from a separate decode, so that reading the clocks does not affect the timed decodes
+    if(decoder->decode==bench_decode_image){
+        ImageDecodeOptions stats_options=*options;
+        stats_options.stats=&result->stats;
+
+        if(trace)
+            Trace_resume();
+        bool decoded;
+        {
+            const TraceScope trace_scope{filepath};
+            decoded=decoder->decode(filepath,&stats_options,&result->width,&result->height);
+        }
+        if(trace)
+            Trace_stop();
+
+        if(!decoded)
+            return false;
+        result->has_stats=true;
+    }
+
+    return true;
+}
+
+static double bench_megabytes_per_second(const BenchResult* const result){
+    return (double)result->file_size/result->median*1e-6;
+}
+static double bench_megapixels_per_second(const BenchResult* const result){
+    return (double)result->width*(double)result->height/result->median*1e-6;
+}
+
+static void bench_print_result(const BenchResult* const result){
+    printf(
+        "%-10s %5ux%-5u min %9.3fms median %9.3fms p99 %9.3fms %9.2fMB/s %9.2fMPix/s  %s\n",
+        result->decoder_name,
+        result->width,result->height,
+        result->min*1e3,result->median*1e3,result->p99*1e3,
+        bench_megabytes_per_second(result),
+        bench_megapixels_per_second(result),
+        result->filepath
+    );
+}
+
+static void bench_json_write_string(FILE* const f,const char* const str){
+    fputc('"',f);
+    for(const char* c=str;*c;c++){
+        switch(*c){
+            case '"': fputs("\\\"",f); break;
+            case '\\': fputs("\\\\",f); break;
+            default:
+                if((unsigned char)*c<0x20)
+                    fprintf(f,"\\u%04x",(unsigned)*c);
+                else
+                    fputc(*c,f);
+        }
+    }
+    fputc('"',f);
+}
+
+static bool bench_write_json(
+    const char* const json_path,
+    const ImageDecodeOptions* const options,
+    const uint32_t num_warmup_iterations,
+    const uint32_t num_iterations,
+    const BenchResult* const results,
+    const uint32_t num_results
+){
+    static const char* const PRECISION_NAMES[]={"fixed","float","exact"};
+
+    FILE* const f=fopen(json_path,"w");
+    if(!f){
+        fprintf(stderr,"failed to open %s for writing\n",json_path);
+        return false;
+    }
+
+    fprintf(f,"{\n");
+    fprintf(f,"  \"isa\": \"%s\",\n",cpu::Isa_name(cpu::isa()));
+    fprintf(f,"  \"precision\": \"%s\",\n",PRECISION_NAMES[options->precision]);
+    fprintf(f,"  \"num_threads\": %u,\n",options->num_threads);
+    fprintf(f,"  \"warmup_iterations\": %u,\n",num_warmup_iterations);
+    fprintf(f,"  \"iterations\": %u,\n",num_iterations);
+    fprintf(f,"  \"results\": [\n");
+    for(uint32_t i=0;i<num_results;i++){
+        const BenchResult* const result=&results[i];
+
+        fprintf(f,"    {\"file\": ");
+        bench_json_write_string(f,result->filepath);
+        fprintf(f,", \"decoder\": \"%s\", \"width\": %u, \"height\": %u, \"file_bytes\": %" PRIu64 ",",result->decoder_name,result->width,result->height,result->file_size);
+        fprintf(f," \"min_ms\": %.6f, \"median_ms\": %.6f, \"p99_ms\": %.6f,",result->min*1e3,result->median*1e3,result->p99*1e3);
+        fprintf(f," \"mb_per_s\": %.3f, \"mpix_per_s\": %.3f",bench_megabytes_per_second(result),bench_megapixels_per_second(result));
+
+        if(result->has_stats){
+            fprintf(f,", \"stage_wall_ms\": {");
+            for(int stage=0;stage<IMAGE_DECODE_NUM_STAGES;stage++)
+                fprintf(f,"%s\"%s\": %.6f",stage?", ":"",ImageDecodeStage_name((ImageDecodeStage)stage),result->stats.stage_time[stage].wall*1e3);
+            fprintf(f,"}, \"peak_memory_bytes\": %" PRIu64,result->stats.peak_memory_bytes);
+
+            if(result->stats.available_counters){
+                fprintf(f,", \"num_mcus\": %" PRIu64 ", \"stage_counters\": {",result->stats.num_mcus);
+                for(int stage=0;stage<IMAGE_DECODE_NUM_STAGES;stage++){
+                    const ImageDecodeCounterValues* const values=&result->stats.stage_counters[stage];
+
+                    fprintf(f,"%s\"%s\": {",stage?", ":"",ImageDecodeStage_name((ImageDecodeStage)stage));
+                    bool first_counter=true;
+                    for(int counter=0;counter<IMAGE_DECODE_NUM_COUNTERS;counter++){
+                        if(!(result->stats.available_counters&(1u<<counter)))
+                            continue;
+                        fprintf(f,"%s\"%s\": %" PRIu64,first_counter?"":", ",ImageDecodeCounter_name((ImageDecodeCounter)counter),values->count[counter]);
+                        first_counter=false;
+                    }
+
+                    ImageDecodeCounterMetrics metrics;
+                    ImageDecodeStats_counterMetrics(&result->stats,values,&metrics);
+                    fprintf(f,", \"ipc\": %.4f, \"branch_miss_rate\": %.6f, \"stalled_cycle_rate\": %.4f",metrics.ipc,metrics.branch_miss_rate,metrics.stalled_cycle_rate);
+                    if(result->stats.num_mcus>0)
+                        fprintf(f,", \"l1d_misses_per_mcu\": %.4f, \"llc_misses_per_mcu\": %.4f",metrics.l1d_misses_per_unit,metrics.llc_misses_per_unit);
+                    fprintf(f,"}");
+                }
+                fprintf(f,"}");
+            }
+        }
+
+        fprintf(f,"}%s\n",(i+1<num_results)?",":"");
+    }
+    fprintf(f,"  ]\n");
+    fprintf(f,"}\n");
+
+    fclose(f);
+    return true;
+}
+
+static void bench_print_usage(const char* const program){
+    fprintf(stderr,"usage: %s [-w num_warmup_iterations] [-n num_iterations] [-o results.json] [-c] [-t trace.json] [-r num_parts] image files...\n",program);
+}
+
+int main(int argc,char** argv){
+    uint32_t num_warmup_iterations=DEFAULT_NUM_WARMUP_ITERATIONS;
+    uint32_t num_iterations=DEFAULT_NUM_ITERATIONS;
+    const char* json_path=NULL;
+    const char* trace_path=NULL;
+    bool read_perf_counters=false;
+    uint32_t num_restart_parts=0;
+
+    int arg_index=1;
+    for(;arg_index<argc;arg_index++){
+        const char* const arg=argv[arg_index];
+        if(arg[0]!='-')
+            break;
+
+        if(strcmp(arg,"-c")==0){
+            read_perf_counters=true;
+            continue;
+        }
+
+        if(arg_index+1>=argc){
+            bench_print_usage(argv[0]);
+            return -1;
+        }
+
+        if(strcmp(arg,"-w")==0){
+            num_warmup_iterations=(uint32_t)strtoul(argv[++arg_index],NULL,10);
+        }else if(strcmp(arg,"-n")==0){
+            num_iterations=(uint32_t)strtoul(argv[++arg_index],NULL,10);
+        }else if(strcmp(arg,"-o")==0){
+            json_path=argv[++arg_index];
+        }else if(strcmp(arg,"-t")==0){
+            trace_path=argv[++arg_index];
+        }else if(strcmp(arg,"-r")==0){
+            num_restart_parts=(uint32_t)strtoul(argv[++arg_index],NULL,10);
+        }else{
+            bench_print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    const uint32_t num_files=(uint32_t)(argc-arg_index);
+    if(num_files==0 || num_iterations==0){
+        bench_print_usage(argv[0]);
+        return -1;
+    }
+
+    #ifdef DEBUG
+        fprintf(stderr,"warning: debug build, the decoder prints statistics after each decode (use MODE=release for representative numbers)\n");
+    #endif
+
+    ImageDecodeOptions options{};
+    ImageDecodeOptions_fromEnvironment(&options);
+
+    ImageDecodePerfCounters perf_counters;
+    if(read_perf_counters){
+        if(ImageDecodePerfCounters_open(&perf_counters))
+            options.perf_counters=&perf_counters;
+        else
+            fprintf(stderr,"warning: no hardware performance counters available (see /proc/sys/kernel/perf_event_paranoid)\n");
+    }
+
+    // events are only recorded while the stages are measured, see bench_run
+    if(trace_path){
+        Trace_start();
+        Trace_stop();
+    }
+
+    static const BenchDecoder IMAGE_DECODER={"image",bench_decode_image};
+    static const BenchDecoder LIBJPEG_DECODER={"libjpeg",bench_decode_libjpeg};
+    static const BenchDecoder LIBPNG_DECODER={"libpng",bench_decode_libpng};
+
+    // one result per decoder per file
+    BenchResult* const results=(BenchResult*)malloc(sizeof(BenchResult)*num_files*2);
+    double* const times=(double*)malloc(sizeof(double)*num_iterations);
+    if(!results || !times){
+        fprintf(stderr,"failed to allocate memory\n");
+        return -1;
+    }
+    uint32_t num_results=0;
+    bool all_succeeded=true;
+
+    for(uint32_t file_index=0;file_index<num_files;file_index++){
+        const char* const filepath=argv[arg_index+(int)file_index];
+
+        // with -r, the re-encoded file is decoded, but the results are reported for the original one
+        char restart_path[sizeof(BENCH_RESTART_PATH_TEMPLATE)];
+        const char* decode_filepath=filepath;
+        if(num_restart_parts>0){
+            if(!bench_write_restart_png(filepath,num_restart_parts,restart_path)){
+                all_succeeded=false;
+                continue;
+            }
+            decode_filepath=restart_path;
+        }
+
+        const BenchDecoder* const decoders[2]={&IMAGE_DECODER,bench_is_png(decode_filepath)?&LIBPNG_DECODER:&LIBJPEG_DECODER};
+        for(const BenchDecoder* const decoder:decoders){
+            BenchResult* const result=&results[num_results];
+            if(!bench_run(decode_filepath,decoder,&options,num_warmup_iterations,num_iterations,trace_path!=NULL,times,result)){
+                fprintf(stderr,"%s failed on %s\n",decoder->name,filepath);
+                all_succeeded=false;
+                continue;
+            }
+            result->filepath=filepath;
+
+            bench_print_result(result);
+            if(result->has_stats && result->stats.available_counters)
+                ImageDecodeStats_print(&result->stats,stdout);
+            num_results++;
+        }
+
+        if(num_restart_parts>0)
+            unlink(restart_path);
+    }
+
+    if(json_path)
+        if(!bench_write_json(json_path,&options,num_warmup_iterations,num_iterations,results,num_results))
+            all_succeeded=false;
+
+    if(read_perf_counters)
+        ImageDecodePerfCounters_close(&perf_counters);
+
+    if(trace_path){
+        if(!Trace_write(trace_path))
+            all_succeeded=false;
+        Trace_destroy();
+    }
+
+    free(times);
+    free(results);
+
+    return all_succeeded?0:-1;
+}
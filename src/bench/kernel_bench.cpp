@@ -0,0 +1,51 @@
+// microbenchmarks of the decoder kernels. each kernel is driven in isolation, with synthetic input or the data of recorded
+// jpeg files, and its output is checked against a reference: the generic (scalar) kernels for the simd kernels, and
+// straightforward implementations in this benchmark for the rest.
+//
+// usage: kernel_bench [jpeg files...]
+//
+// the jpeg files are the recorded input of the idct and colour conversion kernels, which are skipped without them.
+// results are reported in cycles (see cpu::timestamp) per unit of work, for the fastest of KERNEL_BENCH_NUM_RUNS runs.
+// the process exits with a non-zero code if any kernel does not match its reference.
+
+#include <cstdint>
+#include <cstdio>
+#include <cinttypes>
+
+#include "kernel_bench.hpp"
+
+bool KernelBench_report(
+    const char* const kernel,
+    const char* const variant,
+    const uint64_t cycles,
+    const uint64_t num_units,
+    const char* const unit,
+    const double max_difference,
+    const double tolerance
+){
+    const bool matches=max_difference<=tolerance;
+    printf(
+        "%-24s %-20s %10.3f cycles/%-8s %s (max difference %g)\n",
+        kernel,
+        variant,
+        (double)cycles/(double)(num_units?num_units:1),
+        unit,
+        matches?"ok      ":"MISMATCH",
+        max_difference
+    );
+    return matches;
+}
+
+int main(int argc,char** argv){
+    bool all_match=true;
+
+    all_match&=KernelBench_jpegEntropy();
+    all_match&=KernelBench_png();
+
+    if(argc<2)
+        printf("no jpeg file passed, skipping the idct and colour conversion kernels\n");
+    for(int i=1;i<argc;i++)
+        all_match&=KernelBench_jpegKernels(argv[i]);
+
+    return all_match?0:-1;
+}
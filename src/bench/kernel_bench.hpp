@@ -0,0 +1,83 @@
+#pragma once
+
+// shared by the translation units of the kernel microbenchmarks (see kernel_bench.cpp)
+
+#include <cstdint>
+#include <cstdio>
+
+#include "app/cpu.hpp"
+
+/// number of timed runs of each kernel, the fastest one is reported
+static const uint32_t KERNEL_BENCH_NUM_RUNS=25;
+
+/**
+ * @brief time KERNEL_BENCH_NUM_RUNS runs of a kernel, each preceded by an untimed call to setup (e.g. to reset the output)
+ *
+ * @return the number of cycles (see cpu::timestamp) of the fastest run
+ */
+template<typename SETUP,typename RUN>
+uint64_t KernelBench_measure(SETUP&& setup,RUN&& run){
+    uint64_t min_cycles=UINT64_MAX;
+    for(uint32_t i=0;i<KERNEL_BENCH_NUM_RUNS;i++){
+        setup();
+
+        const uint64_t start=cpu::timestamp();
+        run();
+        const uint64_t cycles=cpu::timestamp()-start;
+
+        if(cycles<min_cycles)
+            min_cycles=cycles;
+    }
+    return min_cycles;
+}
+
+/**
+ * @brief print the result of a kernel, and whether its output matches the reference implementation
+ *
+ * @param kernel name of the kernel
+ * @param variant instruction set, precision or input type of this run
+ * @param cycles cycles of a run, see KernelBench_measure
+ * @param num_units number of units (blocks, pixels, bytes, symbols) processed in a run
+ * @param unit name of a unit
+ * @param max_difference largest difference of an output element to the reference output
+ * @param tolerance largest difference that is accepted
+ * @return true if max_difference<=tolerance
+ */
+bool KernelBench_report(
+    const char* kernel,
+    const char* variant,
+    uint64_t cycles,
+    uint64_t num_units,
+    const char* unit,
+    double max_difference,
+    double tolerance
+);
+
+/// xorshift64*, deterministic input data for the synthetic benchmarks
+static inline uint32_t KernelBench_random(uint64_t* const state){
+    *state^=*state>>12;
+    *state^=*state<<25;
+    *state^=*state>>27;
+    return (uint32_t)((*state*0x2545F4914F6CDD1Dull)>>32);
+}
+
+/// instruction sets that are supported by this cpu (and not excluded via CPU_MAX_ISA), generic first. returns the number of sets.
+static inline uint32_t KernelBench_supportedIsas(cpu::Isa isas[5]){
+    const cpu::Isa max_isa=cpu::isa();
+
+    uint32_t num_isas=0;
+    for(const cpu::Isa isa:{cpu::Isa::GENERIC,cpu::Isa::SSSE3,cpu::Isa::AVX2,cpu::Isa::AVX512,cpu::Isa::NEON}){
+        const bool supported=(isa==cpu::Isa::GENERIC) || (max_isa==cpu::Isa::NEON?isa==cpu::Isa::NEON:(isa!=cpu::Isa::NEON && isa<=max_isa));
+        if(supported)
+            isas[num_isas++]=isa;
+    }
+    return num_isas;
+}
+
+/// bitstream refill, huffman lookup and ac coefficient decoding, on synthetic entropy-coded data (kernel_bench_jpeg.cpp)
+bool KernelBench_jpegEntropy();
+/// idct and colour conversion of each instruction set and precision, on the coefficients of a recorded jpeg file, and the colours of
+/// each precision compared to exact precision (kernel_bench_jpeg.cpp)
+bool KernelBench_jpegKernels(const char* filepath);
+/// png unfiltering per filter type, channel swap and deflate match copy, on synthetic data (kernel_bench_png.cpp)
+bool KernelBench_png();
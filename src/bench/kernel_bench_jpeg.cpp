@@ -0,0 +1,420 @@
+// jpeg kernel microbenchmarks, see kernel_bench.cpp
+//
+// the decoder is compiled into this translation unit, so that its internal kernels can be called directly
+
+#include "../image/jpeg.cpp"
+
+#include "kernel_bench.hpp"
+
+/// canonical huffman code of a DHT table definition (Annex C of the jpeg spec), i.e. the encoder side of a HuffmanTable
+typedef struct KernelBenchHuffmanCode{
+    uint16_t code[256];
+    /// 0 for values that are not part of the code
+    uint8_t len[256];
+}KernelBenchHuffmanCode;
+
+static void KernelBenchHuffmanCode_fromDefinition(KernelBenchHuffmanCode* const huffman_code,const uint8_t* const definition){
+    memset(huffman_code,0,sizeof(*huffman_code));
+
+    uint32_t code=0;
+    uint32_t value_index=0;
+    for(uint32_t len=1;len<=16;len++){
+        for(uint32_t i=0;i<definition[len-1];i++){
+            const uint8_t value=definition[16+value_index++];
+            huffman_code->code[value]=(uint16_t)code++;
+            huffman_code->len[value]=(uint8_t)len;
+        }
+        code<<=1;
+    }
+}
+
+/// writes bits most significant bit first, with jpeg byte stuffing (0xFF is followed by 0x00)
+typedef struct KernelBenchBitWriter{
+    uint8_t* data;
+    uint64_t size;
+    uint64_t capacity;
+
+    uint64_t bits;
+    uint32_t num_bits;
+}KernelBenchBitWriter;
+
+static void KernelBenchBitWriter_putByte(KernelBenchBitWriter* const writer,const uint8_t byte){
+    if(writer->size>=writer->capacity){
+        writer->capacity=writer->capacity*2+4096;
+        writer->data=(uint8_t*)realloc(writer->data,writer->capacity);
+        if(!writer->data)
+            bail(-1,"failed to allocate memory");
+    }
+    writer->data[writer->size++]=byte;
+}
+static void KernelBenchBitWriter_put(KernelBenchBitWriter* const writer,const uint32_t value,const uint32_t num_bits){
+    writer->bits=(writer->bits<<num_bits)|(value&bitUtil::get_mask_u32(num_bits));
+    writer->num_bits+=num_bits;
+
+    while(writer->num_bits>=8){
+        const uint8_t byte=(uint8_t)(writer->bits>>(writer->num_bits-8));
+        writer->num_bits-=8;
+
+        KernelBenchBitWriter_putByte(writer,byte);
+        if(byte==0xFF)
+            KernelBenchBitWriter_putByte(writer,0);
+    }
+}
+/// pad the last byte with 1-bits, like jpeg encoders do
+static void KernelBenchBitWriter_flush(KernelBenchBitWriter* const writer){
+    if(writer->num_bits>0)
+        KernelBenchBitWriter_put(writer,0xFF,8-writer->num_bits);
+}
+
+/// bit i (most significant first) of data, i.e. the reference for the bitstream
+static uint32_t KernelBench_referenceBits(const uint8_t* const data,const uint64_t bit_offset,const uint32_t num_bits){
+    uint32_t value=0;
+    for(uint64_t bit=bit_offset;bit<bit_offset+num_bits;bit++)
+        value=(value<<1)|((data[bit/8]>>(7-bit%8))&1);
+    return value;
+}
+
+/// BitStream::fill_buffer (through get_bits_advance), on random bytes with byte stuffing
+static bool KernelBench_bitstream(){
+    static const uint64_t NUM_BYTES=1<<20;
+
+    uint64_t random_state=1;
+    uint8_t* const plain=(uint8_t*)malloc(NUM_BYTES);
+    KernelBenchBitWriter writer={};
+    for(uint64_t i=0;i<NUM_BYTES;i++){
+        plain[i]=(uint8_t)KernelBench_random(&random_state);
+        KernelBenchBitWriter_put(&writer,plain[i],8);
+    }
+
+    // widths of consecutive reads cycle through 1..16 bits
+    const uint64_t num_reads=NUM_BYTES*8/17*2;
+    uint32_t* const values=(uint32_t*)malloc(num_reads*sizeof(uint32_t));
+
+    uint64_t num_refills=0;
+    const uint64_t cycles=KernelBench_measure([]{},[&]{
+        BitStream stream;
+        BitStream::BitStream_new(&stream,writer.data,writer.size);
+        for(uint64_t i=0;i<num_reads;i++)
+            values[i]=(uint32_t)stream.get_bits_advance((uint8_t)(1+i%16));
+        num_refills=stream.num_refills;
+    });
+
+    double max_difference=0;
+    uint64_t bit_offset=0;
+    for(uint64_t i=0;i<num_reads;i++){
+        const uint32_t num_bits=(uint32_t)(1+i%16);
+        if(values[i]!=KernelBench_referenceBits(plain,bit_offset,num_bits))
+            max_difference=1;
+        bit_offset+=num_bits;
+    }
+
+    char variant[64];
+    snprintf(variant,sizeof(variant),"%" PRIu64 " refills",num_refills);
+    const bool matches=KernelBench_report("bitstream fill_buffer",variant,cycles,writer.size,"byte",max_difference,0);
+
+    free(values);
+    free(writer.data);
+    free(plain);
+    return matches;
+}
+
+/// HuffmanTable::lookup with the standard ac luminance table, on symbols with the frequencies implied by their code lengths
+static bool KernelBench_huffmanLookup(){
+    static const uint64_t NUM_SYMBOLS=1<<20;
+
+    KernelBenchHuffmanCode huffman_code;
+    KernelBenchHuffmanCode_fromDefinition(&huffman_code,StandardHuffmanTables::AC_LUMINANCE);
+
+    HuffmanTable table{};
+    table.use_static_lookup_table(&StandardHuffmanTables::AC_LUMINANCE_LOOKUP);
+
+    uint64_t random_state=2;
+    uint8_t* const symbols=(uint8_t*)malloc(NUM_SYMBOLS);
+    KernelBenchBitWriter writer={};
+    for(uint64_t i=0;i<NUM_SYMBOLS;){
+        // the symbol whose code is a prefix of 16 random bits (if any), i.e. a symbol with code length l has probability 2^-l
+        const uint32_t bits=KernelBench_random(&random_state)&0xFFFF;
+        for(uint32_t value=0;value<256;value++){
+            const uint32_t len=huffman_code.len[value];
+            if(len>0 && (bits>>(16-len))==huffman_code.code[value]){
+                symbols[i++]=(uint8_t)value;
+                KernelBenchBitWriter_put(&writer,huffman_code.code[value],len);
+                break;
+            }
+        }
+    }
+    KernelBenchBitWriter_flush(&writer);
+
+    uint8_t* const decoded=(uint8_t*)malloc(NUM_SYMBOLS);
+    const uint64_t cycles=KernelBench_measure([]{},[&]{
+        BitStream stream;
+        BitStream::BitStream_new(&stream,writer.data,writer.size);
+        for(uint64_t i=0;i<NUM_SYMBOLS;i++)
+            decoded[i]=table.lookup(&stream);
+    });
+
+    const bool matches=KernelBench_report("huffman lookup","ac luminance",cycles,NUM_SYMBOLS,"symbol",memcmp(decoded,symbols,NUM_SYMBOLS)==0?0:1,0);
+
+    free(decoded);
+    free(writer.data);
+    free(symbols);
+    return matches;
+}
+
+/// ProcessBlock::decode_block_ac, on blocks with the sparsity of typical photos, encoded with the standard ac luminance table
+static bool KernelBench_decodeBlockAc(){
+    static const uint32_t NUM_BLOCKS=1<<15;
+
+    KernelBenchHuffmanCode huffman_code;
+    KernelBenchHuffmanCode_fromDefinition(&huffman_code,StandardHuffmanTables::AC_LUMINANCE);
+
+    HuffmanTable table{};
+    table.use_static_lookup_table(&StandardHuffmanTables::AC_LUMINANCE_LOOKUP);
+
+    uint64_t random_state=3;
+    MCU_EL* const blocks=(MCU_EL*)calloc((uint64_t)NUM_BLOCKS*64,sizeof(MCU_EL));
+    KernelBenchBitWriter writer={};
+    for(uint32_t b=0;b<NUM_BLOCKS;b++){
+        MCU_EL* const block=blocks+(uint64_t)b*64;
+
+        // coefficient k (in zigzag order) is non-zero with a probability that falls off with k, with mostly small magnitudes
+        for(uint32_t k=1;k<64;k++){
+            if((KernelBench_random(&random_state)%1024)>=(uint32_t)(700>>(k/6)))
+                continue;
+
+            uint32_t magnitude=1;
+            while(magnitude<10 && KernelBench_random(&random_state)%3==0)
+                magnitude++;
+
+            const int32_t value=(int32_t)((1u<<(magnitude-1))+KernelBench_random(&random_state)%(1u<<(magnitude-1)));
+            block[k]=(MCU_EL)((KernelBench_random(&random_state)&1)?value:-value);
+        }
+
+        // run length coding (F.1.2.2 of the jpeg spec)
+        uint32_t num_zeros=0;
+        for(uint32_t k=1;k<64;k++){
+            if(block[k]==0){
+                num_zeros++;
+                continue;
+            }
+
+            while(num_zeros>15){
+                KernelBenchBitWriter_put(&writer,huffman_code.code[0xF0],huffman_code.len[0xF0]);
+                num_zeros-=16;
+            }
+
+            const int32_t value=block[k];
+            const uint32_t magnitude=32-(uint32_t)__builtin_clz((uint32_t)(value<0?-value:value));
+            const uint8_t symbol=(uint8_t)((num_zeros<<4)|magnitude);
+            KernelBenchBitWriter_put(&writer,huffman_code.code[symbol],huffman_code.len[symbol]);
+            KernelBenchBitWriter_put(&writer,(uint32_t)(value<0?value-1:value),magnitude);
+
+            num_zeros=0;
+        }
+        if(num_zeros>0)
+            KernelBenchBitWriter_put(&writer,huffman_code.code[0x00],huffman_code.len[0x00]);
+    }
+    KernelBenchBitWriter_flush(&writer);
+
+    MCU_EL* const decoded=(MCU_EL*)malloc((uint64_t)NUM_BLOCKS*64*sizeof(MCU_EL));
+    const uint64_t cycles=KernelBench_measure([&]{
+        memset(decoded,0,(uint64_t)NUM_BLOCKS*64*sizeof(MCU_EL));
+    },[&]{
+        BitStream stream;
+        BitStream::BitStream_new(&stream,writer.data,writer.size);
+        uint64_t eob_run=0;
+        for(uint32_t b=0;b<NUM_BLOCKS;b++)
+            discard ProcessBlock::decode_block_ac(decoded+(uint64_t)b*64,&table,1,63,&stream,0,&eob_run);
+    });
+
+    double max_difference=0;
+    for(uint64_t i=0;i<(uint64_t)NUM_BLOCKS*64;i++)
+        max_difference=bitUtil::max(max_difference,fabs((double)decoded[i]-(double)blocks[i]));
+
+    const bool matches=KernelBench_report("decode_block_ac","baseline",cycles,NUM_BLOCKS,"block",max_difference,0);
+
+    free(decoded);
+    free(writer.data);
+    free(blocks);
+    return matches;
+}
+
+bool KernelBench_jpegEntropy(){
+    bool all_match=true;
+    all_match&=KernelBench_bitstream();
+    all_match&=KernelBench_huffmanLookup();
+    all_match&=KernelBench_decodeBlockAc();
+    return all_match;
+}
+
+static const char* const KERNEL_BENCH_PRECISION_NAMES[]={"fixed","float","exact"};
+
+/// largest difference between the elements of two idct outputs
+static double KernelBench_idctDifference(const void* const a,const void* const b,const uint64_t num_elements,const uint32_t element_size){
+    double max_difference=0;
+    for(uint64_t i=0;i<num_elements;i++){
+        double difference;
+        if(element_size==sizeof(float))
+            difference=fabs((double)((const float*)a)[i]-(double)((const float*)b)[i]);
+        else
+            difference=fabs((double)((const int16_t*)a)[i]-(double)((const int16_t*)b)[i]);
+        max_difference=bitUtil::max(max_difference,difference);
+    }
+    return max_difference;
+}
+
+/// idct and colour conversion of all instruction sets, on the coefficients parser has decoded
+///
+/// the pixels of the generic kernels (width*4 bytes per row, without padding) are returned in converted_pixels, to be freed by the caller
+static bool KernelBench_parserKernels(JpegParser* const parser,const ImageDecodePrecision precision,ImageData* const image_data,uint8_t** const converted_pixels){
+    bool all_match=true;
+
+    cpu::Isa isas[5];
+    const uint32_t num_isas=KernelBench_supportedIsas(isas);
+
+    const JpegKernels* const reference=JpegKernels_select(cpu::Isa::GENERIC,precision);
+
+    // the idct output of the reference kernels, per component
+    uint64_t num_out_elements[3]={0,0,0};
+    void* reference_out[3]={NULL,NULL,NULL};
+    uint64_t num_blocks=0;
+    for(uint8_t c=0;c<parser->Nf;c++){
+        const ImageComponent* const component=&parser->image_components[c];
+
+        reference->process_channel(parser,c,0,component->num_scans);
+
+        num_out_elements[c]=(uint64_t)parser->num_stored_scans*component->num_blocks_in_scan*64;
+        reference_out[c]=malloc(num_out_elements[c]*reference->out_element_size);
+        memcpy(reference_out[c],component->out_block_downsampled,num_out_elements[c]*reference->out_element_size);
+
+        num_blocks+=component->total_num_blocks;
+    }
+
+    // float kernels are compiled with different instructions per set (e.g. fused multiply-add), which changes the rounding
+    const double idct_tolerance=precision==IMAGE_DECODE_PRECISION_FLOAT?1e-2:0;
+    const double convert_tolerance=precision==IMAGE_DECODE_PRECISION_FLOAT?1:0;
+
+    for(uint32_t i=0;i<num_isas;i++){
+        const JpegKernels* const kernels=JpegKernels_select(isas[i],precision);
+
+        const uint64_t cycles=KernelBench_measure([]{},[&]{
+            for(uint8_t c=0;c<parser->Nf;c++)
+                kernels->process_channel(parser,c,0,parser->image_components[c].num_scans);
+        });
+
+        double max_difference=0;
+        for(uint8_t c=0;c<parser->Nf;c++)
+            max_difference=bitUtil::max(max_difference,KernelBench_idctDifference(parser->image_components[c].out_block_downsampled,reference_out[c],num_out_elements[c],kernels->out_element_size));
+
+        char variant[64];
+        snprintf(variant,sizeof(variant),"%s %s",cpu::Isa_name(isas[i]),KERNEL_BENCH_PRECISION_NAMES[precision]);
+        all_match&=KernelBench_report("idct",variant,cycles,num_blocks,"block",max_difference,idct_tolerance);
+    }
+
+    // all colour conversion kernels get the same input
+    for(uint8_t c=0;c<parser->Nf;c++)
+        memcpy(parser->image_components[c].out_block_downsampled,reference_out[c],num_out_elements[c]*reference->out_element_size);
+
+    const uint64_t row_size=(uint64_t)image_data->width*4;
+    const uint64_t num_pixels=(uint64_t)image_data->width*image_data->height;
+    uint8_t* const reference_pixels=(uint8_t*)malloc(row_size*image_data->height);
+
+    reference->convert_colorspace(parser,0,parser->image_components[0].num_scans,&parser->output);
+    for(uint32_t y=0;y<image_data->height;y++)
+        memcpy(reference_pixels+y*row_size,image_data->data+y*image_data->stride,row_size);
+
+    for(uint32_t i=0;i<num_isas;i++){
+        const JpegKernels* const kernels=JpegKernels_select(isas[i],precision);
+
+        const uint64_t cycles=KernelBench_measure([]{},[&]{
+            kernels->convert_colorspace(parser,0,parser->image_components[0].num_scans,&parser->output);
+        });
+
+        double max_difference=0;
+        for(uint32_t y=0;y<image_data->height;y++)
+            for(uint64_t x=0;x<row_size;x++)
+                max_difference=bitUtil::max(max_difference,fabs((double)image_data->data[y*image_data->stride+x]-(double)reference_pixels[y*row_size+x]));
+
+        char variant[64];
+        snprintf(variant,sizeof(variant),"%s %s",cpu::Isa_name(isas[i]),KERNEL_BENCH_PRECISION_NAMES[precision]);
+        all_match&=KernelBench_report("ycbcr_to_rgb",variant,cycles,num_pixels,"pixel",max_difference,convert_tolerance);
+    }
+
+    *converted_pixels=reference_pixels;
+    for(uint8_t c=0;c<3;c++)
+        free(reference_out[c]);
+
+    return all_match;
+}
+
+/// largest mean absolute difference per sample of the pixels of a precision to those of exact precision (which are identical to the
+/// reference implementation). the precisions differ in rounding only, i.e. a larger difference means that a precision gets the colours
+/// wrong, e.g. mixes up the chroma components or the channel order.
+static const double KERNEL_BENCH_PRECISION_MEAN_DIFFERENCE_TOLERANCE[3]={4,1,0};
+
+/// compare the pixels of each precision to those of exact precision, see KERNEL_BENCH_PRECISION_MEAN_DIFFERENCE_TOLERANCE
+static bool KernelBench_comparePrecisions(uint8_t* const pixels[3],const uint64_t num_pixels){
+    bool all_match=true;
+    for(const ImageDecodePrecision precision:{IMAGE_DECODE_PRECISION_FIXED,IMAGE_DECODE_PRECISION_FLOAT}){
+        uint64_t sum_difference=0;
+        for(uint64_t i=0;i<num_pixels*4;i++)
+            sum_difference+=(uint64_t)abs((int)pixels[precision][i]-(int)pixels[IMAGE_DECODE_PRECISION_EXACT][i]);
+        const double mean_difference=(double)sum_difference/(double)(num_pixels*4);
+
+        char variant[64];
+        snprintf(variant,sizeof(variant),"%s vs exact",KERNEL_BENCH_PRECISION_NAMES[precision]);
+        const bool matches=mean_difference<=KERNEL_BENCH_PRECISION_MEAN_DIFFERENCE_TOLERANCE[precision];
+        printf("%-24s %-20s %s (mean difference %.3f)\n","precision",variant,matches?"ok      ":"MISMATCH",mean_difference);
+        all_match&=matches;
+    }
+    return all_match;
+}
+
+bool KernelBench_jpegKernels(const char* const filepath){
+    printf("%s\n",filepath);
+
+    bool all_match=true;
+    // pixels of each precision, for KernelBench_comparePrecisions
+    uint8_t* pixels[3]={NULL,NULL,NULL};
+    uint64_t num_pixels=0;
+    for(const ImageDecodePrecision precision:{IMAGE_DECODE_PRECISION_FIXED,IMAGE_DECODE_PRECISION_FLOAT,IMAGE_DECODE_PRECISION_EXACT}){
+        ImageData image_data;
+
+        ImageDecodeOptions options{};
+        options.precision=precision;
+
+        ImageDecodeStats stats{};
+        ImageDecodeStageTimer timer{NULL};
+
+        try{
+            // decode the coefficients (the whole image is kept in memory, since the options have no callback)
+            JpegParser parser{filepath,&image_data,&options,&stats,&timer};
+
+            try{
+                parser.parse_file();
+
+                all_match&=KernelBench_parserKernels(&parser,precision,&image_data,&pixels[precision]);
+                num_pixels=(uint64_t)image_data.width*image_data.height;
+
+                parser.destroy();
+            }catch(const ImageParseResult){
+                parser.abort();
+                throw;
+            }
+        }catch(const ImageParseResult result){
+            fprintf(stderr,"failed to decode %s: %s\n",filepath,ImageParseResult_name(result));
+            ImageData_destroy(&image_data);
+            for(uint8_t* const precision_pixels:pixels)
+                free(precision_pixels);
+            return false;
+        }
+
+        ImageData_destroy(&image_data);
+    }
+
+    all_match&=KernelBench_comparePrecisions(pixels,num_pixels);
+    for(uint8_t* const precision_pixels:pixels)
+        free(precision_pixels);
+
+    return all_match;
+}
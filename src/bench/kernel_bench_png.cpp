@@ -0,0 +1,406 @@
+// png kernel microbenchmarks, see kernel_bench.cpp
+//
+// the decoder is compiled into this translation unit, so that its internal kernels can be called directly
+
+#include "../image/png.cpp"
+
+#include "kernel_bench.hpp"
+
+static const char* const KERNEL_BENCH_FILTER_NAMES[]={"none","sub","up","average","paeth"};
+
+/// unfilter_scanline of all instruction sets, per filter type and number of bytes per pixel, on synthetic images where every
+/// scanline has the same filter (the first scanline of each image is unfiltered by the first row kernels)
+static bool KernelBench_unfilterScanline(){
+    static const uint32_t NUM_LINES=64;
+    static const uint32_t NUM_PIXELS=1024;
+    static const uint32_t MAX_BPP=8;
+    static const uint32_t BPPS[]={1,2,3,4,6,8};
+
+    bool all_match=true;
+
+    cpu::Isa isas[5];
+    const uint32_t num_isas=KernelBench_supportedIsas(isas);
+
+    uint64_t random_state=4;
+    uint8_t* const filtered=(uint8_t*)malloc((uint64_t)NUM_LINES*(1+NUM_PIXELS*MAX_BPP));
+    for(uint64_t i=0;i<(uint64_t)NUM_LINES*(1+NUM_PIXELS*MAX_BPP);i++)
+        filtered[i]=(uint8_t)KernelBench_random(&random_state);
+
+    uint8_t* const reference=(uint8_t*)malloc((uint64_t)NUM_LINES*NUM_PIXELS*MAX_BPP);
+    uint8_t* const output=(uint8_t*)malloc((uint64_t)NUM_LINES*NUM_PIXELS*MAX_BPP);
+
+    for(const uint32_t bpp:BPPS){
+        const uint32_t num_bytes=NUM_PIXELS*bpp;
+
+        const auto unfilter_image=[&](const PngKernels* const kernels,uint8_t* const out){
+            for(uint32_t line=0;line<NUM_LINES;line++)
+                kernels->unfilter_scanline(
+                    filtered+(uint64_t)line*(1+num_bytes),
+                    out+(uint64_t)line*num_bytes,
+                    line==0?NULL:out+(uint64_t)(line-1)*num_bytes,
+                    num_bytes,
+                    bpp
+                );
+        };
+
+        for(uint8_t filter=PNG_SCANLINE_FILTER_NONE;filter<=PNG_SCANLINE_FILTER_PAETH;filter++){
+            for(uint32_t line=0;line<NUM_LINES;line++)
+                filtered[(uint64_t)line*(1+num_bytes)]=filter;
+
+            unfilter_image(PngKernels_forIsa(cpu::Isa::GENERIC),reference);
+
+            for(uint32_t i=0;i<num_isas;i++){
+                const PngKernels* const kernels=PngKernels_forIsa(isas[i]);
+
+                const uint64_t cycles=KernelBench_measure([]{},[&]{
+                    unfilter_image(kernels,output);
+                });
+
+                double max_difference=0;
+                for(uint64_t b=0;b<(uint64_t)NUM_LINES*num_bytes;b++)
+                    max_difference=bitUtil::max(max_difference,fabs((double)output[b]-(double)reference[b]));
+
+                char variant[64];
+                snprintf(variant,sizeof(variant),"%s %s bpp%u",cpu::Isa_name(isas[i]),KERNEL_BENCH_FILTER_NAMES[filter],bpp);
+                all_match&=KernelBench_report("unfilter_scanline",variant,cycles,(uint64_t)NUM_LINES*num_bytes,"byte",max_difference,0);
+            }
+        }
+    }
+
+    free(output);
+    free(reference);
+    free(filtered);
+    return all_match;
+}
+
+/// rgba_to_bgra of all instruction sets, on random pixels, out of place and in place
+static bool KernelBench_rgbaToBgra(){
+    static const uint64_t NUM_PIXELS=1<<18;
+
+    bool all_match=true;
+
+    cpu::Isa isas[5];
+    const uint32_t num_isas=KernelBench_supportedIsas(isas);
+
+    uint64_t random_state=5;
+    uint8_t* const input=(uint8_t*)malloc(NUM_PIXELS*4);
+    for(uint64_t i=0;i<NUM_PIXELS*4;i++)
+        input[i]=(uint8_t)KernelBench_random(&random_state);
+
+    uint8_t* const reference=(uint8_t*)malloc(NUM_PIXELS*4);
+    PngKernels_forIsa(cpu::Isa::GENERIC)->rgba_to_bgra(input,reference,NUM_PIXELS);
+
+    uint8_t* const pixels=(uint8_t*)malloc(NUM_PIXELS*4);
+    for(uint32_t i=0;i<num_isas;i++){
+        const PngKernels* const kernels=PngKernels_forIsa(isas[i]);
+
+        const uint64_t cycles=KernelBench_measure([]{},[&]{
+            kernels->rgba_to_bgra(input,pixels,NUM_PIXELS);
+        });
+        bool matches=memcmp(pixels,reference,NUM_PIXELS*4)==0;
+
+        // the kernel must also work in place
+        memcpy(pixels,input,NUM_PIXELS*4);
+        kernels->rgba_to_bgra(pixels,pixels,NUM_PIXELS);
+        matches&=memcmp(pixels,reference,NUM_PIXELS*4)==0;
+
+        all_match&=KernelBench_report("rgba_to_bgra",cpu::Isa_name(isas[i]),cycles,NUM_PIXELS,"pixel",matches?0:1,0);
+    }
+
+    free(pixels);
+    free(reference);
+    free(input);
+    return all_match;
+}
+
+/// the pixel expansion kernels (rgb_to_bgra, grey_to_bgra, grey_alpha_to_bgra, palette_to_bgra, narrow_16_to_8 and
+/// unpack_samples) of all instruction sets, on random samples, against the generic kernels. the number of pixels is not a
+/// multiple of the simd widths, so the scalar tails run as well.
+static bool KernelBench_expandPixels(){
+    static const uint64_t NUM_PIXELS=(1<<16)+13;
+
+    typedef struct Expansion{
+        const char* name;
+        const char* variant;
+        /// number of input bytes per 8 pixels, and output bytes per pixel
+        uint64_t input_bytes_per_8_pixels;
+        uint64_t output_bytes_per_pixel;
+    }Expansion;
+    static const Expansion EXPANSIONS[]={
+        {"rgb_to_bgra","",24,4},
+        {"grey_to_bgra","",8,4},
+        {"grey_alpha_to_bgra","",16,4},
+        {"palette_to_bgra","4 bit",8,4},
+        {"palette_to_bgra","8 bit",8,4},
+        {"narrow_16_to_8","",16,1},
+        {"unpack_samples","1 bit",1,1},
+        {"unpack_samples","2 bit",2,1},
+        {"unpack_samples","4 bit",4,1},
+    };
+
+    const auto expand=[](const PngKernels* const kernels,const uint32_t expansion,const uint8_t* const in,uint8_t* const out,const uint32_t* const palette){
+        switch(expansion){
+            case 0: kernels->rgb_to_bgra(in,out,NUM_PIXELS); break;
+            case 1: kernels->grey_to_bgra(in,out,NUM_PIXELS); break;
+            case 2: kernels->grey_alpha_to_bgra(in,out,NUM_PIXELS); break;
+            case 3: kernels->palette_to_bgra(in,out,NUM_PIXELS,palette,true); break;
+            case 4: kernels->palette_to_bgra(in,out,NUM_PIXELS,palette,false); break;
+            case 5: kernels->narrow_16_to_8(in,out,NUM_PIXELS); break;
+            case 6: kernels->unpack_samples(in,out,NUM_PIXELS,1); break;
+            case 7: kernels->unpack_samples(in,out,NUM_PIXELS,2); break;
+            default: kernels->unpack_samples(in,out,NUM_PIXELS,4); break;
+        }
+    };
+
+    bool all_match=true;
+
+    cpu::Isa isas[5];
+    const uint32_t num_isas=KernelBench_supportedIsas(isas);
+
+    uint64_t random_state=8;
+    uint8_t* const input=(uint8_t*)malloc(NUM_PIXELS*3+16);
+    uint8_t* const indices=(uint8_t*)malloc(NUM_PIXELS);
+    for(uint64_t i=0;i<NUM_PIXELS*3+16;i++)
+        input[i]=(uint8_t)KernelBench_random(&random_state);
+    // indices of the 4 bit palette kernel are below 16
+    for(uint64_t i=0;i<NUM_PIXELS;i++)
+        indices[i]=input[i]&0x0F;
+    uint32_t palette[256];
+    for(uint32_t i=0;i<256;i++)
+        palette[i]=(uint32_t)KernelBench_random(&random_state);
+
+    uint8_t* const reference=(uint8_t*)malloc(NUM_PIXELS*4);
+    uint8_t* const output=(uint8_t*)malloc(NUM_PIXELS*4);
+
+    for(uint32_t e=0;e<sizeof(EXPANSIONS)/sizeof(EXPANSIONS[0]);e++){
+        const uint8_t* const in=e==3?indices:input;
+        const uint64_t output_size=NUM_PIXELS*EXPANSIONS[e].output_bytes_per_pixel;
+
+        expand(PngKernels_forIsa(cpu::Isa::GENERIC),e,in,reference,palette);
+
+        for(uint32_t i=0;i<num_isas;i++){
+            const PngKernels* const kernels=PngKernels_forIsa(isas[i]);
+
+            const uint64_t cycles=KernelBench_measure([]{},[&]{
+                expand(kernels,e,in,output,palette);
+            });
+
+            char variant[64];
+            snprintf(variant,sizeof(variant),"%s%s%s",cpu::Isa_name(isas[i]),EXPANSIONS[e].variant[0]?" ":"",EXPANSIONS[e].variant);
+            all_match&=KernelBench_report(EXPANSIONS[e].name,variant,cycles,NUM_PIXELS,"pixel",memcmp(output,reference,output_size)==0?0:1,0);
+        }
+    }
+
+    free(output);
+    free(reference);
+    free(indices);
+    free(input);
+    return all_match;
+}
+
+/// scatter_pixels of all instruction sets, for the steps of the adam7 passes, into a scanline of random pixels (which the pixels
+/// in between the written ones must keep) against a reference loop
+static bool KernelBench_scatterPixels(){
+    static const uint64_t NUM_PIXELS=(1<<14)+13;
+    static const uint32_t STEPS[]={2,4,8};
+    static const uint32_t MAX_STEP=8;
+
+    bool all_match=true;
+
+    cpu::Isa isas[5];
+    const uint32_t num_isas=KernelBench_supportedIsas(isas);
+
+    uint64_t random_state=9;
+    uint8_t* const input=(uint8_t*)malloc(NUM_PIXELS*4);
+    uint8_t* const background=(uint8_t*)malloc(NUM_PIXELS*MAX_STEP*4);
+    for(uint64_t i=0;i<NUM_PIXELS*4;i++)
+        input[i]=(uint8_t)KernelBench_random(&random_state);
+    for(uint64_t i=0;i<NUM_PIXELS*MAX_STEP*4;i++)
+        background[i]=(uint8_t)KernelBench_random(&random_state);
+
+    uint8_t* const reference=(uint8_t*)malloc(NUM_PIXELS*MAX_STEP*4);
+    uint8_t* const output=(uint8_t*)malloc(NUM_PIXELS*MAX_STEP*4);
+
+    for(const uint32_t step:STEPS){
+        // the scanline ends at the last written pixel
+        const uint64_t output_size=((NUM_PIXELS-1)*step+1)*4;
+
+        memcpy(reference,background,output_size);
+        for(uint64_t pix=0;pix<NUM_PIXELS;pix++)
+            memcpy(reference+pix*step*4,input+pix*4,4);
+
+        for(uint32_t i=0;i<num_isas;i++){
+            const PngKernels* const kernels=PngKernels_forIsa(isas[i]);
+
+            const uint64_t cycles=KernelBench_measure([&]{
+                memcpy(output,background,output_size);
+            },[&]{
+                kernels->scatter_pixels(input,output,NUM_PIXELS,step);
+            });
+
+            char variant[64];
+            snprintf(variant,sizeof(variant),"%s step %u",cpu::Isa_name(isas[i]),step);
+            all_match&=KernelBench_report("scatter_pixels",variant,cycles,NUM_PIXELS,"pixel",memcmp(output,reference,output_size)==0?0:1,0);
+        }
+    }
+
+    free(output);
+    free(reference);
+    free(background);
+    free(input);
+    return all_match;
+}
+
+/// crc32 and adler32 of all instruction sets, on random data, against bit-by-bit (crc-32) and byte-by-byte (adler-32) reference
+/// implementations. the checksums are also compared for all lengths and alignments of short data, which exercise the tails
+/// of the vectorised loops.
+static bool KernelBench_checksums(){
+    static const uint64_t NUM_BYTES=1<<20;
+    static const uint32_t MAX_SHORT_LENGTH=300;
+
+    const auto reference_crc32=[](const uint8_t* const data,const uint64_t num_bytes){
+        uint32_t crc=0xFFFFFFFF;
+        for(uint64_t i=0;i<num_bytes;i++){
+            crc^=data[i];
+            for(uint32_t bit=0;bit<8;bit++)
+                crc=(crc>>1)^((crc&1)?0xEDB88320:0);
+        }
+        return ~crc;
+    };
+    const auto reference_adler32=[](const uint8_t* const data,const uint64_t num_bytes){
+        uint32_t s1=1,s2=0;
+        for(uint64_t i=0;i<num_bytes;i++){
+            s1=(s1+data[i])%ADLER32_BASE;
+            s2=(s2+s1)%ADLER32_BASE;
+        }
+        return s1|(s2<<16);
+    };
+
+    bool all_match=true;
+
+    cpu::Isa isas[5];
+    const uint32_t num_isas=KernelBench_supportedIsas(isas);
+
+    // all 0xFF bytes are the worst case for the adler-32 sums
+    uint64_t random_state=7;
+    uint8_t* const data=(uint8_t*)malloc(NUM_BYTES);
+    for(uint64_t i=0;i<NUM_BYTES;i++)
+        data[i]=i<NUM_BYTES/2?(uint8_t)KernelBench_random(&random_state):0xFF;
+
+    const uint32_t crc_reference=reference_crc32(data,NUM_BYTES);
+    const uint32_t adler_reference=reference_adler32(data,NUM_BYTES);
+
+    for(uint32_t i=0;i<num_isas;i++){
+        const PngKernels* const kernels=PngKernels_forIsa(isas[i]);
+
+        uint64_t num_crc_mismatches=0;
+        uint64_t num_adler_mismatches=0;
+        for(uint32_t offset=0;offset<16;offset++)
+            for(uint32_t length=0;length<=MAX_SHORT_LENGTH;length++){
+                num_crc_mismatches+=kernels->crc32(0,data+offset,length)!=reference_crc32(data+offset,length);
+                num_adler_mismatches+=kernels->adler32(1,data+offset,length)!=reference_adler32(data+offset,length);
+            }
+
+        // the checksums are updated in parts of varying size while decoding
+        uint32_t crc=0,adler=1;
+        for(uint64_t offset=0,part=1;offset<NUM_BYTES;offset+=part,part=part*3+1){
+            const uint64_t part_size=bitUtil::min(part,NUM_BYTES-offset);
+            crc=kernels->crc32(crc,data+offset,part_size);
+            adler=kernels->adler32(adler,data+offset,part_size);
+        }
+        num_crc_mismatches+=crc!=crc_reference;
+        num_adler_mismatches+=adler!=adler_reference;
+
+        uint32_t result=0;
+        const uint64_t crc_cycles=KernelBench_measure([]{},[&]{
+            result=kernels->crc32(0,data,NUM_BYTES);
+        });
+        num_crc_mismatches+=result!=crc_reference;
+        all_match&=KernelBench_report("crc32",cpu::Isa_name(isas[i]),crc_cycles,NUM_BYTES,"byte",(double)num_crc_mismatches,0);
+
+        const uint64_t adler_cycles=KernelBench_measure([]{},[&]{
+            result=kernels->adler32(1,data,NUM_BYTES);
+        });
+        num_adler_mismatches+=result!=adler_reference;
+        all_match&=KernelBench_report("adler32",cpu::Isa_name(isas[i]),adler_cycles,NUM_BYTES,"byte",(double)num_adler_mismatches,0);
+    }
+
+    free(data);
+    return all_match;
+}
+
+/// deflate_copy_match and deflate_copy_match_fast, on matches with the distance and length distribution of typical png data
+/// (mostly short matches, often with a distance of one pixel or one scanline), following a window of random bytes
+static bool KernelBench_deflateCopyMatch(){
+    static const uint32_t WINDOW_SIZE=32*1024;
+    static const uint32_t NUM_MATCHES=1<<16;
+
+    typedef struct Match{
+        uint32_t distance;
+        uint32_t length;
+    }Match;
+
+    uint64_t random_state=6;
+    Match* const matches=(Match*)malloc(NUM_MATCHES*sizeof(Match));
+    uint64_t output_size=WINDOW_SIZE;
+    for(uint32_t i=0;i<NUM_MATCHES;i++){
+        const uint32_t distance_class=KernelBench_random(&random_state)%8;
+        if(distance_class<2)
+            matches[i].distance=1+distance_class*3;
+        else if(distance_class<4)
+            matches[i].distance=4096;
+        else
+            matches[i].distance=1+KernelBench_random(&random_state)%WINDOW_SIZE;
+
+        // lengths 3..258, skewed towards short matches
+        matches[i].length=3+(KernelBench_random(&random_state)%256)*(KernelBench_random(&random_state)%256)/256;
+
+        output_size+=matches[i].length;
+    }
+
+    // the chunked copy may write past the end of the last match
+    uint8_t* const reference=(uint8_t*)malloc(output_size);
+    uint8_t* const output=(uint8_t*)malloc(output_size+DEFLATE_MATCH_COPY_OVERSHOOT);
+    for(uint32_t i=0;i<WINDOW_SIZE;i++)
+        reference[i]=(uint8_t)KernelBench_random(&random_state);
+
+    // straightforward byte by byte copy
+    uint64_t reference_offset=WINDOW_SIZE;
+    for(uint32_t i=0;i<NUM_MATCHES;i++)
+        for(uint32_t l=0;l<matches[i].length;l++,reference_offset++)
+            reference[reference_offset]=reference[reference_offset-matches[i].distance];
+
+    bool all_match=true;
+    for(uint32_t chunked=0;chunked<2;chunked++){
+        memcpy(output,reference,WINDOW_SIZE);
+
+        const uint64_t cycles=KernelBench_measure([]{},[&]{
+            uint64_t out_offset=WINDOW_SIZE;
+            for(uint32_t i=0;i<NUM_MATCHES;i++){
+                if(chunked)
+                    deflate_copy_match_fast(output,out_offset,matches[i].distance,matches[i].length);
+                else
+                    deflate_copy_match(output,out_offset,matches[i].distance,matches[i].length);
+                out_offset+=matches[i].length;
+            }
+        });
+
+        all_match&=KernelBench_report(chunked?"deflate_copy_match_fast":"deflate_copy_match","mixed",cycles,output_size-WINDOW_SIZE,"byte",memcmp(output,reference,output_size)==0?0:1,0);
+    }
+
+    free(output);
+    free(reference);
+    free(matches);
+    return all_match;
+}
+
+bool KernelBench_png(){
+    bool all_match=true;
+    all_match&=KernelBench_unfilterScanline();
+    all_match&=KernelBench_rgbaToBgra();
+    all_match&=KernelBench_expandPixels();
+    all_match&=KernelBench_scatterPixels();
+    all_match&=KernelBench_checksums();
+    all_match&=KernelBench_deflateCopyMatch();
+    return all_match;
+}
@@ -0,0 +1,277 @@
+#include <ctime>
+
+#if defined(__linux__)
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#include "app/image.hpp"
+#include "app/bit_util.hpp"
+
+double current_time(){
+    struct timespec current_time;
+    int time_get_result=clock_gettime(CLOCK_MONOTONIC, &current_time);
+    if (time_get_result != 0) {
+        fprintf(stderr, "failed to get start time because %d\n",time_get_result);
+        exit(-66);
+    }
+
+    double ret=(double)current_time.tv_sec;
+    ret+=((double)current_time.tv_nsec)/(double)(MAX_NSEC+1);
+    return ret;
+}
+
+void ImageData_initEmpty(struct ImageData* const image_data){
+    image_data->data=NULL;
+    image_data->height=0;
+    image_data->width=0;
+    image_data->stride=0;
+    image_data->pixel_format=(PixelFormat)0;
+
+    image_data->image_file_metadata.file_comment=NULL;
+}
+void ImageData_destroy(struct ImageData* const image_data){
+    if(image_data->image_file_metadata.file_comment){
+        free(static_cast<void*>(image_data->image_file_metadata.file_comment));
+        image_data->image_file_metadata.file_comment=NULL;
+    }
+    free(image_data->data);
+}
+
+void ImageData_emitToCallbacks(
+    struct ImageData* const image_data,
+    const ImageDecodeOptions* const options,
+    const uint32_t band_height
+){
+    if(options->row_callback){
+        for(uint32_t first_row=0;first_row<image_data->height;first_row+=band_height){
+            const uint32_t num_rows=bitUtil::min(band_height,image_data->height-first_row);
+            options->row_callback(
+                options->row_callback_user_data,
+                image_data->data+first_row*image_data->stride,
+                first_row,num_rows,
+                image_data->stride
+            );
+        }
+    }else if(options->tile_callback){
+        const uint32_t tile_width=options->tile_width?options->tile_width:IMAGE_DEFAULT_TILE_SIZE;
+        const uint32_t tile_height=options->tile_height?options->tile_height:IMAGE_DEFAULT_TILE_SIZE;
+
+        for(uint32_t y=0;y<image_data->height;y+=tile_height){
+            for(uint32_t x=0;x<image_data->width;x+=tile_width){
+                options->tile_callback(
+                    options->tile_callback_user_data,
+                    image_data->data+y*image_data->stride+(uint64_t)x*4,
+                    x,y,
+                    bitUtil::min(tile_width,image_data->width-x),
+                    bitUtil::min(tile_height,image_data->height-y),
+                    image_data->stride
+                );
+            }
+        }
+    }else{
+        return;
+    }
+
+    free(image_data->data);
+    image_data->data=NULL;
+}
+
+void ImageDecodeOptions_fromEnvironment(ImageDecodeOptions* const options){
+    const char* const precision=getenv("IMAGE_DECODE_PRECISION");
+    if(precision!=nullptr){
+        if(strcmp(precision,"fixed")==0){
+            options->precision=IMAGE_DECODE_PRECISION_FIXED;
+        }else if(strcmp(precision,"float")==0){
+            options->precision=IMAGE_DECODE_PRECISION_FLOAT;
+        }else if(strcmp(precision,"exact")==0){
+            options->precision=IMAGE_DECODE_PRECISION_EXACT;
+        }else{
+            fprintf(stderr,"ignoring unknown IMAGE_DECODE_PRECISION '%s' (expected fixed, float or exact)\n",precision);
+        }
+    }
+
+    const char* const num_threads=getenv("IMAGE_DECODE_NUM_THREADS");
+    if(num_threads!=nullptr)
+        options->num_threads=static_cast<uint32_t>(strtoul(num_threads,nullptr,10));
+
+    const char* const verify_checksums=getenv("IMAGE_DECODE_VERIFY_CHECKSUMS");
+    if(verify_checksums!=nullptr)
+        options->verify_checksums=strtoul(verify_checksums,nullptr,10)!=0;
+}
+
+const char* ImageParseResult_name(const ImageParseResult result){
+    switch(result){
+        case IMAGE_PARSE_RESULT_OK: return "OK";
+        case IMAGE_PARSE_RESULT_FILE_NOT_FOUND: return "FILE_NOT_FOUND";
+        case IMAGE_PARSE_RESULT_FILESIZE_UNKNOWN: return "FILESIZE_UNKNOWN";
+        case IMAGE_PARSE_RESULT_SIGNATURE_INVALID: return "SIGNATURE_INVALID";
+        case IMAGE_PARSE_RESULT_PNG_CHUNK_SIZE_EXCEEDED: return "PNG_CHUNK_SIZE_EXCEEDED";
+        case IMAGE_PARSE_RESULT_DATA_TRUNCATED: return "DATA_TRUNCATED";
+        case IMAGE_PARSE_RESULT_DATA_CORRUPT: return "DATA_CORRUPT";
+        case IMAGE_PARSE_RESULT_UNSUPPORTED: return "UNSUPPORTED";
+        case IMAGE_PARSE_RESULT_INVALID_OPTIONS: return "INVALID_OPTIONS";
+        case IMAGE_PARSE_RESULT_RESOURCE_FAILURE: return "RESOURCE_FAILURE";
+    }
+    return "(unknown)";
+}
+
+const char* ImageDecodeStage_name(const ImageDecodeStage stage){
+    switch(stage){
+        case IMAGE_DECODE_STAGE_PARSE: return "parse";
+        case IMAGE_DECODE_STAGE_ENTROPY_DECODE: return "entropy decode";
+        case IMAGE_DECODE_STAGE_RECONSTRUCT: return "reconstruct";
+        case IMAGE_DECODE_STAGE_CONVERT: return "convert";
+        case IMAGE_DECODE_STAGE_EMIT: return "emit";
+        case IMAGE_DECODE_NUM_STAGES: break;
+    }
+    return "(unknown)";
+}
+
+ImageDecodeStageTime ImageDecodeStageTimer::now()noexcept{
+    struct timespec wall,cpu;
+    clock_gettime(CLOCK_MONOTONIC,&wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&cpu);
+
+    return ImageDecodeStageTime{
+        (double)wall.tv_sec+(double)wall.tv_nsec*1e-9,
+        (double)cpu.tv_sec+(double)cpu.tv_nsec*1e-9,
+    };
+}
+
+const char* ImageDecodeCounter_name(const ImageDecodeCounter counter){
+    switch(counter){
+        case IMAGE_DECODE_COUNTER_CYCLES: return "cycles";
+        case IMAGE_DECODE_COUNTER_INSTRUCTIONS: return "instructions";
+        case IMAGE_DECODE_COUNTER_BRANCHES: return "branches";
+        case IMAGE_DECODE_COUNTER_BRANCH_MISSES: return "branch_misses";
+        case IMAGE_DECODE_COUNTER_L1D_MISSES: return "l1d_misses";
+        case IMAGE_DECODE_COUNTER_LLC_MISSES: return "llc_misses";
+        case IMAGE_DECODE_COUNTER_STALLED_CYCLES: return "stalled_cycles";
+        case IMAGE_DECODE_NUM_COUNTERS: break;
+    }
+    return "(unknown)";
+}
+
+bool ImageDecodePerfCounters_open(ImageDecodePerfCounters* const counters){
+    for(int counter=0;counter<IMAGE_DECODE_NUM_COUNTERS;counter++)
+        counters->fd[counter]=-1;
+
+    #if defined(__linux__)
+        static const struct{
+            uint32_t type;
+            uint64_t config;
+        }EVENTS[IMAGE_DECODE_NUM_COUNTERS]={
+            {PERF_TYPE_HARDWARE,PERF_COUNT_HW_CPU_CYCLES},
+            {PERF_TYPE_HARDWARE,PERF_COUNT_HW_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE,PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+            {PERF_TYPE_HARDWARE,PERF_COUNT_HW_BRANCH_MISSES},
+            {PERF_TYPE_HW_CACHE,PERF_COUNT_HW_CACHE_L1D|(PERF_COUNT_HW_CACHE_OP_READ<<8)|(PERF_COUNT_HW_CACHE_RESULT_MISS<<16)},
+            {PERF_TYPE_HARDWARE,PERF_COUNT_HW_CACHE_MISSES},
+            {PERF_TYPE_HARDWARE,PERF_COUNT_HW_STALLED_CYCLES_BACKEND},
+        };
+
+        bool any_available=false;
+        for(int counter=0;counter<IMAGE_DECODE_NUM_COUNTERS;counter++){
+            // each counter is opened on its own (instead of as a group), so that unavailable counters do not prevent the others,
+            // and so that the kernel can multiplex them if there are more counters than registers
+            struct perf_event_attr attr;
+            memset(&attr,0,sizeof(attr));
+            attr.size=sizeof(attr);
+            attr.type=EVENTS[counter].type;
+            attr.config=EVENTS[counter].config;
+            attr.read_format=PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.inherit=1;
+            attr.exclude_kernel=1;
+            attr.exclude_hv=1;
+
+            const long fd=syscall(SYS_perf_event_open,&attr,0,-1,-1,0);
+            if(fd<0)
+                continue;
+
+            counters->fd[counter]=(int)fd;
+            any_available=true;
+        }
+
+        return any_available;
+    #else
+        return false;
+    #endif
+}
+void ImageDecodePerfCounters_close(ImageDecodePerfCounters* const counters){
+    for(int counter=0;counter<IMAGE_DECODE_NUM_COUNTERS;counter++){
+        #if defined(__linux__)
+            if(counters->fd[counter]>=0)
+                close(counters->fd[counter]);
+        #endif
+        counters->fd[counter]=-1;
+    }
+}
+uint32_t ImageDecodePerfCounters_available(const ImageDecodePerfCounters* const counters){
+    uint32_t available=0;
+    for(int counter=0;counter<IMAGE_DECODE_NUM_COUNTERS;counter++)
+        if(counters->fd[counter]>=0)
+            available|=1u<<counter;
+    return available;
+}
+void ImageDecodePerfCounters_read(const ImageDecodePerfCounters* const counters,ImageDecodeCounterValues* const values){
+    for(int counter=0;counter<IMAGE_DECODE_NUM_COUNTERS;counter++){
+        values->count[counter]=0;
+
+        #if defined(__linux__)
+            if(counters->fd[counter]<0)
+                continue;
+
+            // value, time enabled, time running
+            uint64_t data[3];
+            if(read(counters->fd[counter],data,sizeof(data))!=(ssize_t)sizeof(data) || data[2]==0)
+                continue;
+
+            // extrapolate if the counter has not been scheduled all the time
+            values->count[counter]=data[2]<data[1]?(uint64_t)((double)data[0]*(double)data[1]/(double)data[2]):data[0];
+        #endif
+    }
+}
+
+void ImageDecodeStats_counterMetrics(const ImageDecodeStats* const stats,const ImageDecodeCounterValues* const values,ImageDecodeCounterMetrics* const metrics){
+    const auto ratio=[stats](const uint64_t numerator,const ImageDecodeCounter numerator_counter,const double denominator,const ImageDecodeCounter denominator_counter)->double{
+        if(!(stats->available_counters&(1u<<numerator_counter)) || !(stats->available_counters&(1u<<denominator_counter)) || denominator<=0.0)
+            return 0.0;
+        return (double)numerator/denominator;
+    };
+
+    const uint64_t* const count=values->count;
+    metrics->ipc=ratio(count[IMAGE_DECODE_COUNTER_INSTRUCTIONS],IMAGE_DECODE_COUNTER_INSTRUCTIONS,(double)count[IMAGE_DECODE_COUNTER_CYCLES],IMAGE_DECODE_COUNTER_CYCLES);
+    metrics->branch_miss_rate=ratio(count[IMAGE_DECODE_COUNTER_BRANCH_MISSES],IMAGE_DECODE_COUNTER_BRANCH_MISSES,(double)count[IMAGE_DECODE_COUNTER_BRANCHES],IMAGE_DECODE_COUNTER_BRANCHES);
+    metrics->stalled_cycle_rate=ratio(count[IMAGE_DECODE_COUNTER_STALLED_CYCLES],IMAGE_DECODE_COUNTER_STALLED_CYCLES,(double)count[IMAGE_DECODE_COUNTER_CYCLES],IMAGE_DECODE_COUNTER_CYCLES);
+
+    const double num_units=stats->num_mcus>0?(double)stats->num_mcus:(double)stats->file_bytes/1024.0;
+    metrics->l1d_misses_per_unit=ratio(count[IMAGE_DECODE_COUNTER_L1D_MISSES],IMAGE_DECODE_COUNTER_L1D_MISSES,num_units,IMAGE_DECODE_COUNTER_L1D_MISSES);
+    metrics->llc_misses_per_unit=ratio(count[IMAGE_DECODE_COUNTER_LLC_MISSES],IMAGE_DECODE_COUNTER_LLC_MISSES,num_units,IMAGE_DECODE_COUNTER_LLC_MISSES);
+}
+
+void ImageDecodeStats_print(const ImageDecodeStats* const stats,FILE* const f){
+    for(int stage=0;stage<IMAGE_DECODE_NUM_STAGES;stage++)
+        fprintf(f,"  %-15s wall %8.3fms cpu %8.3fms\n",ImageDecodeStage_name((ImageDecodeStage)stage),stats->stage_time[stage].wall*1e3,stats->stage_time[stage].cpu*1e3);
+    fprintf(f,"  %-15s wall %8.3fms cpu %8.3fms\n","total",stats->total_time.wall*1e3,stats->total_time.cpu*1e3);
+
+    fprintf(f,"  file %" PRIu64 " bytes, entropy-coded %" PRIu64 " bytes, peak memory %" PRIu64 " bytes\n",stats->file_bytes,stats->entropy_coded_bytes,stats->peak_memory_bytes);
+    fprintf(f,"  mcus %" PRIu64 ", blocks %" PRIu64 " (dc only %" PRIu64 "), eob runs %" PRIu64 ", bitstream refills %" PRIu64 "\n",
+        stats->num_mcus,stats->num_blocks,stats->num_dc_only_blocks,stats->num_eob_runs,stats->num_bitstream_refills);
+
+    if(stats->available_counters){
+        const char* const unit=stats->num_mcus>0?"mcu":"KiB";
+        for(int stage=0;stage<=IMAGE_DECODE_NUM_STAGES;stage++){
+            const bool total=stage==IMAGE_DECODE_NUM_STAGES;
+
+            ImageDecodeCounterMetrics metrics;
+            ImageDecodeStats_counterMetrics(stats,total?&stats->total_counters:&stats->stage_counters[stage],&metrics);
+            fprintf(f,"  %-15s ipc %5.2f branch misses %5.2f%% stalled %5.1f%% l1d misses/%s %9.2f llc misses/%s %8.2f\n",
+                total?"total":ImageDecodeStage_name((ImageDecodeStage)stage),
+                metrics.ipc,metrics.branch_miss_rate*100.0,metrics.stalled_cycle_rate*100.0,
+                unit,metrics.l1d_misses_per_unit,unit,metrics.llc_misses_per_unit);
+        }
+    }
+}
@@ -7,37 +7,115 @@
 #include <thread>
 #include <atomic>
 #include <ctime>
-
-#ifdef VK_USE_PLATFORM_METAL_EXT
-    #include <arm_neon.h>
-#elif VK_USE_PLATFORM_XCB_KHR
-    #include <x86intrin.h>
-#endif
-
-#ifdef JPEG_DECODE_PARALLEL
-    const uint32_t JPEG_DECODE_NUM_THREADS=4;
-#else
-    const uint32_t JPEG_DECODE_NUM_THREADS=1;
-#endif
+#include <type_traits>
 
 #define HB_U8(VARIABLE) ((VARIABLE&0xF0)>>4)
 #define LB_U8(VARIABLE) (VARIABLE&0xF)
 
-#include "app/app.hpp"
 #include "app/error.hpp"
 #include "app/huffman.hpp"
 #include "app/bit_util.hpp"
+#include "app/cpu.hpp"
+#include "app/simd.hpp"
+#include "app/trace.hpp"
 
 typedef huffman::CodingTable<uint8_t, bitStream::BITSTREAM_DIRECTION_LEFT_TO_RIGHT, true> HuffmanTable;
 typedef HuffmanTable::BitStream_ BitStream;
 
+/// a DHT table definition is 16 bytes of code length counts, followed by at most 256 values
+typedef huffman::CodingTableCache<HuffmanTable,16+256> HuffmanTableCache;
+
+/// the example huffman tables from Annex K.3 of the jpeg spec, which most (non-optimizing) encoders use.
+/// each is stored as a DHT table definition, i.e. BITS followed by HUFFVAL.
+namespace StandardHuffmanTables{
+    constexpr uint8_t DC_LUMINANCE[16+12]={
+        0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0,
+        0,1,2,3,4,5,6,7,8,9,10,11
+    };
+    constexpr uint8_t DC_CHROMINANCE[16+12]={
+        0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0,
+        0,1,2,3,4,5,6,7,8,9,10,11
+    };
+    constexpr uint8_t AC_LUMINANCE[16+162]={
+        0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d,
+        0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,
+        0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
+        0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+        0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+        0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,
+        0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+        0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,
+        0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,
+        0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+        0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+        0xf9,0xfa
+    };
+    constexpr uint8_t AC_CHROMINANCE[16+162]={
+        0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77,
+        0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,
+        0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
+        0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+        0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
+        0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,
+        0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+        0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,
+        0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,
+        0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+        0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+        0xf9,0xfa
+    };
+
+    // longest codes: 9, 11, 16 and 16 bits
+    constexpr HuffmanTable::StaticLookupTable<9> DC_LUMINANCE_LOOKUP=HuffmanTable::build_static_lookup_table<9>(DC_LUMINANCE);
+    constexpr HuffmanTable::StaticLookupTable<11> DC_CHROMINANCE_LOOKUP=HuffmanTable::build_static_lookup_table<11>(DC_CHROMINANCE);
+    constexpr HuffmanTable::StaticLookupTable<16> AC_LUMINANCE_LOOKUP=HuffmanTable::build_static_lookup_table<16>(AC_LUMINANCE);
+    constexpr HuffmanTable::StaticLookupTable<16> AC_CHROMINANCE_LOOKUP=HuffmanTable::build_static_lookup_table<16>(AC_CHROMINANCE);
+
+    /// use the compile-time table if definition (of definition_size bytes) is one of the standard tables, returns false otherwise
+    bool use_if_standard(HuffmanTable* const table,const uint8_t* const definition,const uint32_t definition_size){
+        if(definition_size==sizeof(DC_LUMINANCE) && memcmp(definition,DC_LUMINANCE,sizeof(DC_LUMINANCE))==0){
+            table->use_static_lookup_table(&DC_LUMINANCE_LOOKUP);
+        }else if(definition_size==sizeof(DC_CHROMINANCE) && memcmp(definition,DC_CHROMINANCE,sizeof(DC_CHROMINANCE))==0){
+            table->use_static_lookup_table(&DC_CHROMINANCE_LOOKUP);
+        }else if(definition_size==sizeof(AC_LUMINANCE) && memcmp(definition,AC_LUMINANCE,sizeof(AC_LUMINANCE))==0){
+            table->use_static_lookup_table(&AC_LUMINANCE_LOOKUP);
+        }else if(definition_size==sizeof(AC_CHROMINANCE) && memcmp(definition,AC_CHROMINANCE,sizeof(AC_CHROMINANCE))==0){
+            table->use_static_lookup_table(&AC_CHROMINANCE_LOOKUP);
+        }else{
+            return false;
+        }
+        return true;
+    }
+};
+
+/// build a huffman table from a DHT table definition (BITS followed by HUFFVAL)
+void HuffmanTable_fromDefinition(HuffmanTable* const table,const uint8_t* const definition,[[maybe_unused]] const uint32_t definition_size){
+    HuffmanTable::VALUE_ values[260];
+    uint8_t value_code_lengths[260];
+    memset(value_code_lengths,0,sizeof(value_code_lengths));
+
+    uint32_t value_index=0;
+    for (uint8_t code_length=0; code_length<16; code_length++) {
+        for(uint32_t i=0;i<definition[code_length];i++){
+            values[value_index]=definition[16+value_index];
+            value_code_lengths[value_index++]=code_length+1;
+        }
+    }
+
+    if(!HuffmanTable::CodingTable_new(
+        table,
+        (int)value_index,
+        value_code_lengths,
+        values
+    ))
+        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid huffman table definition (code lengths do not describe a prefix code)");
+}
+
 typedef int16_t MCU_EL;
-#ifndef USE_FLOAT_PRECISION
-    #define PRECISION 7
-    typedef int16_t OUT_EL; // 16bits are kinda enough, but some images then peak on individual pixels (i.e. random pixels are white)
-#else
-    typedef float OUT_EL;
-#endif
+/// number of fractional bits of the idct output with IMAGE_DECODE_PRECISION_FIXED, which is stored as int16_t
+/// (16bits are kinda enough, but some images then peak on individual pixels (i.e. random pixels are white)).
+/// the idct output element type of each precision is defined with its kernels, see jpeg/jpeg_kernels.cpp
+#define PRECISION 7
 
 enum class JpegSegmentType:uint16_t{
     SOI=0xFFD8,
@@ -157,10 +235,11 @@ const char* Image_jpeg_segment_type_name(JpegSegmentType segment_type){
     return NULL;
 }
 
-typedef OUT_EL QUANT;
+/// quantization table entries are stored as integers, and converted to the arithmetic type of the kernels before use
+typedef uint16_t QUANT;
 typedef QUANT QuantizationTable[64];
 
-static const uint8_t ZIGZAG[64]={
+static constexpr uint8_t ZIGZAG[64]={
     0,  1,  5,  6,  14, 15, 27, 28,
     2,  4,  7,  13, 16, 26, 29, 42,
     3,  8,  12, 17, 25, 30, 41, 43,
@@ -171,7 +250,7 @@ static const uint8_t ZIGZAG[64]={
     35, 36, 48, 49, 57, 58, 62, 63,
 };
 [[maybe_unused]]
-static const int UNZIGZAG[64]={
+static constexpr int UNZIGZAG[64]={
     0,  1,  8,  16, 9,  2,  3,  10,
     17, 24, 32, 25, 18, 11, 4,  5,
     12, 19, 26, 33, 40, 48, 41, 34,
@@ -199,7 +278,8 @@ typedef struct ImageComponent{
     /// decompressed scans, where each scan has its own memory
     MCU_EL** scan_memory;
 
-    OUT_EL* out_block_downsampled;
+    /// idct output, with elements of the type used by the kernels of the selected precision
+    void* out_block_downsampled;
 
     uint32_t* conversion_indices;
 }ImageComponent;
@@ -241,9 +321,10 @@ namespace ProcessBlock{
     * @param bit_stream 
     * @param successive_approximation_bit_low 
     * @param eob_run 
+    * @return 1 if no ac coefficient has been decoded, i.e. the block only has a dc coefficient, otherwise 0
     */
     [[gnu::always_inline,gnu::flatten,gnu::hot,gnu::nonnull(1,2,5,7)]]
-    static inline void decode_block_ac(
+    static inline uint32_t decode_block_ac(
         MCU_EL* const  block_mem,
 
         const HuffmanTable* const  ac_table,
@@ -257,6 +338,7 @@ namespace ProcessBlock{
 
         uint64_t* const  eob_run
     ){
+        uint32_t dc_only=1;
         for(
             int spec_sel=spectral_selection_start;
             spec_sel<=spectral_selection_end;
@@ -292,6 +374,58 @@ namespace ProcessBlock{
             const MCU_EL ac_value=bitUtil::twos_complement(static_cast<MCU_EL>(ac_magnitude),ac_value_bits);
 
             block_mem[spec_sel++]=static_cast<MCU_EL>(ac_value<<successive_approximation_bit_low);
+            dc_only=0;
+        }
+
+        return dc_only;
+    }
+
+    /**
+    * @brief parse the ac coefficients of a block without storing them (used for blocks outside the decoded region)
+    * 
+    * @param ac_table 
+    * @param stream 
+    * @param eob_run 
+    */
+    [[gnu::always_inline,gnu::flatten,gnu::hot,gnu::nonnull(1,2,3)]]
+    static inline void skip_block_ac(
+        const HuffmanTable* const  ac_table,
+
+        BitStream* const  stream,
+
+        uint64_t* const  eob_run
+    ){
+        for(int spec_sel=1;spec_sel<=63;){
+            const auto ac_bits=ac_table->lookup(stream);
+
+            if (ac_bits==0) {
+                break;
+            }
+
+            const auto num_zeros=ac_bits>>4;
+            const auto ac_magnitude=ac_bits&0xF;
+
+            if (ac_magnitude==0) {
+                if (num_zeros==15) {
+                    spec_sel+=16;
+                    continue;
+                }else{
+                    *eob_run=bitUtil::get_mask_u32(num_zeros);
+                    *eob_run+=stream->get_bits_advance((uint8_t)num_zeros);
+
+                    break;
+                }
+            }
+
+            spec_sel+=num_zeros;
+            if (spec_sel>63) {
+                break;
+            }
+
+            stream->ensure_filled((uint8_t)ac_magnitude);
+            stream->advance_unsafe((uint8_t)ac_magnitude);
+
+            spec_sel++;
         }
     }
 
@@ -339,9 +473,10 @@ namespace ProcessBlock{
     * @param successive_approximation_bit_low 
     * @param successive_approximation_bit_high 
     * @param eob_run 
+    * @return 1 if an end-of-band run that spans more than this block has been started, otherwise 0
     */
     [[gnu::flatten,gnu::hot,gnu::nonnull(1,2,5,7)]]
-    static inline void decode_block_with_sbh(
+    static inline uint32_t decode_block_with_sbh(
         MCU_EL* const  block_mem,
 
         const HuffmanTable* const  ac_table,
@@ -355,6 +490,7 @@ namespace ProcessBlock{
 
         uint64_t* const  eob_run
     ){
+        uint32_t num_eob_runs=0;
         uint8_t next_pixel_index=spectral_selection_start;
         for(;next_pixel_index <= spectral_selection_end;){
             const auto ac_bits=ac_table->lookup(stream);
@@ -374,6 +510,7 @@ namespace ProcessBlock{
                         {
                             uint32_t eob_run_bits=static_cast<uint32_t>(stream->get_bits_advance((uint8_t)num_zeros));
                             *eob_run=bitUtil::get_mask_u32(num_zeros) + eob_run_bits;
+                            num_eob_runs=*eob_run>0;
                         }
                         num_zeros=64;
                         break;
@@ -406,9 +543,13 @@ namespace ProcessBlock{
             
             next_pixel_index+=1;
         }
+
+        return num_eob_runs;
     }
 }
 
+/// cosine masks of all 64 dct coefficients, as OUT_EL (fixed-point with PRECISION fractional bits for integer types)
+template<typename OUT_EL>
 class IDCTMaskSet {
     private:
         [[gnu::pure,gnu::hot]]
@@ -419,29 +560,53 @@ class IDCTMaskSet {
                 return 1.0f;
             }
         }
-        
+
+        /// cosine that can be evaluated at compile time (std::cos is not constexpr).
+        ///
+        /// x is reduced to [-pi;pi], where the taylor series below is accurate to double precision
+        [[gnu::const]]
+        constexpr static double cos(double x){
+            while(x>M_PI)
+                x-=2*M_PI;
+            while(x< -M_PI)
+                x+=2*M_PI;
+
+            const double x_squared=x*x;
+            double term=1.0;
+            double sum=1.0;
+            for(int n=1;n<=20;n++){
+                term*=-x_squared/(double)((2*n-1)*(2*n));
+                sum+=term;
+            }
+            return sum;
+        }
+
     public:
         OUT_EL idct_element_masks[64][64];
 
-        IDCTMaskSet(){
+        constexpr IDCTMaskSet():idct_element_masks{}{
+            // the cosine factor of pixel index i (in one dimension) for frequency u, i.e. cos((2i+1)*u*pi/16)*c(u)
+            float cos_values[8][8]={};
+            for(uint32_t i = 0;i<8;i++){
+                for(uint32_t u = 0;u<8;u++){
+                    const float cos_arg = ((2.0f * (float)(i) + 1.0f) * (float)(u) * (float)M_PI) / 16.0f;
+                    cos_values[i][u] = (float)cos((double)cos_arg) * coeff(u);
+                }
+            }
+
             for(uint32_t mask_index = 0;mask_index<64;mask_index++){
                 for(uint32_t ix = 0;ix<8;ix++){
                     for(uint32_t iy = 0;iy<8;iy++){
                         const uint32_t mask_u=mask_index%8;
                         const uint32_t mask_v=mask_index/8;
 
-                        const float x_cos_arg = ((2.0f * (float)(iy) + 1.0f) * (float)(mask_u) * (float)M_PI) / 16.0f;
-                        const float y_cos_arg = ((2.0f * (float)(ix) + 1.0f) * (float)(mask_v) * (float)M_PI) / 16.0f;
-
-                        const float x_val = cosf(x_cos_arg) * coeff(mask_u);
-                        const float y_val = cosf(y_cos_arg) * coeff(mask_v);
+                        const float x_val = cos_values[iy][mask_u];
+                        const float y_val = cos_values[ix][mask_v];
 
                         // the divide by 4 comes from the spec, from the algorithm to reverse the application of the IDCT
-                        #ifndef USE_FLOAT_PRECISION
-                            const OUT_EL value = (OUT_EL)(((x_val * y_val)/4)*(1<<PRECISION));
-                        #else
-                            const OUT_EL value = (x_val * y_val)/4;
-                        #endif
+                        const OUT_EL value = std::is_floating_point_v<OUT_EL>
+                            ? (OUT_EL)((x_val * y_val)/4)
+                            : (OUT_EL)(((x_val * y_val)/4)*(1<<PRECISION));
 
                         const uint32_t mask_pixel_index=8*ix+iy;
                         this->idct_element_masks[ZIGZAG[mask_index]][mask_pixel_index]=value;
@@ -452,10 +617,11 @@ class IDCTMaskSet {
 
         template<typename T>
         const OUT_EL* operator[](const T index)const noexcept{
-            return (OUT_EL*)this->idct_element_masks[index];
+            return this->idct_element_masks[index];
         }
 };
-static const IDCTMaskSet IDCT_MASK_SET;
+template<typename OUT_EL>
+static constexpr IDCTMaskSet<OUT_EL> IDCT_MASK_SET;
 
 class ScanComponent{
     public:
@@ -494,8 +660,15 @@ class ScanComponent{
             scan_memory=0;
         }
 
+        /// decode an mcu of a baseline scan
+        ///
+        /// non-zero template arguments are the sampling factors of this component, known at compile time (see ScanLayout), which
+        /// fully unrolls the block loops. zero selects the sampling factors at runtime.
+        ///
+        /// returns the number of blocks without ac coefficients
+        template<uint32_t VERT_SAMPLE_FACTOR=0,uint32_t HORZ_SAMPLE_FACTOR=0>
         [[gnu::hot,gnu::flatten,gnu::nonnull(3,4,6,7)]]
-        inline void process_mcu_baseline(
+        inline uint32_t process_mcu_baseline(
             const uint32_t mcu_col,
             BitStream* const  stream,
             MCU_EL* const  diff_dc,
@@ -503,44 +676,78 @@ class ScanComponent{
             MCU_EL* const  mcu_memory,
             uint64_t* const  eob_run
         )const noexcept{
-            const uint32_t vert_sample_factor=this->vert_sample_factor;
-            const uint32_t horz_sample_factor=this->horz_sample_factor;
+            const uint32_t vert_sample_factor=VERT_SAMPLE_FACTOR?VERT_SAMPLE_FACTOR:this->vert_sample_factor;
+            const uint32_t horz_sample_factor=HORZ_SAMPLE_FACTOR?HORZ_SAMPLE_FACTOR:this->horz_sample_factor;
 
             const HuffmanTable* const ac_table=this->ac_table;
             const HuffmanTable* const dc_table=this->dc_table;
 
+            // blocks of an mcu are horz_sample_factor blocks wide, and the block rows are num_horz_blocks blocks apart
+            MCU_EL* const mcu_blocks=&mcu_memory[mcu_col*horz_sample_factor*64];
+            const uint32_t block_row_size=this->num_horz_blocks*64;
+
+            uint32_t num_dc_only_blocks=0;
             for (uint32_t vert_sid=0; vert_sid<vert_sample_factor; vert_sid++) {
                 for (uint32_t horz_sid=0; horz_sid<horz_sample_factor; horz_sid++) {
-                    const uint32_t block_col=mcu_col*horz_sample_factor + horz_sid;
-
-                    uint32_t component_block_id = block_col + vert_sid * this->num_horz_blocks;
-                    
-                    MCU_EL* const block_mem=&mcu_memory[component_block_id*64];
+                    MCU_EL* const block_mem=mcu_blocks + vert_sid*block_row_size + horz_sid*64;
 
                     ProcessBlock::decode_dc(block_mem, dc_table, diff_dc, stream, successive_approximation_bit_low);
 
                     if(*eob_run>0){
                         *eob_run-=1;
+                        num_dc_only_blocks++;
                         continue;
                     }
                     
-                    ProcessBlock::decode_block_ac(block_mem, ac_table, 1, 63, stream, successive_approximation_bit_low, eob_run);
+                    num_dc_only_blocks+=ProcessBlock::decode_block_ac(block_mem, ac_table, 1, 63, stream, successive_approximation_bit_low, eob_run);
                 
                 }
             }
+
+            return num_dc_only_blocks;
+        }
+
+        /// parse an mcu of a baseline scan without storing its coefficients, i.e. only the dc prediction is tracked
+        [[gnu::hot,gnu::flatten,gnu::nonnull(2,3,4)]]
+        inline void skip_mcu_baseline(
+            BitStream* const  stream,
+            MCU_EL* const  diff_dc,
+            uint64_t* const  eob_run
+        )const noexcept{
+            const uint32_t num_blocks_in_mcu=(uint32_t)this->vert_sample_factor*this->horz_sample_factor;
+
+            const HuffmanTable* const ac_table=this->ac_table;
+            const HuffmanTable* const dc_table=this->dc_table;
+
+            MCU_EL discarded_dc;
+
+            for (uint32_t block=0; block<num_blocks_in_mcu; block++) {
+                ProcessBlock::decode_dc(&discarded_dc, dc_table, diff_dc, stream, 0);
+
+                if(*eob_run>0){
+                    *eob_run-=1;
+                    continue;
+                }
+
+                ProcessBlock::skip_block_ac(ac_table, stream, eob_run);
+            }
         }
 
-        [[gnu::flatten,gnu::nonnull(3,4,6,11)]]
-        inline void process_mcu_generic(
+        /// decode an mcu of a progressive scan
+        ///
+        /// IS_REFINEMENT is true for scans that refine previously decoded coefficients (i.e. successive_approximation_bit_high!=0)
+        ///
+        /// returns the number of end-of-band runs that span more than one block
+        template<bool IS_INTERLEAVED,bool IS_REFINEMENT>
+        [[gnu::flatten,gnu::nonnull(3,4,6,9)]]
+        inline uint32_t process_mcu_generic(
             uint32_t const mcu_col,
             BitStream* const  stream,
             MCU_EL* const  diff_dc,
             uint8_t const successive_approximation_bit_low,
             MCU_EL* const  mcu_memory,
-            bool is_interleaved,
             uint8_t const spectral_selection_start,
             uint8_t const spectral_selection_end,
-            uint8_t const successive_approximation_bit_high,
             uint64_t* const  eob_run,
             MCU_EL const succ_approx_bit_shifted
         )const noexcept{
@@ -550,12 +757,13 @@ class ScanComponent{
             const HuffmanTable* const ac_table=this->ac_table;
             const HuffmanTable* const dc_table=this->dc_table;
 
+            uint32_t num_eob_runs=0;
             for (uint32_t vert_sid=0; vert_sid<vert_sample_factor; vert_sid++) {
                 for (uint32_t horz_sid=0; horz_sid<horz_sample_factor; horz_sid++) {
                     const uint32_t block_col=mcu_col*horz_sample_factor + horz_sid;
 
                     uint32_t component_block_id;
-                    if (is_interleaved) {
+                    if constexpr(IS_INTERLEAVED) {
                         component_block_id = block_col + vert_sid * this->num_horz_blocks;
                     }else {
                         component_block_id =
@@ -568,7 +776,7 @@ class ScanComponent{
                     
                     MCU_EL* const block_mem=&mcu_memory[component_block_id*64];
 
-                    if (successive_approximation_bit_high==0){
+                    if constexpr(!IS_REFINEMENT){
                         uint8_t scan_start=spectral_selection_start;
 
                         // decode dc
@@ -607,6 +815,7 @@ class ScanComponent{
                                 }else {
                                     *eob_run=bitUtil::get_mask_u32(num_zeros);
                                     *eob_run+=stream->get_bits_advance((uint8_t)num_zeros);
+                                    num_eob_runs+=*eob_run>0;
 
                                     break;
                                 }
@@ -653,7 +862,7 @@ class ScanComponent{
                         if(spectral_selection_end == 0)
                             continue;
 
-                        ProcessBlock::decode_block_with_sbh(
+                        num_eob_runs+=ProcessBlock::decode_block_with_sbh(
                             block_mem,
                             ac_table, 
                             spectral_selection_start, 
@@ -665,9 +874,71 @@ class ScanComponent{
                     }
                 }
             }
+
+            return num_eob_runs;
         }
 };
 
+/// pixel window that decoded pixels are written into, e.g. the decoded region, a band of rows or a tile
+typedef struct JpegOutputWindow{
+    /// image columns [x0;x1) of image rows [y0;y1) are written
+    uint32_t x0,y0,x1,y1;
+    /// end of the row padding, in image columns, i.e. pixels in [x0;row_end_x) can be written without clipping
+    uint32_t row_end_x;
+
+    /// location of image pixel x0,y0
+    uint8_t* data;
+    /// number of bytes between the starts of two rows in data
+    uint64_t stride;
+
+    /// rows are padded to a multiple of 8 pixels, so that the conversion kernels can store full simd groups at the right edge
+    /// (the image is padded to full mcus, which are a multiple of 8 pixels wide, so these pixels are always decoded)
+    static inline uint64_t stride_for_width(const uint32_t width)noexcept{
+        return (uint64_t)ROUND_UP(width,8)*4;
+    }
+
+    static inline struct JpegOutputWindow create(
+        const uint32_t x0,
+        const uint32_t y0,
+        const uint32_t x1,
+        const uint32_t y1,
+        uint8_t* const data
+    )noexcept{
+        const uint64_t stride=stride_for_width(x1-x0);
+        return {
+            .x0=x0,.y0=y0,.x1=x1,.y1=y1,
+            .row_end_x=x0+static_cast<uint32_t>(stride/4),
+            .data=data,
+            .stride=stride
+        };
+    }
+
+    /// output location of the first pixel of the window in image row y
+    inline uint8_t* row(const uint32_t y)const noexcept{
+        return this->data+(uint64_t)(y-this->y0)*this->stride;
+    }
+
+    /// true if num_pixels pixels, starting at image column x, can be stored directly into an output row
+    ///
+    /// pixels past x1 then land in the row padding
+    inline bool fits_row(const uint32_t x,const uint32_t num_pixels)const noexcept{
+        return x>=this->x0 && x+num_pixels<=this->row_end_x;
+    }
+
+    /// copy the pixels out of num_pixels pixels, starting at image column x, that are inside the window into the output row
+    inline void write_clipped_pixels(
+        uint8_t* const out_row,
+        const uint32_t x,
+        const uint32_t num_pixels,
+        const uint8_t* const pixels
+    )const noexcept{
+        const uint32_t start=bitUtil::max(x,this->x0);
+        const uint32_t end=bitUtil::min(x+num_pixels,this->x1);
+        if(start<end)
+            memcpy(out_row+(start-this->x0)*4,pixels+(start-x)*4,(end-start)*4);
+    }
+}JpegOutputWindow;
+
 class JpegParser;
 struct ProcessIncomingScan_Arguments{
     JpegParser* parser;
@@ -677,15 +948,26 @@ struct ProcessIncomingScan_Arguments{
 };
 void* ProcessIncomingScans_pthread(struct ProcessIncomingScan_Arguments* async_args);
 
+/// the kernels compiled for one instruction set and precision (see jpeg/jpeg_kernels.cpp)
+struct JpegKernels{
+    cpu::Isa isa;
+    ImageDecodePrecision precision;
+    /// size of an element of the idct output, which is passed from process_channel to convert_colorspace
+    uint32_t out_element_size;
+
+    /// inverse dct of mcu rows [scan_id_start;scan_id_end) of component c
+    void(*process_channel)(const JpegParser* parser,uint8_t c,uint32_t scan_id_start,uint32_t scan_id_end);
+    /// convert mcu rows [scan_index_start;scan_index_end) to rgba, and write the pixels inside window
+    void(*convert_colorspace)(const JpegParser* parser,uint32_t scan_index_start,uint32_t scan_index_end,const JpegOutputWindow* window);
+};
+/// the kernels for the given instruction set (or the best set available below it) and precision, NULL for an invalid precision
+static const JpegKernels* JpegKernels_select(const cpu::Isa isa,const ImageDecodePrecision precision);
+
 class JpegParser: public FileParser{
     public:
-    #ifdef DEBUG
-        double start_time;
-        double parse_end_time;
-        double process_end_time;
-        double convert_end_time;
-        double crop_end_time;
-    #endif
+    /// statistics of this decode, and the timer of its stages (both owned by the caller)
+    ImageDecodeStats* const stats;
+    ImageDecodeStageTimer* const timer;
 
     QuantizationTable quant_tables[4];
     HuffmanTable ac_coding_tables[4];
@@ -707,10 +989,44 @@ class JpegParser: public FileParser{
     uint32_t component_label;
     uint32_t color_space;
 
+    /// requested region, as passed in the decode options
+    const ImageRegion requested_region;
+    /// decoded region, clamped to the image, in px: [region_x0;region_x1) x [region_y0;region_y1)
+    uint32_t region_x0,region_y0,region_x1,region_y1;
+    /// range of mcu rows/columns that intersect the decoded region
+    uint32_t region_mcu_row_start,region_mcu_row_end;
+    uint32_t region_mcu_col_start,region_mcu_col_end;
+
+    /// window of the decoded region inside image_data->data. when streaming rows, this only holds the current band of rows.
+    JpegOutputWindow output;
+
+    /// if set, the output is handed to this callback in bands of mcu rows, see ImageDecodeOptions
+    const ImageRowCallback row_callback;
+    void* const row_callback_user_data;
+    /// if set (and no row callback is set), the output is handed to this callback in tiles, see ImageDecodeOptions
+    const ImageTileCallback tile_callback;
+    void* const tile_callback_user_data;
+    const uint32_t tile_width,tile_height;
+    /// number of rows of tiles that have been handed to the tile callback
+    uint32_t num_tile_rows_done;
+
+    /// only the mcu rows that are required for the current output are kept in memory (decided at the first scan)
+    bool streaming;
+    /// number of mcu rows kept in memory. mcu row i is stored at index i%num_stored_scans.
+    uint32_t num_stored_scans;
+
+    /// number of threads used for decoding, see ImageDecodeOptions
+    const uint32_t num_threads;
     /// decode in parallel, using multiple threads
     const bool parallel;
+    /// kernels for the instruction set of this cpu and the requested precision
+    const JpegKernels* const kernels;
     struct ProcessIncomingScan_Arguments async_scan_info[3];
     pthread_t async_scan_processors[3];
+    /// async_scan_processors[t] has been started, and not yet joined
+    bool async_scan_processor_running[3]={false,false,false};
+    /// set when decoding is aborted, which stops the async scan processors
+    std::atomic<bool> cancelled{false};
     ScanComponent scan_components[3];
 
     // +1 for each component to allow component with index 0 to be actively counted
@@ -726,15 +1042,41 @@ class JpegParser: public FileParser{
 
     EncodingMethod encoding_method;
 
+    /// sampling factors of the components in a scan, with one byte per component, like in the SOF segment (horizontal factor in the high nibble).
+    ///
+    /// the mcu loops of scans with one of these layouts are specialised at compile time, all other scans use SCAN_LAYOUT_GENERIC.
+    enum class ScanLayout:uint32_t{
+        GENERIC=0,
+        /// single component with one block per mcu, e.g. grayscale images and non-interleaved scans
+        SINGLE=0x11,
+        YCBCR_444=0x111111,
+        YCBCR_422=0x211111,
+        YCBCR_420=0x221111,
+    };
+
     bool parsing_done=false;
 
     JpegParser(
         const char* const filepath,
         ImageData* const image_data,
-        const bool parallel
+        const ImageDecodeOptions* const options,
+        ImageDecodeStats* const stats,
+        ImageDecodeStageTimer* const timer
     ):
         FileParser(filepath, image_data),
-        parallel(parallel),
+        stats(stats),
+        timer(timer),
+        requested_region(options->region),
+        row_callback(options->row_callback),
+        row_callback_user_data(options->row_callback_user_data),
+        tile_callback(options->row_callback?nullptr:options->tile_callback),
+        tile_callback_user_data(options->tile_callback_user_data),
+        tile_width(options->tile_width?options->tile_width:IMAGE_DEFAULT_TILE_SIZE),
+        tile_height(options->tile_height?options->tile_height:IMAGE_DEFAULT_TILE_SIZE),
+        num_threads(bitUtil::max(options->num_threads,1u)),
+        // streamed output is decoded one mcu row after the other (tiles are still processed in parallel)
+        parallel(num_threads>1 && options->row_callback==nullptr && options->tile_callback==nullptr),
+        kernels(JpegKernels_select(cpu::isa(),options->precision)),
         parsing_done(false)
     {
         this->encoding_method=EncodingMethod::UNDEFINED;
@@ -745,10 +1087,19 @@ class JpegParser: public FileParser{
 
             this->ac_coding_tables[i].lookup_table=NULL;
             this->ac_coding_tables[i].max_code_length_bits=0;
+            this->ac_coding_tables[i].owns_lookup_table=false;
+            this->ac_coding_tables[i].lookup_table_references=NULL;
 
             this->dc_coding_tables[i].lookup_table=NULL;
             this->dc_coding_tables[i].max_code_length_bits=0;
+            this->dc_coding_tables[i].owns_lookup_table=false;
+            this->dc_coding_tables[i].lookup_table_references=NULL;
         };
+        // (motion) jpeg streams may omit the DHT segments and rely on the standard tables
+        this->dc_coding_tables[0].use_static_lookup_table(&StandardHuffmanTables::DC_LUMINANCE_LOOKUP);
+        this->dc_coding_tables[1].use_static_lookup_table(&StandardHuffmanTables::DC_CHROMINANCE_LOOKUP);
+        this->ac_coding_tables[0].use_static_lookup_table(&StandardHuffmanTables::AC_LUMINANCE_LOOKUP);
+        this->ac_coding_tables[1].use_static_lookup_table(&StandardHuffmanTables::AC_CHROMINANCE_LOOKUP);
 
         this->max_component_horz_sample_factor=0;
         this->max_component_vert_sample_factor=0;
@@ -763,6 +1114,7 @@ class JpegParser: public FileParser{
 
             this->image_components[i].scan_memory=NULL;
             this->image_components[i].out_block_downsampled=NULL;
+            this->image_components[i].conversion_indices=NULL;
         }
 
         this->P=0;
@@ -772,17 +1124,26 @@ class JpegParser: public FileParser{
         this->real_X=0;
         this->real_Y=0;
 
-        #ifdef DEBUG
-            this->start_time=current_time();
-            this->parse_end_time=0.0;
-            this->process_end_time=0.0;
-            this->convert_end_time=0.0;
-            this->crop_end_time=0.0;
-        #endif
+        this->stats->file_bytes=this->file_size;
+        this->stats->peak_memory_bytes=this->file_size;
 
         this->component_label=0;
         this->color_space=0;
 
+        this->region_x0=0;
+        this->region_y0=0;
+        this->region_x1=0;
+        this->region_y1=0;
+        this->region_mcu_row_start=0;
+        this->region_mcu_row_end=0;
+        this->region_mcu_col_start=0;
+        this->region_mcu_col_end=0;
+
+        this->output=JpegOutputWindow{};
+        this->num_tile_rows_done=0;
+        this->streaming=false;
+        this->num_stored_scans=0;
+
         for(int i=0;i<3;i++){
             async_scan_info[i].parser=this;
             async_scan_info[i].channel=static_cast<uint8_t>(i);
@@ -803,145 +1164,125 @@ class JpegParser: public FileParser{
         for(uint32_t c=0;c<this->Nf;c++){
             free(this->image_components[c].conversion_indices);
             free(this->image_components[c].out_block_downsampled);
-            // free batch allocated scan memory
-            free(this->image_components[c].scan_memory[0]);
+            // free batch allocated scan memory (which is only allocated once the first scan is encountered when streaming)
+            if(this->image_components[c].scan_memory)
+                free(this->image_components[c].scan_memory[0]);
             free(this->image_components[c].scan_memory);
         }
     }
 
-    inline uint16_t next_u16()noexcept{
-        return bitUtil::byteswap(this->get_mem<uint16_t>(),2);
-    }
-
-    void parse_file();
-
-    [[gnu::flatten]]
-    void process_channel(
-        const uint8_t c,
-        const uint32_t scan_id_start,
-        const uint32_t scan_id_end
-    )const noexcept{
-        QuantizationTable component_quant_table;
-        memcpy(component_quant_table,this->quant_tables[this->image_components[c].quant_table_specifier],sizeof(component_quant_table));
-
-        // -- reverse idct and quantization table application
-
-        OUT_EL* const  out_block_downsampled=this->image_components[c].out_block_downsampled;
-
-        const uint32_t num_blocks_in_scan=this->image_components[c].num_blocks_in_scan;
-
-        const OUT_EL idct_m0_v0=IDCT_MASK_SET.idct_element_masks[0][0];
-
-        // local cache, with expanded size to allow simd instructions reading past the real content
-        MCU_EL in_block[80];
-        for(int i=64;i<80;i++) in_block[i]=0;
-
-        for (uint32_t scan_id=scan_id_start; scan_id<scan_id_end; scan_id++) {
-            const MCU_EL* const  scan_mem=this->image_components[c].scan_memory[scan_id];
-
-            for (uint32_t block_id=0; block_id<num_blocks_in_scan; block_id++) {
-
-                memcpy(in_block,scan_mem+block_id*64,64*sizeof(MCU_EL));
-
-                const uint32_t block_pixel_range_start=(scan_id*num_blocks_in_scan+block_id);
-
-                OUT_EL out_block[64];
-
-                // use first idct mask index to initialize storage
-                {
-                    const OUT_EL cosine_mask_strength=(OUT_EL)(in_block[0]*component_quant_table[0]);
-
-                    const OUT_EL idct_m0_value=idct_m0_v0*cosine_mask_strength;
-
-                    for(uint32_t pixel_index = 0;pixel_index<64;pixel_index++){
-                        out_block[pixel_index]=idct_m0_value;
-                    }
-                }
-
-                for(uint32_t cosine_index = 1;cosine_index<64;){
-                    #ifndef USE_FLOAT_PRECISION
-                        #ifdef VK_USE_PLATFORM_XCB_KHR
-                            const __m128i mask_strengths=_mm_loadu_si128((__m128i*)(&in_block[cosine_index]));
-                            const __m128i elements_zero_result=_mm_cmpeq_epi16(mask_strengths, _mm_set1_epi16(0));
-                            uint32_t elements_nonzero=0xFFFF-(uint32_t)_mm_movemask_epi8(elements_zero_result);
+    /// stop decoding after a failure: stop and join the async scan processors, then cleanup all resources
+    void abort(){
+        this->cancelled.store(true);
+        for(uint8_t t=0;t<3;t++)
+            if(this->async_scan_processor_running[t]){
+                pthread_join(this->async_scan_processors[t],NULL);
+                this->async_scan_processor_running[t]=false;
+            }
 
-                            const uint32_t num_cosines_remaining=64-cosine_index;
-                            const uint32_t num_cosines_remaining_in_current_iteration=bitUtil::min(8u,num_cosines_remaining);
+        this->destroy();
+    }
 
-                            const uint32_t all_elements_mask=mask_u32(num_cosines_remaining_in_current_iteration*2);
-                            elements_nonzero&=all_elements_mask;
+    inline uint16_t next_u16(){
+        return bitUtil::byteswap(this->get_mem<uint16_t>(),2);
+    }
 
-                            if(elements_nonzero==0){
-                                cosine_index+=8;
-                                continue;
-                            }
+    /// read the size of the segment at the current position, which includes the two bytes of the size itself
+    ///
+    /// the rest of the segment is guaranteed to be inside the file
+    inline uint16_t next_segment_size(){
+        const uint16_t segment_size=this->next_u16();
+        if(segment_size<2)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid jpeg segment size %d",segment_size);
 
-                            cosine_index+=bitUtil::tzcnt_32(elements_nonzero)/2;
-                        #elif defined( VK_USE_PLATFORM_METAL_EXT)
-                            const int16x8_t mask_strengths=vld1q_s16((int16_t*)(&in_block[cosine_index]));
-                            const int16x8_t elements_zero_result=vceqq_s16(mask_strengths, vdupq_n_s16(0));
-                            uint64_t elements_nonzero=0;
-                            vst1_s8((int8_t*)&elements_nonzero,vqmovn_s16(elements_zero_result));
-                            elements_nonzero=UINT64_MAX-elements_nonzero;
+        this->require_bytes(segment_size-2u);
 
-                            //printf("mask %16llx\n",elements_nonzero);
+        return segment_size;
+    }
 
-                            const uint32_t num_cosines_remaining=64-cosine_index;
-                            const uint32_t num_cosines_remaining_in_current_iteration=bitUtil::min(8u,num_cosines_remaining);
+    /// get the pixel rows of mcu row mcu_row that are inside the output window, relative to the first pixel row of the mcu row
+    ///
+    /// returns false if the mcu row does not intersect the window
+    inline bool rows_in_mcu_row(
+        const JpegOutputWindow* const window,
+        const uint32_t mcu_row,
+        uint32_t* const row_start,
+        uint32_t* const row_end
+    )const noexcept{
+        const uint32_t mcu_height=8*this->max_component_vert_sample_factor;
+        const uint32_t mcu_y0=mcu_row*mcu_height;
+        const uint32_t mcu_y1=mcu_y0+mcu_height;
 
-                            const uint64_t all_elements_mask=mask_u64((num_cosines_remaining_in_current_iteration-1)*8+1);
-                            elements_nonzero&=all_elements_mask;
+        if(mcu_y1<=window->y0 || mcu_y0>=window->y1)
+            return false;
 
-                            if(elements_nonzero==0){
-                                cosine_index+=8;
-                                continue;
-                            }
+        *row_start=bitUtil::max(mcu_y0,window->y0)-mcu_y0;
+        *row_end=bitUtil::min(mcu_y1,window->y1)-mcu_y0;
+        return true;
+    }
 
-                            while (in_block[cosine_index]==0 && cosine_index<63) cosine_index++;
-                        #endif
-                    #else
-                        if(in_block[cosine_index] == 0) {
-                            cosine_index++;
-                            continue;
-                        }
-                    #endif
+    /// idct output of mcu row scan_id of component c (OUT_EL is the idct output element type of the selected kernels)
+    template<typename OUT_EL>
+    inline OUT_EL* component_scan_pixels(const uint32_t c,const uint32_t scan_id)const noexcept{
+        const ImageComponent* const component=&this->image_components[c];
+        return static_cast<OUT_EL*>(component->out_block_downsampled)+(uint64_t)(scan_id%this->num_stored_scans)*component->num_blocks_in_scan*64;
+    }
 
-                    const MCU_EL pre_quantized_mask_strength=in_block[cosine_index];
+    /// advance past the remaining entropy-coded data of a scan, i.e. to the next marker
+    void skip_to_next_marker()noexcept{
+        while(this->current_file_content_index+1<this->file_size){
+            const uint8_t next_byte=this->file_contents[this->current_file_content_index+1];
+            if(this->file_contents[this->current_file_content_index]==0xFF && next_byte!=0x00 && next_byte!=0xFF)
+                return;
 
-                    const OUT_EL cosine_mask_strength=pre_quantized_mask_strength*component_quant_table[cosine_index];
-                    const OUT_EL* const idct_mask=IDCT_MASK_SET[cosine_index];
-                    
-                    for(uint32_t pixel_index = 0;pixel_index<64;pixel_index++){
-                        out_block[pixel_index]+=static_cast<OUT_EL>(idct_mask[pixel_index]*cosine_mask_strength);
-                    }
+            this->current_file_content_index++;
+        }
+    }
 
-                    cosine_index++;
-                }
+    void parse_file();
 
-                memcpy(out_block_downsampled+block_pixel_range_start*64,out_block,sizeof(OUT_EL)*64);
-            }
-        }
+    /// inverse dct of mcu rows [scan_id_start;scan_id_end) of component c, with the kernel for the instruction set of this cpu and the selected precision
+    void process_channel(
+        const uint8_t c,
+        const uint32_t scan_id_start,
+        const uint32_t scan_id_end
+    )const noexcept{
+        const TraceScope trace_scope{"idct",scan_id_start,scan_id_end};
+        this->kernels->process_channel(this,c,scan_id_start,scan_id_end);
     }
 
     template<JpegSegmentType SEGMENT_TYPE>
     void parse_segment(){
-        bail(FATAL_UNEXPECTED_ERROR,"unimplemented segment %s",Image_jpeg_segment_type_name(SEGMENT_TYPE));
+        parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"unimplemented segment %s",Image_jpeg_segment_type_name(SEGMENT_TYPE));
     }
 
     template<EncodingMethod ENCODING_METHOD>
     void parse_sof(){
+        if(this->encoding_method!=EncodingMethod::UNDEFINED)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"jpeg file contains more than one frame");
+
         this->encoding_method=ENCODING_METHOD;
 
-        const uint16_t segment_size=this->next_u16();
+        const uint16_t segment_size=this->next_segment_size();
         const uint32_t segment_end_position=static_cast<uint32_t>(this->current_file_content_index)+segment_size-2;
 
         this->P=this->get_mem<uint8_t>();
         this->real_Y=this->next_u16();
         this->real_X=this->next_u16();
-        this->Nf=this->get_mem<uint8_t>();
+        const uint32_t num_components=this->get_mem<uint8_t>();
 
         if (this->P!=8)
-            bail(-46,"image precision is not 8 - is %d instead\n",this->P);
+            parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"image precision is not 8 - is %d instead",this->P);
+        if (this->real_X==0)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"image width is zero");
+        if (this->real_Y==0)
+            parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"image height defined by DNL segment");
+        if (num_components==0)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"image has no components");
+        if (num_components>3)
+            parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"image has %d components, at most 3 are supported",num_components);
+
+        this->Nf=num_components;
 
         // parse basic per-component metadata
         for (uint32_t i=0; i<this->Nf; i++) {
@@ -949,11 +1290,20 @@ class JpegParser: public FileParser{
 
             const uint32_t sample_factors=this->get_mem<uint8_t>();
 
-            this->image_components[i].vert_sample_factor=HB_U8(sample_factors);
-            this->image_components[i].horz_sample_factor=LB_U8(sample_factors);
+            this->image_components[i].horz_sample_factor=HB_U8(sample_factors);
+            this->image_components[i].vert_sample_factor=LB_U8(sample_factors);
 
             this->image_components[i].quant_table_specifier=this->get_mem<uint8_t>();
 
+            if (
+                this->image_components[i].horz_sample_factor<1 || this->image_components[i].horz_sample_factor>4
+                || this->image_components[i].vert_sample_factor<1 || this->image_components[i].vert_sample_factor>4
+            )
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid sampling factors %dx%d of component %d",
+                    this->image_components[i].horz_sample_factor,this->image_components[i].vert_sample_factor,i);
+            if (this->image_components[i].quant_table_specifier>3)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid quantization table %d of component %d",this->image_components[i].quant_table_specifier,i);
+
             if (this->image_components[i].vert_sample_factor>this->max_component_vert_sample_factor) {
                 this->max_component_vert_sample_factor=this->image_components[i].vert_sample_factor;
             }
@@ -965,10 +1315,7 @@ class JpegParser: public FileParser{
         this->X=ROUND_UP(this->real_X,8);
         this->Y=ROUND_UP(this->real_Y,8);
 
-        image_data->height=this->Y;
-        image_data->width=this->X;
-
-        // calculate per-component metadata and allocate scan memory
+        // calculate per-component metadata
         for (uint32_t i=0; i<this->Nf; i++) {
             this->image_components[i].vert_samples=(ROUND_UP(this->Y,8*this->max_component_vert_sample_factor))*this->image_components[i].vert_sample_factor/this->max_component_vert_sample_factor;
             this->image_components[i].horz_samples=(ROUND_UP(this->X,8*this->max_component_horz_sample_factor))*this->image_components[i].horz_sample_factor/this->max_component_horz_sample_factor;
@@ -976,32 +1323,23 @@ class JpegParser: public FileParser{
             this->X=bitUtil::max(this->X,this->image_components[i].horz_samples);
             this->Y=bitUtil::max(this->Y,this->image_components[i].vert_samples);
 
-            const uint32_t component_data_size=this->image_components[i].vert_samples*this->image_components[i].horz_samples;
-
             const uint32_t component_num_scans=this->image_components[i].vert_samples/this->image_components[i].vert_sample_factor/8;
             const uint32_t component_num_scan_elements=this->image_components[i].horz_samples*this->image_components[i].vert_sample_factor*8;
 
-            this->image_components[i].scan_memory=(MCU_EL**)malloc(sizeof(MCU_EL*)*component_num_scans);
-
-            uint32_t per_scan_memory_size=ROUND_UP<uint32_t>(component_num_scan_elements*sizeof(MCU_EL),4096);
-            MCU_EL* const total_scan_memory=(MCU_EL*)calloc(component_num_scans,per_scan_memory_size);
-            for (uint32_t s=0; s<component_num_scans; s++) {
-                this->image_components[i].scan_memory[s]=total_scan_memory+s*per_scan_memory_size/sizeof(MCU_EL);
-                //parser->image_components[i].scan_memory[s]=calloc(1,component_num_scan_elements*sizeof(MCU_EL));
-            }
-
             this->image_components[i].num_scans=component_num_scans;
             this->image_components[i].num_blocks_in_scan=component_num_scan_elements/64;
 
-            this->image_components[i].out_block_downsampled=(OUT_EL*)aligned_alloc(64,ROUND_UP(sizeof(OUT_EL)*(component_data_size+16),64));
-
-            this->image_components[i].total_num_blocks=this->image_components[i].vert_samples*this->image_components[i].horz_samples/64;
+            this->image_components[i].total_num_blocks=(this->image_components[i].vert_samples/8)*(this->image_components[i].horz_samples/8);
 
             this->component_label|=((uint32_t)this->image_components[i].horz_sample_factor)<<(((this->Nf-i)*2-1)*4);
             this->component_label|=((uint32_t)this->image_components[i].vert_sample_factor)<<(((this->Nf-i)*2-2)*4);
 
             this->color_space|=(uint32_t)(this->image_components[i].component_id<<(4*(this->Nf-1-i)));
         }
+
+        // fail before decoding the image, instead of after
+        if(this->Nf!=3 || this->color_space!=0x123)
+            parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"color space %3X other than YCbCr (component IDs 1,2,3) currently unimplemented",this->color_space);
         
         const uint32_t num_pixels_per_scan=this->max_component_vert_sample_factor*8*this->X;
 
@@ -1009,6 +1347,9 @@ class JpegParser: public FileParser{
         for (uint32_t i=0; i<this->Nf; i++) {
             this->image_components[i].conversion_indices=(uint32_t*)malloc(sizeof(uint32_t)*num_pixels_per_scan);
             uint32_t* const conversion_indices=this->image_components[i].conversion_indices;
+            if(!conversion_indices)
+                parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+            this->stats->peak_memory_bytes+=sizeof(uint32_t)*num_pixels_per_scan;
 
             uint32_t ci=0;
             for(uint32_t img_y=0;img_y<this->max_component_vert_sample_factor*8;img_y++){
@@ -1025,26 +1366,197 @@ class JpegParser: public FileParser{
                     conversion_indices[ci++]=index;
                 }
             }
+        }
 
-            if(ci!=num_pixels_per_scan)
-                bail(FATAL_UNEXPECTED_ERROR,"this is a bug. %d != %d",ci,num_pixels_per_scan);
+        // clamp requested region to image size. without a requested region, the whole image is decoded.
+        // in both cases the output is written at its final size, i.e. the mcu padding is never stored.
+        {
+            const ImageRegion region=this->requested_region;
+            this->region_x0=bitUtil::min(region.x,this->real_X);
+            this->region_y0=bitUtil::min(region.y,this->real_Y);
+            this->region_x1=(region.width==0)?this->real_X:bitUtil::min(this->real_X,region.x+bitUtil::min(region.width,this->real_X));
+            this->region_y1=(region.height==0)?this->real_Y:bitUtil::min(this->real_Y,region.y+bitUtil::min(region.height,this->real_Y));
+
+            if(this->region_x0>=this->region_x1 || this->region_y0>=this->region_y1)
+                parse_fail(IMAGE_PARSE_RESULT_INVALID_OPTIONS,"requested region %d,%d %dx%d is outside the image (%dx%d)",region.x,region.y,region.width,region.height,this->real_X,this->real_Y);
+
+            const uint32_t mcu_width=8*this->max_component_horz_sample_factor;
+            const uint32_t mcu_height=8*this->max_component_vert_sample_factor;
+
+            this->region_mcu_col_start=this->region_x0/mcu_width;
+            this->region_mcu_col_end=ROUND_UP(this->region_x1,mcu_width)/mcu_width;
+            this->region_mcu_row_start=this->region_y0/mcu_height;
+            this->region_mcu_row_end=ROUND_UP(this->region_y1,mcu_height)/mcu_height;
+
+            image_data->width=this->region_x1-this->region_x0;
+            image_data->height=this->region_y1-this->region_y0;
         }
 
-        const uint32_t total_num_pixels_in_image=this->X*this->Y;
+        image_data->stride=JpegOutputWindow::stride_for_width(image_data->width);
 
-        // overallocate for simd access overflows
-        static  const uint32_t OVERALLOCATE_NUM_BYTES=256;
-        image_data->data=(uint8_t*)malloc(sizeof(uint8_t)*total_num_pixels_in_image*4+OVERALLOCATE_NUM_BYTES);
+        // when streaming, the memory size depends on the layout of the first scan
+        if(this->row_callback==nullptr && this->tile_callback==nullptr)
+            this->allocate_decode_memory(false);
 
         this->current_file_content_index=segment_end_position;
     }
 
+    /// size of the memory that holds the pixels of a tile (while it is handed to the tile callback)
+    inline uint64_t tile_memory_size()const noexcept{
+        // overallocate for simd access overflows
+        static const uint32_t OVERALLOCATE_NUM_BYTES=256;
+        return JpegOutputWindow::stride_for_width(this->tile_width)*this->tile_height+OVERALLOCATE_NUM_BYTES;
+    }
+
+    /// allocate coefficient, idct output and pixel output memory
+    ///
+    /// when streaming, only the mcu rows that are required for the current output are kept in memory, otherwise all of them.
+    void allocate_decode_memory(const bool streaming){
+        const uint32_t mcu_height=8*this->max_component_vert_sample_factor;
+        const uint32_t num_scans=this->image_components[0].num_scans;
+
+        if(!streaming)
+            this->num_stored_scans=num_scans;
+        else if(this->row_callback)
+            this->num_stored_scans=1;
+        else
+            // a row of tiles can start in the middle of an mcu row, and the mcu rows of the next row of tiles are decoded
+            // only after the current one has been handed out
+            this->num_stored_scans=bitUtil::min(num_scans,ROUND_UP(this->tile_height,mcu_height)/mcu_height+1);
+
+        for (uint32_t i=0; i<this->Nf; i++) {
+            ImageComponent* const component=&this->image_components[i];
+
+            const uint32_t component_num_scans=component->num_scans;
+            const uint32_t component_num_scan_elements=component->num_blocks_in_scan*64;
+
+            // stored mcu rows are reused in a round-robin fashion
+            uint32_t per_scan_memory_size=ROUND_UP<uint32_t>(component_num_scan_elements*sizeof(MCU_EL),4096);
+            MCU_EL* const total_scan_memory=(MCU_EL*)calloc(this->num_stored_scans,per_scan_memory_size);
+            if(!total_scan_memory)
+                parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+
+            component->scan_memory=(MCU_EL**)malloc(sizeof(MCU_EL*)*component_num_scans);
+            if(!component->scan_memory){
+                free(total_scan_memory);
+                parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+            }
+            for (uint32_t s=0; s<component_num_scans; s++) {
+                component->scan_memory[s]=total_scan_memory+(uint64_t)(s%this->num_stored_scans)*per_scan_memory_size/sizeof(MCU_EL);
+            }
+
+            const uint64_t component_data_size=(uint64_t)this->num_stored_scans*component_num_scan_elements;
+            const uint64_t out_block_size=ROUND_UP(this->kernels->out_element_size*(component_data_size+16),64);
+            component->out_block_downsampled=aligned_alloc(64,out_block_size);
+            if(!component->out_block_downsampled)
+                parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+
+            this->stats->peak_memory_bytes+=(uint64_t)this->num_stored_scans*per_scan_memory_size+sizeof(MCU_EL*)*component_num_scans+out_block_size;
+        }
+
+        // when streaming tiles, the pixel output memory holds one tile per thread
+        uint64_t output_memory_size;
+        if(streaming && this->tile_callback){
+            output_memory_size=this->tile_memory_size()*this->num_threads;
+        }else{
+            // overallocate for simd access overflows
+            static  const uint32_t OVERALLOCATE_NUM_BYTES=256;
+
+            const uint32_t num_output_rows=streaming?mcu_height:image_data->height;
+            output_memory_size=image_data->stride*num_output_rows+OVERALLOCATE_NUM_BYTES;
+        }
+        image_data->data=(uint8_t*)malloc(output_memory_size);
+        if(!image_data->data)
+            parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+        // nothing is freed before the end of the decode, so the peak is the sum of all allocations
+        this->stats->peak_memory_bytes+=output_memory_size;
+
+        this->output=JpegOutputWindow::create(this->region_x0,this->region_y0,this->region_x1,this->region_y1,image_data->data);
+    }
+
+    /// decode mcu columns [mcu_col_start;mcu_col_end) of an mcu row of a baseline scan, returns the number of blocks without ac coefficients
+    template<ScanLayout SCAN_LAYOUT>
+    [[gnu::hot,gnu::nonnull(2,3,5,6)]]
+    uint64_t decode_baseline_mcus(
+        BitStream* const stream,
+        MCU_EL* const differential_dc,
+        const uint8_t successive_approximation_bit_low,
+        MCU_EL* const* const scan_memories,
+        uint64_t* const eob_run,
+        const uint32_t num_scan_components,
+        const uint32_t mcu_col_start,
+        const uint32_t mcu_col_end
+    )const noexcept{
+        constexpr uint32_t layout=static_cast<uint32_t>(SCAN_LAYOUT);
+        // sampling factors of component c in the layout
+        #define LAYOUT_VSF(NUM_COMPONENTS,C) ((layout>>(8*((NUM_COMPONENTS)-1-(C))))&0xF)
+        #define LAYOUT_HSF(NUM_COMPONENTS,C) ((layout>>(8*((NUM_COMPONENTS)-1-(C))+4))&0xF)
+
+        uint64_t num_dc_only_blocks=0;
+        for (uint32_t mcu_col=mcu_col_start;mcu_col<mcu_col_end;mcu_col++) {
+            if constexpr(SCAN_LAYOUT==ScanLayout::GENERIC){
+                for (uint32_t c=0; c<num_scan_components; c++)
+                    num_dc_only_blocks+=scan_components[c].process_mcu_baseline(mcu_col,stream,&differential_dc[c],successive_approximation_bit_low,scan_memories[c],eob_run);
+            }else if constexpr(SCAN_LAYOUT==ScanLayout::SINGLE){
+                num_dc_only_blocks+=scan_components[0].process_mcu_baseline<1,1>(mcu_col,stream,&differential_dc[0],successive_approximation_bit_low,scan_memories[0],eob_run);
+            }else{
+                num_dc_only_blocks+=scan_components[0].process_mcu_baseline<LAYOUT_VSF(3,0),LAYOUT_HSF(3,0)>(mcu_col,stream,&differential_dc[0],successive_approximation_bit_low,scan_memories[0],eob_run);
+                num_dc_only_blocks+=scan_components[1].process_mcu_baseline<LAYOUT_VSF(3,1),LAYOUT_HSF(3,1)>(mcu_col,stream,&differential_dc[1],successive_approximation_bit_low,scan_memories[1],eob_run);
+                num_dc_only_blocks+=scan_components[2].process_mcu_baseline<LAYOUT_VSF(3,2),LAYOUT_HSF(3,2)>(mcu_col,stream,&differential_dc[2],successive_approximation_bit_low,scan_memories[2],eob_run);
+            }
+        }
+
+        #undef LAYOUT_VSF
+        #undef LAYOUT_HSF
+
+        return num_dc_only_blocks;
+    }
+    typedef uint64_t(JpegParser::*DecodeBaselineMcus)(BitStream*,MCU_EL*,uint8_t,MCU_EL* const*,uint64_t*,uint32_t,uint32_t,uint32_t)const;
+
+    /// decode an mcu row of a progressive scan, returns the number of end-of-band runs that span more than one block
+    template<bool IS_INTERLEAVED,bool IS_REFINEMENT>
+    [[gnu::hot,gnu::nonnull(2,3,5,9)]]
+    uint64_t decode_progressive_mcus(
+        BitStream* const stream,
+        MCU_EL* const differential_dc,
+        const uint8_t successive_approximation_bit_low,
+        MCU_EL* const* const scan_memories,
+        const uint32_t num_scan_components,
+        const uint8_t spectral_selection_start,
+        const uint8_t spectral_selection_end,
+        uint64_t* const eob_run,
+        const MCU_EL succ_approx_bit_shifted,
+        const uint32_t mcu_cols
+    )const noexcept{
+        uint64_t num_eob_runs=0;
+        for (uint32_t mcu_col=0;mcu_col<mcu_cols;mcu_col++) {
+            for (uint32_t c=0; c<num_scan_components; c++) {
+                num_eob_runs+=scan_components[c].process_mcu_generic<IS_INTERLEAVED,IS_REFINEMENT>(
+                    mcu_col,
+                    stream,
+                    &differential_dc[c],
+                    successive_approximation_bit_low,
+                    scan_memories[c],
+                    spectral_selection_start,
+                    spectral_selection_end,
+                    eob_run,
+                    succ_approx_bit_shifted
+                );
+            }
+        }
+
+        return num_eob_runs;
+    }
+    typedef uint64_t(JpegParser::*DecodeProgressiveMcus)(BitStream*,MCU_EL*,uint8_t,MCU_EL* const*,uint32_t,uint8_t,uint8_t,uint64_t*,MCU_EL,uint32_t)const;
+
     template<EncodingMethod ENCODING_METHOD>
     void parse_sos(){
-        const uint16_t segment_size=this->next_u16();
+        const uint16_t segment_size=this->next_segment_size();
         discard segment_size;
 
         const uint8_t num_scan_components=this->get_mem<uint8_t>();
+        if(num_scan_components==0 || num_scan_components>this->Nf)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid number of components %d in scan (image has %d)",num_scan_components,this->Nf);
 
         const bool is_interleaved=num_scan_components != 1;
 
@@ -1059,6 +1571,9 @@ class JpegParser: public FileParser{
 
             scan_component_dc_table_index[i]=HB_U8(table_indices);
             scan_component_ac_table_index[i]=LB_U8(table_indices);
+
+            if(scan_component_dc_table_index[i]>3 || scan_component_ac_table_index[i]>3)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid huffman table indices %d,%d in scan",scan_component_dc_table_index[i],scan_component_ac_table_index[i]);
         }
 
         const uint8_t spectral_selection_start=this->get_mem<uint8_t>();
@@ -1068,6 +1583,13 @@ class JpegParser: public FileParser{
         const uint8_t successive_approximation_bit_low=LB_U8(successive_approximation_bits);
         const uint8_t successive_approximation_bit_high=HB_U8(successive_approximation_bits);
 
+        if(spectral_selection_start>spectral_selection_end || spectral_selection_end>63)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid spectral selection %d..%d in scan",spectral_selection_start,spectral_selection_end);
+        if(successive_approximation_bit_low>13)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid successive approximation bit %d in scan",successive_approximation_bit_low);
+        if(ENCODING_METHOD==EncodingMethod::Baseline && successive_approximation_bit_high!=0)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"successive approximation in baseline scan");
+
         MCU_EL differential_dc[3]={0,0,0};
 
         BitStream _bit_stream;
@@ -1093,7 +1615,14 @@ class JpegParser: public FileParser{
             }
 
             if (scan_component_index_in_image[scan_component_index]==UINT8_MAX)
-                bail(-102,"did not find image component?!\n");
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"scan contains component %d, which is not part of the image",scan_component_id[scan_component_index]);
+        }
+
+        // a baseline scan that contains all components completes one mcu row after the other, so only the mcu rows required for the current output
+        // need to be kept in memory
+        if(this->image_components[0].scan_memory==NULL){
+            this->streaming=ENCODING_METHOD==EncodingMethod::Baseline && num_scan_components==this->Nf && this->color_space==0x123;
+            this->allocate_decode_memory(this->streaming);
         }
 
         for (int c=0; c<num_scan_components; c++) {
@@ -1108,6 +1637,12 @@ class JpegParser: public FileParser{
             scan_components[c].dc_table=&this->dc_coding_tables[scan_component_dc_table_index[c]];
             scan_components[c].ac_table=&this->ac_coding_tables[scan_component_ac_table_index[c]];
 
+            // a table is only used if the scan contains its coefficients
+            const bool uses_dc_table=spectral_selection_start==0 && successive_approximation_bit_high==0;
+            const bool uses_ac_table=ENCODING_METHOD==EncodingMethod::Baseline || spectral_selection_end>0;
+            if((uses_dc_table && scan_components[c].dc_table->lookup_table==NULL) || (uses_ac_table && scan_components[c].ac_table->lookup_table==NULL))
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"scan uses an undefined huffman table");
+
             scan_components[c].scan_memory=this->image_components[component_index_in_image].scan_memory;
 
             scan_components[c].num_scans=this->image_components[component_index_in_image].num_scans;
@@ -1126,7 +1661,9 @@ class JpegParser: public FileParser{
                     channel_completeness[t]+=i+1;
                 }
                 if (channel_completeness[t]==CHANNEL_COMPLETE){
-                    pthread_create(&async_scan_processors[t], NULL, (pthread_callback)ProcessIncomingScans_pthread, &async_scan_info[t]);
+                    if(pthread_create(&async_scan_processors[t], NULL, (pthread_callback)ProcessIncomingScans_pthread, &async_scan_info[t])!=0)
+                        parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to launch pthread");
+                    async_scan_processor_running[t]=true;
                 }
             }
         }
@@ -1134,51 +1671,137 @@ class JpegParser: public FileParser{
         // needed when successive_approximation_bit_high>0
         const MCU_EL succ_approx_bit_shifted=(MCU_EL)(1<<successive_approximation_bit_low);
 
+        // the mcu loops are selected once per scan, based on the scan layout
+        [[maybe_unused]] DecodeBaselineMcus baseline_mcu_decoder=&JpegParser::decode_baseline_mcus<ScanLayout::GENERIC>;
+        [[maybe_unused]] DecodeProgressiveMcus progressive_mcu_decoder=NULL;
+        if constexpr(ENCODING_METHOD==EncodingMethod::Baseline){
+            uint32_t scan_layout=0;
+            for (uint32_t c=0; c<num_scan_components; c++)
+                scan_layout=(scan_layout<<8) | (uint32_t)(scan_components[c].horz_sample_factor<<4) | scan_components[c].vert_sample_factor;
+
+            switch(static_cast<ScanLayout>(scan_layout)){
+                case ScanLayout::SINGLE:
+                    baseline_mcu_decoder=&JpegParser::decode_baseline_mcus<ScanLayout::SINGLE>;
+                    break;
+                case ScanLayout::YCBCR_444:
+                    baseline_mcu_decoder=&JpegParser::decode_baseline_mcus<ScanLayout::YCBCR_444>;
+                    break;
+                case ScanLayout::YCBCR_422:
+                    baseline_mcu_decoder=&JpegParser::decode_baseline_mcus<ScanLayout::YCBCR_422>;
+                    break;
+                case ScanLayout::YCBCR_420:
+                    baseline_mcu_decoder=&JpegParser::decode_baseline_mcus<ScanLayout::YCBCR_420>;
+                    break;
+                default:
+                    break;
+            }
+        }else{
+            if(is_interleaved){
+                if(successive_approximation_bit_high==0)
+                    progressive_mcu_decoder=&JpegParser::decode_progressive_mcus<true,false>;
+                else
+                    progressive_mcu_decoder=&JpegParser::decode_progressive_mcus<true,true>;
+            }else{
+                if(successive_approximation_bit_high==0)
+                    progressive_mcu_decoder=&JpegParser::decode_progressive_mcus<false,false>;
+                else
+                    progressive_mcu_decoder=&JpegParser::decode_progressive_mcus<false,true>;
+            }
+        }
+
         uint64_t eob_run=0;
 
-        for (uint32_t mcu_row=0;mcu_row<mcu_rows;mcu_row++) {
-            MCU_EL* const scan_memories[3]={
-                scan_components[0].scan_memory[mcu_row],
-                scan_components[1].scan_memory[mcu_row],
-                scan_components[2].scan_memory[mcu_row],
-            };
+        uint32_t num_blocks_per_mcu=0;
+        for (uint32_t c=0; c<num_scan_components; c++)
+            num_blocks_per_mcu+=(uint32_t)scan_components[c].horz_sample_factor*scan_components[c].vert_sample_factor;
+
+        // counted locally, and added to the stats once per scan
+        uint64_t num_decoded_mcus=0;
+        uint64_t num_dc_only_blocks=0;
+        uint64_t num_eob_runs=0;
+
+        // mcu rows below the decoded region are never used, so the entropy-coded data is only parsed up to the last row in the region
+        const uint32_t mcu_rows_to_decode=this->region_mcu_row_end;
 
-            if constexpr(ENCODING_METHOD==EncodingMethod::Baseline){
-                if(successive_approximation_bit_high!=0)
-                    bail(FATAL_UNEXPECTED_ERROR,"this is a bug.");
+        // the range of a scan in the trace is its spectral selection
+        const TraceScope scan_trace_scope{"scan",spectral_selection_start,(uint32_t)spectral_selection_end+1};
 
-                for (uint32_t mcu_col=0;mcu_col<mcu_cols;mcu_col++) {
+        for (uint32_t mcu_row=0;mcu_row<mcu_rows;mcu_row++) {
+            const TraceScope mcu_row_trace_scope{"mcu row",mcu_row,mcu_row+1};
+
+            if(mcu_row>=mcu_rows_to_decode){
+                // still update the scan progress below, so that threads waiting for these rows can finish
+            }else if constexpr(ENCODING_METHOD==EncodingMethod::Baseline){
+                MCU_EL* scan_memories[3]={NULL,NULL,NULL};
+                for (uint32_t c=0; c<num_scan_components; c++)
+                    scan_memories[c]=scan_components[c].scan_memory[mcu_row];
+
+                // stored mcu rows are reused when streaming, and the coefficients of the previous mcu row have to be cleared
+                if(this->streaming)
+                    for (uint32_t c=0; c<num_scan_components; c++)
+                        memset(scan_memories[c],0,scan_components[c].num_blocks_in_scan*64*sizeof(MCU_EL));
+
+                // mcus outside the decoded region are only parsed, their coefficients are not stored
+                uint32_t region_mcu_col_start=0;
+                uint32_t region_mcu_col_end=0;
+                if(mcu_row>=this->region_mcu_row_start){
+                    if(is_interleaved){
+                        region_mcu_col_start=this->region_mcu_col_start;
+                        region_mcu_col_end=this->region_mcu_col_end;
+                    }else{
+                        // the blocks of a non-interleaved scan are stored in raster order, which does not map to mcu columns, so the whole row is decoded
+                        region_mcu_col_end=mcu_cols;
+                    }
+                }
+
+                for (uint32_t mcu_col=0;mcu_col<region_mcu_col_start;mcu_col++) {
                     for (uint32_t c=0; c<num_scan_components; c++) {
-                        scan_components[c].process_mcu_baseline(
-                            mcu_col,
-                            stream,
-                            &differential_dc[c],
-                            successive_approximation_bit_low,
-                            scan_memories[c],
-                            &eob_run
-                        );
+                        scan_components[c].skip_mcu_baseline(stream,&differential_dc[c],&eob_run);
                     }
                 }
-            }else{
-                for (uint32_t mcu_col=0;mcu_col<mcu_cols;mcu_col++) {
+                num_decoded_mcus+=region_mcu_col_end-region_mcu_col_start;
+                num_dc_only_blocks+=(this->*baseline_mcu_decoder)(
+                    stream,
+                    differential_dc,
+                    successive_approximation_bit_low,
+                    scan_memories,
+                    &eob_run,
+                    num_scan_components,
+                    region_mcu_col_start,
+                    region_mcu_col_end
+                );
+                for (uint32_t mcu_col=region_mcu_col_end;mcu_col<mcu_cols;mcu_col++) {
                     for (uint32_t c=0; c<num_scan_components; c++) {
-                        scan_components[c].process_mcu_generic(
-                            mcu_col,
-                            stream,
-                            &differential_dc[c],
-                            successive_approximation_bit_low,
-                            scan_memories[c],
-                            is_interleaved,
-                            spectral_selection_start,
-                            spectral_selection_end,
-                            successive_approximation_bit_high,
-                            &eob_run,
-                            succ_approx_bit_shifted
-                        );
+                        scan_components[c].skip_mcu_baseline(stream,&differential_dc[c],&eob_run);
                     }
                 }
+            }else{
+                MCU_EL* scan_memories[3]={NULL,NULL,NULL};
+                for (uint32_t c=0; c<num_scan_components; c++)
+                    scan_memories[c]=scan_components[c].scan_memory[mcu_row];
+
+                num_decoded_mcus+=mcu_cols;
+                num_eob_runs+=(this->*progressive_mcu_decoder)(
+                    stream,
+                    differential_dc,
+                    successive_approximation_bit_low,
+                    scan_memories,
+                    num_scan_components,
+                    spectral_selection_start,
+                    spectral_selection_end,
+                    &eob_run,
+                    succ_approx_bit_shifted,
+                    mcu_cols
+                );
             }
 
+            // truncated data is decoded as zero bits, and only detected once per mcu row
+            if(stream->overrun())
+                parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"jpeg scan data ends in mcu row %d of %d",mcu_row,mcu_rows);
+
+            if(this->streaming && mcu_row<mcu_rows_to_decode)
+                this->stream_mcu_row(mcu_row);
+
             if(parallel&&(successive_approximation_bit_low==0))
                 for(int t=0;t<num_scan_components;t++){
                     const uint8_t index=scan_components[t].component_index_in_image;
@@ -1187,15 +1810,25 @@ class JpegParser: public FileParser{
                 }
         }
 
-        const uint32_t bytes_read_from_stream=(uint32_t)(stream->next_data_index-stream->buffer_bits_filled/8);
+        const uint32_t bytes_read_from_stream=(uint32_t)(stream->next_data_index-(stream->buffer_bits_filled/8-stream->num_padding_bytes));
 
         this->current_file_content_index+=bytes_read_from_stream;
+
+        this->stats->entropy_coded_bytes+=bytes_read_from_stream;
+        this->stats->num_mcus+=num_decoded_mcus;
+        this->stats->num_blocks+=num_decoded_mcus*num_blocks_per_mcu;
+        this->stats->num_dc_only_blocks+=num_dc_only_blocks;
+        this->stats->num_eob_runs+=num_eob_runs;
+        this->stats->num_bitstream_refills+=stream->num_refills;
+
+        if(mcu_rows_to_decode<mcu_rows)
+            this->skip_to_next_marker();
     }
 
     /// skip segment body (if it exists), based on the encoded segment size
     void skip_segment(JpegSegmentType segment_type){
         if(JpegSegmentType_hasSegmentBody(segment_type)){
-            const uint32_t segment_size=this->next_u16();
+            const uint32_t segment_size=this->next_segment_size();
             const uint32_t segment_end_position=static_cast<uint32_t>(this->current_file_content_index)+segment_size-2;
             this->current_file_content_index=segment_end_position;
         }
@@ -1203,31 +1836,14 @@ class JpegParser: public FileParser{
 
     void convert_colorspace();
 
-    void correct_image_size(){
-        if(this->X!=this->real_X || this->Y!=this->real_Y){
-            uint8_t* const old_data=image_data->data;
-            uint8_t* const real_data=(uint8_t*)aligned_alloc(64,ROUND_UP(this->real_X*this->real_Y*4,64));
-
-            for (uint32_t y=0; y<this->real_Y; y++) {
-                for(uint32_t x=0; x<this->real_X; x++) {
-                    real_data[(y*this->real_X+x)*4+0]=old_data[(y*this->X+x)*4+0];
-                    real_data[(y*this->real_X+x)*4+1]=old_data[(y*this->X+x)*4+1];
-                    real_data[(y*this->real_X+x)*4+2]=old_data[(y*this->X+x)*4+2];
-                    real_data[(y*this->real_X+x)*4+3]=old_data[(y*this->X+x)*4+3];
-                }
-            }
-
-            free(old_data);
-
-            image_data->height=this->real_Y;
-            image_data->width=this->real_X;
-            image_data->data=real_data;
-
-            #ifdef DEBUG
-                this->crop_end_time=current_time()-this->start_time;
-            #endif
-        }
-    }
+    void stream_mcu_row(const uint32_t mcu_row);
+    void emit_tile_row(const uint32_t tile_row);
+    void emit_tiles(
+        const uint32_t tile_row,
+        const uint32_t first_tile_col,
+        const uint32_t tile_col_step,
+        uint8_t* const tile_memory
+    )const;
 };
 
 template<>
@@ -1240,24 +1856,28 @@ void JpegParser::parse_segment<JpegSegmentType::EOI>(){
 }
 template<>
 void JpegParser::parse_segment<JpegSegmentType::COM>(){
-    const uint32_t segment_size=this->next_u16();
+    const uint32_t segment_size=this->next_segment_size();
     
     const uint32_t segment_end_position=static_cast<uint32_t>(this->current_file_content_index)+segment_size-2;
 
     const uint32_t comment_length=segment_size-2;
 
     char* const comment_str=(char*)malloc(comment_length+1);
+    if(!comment_str)
+        parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
     comment_str[comment_length]=0;
 
     memcpy(comment_str,&this->file_contents[this->current_file_content_index],comment_length);
 
+    // only the last comment is kept
+    free(image_data->image_file_metadata.file_comment);
     image_data->image_file_metadata.file_comment=comment_str;
 
     this->current_file_content_index=segment_end_position;
 }
 template<>
 void JpegParser::parse_segment<JpegSegmentType::DQT>(){
-    const uint32_t segment_size=this->next_u16();
+    const uint32_t segment_size=this->next_segment_size();
     const uint32_t segment_end_position=static_cast<uint32_t>(this->current_file_content_index)+segment_size-2;
 
     uint32_t segment_bytes_read=0;
@@ -1266,8 +1886,11 @@ void JpegParser::parse_segment<JpegSegmentType::DQT>(){
         const uint8_t destination=LB_U8(destination_and_precision);
         const uint8_t precision=HB_U8(destination_and_precision);
         if (precision!=0)
-            bail(-45, "jpeg quant table precision is not 0 - it is %d\n",precision);
+            parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"jpeg quant table precision is not 0 - it is %d",precision);
+        if (destination>3)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid jpeg quant table destination %d",destination);
 
+        this->require_bytes(64);
         uint8_t table_entries[64];
         memcpy(table_entries,&this->file_contents[this->current_file_content_index],64);
         this->current_file_content_index+=64;
@@ -1284,7 +1907,7 @@ void JpegParser::parse_segment<JpegSegmentType::DQT>(){
 }
 template<>
 void JpegParser::parse_segment<JpegSegmentType::DHT>(){
-    const uint32_t segment_size=this->next_u16();
+    const uint32_t segment_size=this->next_segment_size();
     const uint32_t segment_end_position=static_cast<uint32_t>(this->current_file_content_index)+segment_size-2;
 
     uint32_t segment_bytes_read=0;
@@ -1294,6 +1917,9 @@ void JpegParser::parse_segment<JpegSegmentType::DHT>(){
         const uint8_t table_index=LB_U8(table_index_and_class);
         const uint8_t table_class=HB_U8(table_index_and_class);
 
+        if(table_index>3)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid huffman table index %d",table_index);
+
         HuffmanTable* target_table=NULL;
         switch (table_class) {
             case  0:
@@ -1303,43 +1929,36 @@ void JpegParser::parse_segment<JpegSegmentType::DHT>(){
                 target_table=&this->ac_coding_tables[table_index];
                 break;
             default:
-                exit(FATAL_UNEXPECTED_ERROR);
-        }
-
-        uint32_t total_num_values=0;
-        uint8_t num_values_of_length[16];
-        for(int i=0;i<16;i++){
-            num_values_of_length[i]=this->file_contents[this->current_file_content_index++];
-
-            total_num_values+=num_values_of_length[i];
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid huffman table class %d",table_class);
         }
 
-        segment_bytes_read+=17;
+        // the table definition is BITS (number of codes of each length) followed by HUFFVAL
+        this->require_bytes(16);
+        const uint8_t* const definition=this->data_ptr();
 
-        HuffmanTable::VALUE_ values[260];
-        for(uint32_t i=0;i<total_num_values;i++)
-            values[i]=this->file_contents[this->current_file_content_index++];
-
-        uint8_t value_code_lengths[260];
-        memset(value_code_lengths,0,sizeof(value_code_lengths));
-
-        uint32_t value_index=0;
-        for (uint8_t code_length=0; code_length<16; code_length++) {
-            for(uint32_t i=0;i<num_values_of_length[code_length];i++)
-                value_code_lengths[value_index++]=code_length+1;
-        }
-
-        segment_bytes_read+=value_index;
+        uint32_t total_num_values=0;
+        for(int i=0;i<16;i++)
+            total_num_values+=definition[i];
+        if(total_num_values>256)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid huffman table definition with %d values",total_num_values);
+
+        const uint32_t definition_size=16+total_num_values;
+        this->require_bytes(definition_size);
+
+        // dc values are the bit length of the dc difference, which is at most 11 bits for 8 bit samples
+        if(table_class==0)
+            for(uint32_t i=0;i<total_num_values;i++)
+                if(definition[16+i]>11)
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid dc huffman table value %d",definition[16+i]);
+        this->current_file_content_index+=definition_size;
+        segment_bytes_read+=1+definition_size;
 
         // destroy previous table, if there was one
         target_table->destroy();
 
-        HuffmanTable::CodingTable_new(
-            target_table,
-            (int)total_num_values,
-            value_code_lengths,
-            values
-        );
+        // most images use the standard tables, or one of a few sets of encoder-specific ones, so the lookup tables are shared
+        if(!StandardHuffmanTables::use_if_standard(target_table,definition,definition_size))
+            HuffmanTableCache::get(target_table,definition,definition_size,HuffmanTable_fromDefinition);
     }
 
     this->current_file_content_index=segment_end_position;
@@ -1364,7 +1983,7 @@ void JpegParser::parse_segment<JpegSegmentType::SOS>(){
             this->parse_sos<EncodingMethod::Progressive>();
             break;
         case EncodingMethod::UNDEFINED:
-            bail(FATAL_UNEXPECTED_ERROR,"this is a bug.");
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"scan before frame header");
     }
 }
 
@@ -1381,44 +2000,146 @@ void* JpegParser_process_channel_pthread(struct JpegParser_process_channel_argse
 }
 
 void* ProcessIncomingScans_pthread(struct ProcessIncomingScan_Arguments* async_args){
+    Trace_setThreadName("idct worker",async_args->channel);
+
+    // start of the current wait for mcu rows (the sleeps of a wait are recorded as a single event), 0 if not waiting or not tracing
+    uint64_t wait_begin=0;
+
     uint32_t scan_id_start=0;
     uint32_t total_num_scans=async_args->parser->image_components[1].num_scans;
-    while(scan_id_start<total_num_scans){
+    while(scan_id_start<total_num_scans && !async_args->parser->cancelled.load()){
         uint32_t scan_id_end=async_args->num_scans_parsed.load();
 
         uint32_t num_scans_to_process=scan_id_end-scan_id_start;
         if(num_scans_to_process){
+            if(wait_begin){
+                Trace_record("wait for mcu rows",wait_begin,scan_id_start,scan_id_end);
+                wait_begin=0;
+            }
+
             const uint8_t c=async_args->channel;
 
             async_args->parser->process_channel(c,scan_id_start,scan_id_end);
 
             scan_id_start=scan_id_end;
         }else{
+            if(!wait_begin && trace_enabled.load(std::memory_order_relaxed))
+                wait_begin=cpu::timestamp();
+
             struct timespec sleeptime={.tv_sec=0,.tv_nsec=100000};
             nanosleep(&sleeptime, NULL);
         }
     }
 
+    if(wait_begin)
+        Trace_record("wait for mcu rows",wait_begin);
+
     return NULL;
 }
 
-#include "jpeg/jpeg_ycbcr_to_rgb.cpp"
+// the kernels are compiled once per instruction set (and precision), and the best set supported by the cpu is selected at runtime.
+// vec is the portable simd backend used by the kernels of a set. the generic set is available on every architecture, e.g. as baseline
+// for benchmarks of the other sets.
+namespace jpeg_kernels_generic{
+    namespace vec=simd::scalar;
+    #define KERNEL_TARGET
+    #define KERNEL_ISA cpu::Isa::GENERIC
+    #define KERNEL_ISA_GENERIC
+    #include "jpeg/jpeg_kernels.cpp"
+    #undef KERNEL_TARGET
+    #undef KERNEL_ISA
+    #undef KERNEL_ISA_GENERIC
+};
+#if defined(__x86_64__)
+    namespace jpeg_kernels_ssse3{
+        namespace vec=simd::sse2;
+        #define KERNEL_TARGET gnu::target("ssse3")
+        #define KERNEL_ISA cpu::Isa::SSSE3
+        #define KERNEL_ISA_SSSE3
+        #include "jpeg/jpeg_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_SSSE3
+    };
+    namespace jpeg_kernels_avx2{
+        namespace vec=simd::avx2;
+        #define KERNEL_TARGET gnu::target("avx2")
+        #define KERNEL_ISA cpu::Isa::AVX2
+        #define KERNEL_ISA_AVX2
+        #include "jpeg/jpeg_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_AVX2
+    };
+    namespace jpeg_kernels_avx512{
+        namespace vec=simd::avx512;
+        #define KERNEL_TARGET gnu::target("avx2,avx512f,avx512bw")
+        #define KERNEL_ISA cpu::Isa::AVX512
+        #define KERNEL_ISA_AVX512
+        #include "jpeg/jpeg_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_AVX512
+    };
+#elif defined(__aarch64__)
+    namespace jpeg_kernels_neon{
+        namespace vec=simd::neon;
+        // neon is always available on arm64
+        #define KERNEL_TARGET
+        #define KERNEL_ISA cpu::Isa::NEON
+        #define KERNEL_ISA_NEON
+        #include "jpeg/jpeg_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_NEON
+    };
+#endif
+
+static const JpegKernels* JpegKernels_select(const cpu::Isa isa,const ImageDecodePrecision precision){
+    // the kernel sets of an instruction set are indexed by precision
+    if(precision>IMAGE_DECODE_PRECISION_EXACT)
+        return NULL;
+
+    switch(isa){
+        #if defined(__x86_64__)
+            case cpu::Isa::AVX512:
+                return &jpeg_kernels_avx512::KERNELS[precision];
+            case cpu::Isa::AVX2:
+                return &jpeg_kernels_avx2::KERNELS[precision];
+            case cpu::Isa::SSSE3:
+                return &jpeg_kernels_ssse3::KERNELS[precision];
+        #elif defined(__aarch64__)
+            case cpu::Isa::NEON:
+                return &jpeg_kernels_neon::KERNELS[precision];
+        #endif
+        default:
+            return &jpeg_kernels_generic::KERNELS[precision];
+    }
+}
 
 struct JpegParser_convert_colorspace_argset{
     JpegParser* parser;
 
     uint32_t scan_index_start;
     uint32_t scan_index_end;
+    /// index of the thread among the convert workers, names the thread in the trace
+    uint32_t thread_index;
 };
 void* JpegParser_convert_colorspace_pthread(struct JpegParser_convert_colorspace_argset* args){
-    JpegParser_convert_colorspace(args->parser,args->scan_index_start,args->scan_index_end);
+    Trace_setThreadName("convert worker",args->thread_index);
+
+    const TraceScope trace_scope{"convert",args->scan_index_start,args->scan_index_end};
+    args->parser->kernels->convert_colorspace(args->parser,args->scan_index_start,args->scan_index_end,&args->parser->output);
     return NULL;
 }
 
 void JpegParser::parse_file(){
     while (!parsing_done) {
         const JpegSegmentType next_header=JpegSegmentType(this->next_u16());
-        
+
+        const char* const segment_name=Image_jpeg_segment_type_name(next_header);
+        const TraceScope trace_scope{segment_name?segment_name:"unknown segment"};
+
         switch (next_header) {
             case JpegSegmentType::SOI:
                 this->parse_segment<JpegSegmentType::SOI>();
@@ -1472,111 +2193,291 @@ void JpegParser::parse_file(){
                 break;
 
             case JpegSegmentType::SOS:
+                this->timer->lap(IMAGE_DECODE_STAGE_PARSE);
                 this->parse_segment<JpegSegmentType::SOS>();
+                this->timer->lap(IMAGE_DECODE_STAGE_ENTROPY_DECODE);
                 break;
 
             default:
-                bail(-40,"unhandled segment %s ( %X ) \n",Image_jpeg_segment_type_name((JpegSegmentType)next_header),static_cast<uint32_t>(next_header));
+                if((static_cast<uint32_t>(next_header)>>8)!=0xFF)
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"expected jpeg segment marker, found %X",static_cast<uint32_t>(next_header));
+
+                parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"unhandled segment %s ( %X )",Image_jpeg_segment_type_name((JpegSegmentType)next_header),static_cast<uint32_t>(next_header));
         }
     }
 
-    #ifdef DEBUG
-        this->parse_end_time=current_time()-this->start_time;
-    #endif
+    this->timer->lap(IMAGE_DECODE_STAGE_PARSE);
 
     if(parallel)
-        for(uint8_t t=0;t<3;t++)
-            pthread_join(async_scan_processors[t], NULL);
+        for(uint8_t t=0;t<3;t++){
+            const TraceScope trace_scope{"join idct worker",t,(uint32_t)t+1};
+            if(async_scan_processor_running[t]){
+                pthread_join(async_scan_processors[t], NULL);
+                async_scan_processor_running[t]=false;
+            }else{
+                // not all scans of this channel are present, so it has not been processed yet
+                this->process_channel(t,0,this->image_components[t].num_scans);
+            }
+        }
 
-    if (!parallel) {
+    // streamed mcu rows have already been processed
+    if (!parallel && !streaming) {
         for(uint8_t c=0;c<3;c++){
             this->process_channel(c,0,this->image_components[c].num_scans);
         }
     }
 
-    #ifdef DEBUG
-        this->process_end_time=current_time()-this->start_time;
-    #endif
+    this->timer->lap(IMAGE_DECODE_STAGE_RECONSTRUCT);
 }
 void JpegParser::convert_colorspace(){
     switch(this->color_space){
         case 0x123:
             {
                 if(this->parallel){
-                    struct JpegParser_convert_colorspace_argset* const thread_args=(struct JpegParser_convert_colorspace_argset*)malloc(JPEG_DECODE_NUM_THREADS*sizeof(struct JpegParser_convert_colorspace_argset));
-                    pthread_t* const threads=(pthread_t*)malloc(JPEG_DECODE_NUM_THREADS*sizeof(pthread_t));
+                    const uint32_t num_threads=this->num_threads;
+
+                    struct JpegParser_convert_colorspace_argset* const thread_args=(struct JpegParser_convert_colorspace_argset*)malloc(num_threads*sizeof(struct JpegParser_convert_colorspace_argset));
+                    pthread_t* const threads=(pthread_t*)malloc(num_threads*sizeof(pthread_t));
+                    if(!thread_args || !threads){
+                        free(thread_args);
+                        free(threads);
+                        parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+                    }
 
-                    const uint32_t num_scans_per_thread=this->image_components[0].num_scans/JPEG_DECODE_NUM_THREADS;
-                    for(uint32_t i=0;i<JPEG_DECODE_NUM_THREADS;i++){
+                    const uint32_t num_scans_per_thread=this->image_components[0].num_scans/num_threads;
+                    for(uint32_t i=0;i<num_threads;i++){
                         thread_args[i].parser=this;
                         thread_args[i].scan_index_start=i*num_scans_per_thread;
                         thread_args[i].scan_index_end=(i+1)*num_scans_per_thread;
+                        thread_args[i].thread_index=i;
                     }
-                    thread_args[JPEG_DECODE_NUM_THREADS-1].scan_index_end=this->image_components[0].num_scans;
+                    thread_args[num_threads-1].scan_index_end=this->image_components[0].num_scans;
 
-                    for(uint32_t i=0;i<JPEG_DECODE_NUM_THREADS;i++){
-                        if(pthread_create(&threads[i], NULL, (pthread_callback)JpegParser_convert_colorspace_pthread, &thread_args[i])!=0){
-                            bail(-107,"failed to launch pthread\n");
-                        }
+                    uint32_t num_threads_started=0;
+                    while(num_threads_started<num_threads){
+                        if(pthread_create(&threads[num_threads_started], NULL, (pthread_callback)JpegParser_convert_colorspace_pthread, &thread_args[num_threads_started])!=0)
+                            break;
+                        num_threads_started++;
                     }
 
-                    for(uint32_t i=0;i<JPEG_DECODE_NUM_THREADS;i++){
-                        if(pthread_join(threads[i],NULL)!=0){
-                            bail(-108,"failed to join pthread\n");
-                        }
+                    {
+                        const TraceScope trace_scope{"join convert workers"};
+                        for(uint32_t i=0;i<num_threads_started;i++)
+                            pthread_join(threads[i],NULL);
                     }
 
                     free(thread_args);
                     free(threads);
+
+                    if(num_threads_started<num_threads)
+                        parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to launch pthread");
                 }else{
-                    JpegParser_convert_colorspace(this,0,this->image_components[0].num_scans);
+                    const TraceScope trace_scope{"convert",0,this->image_components[0].num_scans};
+                    this->kernels->convert_colorspace(this,0,this->image_components[0].num_scans,&this->output);
                 }
             }
             break;
 
         default:
-            bail(-65,"color space %3X other than YCbCr (component IDs 1,2,3) currently unimplemented",this->color_space);
+            parse_fail(IMAGE_PARSE_RESULT_UNSUPPORTED,"color space %3X other than YCbCr (component IDs 1,2,3) currently unimplemented",this->color_space);
     }
 
-    #ifdef DEBUG
-        this->convert_end_time=current_time()-this->start_time;
-    #endif
+    this->timer->lap(IMAGE_DECODE_STAGE_CONVERT);
+}
+/// process a fully decoded mcu row, then hand all output that is complete to the row or tile callback
+void JpegParser::stream_mcu_row(const uint32_t mcu_row){
+    uint32_t row_start,row_end;
+    if(!this->rows_in_mcu_row(&this->output,mcu_row,&row_start,&row_end))
+        return;
+
+    for(uint8_t c=0;c<this->Nf;c++)
+        this->process_channel(c,mcu_row,mcu_row+1);
+
+    const uint32_t mcu_y0=mcu_row*8*this->max_component_vert_sample_factor;
+
+    if(this->row_callback){
+        // the output only holds the rows of the current mcu row
+        JpegOutputWindow band=this->output;
+        band.y0=mcu_y0+row_start;
+        band.y1=mcu_y0+row_end;
+
+        {
+            const TraceScope trace_scope{"convert",mcu_row,mcu_row+1};
+            this->kernels->convert_colorspace(this,mcu_row,mcu_row+1,&band);
+        }
+
+        this->row_callback(this->row_callback_user_data,band.data,band.y0-this->region_y0,band.y1-band.y0,band.stride);
+        return;
+    }
+
+    // a row of tiles is complete once its last pixel row has been processed (an mcu row may complete multiple rows of tiles)
+    const uint32_t num_tile_rows=ROUND_UP(this->region_y1-this->region_y0,this->tile_height)/this->tile_height;
+    while(this->num_tile_rows_done<num_tile_rows){
+        const uint32_t tile_y1=bitUtil::min(this->region_y0+(this->num_tile_rows_done+1)*this->tile_height,this->region_y1);
+        if(tile_y1>mcu_y0+row_end)
+            break;
+
+        this->emit_tile_row(this->num_tile_rows_done++);
+    }
+}
+
+struct JpegParser_emit_tiles_argset{
+    JpegParser* parser;
+
+    uint32_t tile_row;
+    uint32_t first_tile_col;
+    uint32_t tile_col_step;
+    uint8_t* tile_memory;
+};
+void* JpegParser_emit_tiles_pthread(struct JpegParser_emit_tiles_argset* args){
+    Trace_setThreadName("tile worker",args->first_tile_col);
+
+    args->parser->emit_tiles(args->tile_row,args->first_tile_col,args->tile_col_step,args->tile_memory);
+    return NULL;
+}
+
+/// convert the tiles of a row of tiles and hand them to the tile callback, distributing the tiles across threads
+void JpegParser::emit_tile_row(const uint32_t tile_row){
+    const uint32_t num_tile_cols=ROUND_UP(this->region_x1-this->region_x0,this->tile_width)/this->tile_width;
+    const uint32_t num_threads=bitUtil::min(this->num_threads,num_tile_cols);
+
+    if(num_threads<=1){
+        this->emit_tiles(tile_row,0,1,image_data->data);
+        return;
+    }
+
+    struct JpegParser_emit_tiles_argset* const thread_args=(struct JpegParser_emit_tiles_argset*)malloc(num_threads*sizeof(struct JpegParser_emit_tiles_argset));
+    pthread_t* const threads=(pthread_t*)malloc(num_threads*sizeof(pthread_t));
+    if(!thread_args || !threads){
+        free(thread_args);
+        free(threads);
+        parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+    }
+
+    uint32_t num_threads_started=0;
+    for(uint32_t i=0;i<num_threads;i++){
+        thread_args[i].parser=this;
+        thread_args[i].tile_row=tile_row;
+        thread_args[i].first_tile_col=i;
+        thread_args[i].tile_col_step=num_threads;
+        thread_args[i].tile_memory=image_data->data+i*this->tile_memory_size();
+
+        if(pthread_create(&threads[i], NULL, (pthread_callback)JpegParser_emit_tiles_pthread, &thread_args[i])!=0)
+            break;
+        num_threads_started++;
+    }
+
+    for(uint32_t i=0;i<num_threads_started;i++)
+        pthread_join(threads[i],NULL);
+
+    free(thread_args);
+    free(threads);
+
+    if(num_threads_started<num_threads)
+        parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to launch pthread");
+}
+/// convert every tile_col_step-th tile of a row of tiles into tile_memory, and hand it to the tile callback
+void JpegParser::emit_tiles(
+    const uint32_t tile_row,
+    const uint32_t first_tile_col,
+    const uint32_t tile_col_step,
+    uint8_t* const tile_memory
+)const{
+    const TraceScope trace_scope{"emit tiles",tile_row,tile_row+1};
+
+    const uint32_t mcu_height=8*this->max_component_vert_sample_factor;
+    const uint32_t num_tile_cols=ROUND_UP(this->region_x1-this->region_x0,this->tile_width)/this->tile_width;
+
+    const uint32_t tile_y0=this->region_y0+tile_row*this->tile_height;
+    const uint32_t tile_y1=bitUtil::min(tile_y0+this->tile_height,this->region_y1);
+
+    for(uint32_t tile_col=first_tile_col;tile_col<num_tile_cols;tile_col+=tile_col_step){
+        const uint32_t tile_x0=this->region_x0+tile_col*this->tile_width;
+        const uint32_t tile_x1=bitUtil::min(tile_x0+this->tile_width,this->region_x1);
+
+        const JpegOutputWindow tile=JpegOutputWindow::create(tile_x0,tile_y0,tile_x1,tile_y1,tile_memory);
+
+        this->kernels->convert_colorspace(this,tile_y0/mcu_height,(tile_y1-1)/mcu_height+1,&tile);
+
+        this->tile_callback(
+            this->tile_callback_user_data,
+            tile_memory,
+            tile_x0-this->region_x0,tile_y0-this->region_y0,
+            tile_x1-tile_x0,tile_y1-tile_y0,
+            tile.stride
+        );
+    }
 }
 
 ImageParseResult Image_read_jpeg(
     const char* const filepath,
-    ImageData* const  image_data
+    ImageData* const  image_data,
+    const ImageDecodeOptions* const options
 ){
-    JpegParser parser{filepath,image_data,JPEG_DECODE_NUM_THREADS>1};
+    const ImageDecodeOptions default_options{};
+    const ImageDecodeOptions* const decode_options=options?options:&default_options;
 
-    parser.parse_file();
+    const TraceScope trace_scope{"decode jpeg"};
 
-    // -- convert idct magnitude values to channel pixel values
-    // then upsample channels to final resolution
-    // and convert ycbcr to rgb
+    // stats are always collected in debug builds (and printed after the decode)
+    ImageDecodeStats stats{};
+    #ifdef DEBUG
+        ImageDecodeStageTimer timer{&stats,decode_options->perf_counters};
+    #else
+        ImageDecodeStageTimer timer{decode_options->stats?&stats:NULL,decode_options->perf_counters};
+    #endif
+
+    try{
+        JpegParser parser{filepath,image_data,decode_options,&stats,&timer};
 
-    image_data->interleaved=true;
-    image_data->pixel_format=PIXEL_FORMAT_Ru8Gu8Bu8Au8;
+        try{
+            if(!parser.kernels)
+                parse_fail(IMAGE_PARSE_RESULT_INVALID_OPTIONS,"invalid decode precision %d",(int)decode_options->precision);
 
-    parser.convert_colorspace();
+            parser.parse_file();
 
-    // -- crop to real size
+            // -- convert idct magnitude values to channel pixel values
+            // then upsample channels to final resolution
+            // and convert ycbcr to rgb
 
-    parser.correct_image_size();
+            image_data->interleaved=true;
+            image_data->pixel_format=PIXEL_FORMAT_Ru8Gu8Bu8Au8;
 
-    // -- parsing done. free all resources
+            // streamed mcu rows have already been converted and passed to the callback
+            if(!parser.streaming)
+                parser.convert_colorspace();
 
-    parser.destroy();
+            // -- parsing done. free all resources
+
+            parser.destroy();
+
+            if(parser.streaming){
+                // the output memory only held the pixels that have been passed to the callback
+                free(image_data->data);
+                image_data->data=NULL;
+            }else{
+                // images that cannot be streamed are passed to the callbacks (if any) once decoded completely
+                ImageData_emitToCallbacks(image_data,decode_options,8*parser.max_component_vert_sample_factor);
+                timer.lap(IMAGE_DECODE_STAGE_EMIT);
+            }
+        }catch(const ImageParseResult){
+            parser.abort();
+            throw;
+        }
+    }catch(const ImageParseResult result){
+        // free everything that has been handed to image_data so far
+        ImageData_destroy(image_data);
+        ImageData_initEmpty(image_data);
+        return result;
+    }
 
     #ifdef DEBUG
-        println(
-            "decoded %s: parsed %.3fms processed %.3fms converted %.3fms",
-            filepath,
-            parser.parse_end_time*1000,
-            parser.process_end_time*1000,
-            parser.convert_end_time*1000
-        );
+        println("decoded %s:",filepath);
+        ImageDecodeStats_print(&stats,stdout);
     #endif
 
+    if(decode_options->stats)
+        *decode_options->stats=stats;
+
     return IMAGE_PARSE_RESULT_OK;
 }
@@ -0,0 +1,82 @@
+// inverse dct kernel for fixed and float precision, included by jpeg_kernels.cpp (i.e. compiled once per instruction set and precision)
+
+/**
+ * @brief reverse quantization and dct of mcu rows [scan_id_start;scan_id_end) of component c
+ *
+ * the idct is the sum of the cosine masks of all non-zero coefficients, so only the non-zero coefficients are visited. they are
+ * found with vector compares over the widest vector of the instruction set, i.e. 8, 16 (avx2) or 32 (avx-512) coefficients at
+ * once. the accumulation of the masks is a plain loop, which the compiler vectorises to the width of the instruction set.
+ */
+[[gnu::hot,gnu::flatten,gnu::nonnull(1),KERNEL_TARGET]]
+static void JpegParser_process_channel(
+    const JpegParser* const  parser,
+    const uint8_t c,
+    const uint32_t scan_id_start,
+    const uint32_t scan_id_end
+){
+    OUT_EL component_quant_table[64];
+    for(int i=0;i<64;i++)
+        component_quant_table[i]=static_cast<OUT_EL>(parser->quant_tables[parser->image_components[c].quant_table_specifier][i]);
+
+    // -- reverse idct and quantization table application
+
+    const uint32_t num_blocks_in_scan=parser->image_components[c].num_blocks_in_scan;
+
+    // only blocks inside the mcus that intersect the decoded region are transformed
+    const uint32_t num_horz_blocks=parser->image_components[c].horz_samples/8;
+    const uint32_t region_block_col_start=parser->region_mcu_col_start*parser->image_components[c].horz_sample_factor;
+    const uint32_t region_block_col_end=parser->region_mcu_col_end*parser->image_components[c].horz_sample_factor;
+
+    const uint32_t region_scan_id_start=bitUtil::max(scan_id_start,parser->region_mcu_row_start);
+    const uint32_t region_scan_id_end=bitUtil::min(scan_id_end,parser->region_mcu_row_end);
+
+    const OUT_EL idct_m0_v0=IDCT_MASK_SET<OUT_EL>.idct_element_masks[0][0];
+
+    for (uint32_t scan_id=region_scan_id_start; scan_id<region_scan_id_end; scan_id++) {
+        const MCU_EL* const  scan_mem=parser->image_components[c].scan_memory[scan_id];
+        OUT_EL* const  scan_pixels=parser->component_scan_pixels<OUT_EL>(c,scan_id);
+
+        for (uint32_t block_id=0; block_id<num_blocks_in_scan; block_id++) {
+            const uint32_t block_col=block_id%num_horz_blocks;
+            if(block_col<region_block_col_start || block_col>=region_block_col_end)
+                continue;
+
+            const MCU_EL* const in_block=scan_mem+block_id*64;
+
+            OUT_EL out_block[64];
+
+            // use first idct mask index to initialize storage
+            {
+                const OUT_EL cosine_mask_strength=(OUT_EL)(in_block[0]*component_quant_table[0]);
+
+                const OUT_EL idct_m0_value=idct_m0_v0*cosine_mask_strength;
+
+                for(uint32_t pixel_index = 0;pixel_index<64;pixel_index++){
+                    out_block[pixel_index]=idct_m0_value;
+                }
+            }
+
+            // bit i is set iff coefficient i is non-zero, tested one vector at a time. the first coefficient is applied above.
+            uint64_t coefficients_nonzero=0;
+            for(uint32_t i=0;i<64;i+=vec::NUM_I16_WIDE_LANES)
+                coefficients_nonzero|=(uint64_t)vec::nonzero_lanes(vec::load_i16_wide(&in_block[i]))<<i;
+            coefficients_nonzero&=~(uint64_t)1;
+
+            while(coefficients_nonzero){
+                const uint32_t cosine_index=bitUtil::tzcnt_64(coefficients_nonzero);
+                coefficients_nonzero&=coefficients_nonzero-1;
+
+                const MCU_EL pre_quantized_mask_strength=in_block[cosine_index];
+
+                const OUT_EL cosine_mask_strength=pre_quantized_mask_strength*component_quant_table[cosine_index];
+                const OUT_EL* const idct_mask=IDCT_MASK_SET<OUT_EL>[cosine_index];
+
+                for(uint32_t pixel_index = 0;pixel_index<64;pixel_index++){
+                    out_block[pixel_index]+=static_cast<OUT_EL>(idct_mask[pixel_index]*cosine_mask_strength);
+                }
+            }
+
+            memcpy(scan_pixels+block_id*64,out_block,sizeof(OUT_EL)*64);
+        }
+    }
+}
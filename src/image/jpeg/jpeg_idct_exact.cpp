@@ -0,0 +1,178 @@
+// inverse dct kernel for exact precision, included by jpeg_kernels.cpp (i.e. compiled once per instruction set)
+//
+// this is the accurate integer idct of the jpeg reference implementation (separable, 13 fractional bits for the constants,
+// 2 additional bits between the passes), so that the output is bit-exact with other decoders that use it.
+
+namespace ExactIdct{
+    constexpr int32_t CONST_BITS=13;
+    constexpr int32_t PASS1_BITS=2;
+
+    /// round(x*2^CONST_BITS)
+    constexpr int32_t FIX_0_298631336=2446;
+    constexpr int32_t FIX_0_390180644=3196;
+    constexpr int32_t FIX_0_541196100=4433;
+    constexpr int32_t FIX_0_765366865=6270;
+    constexpr int32_t FIX_0_899976223=7373;
+    constexpr int32_t FIX_1_175875602=9633;
+    constexpr int32_t FIX_1_501321110=12299;
+    constexpr int32_t FIX_1_847759065=15137;
+    constexpr int32_t FIX_1_961570560=16069;
+    constexpr int32_t FIX_2_053119869=16819;
+    constexpr int32_t FIX_2_562915447=20995;
+    constexpr int32_t FIX_3_072711026=25172;
+
+    /// divide by 2^n, rounding to nearest
+    [[gnu::always_inline]]
+    static inline int32_t descale(const int32_t x,const int32_t n){
+        return (x+(1<<(n-1)))>>n;
+    }
+
+    /// one dimensional idct of in0..in7 (lowest to highest frequency).
+    /// out receives the 8 results scaled up by 2^CONST_BITS, i.e. each result still has to be descaled.
+    [[gnu::always_inline]]
+    static inline void idct_1d(
+        const int32_t in0,const int32_t in1,const int32_t in2,const int32_t in3,
+        const int32_t in4,const int32_t in5,const int32_t in6,const int32_t in7,
+        int32_t out[8]
+    ){
+        // even part
+        int32_t z2=in2;
+        int32_t z3=in6;
+
+        int32_t z1=(z2+z3)*FIX_0_541196100;
+        int32_t tmp2=z1+z3*(-FIX_1_847759065);
+        int32_t tmp3=z1+z2*FIX_0_765366865;
+
+        int32_t tmp0=(in0+in4)*(1<<CONST_BITS);
+        int32_t tmp1=(in0-in4)*(1<<CONST_BITS);
+
+        const int32_t tmp10=tmp0+tmp3;
+        const int32_t tmp13=tmp0-tmp3;
+        const int32_t tmp11=tmp1+tmp2;
+        const int32_t tmp12=tmp1-tmp2;
+
+        // odd part
+        tmp0=in7;
+        tmp1=in5;
+        tmp2=in3;
+        tmp3=in1;
+
+        z1=tmp0+tmp3;
+        z2=tmp1+tmp2;
+        z3=tmp0+tmp2;
+        int32_t z4=tmp1+tmp3;
+        const int32_t z5=(z3+z4)*FIX_1_175875602;
+
+        tmp0*=FIX_0_298631336;
+        tmp1*=FIX_2_053119869;
+        tmp2*=FIX_3_072711026;
+        tmp3*=FIX_1_501321110;
+        z1*=-FIX_0_899976223;
+        z2*=-FIX_2_562915447;
+        z3*=-FIX_1_961570560;
+        z4*=-FIX_0_390180644;
+
+        z3+=z5;
+        z4+=z5;
+
+        tmp0+=z1+z3;
+        tmp1+=z2+z4;
+        tmp2+=z2+z3;
+        tmp3+=z1+z4;
+
+        out[0]=tmp10+tmp3;
+        out[7]=tmp10-tmp3;
+        out[1]=tmp11+tmp2;
+        out[6]=tmp11-tmp2;
+        out[2]=tmp12+tmp1;
+        out[5]=tmp12-tmp1;
+        out[3]=tmp13+tmp0;
+        out[4]=tmp13-tmp0;
+    }
+
+    /// dequantize and transform one block of coefficients (in zigzag order) into 64 pixel values in [0;255]
+    [[gnu::always_inline]]
+    static inline void idct_block(
+        const MCU_EL* const in_block,
+        const int32_t quant_table[64],
+        OUT_EL out_block[64]
+    ){
+        // dequantized coefficients in natural (row-major) order
+        int32_t coefficients[64];
+        for(int i=0;i<64;i++)
+            coefficients[i]=(int32_t)in_block[ZIGZAG[i]]*quant_table[ZIGZAG[i]];
+
+        // pass 1: columns, results are scaled up by 2^PASS1_BITS
+        int32_t workspace[64];
+        for(int col=0;col<8;col++){
+            const int32_t* const in=coefficients+col;
+            int32_t* const ws=workspace+col;
+
+            if(in[8]==0 && in[16]==0 && in[24]==0 && in[32]==0 && in[40]==0 && in[48]==0 && in[56]==0){
+                const int32_t dc_value=in[0]*(1<<PASS1_BITS);
+                for(int row=0;row<8;row++)
+                    ws[row*8]=dc_value;
+                continue;
+            }
+
+            int32_t out[8];
+            idct_1d(in[0],in[8],in[16],in[24],in[32],in[40],in[48],in[56],out);
+            for(int row=0;row<8;row++)
+                ws[row*8]=descale(out[row],CONST_BITS-PASS1_BITS);
+        }
+
+        // pass 2: rows, remove the PASS1_BITS scaling and the factor 8 of the two passes, then level shift and clamp
+        for(int row=0;row<8;row++){
+            const int32_t* const ws=workspace+row*8;
+            OUT_EL* const out_row=out_block+row*8;
+
+            if(ws[1]==0 && ws[2]==0 && ws[3]==0 && ws[4]==0 && ws[5]==0 && ws[6]==0 && ws[7]==0){
+                const OUT_EL value=static_cast<OUT_EL>(bitUtil::clamp(0,255,descale(ws[0],PASS1_BITS+3)+128));
+                for(int col=0;col<8;col++)
+                    out_row[col]=value;
+                continue;
+            }
+
+            int32_t out[8];
+            idct_1d(ws[0],ws[1],ws[2],ws[3],ws[4],ws[5],ws[6],ws[7],out);
+            for(int col=0;col<8;col++)
+                out_row[col]=static_cast<OUT_EL>(bitUtil::clamp(0,255,descale(out[col],CONST_BITS+PASS1_BITS+3)+128));
+        }
+    }
+};
+
+/// reverse quantization and dct of mcu rows [scan_id_start;scan_id_end) of component c
+[[gnu::hot,gnu::flatten,gnu::nonnull(1),KERNEL_TARGET]]
+static void JpegParser_process_channel(
+    const JpegParser* const  parser,
+    const uint8_t c,
+    const uint32_t scan_id_start,
+    const uint32_t scan_id_end
+){
+    int32_t component_quant_table[64];
+    for(int i=0;i<64;i++)
+        component_quant_table[i]=parser->quant_tables[parser->image_components[c].quant_table_specifier][i];
+
+    const uint32_t num_blocks_in_scan=parser->image_components[c].num_blocks_in_scan;
+
+    // only blocks inside the mcus that intersect the decoded region are transformed
+    const uint32_t num_horz_blocks=parser->image_components[c].horz_samples/8;
+    const uint32_t region_block_col_start=parser->region_mcu_col_start*parser->image_components[c].horz_sample_factor;
+    const uint32_t region_block_col_end=parser->region_mcu_col_end*parser->image_components[c].horz_sample_factor;
+
+    const uint32_t region_scan_id_start=bitUtil::max(scan_id_start,parser->region_mcu_row_start);
+    const uint32_t region_scan_id_end=bitUtil::min(scan_id_end,parser->region_mcu_row_end);
+
+    for (uint32_t scan_id=region_scan_id_start; scan_id<region_scan_id_end; scan_id++) {
+        const MCU_EL* const  scan_mem=parser->image_components[c].scan_memory[scan_id];
+        OUT_EL* const  scan_pixels=parser->component_scan_pixels<OUT_EL>(c,scan_id);
+
+        for (uint32_t block_id=0; block_id<num_blocks_in_scan; block_id++) {
+            const uint32_t block_col=block_id%num_horz_blocks;
+            if(block_col<region_block_col_start || block_col>=region_block_col_end)
+                continue;
+
+            ExactIdct::idct_block(scan_mem+block_id*64,component_quant_table,scan_pixels+block_id*64);
+        }
+    }
+}
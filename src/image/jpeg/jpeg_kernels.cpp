@@ -0,0 +1,62 @@
+// the kernels of one instruction set, included by jpeg.cpp once per instruction set (inside a namespace per set).
+//
+// KERNEL_TARGET is the function attribute that enables the instruction set, KERNEL_ISA is the matching cpu::Isa,
+// and KERNEL_ISA_<name> is defined for conditional compilation of hand-written simd code.
+//
+// each precision has its own set of kernels, with its own idct output type OUT_EL. KERNEL_PRECISION_<name> is defined
+// while the kernels of a precision are compiled. the set is selected once per decode, i.e. there is no branching on the
+// precision inside the kernels.
+
+namespace fixed_precision{
+    typedef int16_t OUT_EL;
+
+    #define KERNEL_PRECISION_FIXED
+    #include "jpeg_idct.cpp"
+    #include "jpeg_ycbcr_to_rgb.cpp"
+    #undef KERNEL_PRECISION_FIXED
+};
+namespace float_precision{
+    typedef float OUT_EL;
+
+    #define KERNEL_PRECISION_FLOAT
+    #include "jpeg_idct.cpp"
+    #include "jpeg_ycbcr_to_rgb.cpp"
+    #undef KERNEL_PRECISION_FLOAT
+};
+namespace exact_precision{
+    /// pixel values in [0;255], like the output of the reference implementation
+    typedef int16_t OUT_EL;
+
+    #define KERNEL_PRECISION_EXACT
+    #include "jpeg_idct_exact.cpp"
+    #include "jpeg_ycbcr_to_rgb.cpp"
+    #undef KERNEL_PRECISION_EXACT
+};
+
+/// indexed by ImageDecodePrecision
+static const JpegKernels KERNELS[3]={
+    {
+        KERNEL_ISA,
+        IMAGE_DECODE_PRECISION_FIXED,
+        sizeof(fixed_precision::OUT_EL),
+
+        fixed_precision::JpegParser_process_channel,
+        fixed_precision::JpegParser_convert_colorspace,
+    },
+    {
+        KERNEL_ISA,
+        IMAGE_DECODE_PRECISION_FLOAT,
+        sizeof(float_precision::OUT_EL),
+
+        float_precision::JpegParser_process_channel,
+        float_precision::JpegParser_convert_colorspace,
+    },
+    {
+        KERNEL_ISA,
+        IMAGE_DECODE_PRECISION_EXACT,
+        sizeof(exact_precision::OUT_EL),
+
+        exact_precision::JpegParser_process_channel,
+        exact_precision::JpegParser_convert_colorspace,
+    },
+};
@@ -1,12 +1,16 @@
-#include <cstdint>
-#include <x86intrin.h>
+// x64 colour conversion kernels, included by jpeg_ycbcr_to_rgb.cpp for the avx2 and avx-512 instruction sets (i.e. compiled once per
+// instruction set and precision).
+//
+// these use the full 256 bit registers, which the portable 8 pixel kernels do not.
 
-#ifdef USE_FLOAT_PRECISION
+#if defined(KERNEL_PRECISION_FIXED)
 
-[[gnu::hot,gnu::flatten,gnu::nonnull(1)]]
-void scan_ycbcr_to_rgb_sse_float(
+/// same as scan_ycbcr_to_rgb_vec, but converts 16 pixels per iteration
+[[gnu::hot,gnu::flatten,gnu::nonnull(1,3),maybe_unused,KERNEL_TARGET]]
+static inline void scan_ycbcr_to_rgb_avx2_fixed(
     const JpegParser* const  parser,
-    const uint32_t mcu_row
+    const uint32_t mcu_row,
+    const JpegOutputWindow* const  window
 ){
     const ImageComponent image_components[3]={
         parser->image_components[0],
@@ -14,152 +18,85 @@ void scan_ycbcr_to_rgb_sse_float(
         parser->image_components[2]
     };
 
-    uint32_t pixels_in_scan=image_components[0].horz_samples*8*image_components[0].vert_sample_factor;
-    uint32_t scan_offset=mcu_row*pixels_in_scan;
-
-    uint8_t* const  image_data_data=parser->image_data->data+scan_offset*4;
-
-    const uint32_t rescale_factor[3]={
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[0].horz_sample_factor*image_components[0].vert_sample_factor),
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[1].horz_sample_factor*image_components[1].vert_sample_factor),
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[2].horz_sample_factor*image_components[2].vert_sample_factor)
-    };
-
-    const OUT_EL* const  y[[gnu::aligned(16)]]=image_components[0].out_block_downsampled+scan_offset/rescale_factor[0];
-    const OUT_EL* const  cr[[gnu::aligned(16)]]=image_components[1].out_block_downsampled+scan_offset/rescale_factor[1];
-    const OUT_EL* const  cb[[gnu::aligned(16)]]=image_components[2].out_block_downsampled+scan_offset/rescale_factor[2];
-
-    for (uint32_t i=0; i<pixels_in_scan; i+=4) {
-        // -- re-order from block-orientation to final image orientation
-
-        __m128 y_simd=_mm_loadu_ps(&y[image_components[0].conversion_indices[i]]);
-        __m128 cr_simd=_mm_loadu_ps(&cr[image_components[1].conversion_indices[i]]);
-        cr_simd=_mm_shuffle_epi32(cr_simd,(1<<4)+(1<<6));
-        __m128 cb_simd=_mm_loadu_ps(&cb[image_components[2].conversion_indices[i]]);
-        cb_simd=_mm_shuffle_epi32(cb_simd,(1<<4)+(1<<6));
-
-        // -- convert ycbcr to rgb
-
-        __m128 r_simd=y_simd+1.402f*cr_simd;
-        __m128 b_simd=y_simd+1.772f*cb_simd;
-        __m128 g_simd=y_simd-(0.343f * cb_simd + 0.718f * cr_simd );
-
-        const __m128 v_simd=_mm_set1_ps(128.0);
-
-        r_simd+=v_simd;
-        g_simd+=v_simd;
-        b_simd+=v_simd;
-
-        // conversion from i32->i16->u8 is clamping, i.e. clamp to [0;255] is implicit
-
-        const __m128i r_s32=_mm_cvtps_epi32(r_simd);
-        const __m128i g_s32=_mm_cvtps_epi32(g_simd);
-        const __m128i b_s32=_mm_cvtps_epi32(b_simd);
-        const __m128i a_s32=_mm_set1_epi32(255);
-
-        const __m128i rg_u16=_mm_packs_epi32(r_s32,g_s32);
-        const __m128i ba_u16=_mm_packs_epi32(b_s32,a_s32);
-
-        __m128i rgba_u8=_mm_packus_epi16(rg_u16,ba_u16);
-
-        // -- deinterlace and convert to uint8
-
-        static const uint8_t indices [[gnu::aligned(16)]] [16] = {
-            0, 4, 8, 12, 
-            1, 5, 9, 13, 
-            2, 6, 10, 14, 
-            3, 7, 11, 15
-        };
-        const __m128i indices_vector = _mm_load_ps((float*)indices);
-
-        rgba_u8=_mm_shuffle_epi8(rgba_u8, indices_vector);
-
-        _mm_storeu_si128((__m128i*)(image_data_data+i*4),rgba_u8);
-    }
-}
-
-#else
-
-[[gnu::hot,gnu::flatten,gnu::nonnull(1),maybe_unused]]
-static inline void scan_ycbcr_to_rgb_sse_fixed(
-    const JpegParser* const  parser,
-    const uint32_t mcu_row
-){
-    const ImageComponent image_components[3]={
-        parser->image_components[0],
-        parser->image_components[1],
-        parser->image_components[2]
-    };
-
-    uint32_t pixels_in_scan=image_components[0].horz_samples*8*image_components[0].vert_sample_factor;
-    uint32_t scan_offset=mcu_row*pixels_in_scan;
-
-    uint8_t* const image_data_data=parser->image_data->data+scan_offset*4;
-
-    const uint32_t rescale_factor[3]={
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[0].horz_sample_factor*image_components[0].vert_sample_factor),
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[1].horz_sample_factor*image_components[1].vert_sample_factor),
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[2].horz_sample_factor*image_components[2].vert_sample_factor)
-    };
-
-    const OUT_EL* const y[[gnu::aligned(16)]]=image_components[0].out_block_downsampled+scan_offset/rescale_factor[0];
-    const OUT_EL* const cr[[gnu::aligned(16)]]=image_components[1].out_block_downsampled+scan_offset/rescale_factor[1];
-    const OUT_EL* const cb[[gnu::aligned(16)]]=image_components[2].out_block_downsampled+scan_offset/rescale_factor[2];
-
-    for (uint32_t i=0; i<pixels_in_scan; i+=8) {
-        // -- re-order from block-orientation to final image orientation
-
-        const int16_t* y_ptr = &y[image_components[0].conversion_indices[i]];
-        const int16_t* cr_ptr = &cr[image_components[1].conversion_indices[i]];
-        const int16_t* cb_ptr = &cb[image_components[2].conversion_indices[i]];
-
-        // Load 8 Y, Cr, and Cb values
-        __m128i y_values = _mm_loadu_si128((__m128i*)y_ptr);
-        __m128i cr_values = _mm_loadu_si128((__m128i*)cr_ptr);
-        cr_values=_mm_unpacklo_epi16(cr_values,cr_values);
-        __m128i cb_values = _mm_loadu_si128((__m128i*)cb_ptr);
-        cb_values=_mm_unpacklo_epi16(cb_values,cb_values);
-
-        // Shift and subtract constants
-        y_values = _mm_srai_epi16(y_values, PRECISION);
-        cr_values = _mm_srai_epi16(cr_values, PRECISION);
-        cb_values = _mm_srai_epi16(cb_values, PRECISION);
-
-        // Constants for RGB conversion
-        const __m128i const_45 = _mm_set1_epi16(45);
-        const __m128i const_113 = _mm_set1_epi16(113);
-        const __m128i const_11 = _mm_set1_epi16(11);
-        const __m128i const_23 = _mm_set1_epi16(23);
-
-        // Calculate R, G, and B values
-        __m128i R = _mm_add_epi16(y_values, _mm_srai_epi16(_mm_mullo_epi16(const_45, cr_values), 5));
-        __m128i B = _mm_add_epi16(y_values, _mm_srai_epi16(_mm_mullo_epi16(const_113, cb_values), 6));
-        __m128i G = _mm_sub_epi16(y_values, _mm_srai_epi16(_mm_add_epi16(_mm_mullo_epi16(const_11, cb_values), _mm_mullo_epi16(const_23, cr_values)), 5));
-        __m128i A = _mm_set1_epi16(UINT8_MAX);
-
-        // Add offset and store as uint8_t values
-        const __m128i offset = _mm_set1_epi16(128);
-        R=_mm_add_epi16(R, offset);
-        G=_mm_add_epi16(G, offset);
-        B=_mm_add_epi16(B, offset);
-
-        const __m128i r_u8 = _mm_packus_epi16(R,R);
-        const __m128i g_u8 = _mm_packus_epi16(G,G);
-        const __m128i b_u8 = _mm_packus_epi16(B,B);
-        const __m128i a_u8 = _mm_packus_epi16(A,A);
-
-        const __m128i rb_u8=_mm_unpacklo_epi8(r_u8,b_u8);
-        const __m128i ga_u8=_mm_unpacklo_epi8(g_u8,a_u8);
-
-        const __m128i o1=_mm_unpacklo_epi8(rb_u8,ga_u8);
-        const __m128i o2=_mm_unpackhi_epi8(rb_u8,ga_u8);
-
-        // Store as uint8_t values
-        uint8_t* output_ptr = &image_data_data[i * 4];
-        _mm_storeu_si128((__m128i*)output_ptr, o1);
-        output_ptr = &image_data_data[(i+4) * 4];
-        _mm_storeu_si128((__m128i*)output_ptr, o2);
-
+    const OUT_EL* const y[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(0,mcu_row);
+    const OUT_EL* const cb[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(1,mcu_row);
+    const OUT_EL* const cr[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(2,mcu_row);
+
+    uint32_t row_start,row_end;
+    if(!parser->rows_in_mcu_row(window,mcu_row,&row_start,&row_end))
+        return;
+
+    const uint32_t first_row_in_mcu_row=mcu_row*8*parser->max_component_vert_sample_factor;
+
+    for(uint32_t row=row_start;row<row_end;row++){
+        const uint32_t* const y_indices=image_components[0].conversion_indices+row*parser->X;
+        const uint32_t* const cb_indices=image_components[1].conversion_indices+row*parser->X;
+        const uint32_t* const cr_indices=image_components[2].conversion_indices+row*parser->X;
+
+        uint8_t* const out_row=window->row(first_row_in_mcu_row+row);
+
+        // the image width is a multiple of 16 (two luma blocks, one chroma block), so the 16 pixels span two luma blocks and one row of a chroma block
+        for (uint32_t x=window->x0&~15u; x<window->x1; x+=16) {
+            // -- re-order from block-orientation to final image orientation
+
+            const __m128i y_lo=_mm_loadu_si128((const __m128i*)&y[y_indices[x]]);
+            const __m128i y_hi=_mm_loadu_si128((const __m128i*)&y[y_indices[x+8]]);
+            const __m128i cr_8=_mm_loadu_si128((const __m128i*)&cr[cr_indices[x]]);
+            const __m128i cb_8=_mm_loadu_si128((const __m128i*)&cb[cb_indices[x]]);
+
+            __m256i y_values=_mm256_set_m128i(y_hi,y_lo);
+            __m256i cr_values=_mm256_set_m128i(_mm_unpackhi_epi16(cr_8,cr_8),_mm_unpacklo_epi16(cr_8,cr_8));
+            __m256i cb_values=_mm256_set_m128i(_mm_unpackhi_epi16(cb_8,cb_8),_mm_unpacklo_epi16(cb_8,cb_8));
+
+            y_values = _mm256_srai_epi16(y_values, PRECISION);
+            cr_values = _mm256_srai_epi16(cr_values, PRECISION);
+            cb_values = _mm256_srai_epi16(cb_values, PRECISION);
+
+            // -- convert ycbcr to rgb (same constants as the portable version)
+
+            const __m256i const_45 = _mm256_set1_epi16(45);
+            const __m256i const_113 = _mm256_set1_epi16(113);
+            const __m256i const_11 = _mm256_set1_epi16(11);
+            const __m256i const_23 = _mm256_set1_epi16(23);
+
+            __m256i R = _mm256_add_epi16(y_values, _mm256_srai_epi16(_mm256_mullo_epi16(const_45, cr_values), 5));
+            __m256i B = _mm256_add_epi16(y_values, _mm256_srai_epi16(_mm256_mullo_epi16(const_113, cb_values), 6));
+            __m256i G = _mm256_sub_epi16(y_values, _mm256_srai_epi16(_mm256_add_epi16(_mm256_mullo_epi16(const_11, cb_values), _mm256_mullo_epi16(const_23, cr_values)), 5));
+            const __m256i A = _mm256_set1_epi16(UINT8_MAX);
+
+            const __m256i offset = _mm256_set1_epi16(128);
+            R=_mm256_add_epi16(R, offset);
+            G=_mm256_add_epi16(G, offset);
+            B=_mm256_add_epi16(B, offset);
+
+            // -- deinterlace (in b,g,r,a order) and convert to uint8
+            // packing and unpacking work within the 128 bit lanes, i.e. on pixels 0-7 and 8-15 separately
+
+            const __m256i bg_u8=_mm256_packus_epi16(B,G);
+            const __m256i ra_u8=_mm256_packus_epi16(R,A);
+
+            const __m256i br_u8=_mm256_unpacklo_epi8(bg_u8,ra_u8);
+            const __m256i ga_u8=_mm256_unpackhi_epi8(bg_u8,ra_u8);
+
+            // pixels 0-3 and 8-11, and pixels 4-7 and 12-15
+            const __m256i bgra_lo=_mm256_unpacklo_epi8(br_u8,ga_u8);
+            const __m256i bgra_hi=_mm256_unpackhi_epi8(br_u8,ga_u8);
+
+            const __m256i o1=_mm256_permute2x128_si256(bgra_lo,bgra_hi,0x20);
+            const __m256i o2=_mm256_permute2x128_si256(bgra_lo,bgra_hi,0x31);
+
+            // pixels at the region border are written individually
+            if(window->fits_row(x,16)){
+                uint8_t* const output_ptr = out_row+(x-window->x0)*4;
+                _mm256_storeu_si256((__m256i*)output_ptr, o1);
+                _mm256_storeu_si256((__m256i*)(output_ptr+32), o2);
+            }else{
+                uint8_t pixels[64];
+                _mm256_storeu_si256((__m256i*)pixels, o1);
+                _mm256_storeu_si256((__m256i*)(pixels+32), o2);
+                window->write_clipped_pixels(out_row,x,16,pixels);
+            }
+        }
     }
 }
 
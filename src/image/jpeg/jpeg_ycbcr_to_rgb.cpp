@@ -1,13 +1,25 @@
-#ifdef  VK_USE_PLATFORM_XCB_KHR
+// colour conversion kernels, included by jpeg_kernels.cpp (i.e. compiled once per instruction set and precision)
+//
+// component 1 holds the blue (cb), component 2 the red chroma difference (cr). all kernels of all precisions write the pixels
+// in b,g,r,a order (see PixelFormat).
+
+#if defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
     #include "jpeg_x64.cpp"
-#elif defined( VK_USE_PLATFORM_METAL_EXT)
-    #include "jpeg_arm64.cpp"
 #endif
 
-[[gnu::hot,gnu::flatten,gnu::nonnull(1)]]
-static inline void scan_ycbcr_to_rgb(
+#ifndef KERNEL_PRECISION_EXACT
+
+/**
+ * @brief convert the pixels of one mcu row of an image with 2x1 chroma subsampling, 8 pixels at a time
+ *
+ * written once with the portable vector operations (vec), i.e. this is the same kernel on every instruction set.
+ * the 8 pixels are one row of a luma block, and half a row of a chroma block.
+ */
+[[gnu::hot,gnu::flatten,gnu::nonnull(1,3),maybe_unused,KERNEL_TARGET]]
+static inline void scan_ycbcr_to_rgb_vec(
     const JpegParser* const  parser,
-    const uint32_t mcu_row
+    const uint32_t mcu_row,
+    const JpegOutputWindow* const  window
 ){
     const ImageComponent image_components[3]={
         parser->image_components[0],
@@ -15,91 +27,216 @@ static inline void scan_ycbcr_to_rgb(
         parser->image_components[2]
     };
 
-    uint32_t pixels_in_scan=image_components[0].horz_samples*8*image_components[0].vert_sample_factor;
-    uint32_t scan_offset=mcu_row*pixels_in_scan;
+    const OUT_EL* const y[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(0,mcu_row);
+    const OUT_EL* const cb[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(1,mcu_row);
+    const OUT_EL* const cr[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(2,mcu_row);
+
+    uint32_t row_start,row_end;
+    if(!parser->rows_in_mcu_row(window,mcu_row,&row_start,&row_end))
+        return;
+
+    const uint32_t first_row_in_mcu_row=mcu_row*8*parser->max_component_vert_sample_factor;
+
+    for(uint32_t row=row_start;row<row_end;row++){
+        const uint32_t* const y_indices=image_components[0].conversion_indices+row*parser->X;
+        const uint32_t* const cb_indices=image_components[1].conversion_indices+row*parser->X;
+        const uint32_t* const cr_indices=image_components[2].conversion_indices+row*parser->X;
+
+        uint8_t* const out_row=window->row(first_row_in_mcu_row+row);
+
+        for (uint32_t x=window->x0&~7u; x<window->x1; x+=8) {
+            #if defined(KERNEL_PRECISION_FIXED)
+                // -- re-order from block-orientation to final image orientation
+
+                const vec::i16x8 cr_8=vec::load_i16x8(&cr[cr_indices[x]]);
+                const vec::i16x8 cb_8=vec::load_i16x8(&cb[cb_indices[x]]);
+
+                const vec::i16x8 y_values=vec::shift_right<PRECISION>(vec::load_i16x8(&y[y_indices[x]]));
+                const vec::i16x8 cr_values=vec::shift_right<PRECISION>(vec::zip_lo(cr_8,cr_8));
+                const vec::i16x8 cb_values=vec::shift_right<PRECISION>(vec::zip_lo(cb_8,cb_8));
+
+                // -- convert ycbcr to rgb
+
+                const vec::i16x8 offset=vec::set1_i16x8(128);
+
+                const vec::i16x8 R=vec::add(vec::add(y_values,vec::shift_right<5>(vec::mul(vec::set1_i16x8(45),cr_values))),offset);
+                const vec::i16x8 B=vec::add(vec::add(y_values,vec::shift_right<6>(vec::mul(vec::set1_i16x8(113),cb_values))),offset);
+                const vec::i16x8 G=vec::add(vec::sub(y_values,vec::shift_right<5>(vec::add(
+                    vec::mul(vec::set1_i16x8(11),cb_values),
+                    vec::mul(vec::set1_i16x8(23),cr_values)
+                ))),offset);
+            #elif defined(KERNEL_PRECISION_FLOAT)
+                // -- re-order from block-orientation to final image orientation
+                // (float vectors hold 4 pixels, so the 8 pixels are converted in two halves)
+
+                const vec::f32x4 cr_4=vec::load_f32x4(&cr[cr_indices[x]]);
+                const vec::f32x4 cb_4=vec::load_f32x4(&cb[cb_indices[x]]);
 
-    uint8_t* const  image_data_data=parser->image_data->data+scan_offset*4;
+                vec::i32x4 r_s32[2],g_s32[2],b_s32[2];
+                for(int half=0;half<2;half++){
+                    const vec::f32x4 y_values=vec::load_f32x4(&y[y_indices[x+(uint32_t)half*4]]);
+                    const vec::f32x4 cr_values=half==0?vec::zip_lo(cr_4,cr_4):vec::zip_hi(cr_4,cr_4);
+                    const vec::f32x4 cb_values=half==0?vec::zip_lo(cb_4,cb_4):vec::zip_hi(cb_4,cb_4);
+
+                    // -- convert ycbcr to rgb
+
+                    const vec::f32x4 offset=vec::set1_f32x4(128.0f);
+
+                    const vec::f32x4 r_f32=vec::add(y_values,vec::mul(vec::set1_f32x4(1.402f),cr_values));
+                    const vec::f32x4 b_f32=vec::add(y_values,vec::mul(vec::set1_f32x4(1.772f),cb_values));
+                    const vec::f32x4 g_f32=vec::sub(y_values,vec::add(
+                        vec::mul(vec::set1_f32x4(0.343f),cb_values),
+                        vec::mul(vec::set1_f32x4(0.718f),cr_values)
+                    ));
+
+                    r_s32[half]=vec::round_to_i32(vec::add(r_f32,offset));
+                    g_s32[half]=vec::round_to_i32(vec::add(g_f32,offset));
+                    b_s32[half]=vec::round_to_i32(vec::add(b_f32,offset));
+                }
+
+                const vec::i16x8 R=vec::narrow_saturate(r_s32[0],r_s32[1]);
+                const vec::i16x8 G=vec::narrow_saturate(g_s32[0],g_s32[1]);
+                const vec::i16x8 B=vec::narrow_saturate(b_s32[0],b_s32[1]);
+            #endif
+
+            // -- deinterlace and convert to uint8 (clamping to [0;255] is part of the conversion)
+
+            const vec::i16x8 A=vec::set1_i16x8(UINT8_MAX);
+
+            // pixels at the region border are written individually
+            if(window->fits_row(x,8)){
+                vec::store_interleaved_u8(out_row+(x-window->x0)*4,B,G,R,A);
+            }else{
+                uint8_t pixels[32];
+                vec::store_interleaved_u8(pixels,B,G,R,A);
+                window->write_clipped_pixels(out_row,x,8,pixels);
+            }
+        }
+    }
+}
+
+#endif
 
-    const uint32_t rescale_factor[3]={
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[0].horz_sample_factor*image_components[0].vert_sample_factor),
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[1].horz_sample_factor*image_components[1].vert_sample_factor),
-        (uint32_t)parser->max_component_horz_sample_factor*parser->max_component_vert_sample_factor/(image_components[2].horz_sample_factor*image_components[2].vert_sample_factor)
+[[gnu::hot,gnu::flatten,gnu::nonnull(1,3),KERNEL_TARGET]]
+static inline void scan_ycbcr_to_rgb(
+    const JpegParser* const  parser,
+    const uint32_t mcu_row,
+    const JpegOutputWindow* const  window
+){
+    const ImageComponent image_components[3]={
+        parser->image_components[0],
+        parser->image_components[1],
+        parser->image_components[2]
     };
 
-    const OUT_EL* const  y[[gnu::aligned(16)]]=image_components[0].out_block_downsampled+scan_offset/rescale_factor[0];
-    const OUT_EL* const  cr[[gnu::aligned(16)]]=image_components[1].out_block_downsampled+scan_offset/rescale_factor[1];
-    const OUT_EL* const  cb[[gnu::aligned(16)]]=image_components[2].out_block_downsampled+scan_offset/rescale_factor[2];
+    const OUT_EL* const  y[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(0,mcu_row);
+    const OUT_EL* const  cb[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(1,mcu_row);
+    const OUT_EL* const  cr[[gnu::aligned(16)]]=parser->component_scan_pixels<OUT_EL>(2,mcu_row);
+
+    uint32_t row_start,row_end;
+    if(!parser->rows_in_mcu_row(window,mcu_row,&row_start,&row_end))
+        return;
+
+    const uint32_t first_row_in_mcu_row=mcu_row*8*parser->max_component_vert_sample_factor;
+
+    for(uint32_t row=row_start;row<row_end;row++){
+        uint8_t* const out_row=window->row(first_row_in_mcu_row+row);
+
+        for (uint32_t x=window->x0; x<window->x1; x++) {
+            const uint32_t i=row*parser->X+x;
+            uint8_t* const image_data_data=out_row+(x-window->x0)*4;
+
+            #if defined(KERNEL_PRECISION_FLOAT)
+                // -- re-order from block-orientation to final image orientation
+
+                const OUT_EL Y=y[image_components[0].conversion_indices[i]];
+                const OUT_EL Cb=cb[image_components[1].conversion_indices[i]];
+                const OUT_EL Cr=cr[image_components[2].conversion_indices[i]];
 
-    for (uint32_t i=0; i<pixels_in_scan; i++) {
-        #ifdef USE_FLOAT_PRECISION
-            // -- re-order from block-orientation to final image orientation
+                // -- convert ycbcr to rgb
 
-            const OUT_EL Y=y[image_components[0].conversion_indices[i]];
-            const OUT_EL Cr=cr[image_components[1].conversion_indices[i]];
-            const OUT_EL Cb=cb[image_components[2].conversion_indices[i]];
+                const OUT_EL R = Y +                1.402f * Cr;
+                const OUT_EL B = Y +  1.772f * Cb;
+                const OUT_EL G = Y - (0.343f * Cb + 0.718f * Cr );
 
-            // -- convert ycbcr to rgb
+                // -- convert to uint8
 
-            const OUT_EL R = Y +                1.402f * Cr;
-            const OUT_EL B = Y +  1.772f * Cb;
-            const OUT_EL G = Y - (0.343f * Cb + 0.718f * Cr );
+                const uint8_t r = static_cast<uint8_t>(bitUtil::clamp(0.0f,255.0f,R+128.0f));
+                const uint8_t g = static_cast<uint8_t>(bitUtil::clamp(0.0f,255.0f,G+128.0f));
+                const uint8_t b = static_cast<uint8_t>(bitUtil::clamp(0.0f,255.0f,B+128.0f));
+            #elif defined(KERNEL_PRECISION_FIXED)
+                // -- re-order from block-orientation to final image orientation
 
-            // -- deinterlace and convert to uint8
+                const OUT_EL Y= static_cast<OUT_EL>( y [image_components[0].conversion_indices[i]]     >>PRECISION);
+                const OUT_EL Cb=static_cast<OUT_EL>((cb[image_components[1].conversion_indices[i]]-128)>>PRECISION);
+                const OUT_EL Cr=static_cast<OUT_EL>((cr[image_components[2].conversion_indices[i]]-128)>>PRECISION);
 
-            image_data_data[i* 4 + 0] = static_cast<uint8_t>(bitUtil::clamp(0.0f,255.0f,R+128.0f));
-            image_data_data[i* 4 + 1] = static_cast<uint8_t>(bitUtil::clamp(0.0f,255.0f,G+128.0f));
-            image_data_data[i* 4 + 2] = static_cast<uint8_t>(bitUtil::clamp(0.0f,255.0f,B+128.0f));
-            image_data_data[i* 4 + 3] = UINT8_MAX;
-        #else
-            // -- re-order from block-orientation to final image orientation
+                // -- convert ycbcr to rgb
 
-            const OUT_EL Y= static_cast<OUT_EL>( y [image_components[0].conversion_indices[i]]     >>PRECISION);
-            const OUT_EL Cr=static_cast<OUT_EL>((cr[image_components[1].conversion_indices[i]]-128)>>PRECISION);
-            const OUT_EL Cb=static_cast<OUT_EL>((cb[image_components[2].conversion_indices[i]]-128)>>PRECISION);
+                const OUT_EL R = static_cast<OUT_EL>(Y + ((            45 * Cr ) >> 5 ));
+                const OUT_EL B = static_cast<OUT_EL>(Y + (( 113 * Cb           ) >> 6 ));
+                const OUT_EL G = static_cast<OUT_EL>(Y - ((  11 * Cb + 23 * Cr ) >> 5 ));
 
-            // -- convert ycbcr to rgb
+                // -- convert to uint8
 
-            const OUT_EL R = static_cast<OUT_EL>(Y + ((            45 * Cr ) >> 5 ));
-            const OUT_EL B = static_cast<OUT_EL>(Y + (( 113 * Cb           ) >> 6 ));
-            const OUT_EL G = static_cast<OUT_EL>(Y - ((  11 * Cb + 23 * Cr ) >> 5 ));
+                const uint8_t r = static_cast<uint8_t>(bitUtil::clamp(0,255,R+128));
+                const uint8_t g = static_cast<uint8_t>(bitUtil::clamp(0,255,G+128));
+                const uint8_t b = static_cast<uint8_t>(bitUtil::clamp(0,255,B+128));
+            #elif defined(KERNEL_PRECISION_EXACT)
+                // -- re-order from block-orientation to final image orientation
+                // (the idct output is already level shifted)
 
-            // -- deinterlace and convert to uint8
+                const int32_t Y=y[image_components[0].conversion_indices[i]];
+                const int32_t Cb=cb[image_components[1].conversion_indices[i]]-128;
+                const int32_t Cr=cr[image_components[2].conversion_indices[i]]-128;
 
-            image_data_data[i* 4 + 0] = static_cast<uint8_t>(bitUtil::clamp(0,255,R+128));
-            image_data_data[i* 4 + 1] = static_cast<uint8_t>(bitUtil::clamp(0,255,G+128));
-            image_data_data[i* 4 + 2] = static_cast<uint8_t>(bitUtil::clamp(0,255,B+128));
-            image_data_data[i* 4 + 3] = UINT8_MAX;
-        #endif
+                // -- convert ycbcr to rgb, with the 16 bit fixed-point constants (and rounding) of the reference implementation
+
+                static const int32_t ONE_HALF=1<<15;
+                const int32_t R = Y + ((  91881 * Cr + ONE_HALF ) >> 16 );
+                const int32_t B = Y + (( 116130 * Cb + ONE_HALF ) >> 16 );
+                const int32_t G = Y + (( -22554 * Cb - 46802 * Cr + ONE_HALF ) >> 16 );
+
+                // -- convert to uint8
+
+                const uint8_t r = static_cast<uint8_t>(bitUtil::clamp(0,255,R));
+                const uint8_t g = static_cast<uint8_t>(bitUtil::clamp(0,255,G));
+                const uint8_t b = static_cast<uint8_t>(bitUtil::clamp(0,255,B));
+            #endif
+
+            // -- deinterlace
+
+            image_data_data[0] = b;
+            image_data_data[1] = g;
+            image_data_data[2] = r;
+            image_data_data[3] = UINT8_MAX;
+        }
     }
 }
 
-[[gnu::flatten,gnu::hot,gnu::nonnull(1)]]
+[[gnu::flatten,gnu::hot,gnu::nonnull(1,4),KERNEL_TARGET]]
 static void JpegParser_convert_colorspace(
-    JpegParser* const  parser,
+    const JpegParser* const  parser,
     const uint32_t scan_index_start,
-    const uint32_t scan_index_end
+    const uint32_t scan_index_end,
+    const JpegOutputWindow* const  window
 ){
-    if (parser->component_label==0x221111){
-        for (uint32_t s=scan_index_start; s<scan_index_end; s++){
-            #ifdef  USE_FLOAT_PRECISION
-                #ifdef VK_USE_PLATFORM_METAL_EXT
-                    scan_ycbcr_to_rgb_neon_float(parser,s);
-                #elif defined( VK_USE_PLATFORM_XCB_KHR)
-                    scan_ycbcr_to_rgb_sse_float(parser,s);
-                #endif
-            #else
-                #ifdef VK_USE_PLATFORM_METAL_EXT
-                    scan_ycbcr_to_rgb_neon_fixed(parser,s);
-                #elif defined( VK_USE_PLATFORM_XCB_KHR)
-                    scan_ycbcr_to_rgb_sse_fixed(parser,s);
+    // there are no simd kernels for exact precision
+    #ifndef KERNEL_PRECISION_EXACT
+        if (parser->component_label==0x221111){
+            for (uint32_t s=scan_index_start; s<scan_index_end; s++){
+                #if defined(KERNEL_PRECISION_FIXED) && (defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512))
+                    scan_ycbcr_to_rgb_avx2_fixed(parser,s,window);
+                #else
+                    scan_ycbcr_to_rgb_vec(parser,s,window);
                 #endif
-            #endif
-        }
+            }
 
-        return;
-    }
+            return;
+        }
+    #endif
 
     for (uint32_t s=scan_index_start; s<scan_index_end; s++) {
-        scan_ycbcr_to_rgb(parser, s);
+        scan_ycbcr_to_rgb(parser,s,window);
     }
 }
@@ -5,22 +5,31 @@
 #include <string>
 #include <cmath>
 #include <thread>
+#include <atomic>
 #include <stdatomic.h>
 
 #include <time.h>
 
-#include "app/app.hpp"
 #include "app/bitstream.hpp"
 #include "app/error.hpp"
-#include "app/huffman.hpp"
 #include "app/image.hpp"
+#include "app/cpu.hpp"
+#include "app/simd.hpp"
+#include "app/trace.hpp"
 
-typedef huffman::CodingTable<uint16_t, bitStream::BITSTREAM_DIRECTION_RIGHT_TO_LEFT, false> DistanceTable;
-typedef huffman::CodingTable<uint16_t, bitStream::BITSTREAM_DIRECTION_RIGHT_TO_LEFT, false> LiteralTable;
-typedef huffman::CodingTable<uint8_t, bitStream::BITSTREAM_DIRECTION_RIGHT_TO_LEFT, false> CodeLengthTable;
-typedef DistanceTable::BitStream_ BitStream;
+typedef bitStream::BitStream<bitStream::BITSTREAM_DIRECTION_RIGHT_TO_LEFT,false> BitStream;
 
 static const uint32_t PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE=32768;
+/// minimum size of the window the image data is inflated into, see Image_read_png. large enough that the unfilter kernels
+/// run on many scanlines per round, small enough to stay in the L2 cache.
+static const uint32_t PNG_INFLATE_WINDOW_MIN_SIZE=256*1024;
+/// minimum size of the inflate window when inflating and unfiltering run on separate threads. the window is only moved once
+/// the unfilter thread has caught up, i.e. a larger window lets the threads wait for each other less often.
+static const uint32_t PNG_PIPELINE_WINDOW_MIN_SIZE=4*1024*1024;
+/// number of bytes inflated between two updates of the progress of the inflate thread
+static const uint32_t PNG_PIPELINE_INFLATE_STEP_SIZE=64*1024;
+/// maximum number of threads that decode the parts of an image with restart points besides the calling thread
+static const uint32_t PNG_MAX_PART_WORKERS=63;
 static const uint32_t MAX_CHUNK_SIZE=0x8FFFFFFF;
 
 #define CHUNK_TYPE_FROM_NAME(C0,C1,C2,C3) ((C3<<24)|(C2<<16)|(C1<<8)|(C0))
@@ -29,6 +38,10 @@ enum ChunkType{
     CHUNK_TYPE_IDAT=CHUNK_TYPE_FROM_NAME('I','D','A','T'),
     CHUNK_TYPE_PLTE=CHUNK_TYPE_FROM_NAME('P','L','T','E'),
     CHUNK_TYPE_IEND=CHUNK_TYPE_FROM_NAME('I','E','N','D'),
+    CHUNK_TYPE_TRNS=CHUNK_TYPE_FROM_NAME('t','R','N','S'),
+    /// private ancillary chunk with the restart points of the zlib stream, see Image_write_png. it is not safe to copy, i.e.
+    /// editors drop it when they change the image data.
+    CHUNK_TYPE_RSPT=CHUNK_TYPE_FROM_NAME('r','s','P','T'),
 
     //other common chunk types: sRGB, iCCP, cHRM, gAMA, iTXt, tEXt, zTXt, bKGD, pHYs, sBIT, hIST, tIME
 };
@@ -51,6 +64,28 @@ const char* PNGColorType_name(uint8_t color_type){
         default: return NULL;
     }
 }
+/// number of samples per pixel, 0 for an unknown colour type
+static uint32_t PNGColorType_numChannels(uint8_t color_type){
+    switch(color_type){
+        case PNG_COLOR_TYPE_GREYSCALE: return 1;
+        case PNG_COLOR_TYPE_RGB: return 3;
+        case PNG_COLOR_TYPE_PALETTE: return 1;
+        case PNG_COLOR_TYPE_GREYSCALEALPHA: return 2;
+        case PNG_COLOR_TYPE_RGBA: return 4;
+        default: return 0;
+    }
+}
+/// whether the bit depth is allowed for the colour type
+static bool PNGColorType_allowsBitDepth(uint8_t color_type,uint8_t bit_depth){
+    switch(color_type){
+        case PNG_COLOR_TYPE_GREYSCALE: return bit_depth==1 || bit_depth==2 || bit_depth==4 || bit_depth==8 || bit_depth==16;
+        case PNG_COLOR_TYPE_PALETTE: return bit_depth==1 || bit_depth==2 || bit_depth==4 || bit_depth==8;
+        case PNG_COLOR_TYPE_RGB:
+        case PNG_COLOR_TYPE_GREYSCALEALPHA:
+        case PNG_COLOR_TYPE_RGBA: return bit_depth==8 || bit_depth==16;
+        default: return false;
+    }
+}
 /// specified in IHDR
 enum PNGCompressionMethod{
     /// zlib/deflate format
@@ -86,7 +121,6 @@ enum PNGInterlace{
     PNG_INTERLACE_ADAM7=1,
 };
 
-[[maybe_unused]]
 constexpr static const uint8_t DEFLATE_EXTRA_BITS[]={
     0,0,0,0, 0,0,0,0,// 257...264
     1,1,1,1,// 265...268
@@ -96,7 +130,6 @@ constexpr static const uint8_t DEFLATE_EXTRA_BITS[]={
     5,5,5,5,// 281...284
     0 // 285
 };
-[[maybe_unused]]
 constexpr static const uint16_t DEFLATE_BASE_LENGTH_OFFSET[]={
     3,   4,      5,        6,      7,  8,  9,  10, // 257...264
     11,  11+2,   11+2*2,   11+2*3, // 265...268
@@ -106,7 +139,6 @@ constexpr static const uint16_t DEFLATE_BASE_LENGTH_OFFSET[]={
     131, 131+32, 131+32*2, 131+32*3, // 281...284
     258 // 285
 };
-[[maybe_unused]]
 constexpr static const uint8_t DEFLATE_BACKWARD_EXTRA_BIT[]={
     0,  0,  0,  0,
     1,  1,
@@ -123,7 +155,6 @@ constexpr static const uint8_t DEFLATE_BACKWARD_EXTRA_BIT[]={
     12, 12,
     13, 13
 };
-[[maybe_unused]]
 constexpr static const uint16_t DEFLATE_BACKWARD_LENGTH_OFFSET[]={
     1,     2,    3,    4,
     5,     7,
@@ -147,53 +178,434 @@ constexpr static const uint16_t DEFLATE_BACKWARD_LENGTH_OFFSET[]={
 /// the sequence in which the number of bits used for each code length code appear in this table is specified to the following:
 constexpr static const uint8_t CODE_LENGTH_CODE_CHARACTERS[NUM_CODE_LENGTH_CODES]={16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
 
+static const uint32_t DEFLATE_MAX_CODE_LENGTH=15;
+static const uint32_t DEFLATE_NUM_LITERAL_SYMBOLS=288;
+static const uint32_t DEFLATE_NUM_DISTANCE_SYMBOLS=32;
+static const uint32_t DEFLATE_MAX_MATCH_LENGTH=258;
+
+/// number of bits looked up at once in the decode tables. longer codes continue in a subtable.
+static const uint32_t DEFLATE_LITERAL_TABLE_BITS=11;
+static const uint32_t DEFLATE_DISTANCE_TABLE_BITS=8;
+static const uint32_t DEFLATE_CODE_LENGTH_TABLE_BITS=7;
+/// number of entries in the decode tables, including all subtables, for the worst case code (as computed by zlib's enough.c)
+static const uint32_t DEFLATE_LITERAL_TABLE_SIZE=2342;
+static const uint32_t DEFLATE_DISTANCE_TABLE_SIZE=402;
+static const uint32_t DEFLATE_CODE_LENGTH_TABLE_SIZE=1<<DEFLATE_CODE_LENGTH_TABLE_BITS;
+
+/// bits consumed by one literal/length symbol and the distance that follows it, at most
+static const uint8_t DEFLATE_MAX_SYMBOL_BITS=15+5+15+13;
+
+enum DeflateTableEntryFlags{
+    /// extra bits (of a length or distance), or the number of bits looked up in a subtable
+    DEFLATE_ENTRY_NUM_BITS_MASK=0x0F,
+    /// literal byte (or code length symbol)
+    DEFLATE_ENTRY_LITERAL=0x10,
+    DEFLATE_ENTRY_END_OF_BLOCK=0x20,
+    /// the code continues in the subtable at value
+    DEFLATE_ENTRY_SUBTABLE=0x40,
+    /// the bits are not assigned to a symbol, or to a symbol that must not occur
+    DEFLATE_ENTRY_INVALID=0x80,
+};
+
+/// entry of a deflate decode table
+///
+/// the table is indexed by the next bits of the stream. entries for length and distance symbols carry the base value
+/// and the number of extra bits, so that a match is decoded without any further table.
+typedef struct DeflateTableEntry{
+    /// literal byte, base length, base distance, or the index of the subtable
+    uint16_t value;
+    /// see DeflateTableEntryFlags. length and distance entries have no flag set.
+    uint8_t flags;
+    /// number of bits of the code consumed by this entry
+    uint8_t code_length;
+}DeflateTableEntry;
+
+template<uint32_t NUM_SYMBOLS>
+struct DeflateSymbolEntries{
+    DeflateTableEntry entries[NUM_SYMBOLS];
+};
+constexpr static DeflateSymbolEntries<DEFLATE_NUM_LITERAL_SYMBOLS> deflate_literal_symbol_entries(){
+    DeflateSymbolEntries<DEFLATE_NUM_LITERAL_SYMBOLS> symbols{};
+    for(uint32_t i=0;i<DEFLATE_NUM_LITERAL_SYMBOLS;i++){
+        if(i<256)
+            symbols.entries[i]={static_cast<uint16_t>(i),DEFLATE_ENTRY_LITERAL,0};
+        else if(i==256)
+            symbols.entries[i]={0,DEFLATE_ENTRY_END_OF_BLOCK,0};
+        else if(i<=285)
+            symbols.entries[i]={DEFLATE_BASE_LENGTH_OFFSET[i-257],DEFLATE_EXTRA_BITS[i-257],0};
+        else
+            symbols.entries[i]={0,DEFLATE_ENTRY_INVALID,0};
+    }
+    return symbols;
+}
+constexpr static DeflateSymbolEntries<DEFLATE_NUM_DISTANCE_SYMBOLS> deflate_distance_symbol_entries(){
+    DeflateSymbolEntries<DEFLATE_NUM_DISTANCE_SYMBOLS> symbols{};
+    for(uint32_t i=0;i<DEFLATE_NUM_DISTANCE_SYMBOLS;i++){
+        if(i<30)
+            symbols.entries[i]={DEFLATE_BACKWARD_LENGTH_OFFSET[i],DEFLATE_BACKWARD_EXTRA_BIT[i],0};
+        else
+            symbols.entries[i]={0,DEFLATE_ENTRY_INVALID,0};
+    }
+    return symbols;
+}
+constexpr static DeflateSymbolEntries<NUM_CODE_LENGTH_CODES> deflate_code_length_symbol_entries(){
+    DeflateSymbolEntries<NUM_CODE_LENGTH_CODES> symbols{};
+    for(uint32_t i=0;i<NUM_CODE_LENGTH_CODES;i++)
+        symbols.entries[i]={static_cast<uint16_t>(i),DEFLATE_ENTRY_LITERAL,0};
+    return symbols;
+}
+constexpr static DeflateSymbolEntries<DEFLATE_NUM_LITERAL_SYMBOLS> DEFLATE_LITERAL_SYMBOL_ENTRIES=deflate_literal_symbol_entries();
+constexpr static DeflateSymbolEntries<DEFLATE_NUM_DISTANCE_SYMBOLS> DEFLATE_DISTANCE_SYMBOL_ENTRIES=deflate_distance_symbol_entries();
+constexpr static DeflateSymbolEntries<NUM_CODE_LENGTH_CODES> DEFLATE_CODE_LENGTH_SYMBOL_ENTRIES=deflate_code_length_symbol_entries();
+
+/**
+ * @brief build the decode table of a canonical huffman code
+ *
+ * codes of up to table_bits bits are decoded with a single lookup, longer codes with a second lookup in a subtable
+ * (as in zlib's inflate_table). an incomplete code is valid, the bit sequences that are not assigned to a symbol decode
+ * to an invalid entry.
+ *
+ * returns false if the code lengths do not describe a valid prefix code, or if the tables do not fit into table_capacity entries.
+ *
+ * @param table output, table_capacity entries
+ * @param table_bits number of bits looked up in the first table
+ * @param table_capacity
+ * @param code_lengths code length of each symbol, zero if the symbol does not occur
+ * @param num_symbols
+ * @param symbol_entries decode table entry of each symbol (the code length is filled in)
+ */
+constexpr static bool DeflateTable_build(
+    DeflateTableEntry* const table,
+    const uint32_t table_bits,
+    const uint32_t table_capacity,
+    const uint8_t* const code_lengths,
+    const uint32_t num_symbols,
+    const DeflateTableEntry* const symbol_entries
+){
+    // number of codes of each length
+    uint32_t count[DEFLATE_MAX_CODE_LENGTH+1]={};
+    uint32_t max_code_length=0;
+    for(uint32_t i=0;i<num_symbols;i++){
+        if(code_lengths[i]>DEFLATE_MAX_CODE_LENGTH)
+            return false;
+        count[code_lengths[i]]++;
+        if(code_lengths[i]>max_code_length)
+            max_code_length=code_lengths[i];
+    }
+    count[0]=0;
+
+    // kraft inequality: the codes of all lengths must fit into the code space
+    int32_t code_space_left=1;
+    for(uint32_t len=1;len<=DEFLATE_MAX_CODE_LENGTH;len++){
+        code_space_left=code_space_left*2-static_cast<int32_t>(count[len]);
+        if(code_space_left<0)
+            return false;
+    }
+
+    // symbols in the order of their codes, i.e. sorted by code length, then by symbol
+    uint32_t offsets[DEFLATE_MAX_CODE_LENGTH+2]={};
+    for(uint32_t len=1;len<=DEFLATE_MAX_CODE_LENGTH;len++)
+        offsets[len+1]=offsets[len]+count[len];
+    const uint32_t num_codes=offsets[DEFLATE_MAX_CODE_LENGTH+1];
+
+    uint16_t sorted_symbols[DEFLATE_NUM_LITERAL_SYMBOLS]={};
+    for(uint32_t i=0;i<num_symbols;i++)
+        if(code_lengths[i]>0)
+            sorted_symbols[offsets[code_lengths[i]]++]=static_cast<uint16_t>(i);
+
+    const uint32_t primary_table_size=1u<<table_bits;
+    if(primary_table_size>table_capacity)
+        return false;
+
+    const DeflateTableEntry invalid_entry={0,DEFLATE_ENTRY_INVALID,static_cast<uint8_t>(table_bits)};
+    for(uint32_t i=0;i<primary_table_size;i++)
+        table[i]=invalid_entry;
+    uint32_t table_end=primary_table_size;
+
+    uint32_t code=0;
+    uint32_t code_length=0;
+    uint32_t subtable_prefix=UINT32_MAX;
+    uint32_t subtable_start=0;
+    uint32_t subtable_bits=0;
+    for(uint32_t i=0;i<num_codes;i++){
+        const uint16_t symbol=sorted_symbols[i];
+        const uint32_t len=code_lengths[symbol];
+
+        // canonical code: the next code of the same length, or the first code of the next length
+        code<<=len-code_length;
+        code_length=len;
+
+        // the first bit of the code is the least significant bit of the looked up bits
+        uint32_t reversed_code=0;
+        for(uint32_t b=0;b<len;b++)
+            reversed_code|=((code>>b)&1)<<(len-1-b);
+
+        DeflateTableEntry entry=symbol_entries[symbol];
+        if(len<=table_bits){
+            entry.code_length=static_cast<uint8_t>(len);
+            for(uint32_t index=reversed_code;index<primary_table_size;index+=1u<<len)
+                table[index]=entry;
+        }else{
+            const uint32_t prefix=reversed_code&(primary_table_size-1);
+            if(prefix!=subtable_prefix){
+                // codes with the same prefix are consecutive. the subtable grows until the remaining codes fill it.
+                subtable_prefix=prefix;
+                subtable_start=table_end;
+                subtable_bits=len-table_bits;
+                int32_t subtable_space_left=1<<subtable_bits;
+                while(subtable_bits+table_bits<max_code_length){
+                    subtable_space_left-=static_cast<int32_t>(count[subtable_bits+table_bits]);
+                    if(subtable_space_left<=0)
+                        break;
+                    subtable_bits++;
+                    subtable_space_left<<=1;
+                }
+
+                if(table_end+(1u<<subtable_bits)>table_capacity)
+                    return false;
+                for(uint32_t j=0;j<(1u<<subtable_bits);j++)
+                    table[table_end+j]=invalid_entry;
+                table_end+=1u<<subtable_bits;
+
+                table[prefix]={static_cast<uint16_t>(subtable_start),static_cast<uint8_t>(DEFLATE_ENTRY_SUBTABLE|subtable_bits),static_cast<uint8_t>(table_bits)};
+            }
+
+            const uint32_t subtable_code_length=len-table_bits;
+            entry.code_length=static_cast<uint8_t>(subtable_code_length);
+            for(uint32_t index=reversed_code>>table_bits;index<(1u<<subtable_bits);index+=1u<<subtable_code_length)
+                table[subtable_start+index]=entry;
+        }
+
+        count[len]--;
+        code++;
+    }
+
+    return true;
+}
+
+/// decode tables of a block with fixed huffman codes (btype 1), specified in RFC 1951 section 3.2.6
+typedef struct DeflateFixedTables{
+    DeflateTableEntry literal[DEFLATE_LITERAL_TABLE_SIZE];
+    DeflateTableEntry distance[DEFLATE_DISTANCE_TABLE_SIZE];
+}DeflateFixedTables;
+constexpr static DeflateFixedTables deflate_fixed_tables(){
+    DeflateFixedTables tables{};
+
+    uint8_t literal_code_lengths[DEFLATE_NUM_LITERAL_SYMBOLS]={};
+    for(uint32_t i=0;i<DEFLATE_NUM_LITERAL_SYMBOLS;i++){
+        if(i<144)
+            literal_code_lengths[i]=8;
+        else if(i<256)
+            literal_code_lengths[i]=9;
+        else if(i<280)
+            literal_code_lengths[i]=7;
+        else
+            literal_code_lengths[i]=8;
+    }
+    uint8_t distance_code_lengths[DEFLATE_NUM_DISTANCE_SYMBOLS]={};
+    for(uint32_t i=0;i<DEFLATE_NUM_DISTANCE_SYMBOLS;i++)
+        distance_code_lengths[i]=5;
+
+    // symbols 286, 287 (literal) and 30, 31 (distance) are part of the code, but must not occur in the data
+    DeflateTable_build(tables.literal,DEFLATE_LITERAL_TABLE_BITS,DEFLATE_LITERAL_TABLE_SIZE,literal_code_lengths,DEFLATE_NUM_LITERAL_SYMBOLS,DEFLATE_LITERAL_SYMBOL_ENTRIES.entries);
+    DeflateTable_build(tables.distance,DEFLATE_DISTANCE_TABLE_BITS,DEFLATE_DISTANCE_TABLE_SIZE,distance_code_lengths,DEFLATE_NUM_DISTANCE_SYMBOLS,DEFLATE_DISTANCE_SYMBOL_ENTRIES.entries);
+
+    return tables;
+}
+/// shared by all blocks that use the fixed codes
+constexpr static DeflateFixedTables DEFLATE_FIXED_TABLES=deflate_fixed_tables();
+
+/// look up the entry of the next code in the bits of buffer, and consume the bits of the first table if the code continues in a subtable
+///
+/// the bits of the returned entry (code_length) are not consumed. buffer must hold at least DEFLATE_MAX_CODE_LENGTH bits.
+[[gnu::always_inline,gnu::hot]]
+static inline DeflateTableEntry DeflateTable_lookup(
+    const DeflateTableEntry* const table,
+    const uint32_t table_bits,
+    uint64_t* const buffer,
+    uint64_t* const bits_filled
+){
+    DeflateTableEntry entry=table[*buffer&bitUtil::get_mask_u64(table_bits)];
+    if(entry.flags&DEFLATE_ENTRY_SUBTABLE){
+        *buffer>>=entry.code_length;
+        *bits_filled-=entry.code_length;
+        entry=table[entry.value+(*buffer&bitUtil::get_mask_u64(entry.flags&DEFLATE_ENTRY_NUM_BITS_MASK))];
+    }
+    return entry;
+}
+
+/// copy a deflate match of length bytes, starting distance bytes before output+out_offset, to output+out_offset
+///
+/// the ranges overlap if distance<length, in which case the last distance bytes are repeated
+[[gnu::always_inline,gnu::hot]]
+static inline void deflate_copy_match(
+    uint8_t* const output,
+    const uint64_t out_offset,
+    const uint32_t distance,
+    const uint32_t length
+){
+    for(uint32_t l=0;l<length;l++){
+        const uint64_t base_offset=out_offset+l;
+        output[base_offset]=output[base_offset-distance];
+    }
+}
+
+/// number of bytes deflate_copy_match_fast may write after the end of the match
+static const uint32_t DEFLATE_MATCH_COPY_OVERSHOOT=16;
+
+/// smallest multiple of the distance that is at least 8, for distances below 8
+constexpr static const uint8_t DEFLATE_PATTERN_PERIOD[8]={0,8,8,9,8,10,12,14};
+
+/// same as deflate_copy_match, but copies 8 or 16 bytes at a time. may write up to DEFLATE_MATCH_COPY_OVERSHOOT bytes (of
+/// garbage) after the match.
+[[gnu::always_inline,gnu::hot]]
+static inline void deflate_copy_match_fast(
+    uint8_t* const output,
+    const uint64_t out_offset,
+    const uint32_t distance,
+    const uint32_t length
+){
+    uint8_t* dst=output+out_offset;
+    const uint8_t* const end=dst+length;
+
+    if(distance>=16){
+        // the chunks of source and destination never overlap
+        const uint8_t* src=dst-distance;
+        do{
+            memcpy(dst,src,16);
+            dst+=16;
+            src+=16;
+        }while(dst<end);
+    }else if(distance>=8){
+        const uint8_t* src=dst-distance;
+        do{
+            memcpy(dst,src,8);
+            dst+=8;
+            src+=8;
+        }while(dst<end);
+    }else if(distance==1){
+        const uint64_t pattern=dst[-1]*0x0101010101010101ull;
+        do{
+            memcpy(dst,&pattern,8);
+            dst+=8;
+        }while(dst<end);
+    }else{
+        // after the first 8 bytes the data repeats every distance bytes, so also every multiple of distance bytes,
+        // i.e. every period bytes, which is far enough back to copy 8 bytes at a time
+        const uint8_t* const src=dst-distance;
+        for(uint32_t i=0;i<8;i++)
+            dst[i]=src[i];
+        dst+=8;
+
+        const uint32_t period=DEFLATE_PATTERN_PERIOD[distance];
+        while(dst<end){
+            memcpy(dst,dst-period,8);
+            dst+=8;
+        }
+    }
+}
+
+/// state of ZLIBDecoder between two calls of decode_some
+enum DeflateBlockState{
+    /// the next bits are the header of a block
+    DEFLATE_BLOCK_STATE_HEADER,
+    /// inside a stored block, with stored_bytes_left bytes left
+    DEFLATE_BLOCK_STATE_STORED,
+    /// inside a block with huffman codes (the tables are current_literal_table and current_distance_table)
+    DEFLATE_BLOCK_STATE_HUFFMAN,
+};
+
 /// decode zlib-compressed data
 ///
 /// specified in RFC 1950 (e.g. https://datatracker.ietf.org/doc/html/rfc1950)
+///
+/// the data is either decoded in one go (decode), or in parts (begin, then decode_some and discard_output), with only a window
+/// of the decompressed data in output_buffer, e.g. to process the data while it is still in the cache.
 class ZLIBDecoder{
     public:
-        uint8_t* input_buffer;
-        uint64_t input_buffer_size;
+        /// the compressed data, which may be split into several segments (e.g. the payloads of the IDAT chunks)
+        const bitStream::Segment* input_segments;
+        uint64_t num_input_segments;
         uint8_t* output_buffer;
         uint64_t output_buffer_size;
 
+        /// number of decompressed bytes in output_buffer
+        uint64_t out_offset=0;
+        /// number of decompressed bytes that have been removed from the start of output_buffer, see discard_output
+        uint64_t num_discarded_bytes=0;
+        /// set once the last block (and the checksum, if it is verified) has been decoded
+        bool finished=false;
+
+        /// number of bit buffer refills of the last decode, see ImageDecodeStats
+        uint64_t num_bitstream_refills=0;
+
+        /// if set, the adler-32 checksum of the decompressed data is updated with this function after each block (while the
+        /// block is still in the cache), and compared to the checksum at the end of the stream
+        uint32_t(*adler32)(uint32_t adler,const uint8_t* data,uint64_t num_bytes)=NULL;
+        /// if set, called with each input segment once all of its data has been read (and with the remaining segments at the
+        /// end of the stream), e.g. to verify the checksum of the chunk that contains it. throws to abort decoding.
+        void(*verify_segment)(const bitStream::Segment* segment,const void* user_data)=NULL;
+        const void* verify_segment_user_data=NULL;
+
+        /// the input may be one of the parts that the stream was split into at its restart points (see PngPart): a part other
+        /// than the first starts at a block boundary (without the zlib header), and a part other than the last ends at a block
+        /// boundary (the empty stored block of a flush) instead of with the last block and the checksum.
+        bool first_part=true;
+        bool last_part=true;
+        /// adler-32 checksum of the data decoded so far (if adler32 is set). the checksum at the end of the stream is compared
+        /// to it if the input is the whole stream, and only stored in stored_adler if it is the last of several parts.
+        uint32_t adler=1;
+        uint32_t stored_adler=0;
+
         ZLIBDecoder(
-            uint64_t input_buffer_size,
-            uint8_t* input_buffer,
+            const bitStream::Segment* input_segments,
+            uint64_t num_input_segments,
             uint64_t output_buffer_size,
             uint8_t* output_buffer
         ):
-            input_buffer(input_buffer),
-            input_buffer_size(input_buffer_size),
+            input_segments(input_segments),
+            num_input_segments(num_input_segments),
             output_buffer(output_buffer),
             output_buffer_size(output_buffer_size)
         {}
 
-        void decode(){
-            BitStream _stream;
-            BitStream* stream=&_stream;
-            BitStream::BitStream_new(stream,input_buffer,input_buffer_size);
+        /// decode the whole zlib stream into output_buffer, returns the number of bytes written
+        ///
+        /// throws DATA_CORRUPT if the stream is invalid or does not fit into output_buffer, and DATA_TRUNCATED if it ends early.
+        uint64_t decode(){
+            this->begin();
+            this->decode_some(this->output_buffer_size,true);
+            return this->out_offset;
+        }
+
+        /// read the zlib header (of the first part), before the first decode_some
+        void begin(){
+            BitStream* const stream=&this->stream;
+            BitStream::BitStream_newFromSegments(stream,input_segments,num_input_segments);
+            if(!this->first_part)
+                return;
+
+            uint64_t input_size=0;
+            for(uint64_t i=0;i<num_input_segments;i++)
+                input_size+=input_segments[i].size;
+            if(input_size<2)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png zlib stream is %" PRIu64 " bytes long",input_size);
 
             /// combined cm+cinfo flag across 2 bytes is used to verify data integrity
             const uint64_t cmf_flag=bitUtil::byteswap((uint32_t)stream->get_bits(16),2);
-            if(cmf_flag%31!=0){
-                fprintf(stderr,"png cmf integrity check failed: cmf is %" PRIu64 "\n",cmf_flag);
-                exit(FATAL_UNEXPECTED_ERROR);
-            }
+            if(cmf_flag%31!=0)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png cmf integrity check failed: cmf is %" PRIu64,cmf_flag);
 
             /// compression method flag
             const uint64_t cm_flag=stream->get_bits_advance(4);
-            if(cm_flag!=PNG_COMPRESSION_METHOD_CODE_ZLIB){
-                bail(FATAL_UNEXPECTED_ERROR,"invalid png bitstream compression method %d",(int)cm_flag);
-            }
+            if(cm_flag!=PNG_COMPRESSION_METHOD_CODE_ZLIB)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png bitstream compression method %d",(int)cm_flag);
             /// (encoded) compression info flag
             const uint64_t cinfo_flag=stream->get_bits_advance(4);
 
             const uint32_t window_size=1<<(cinfo_flag+8);
-            if(window_size>PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE){
-                fprintf(stderr,"invalid png bitstream compression window size %d\n",window_size);
-                exit(FATAL_UNEXPECTED_ERROR);
-            }
+            if(window_size>PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png bitstream compression window size %d",window_size);
 
             /// is set so that the cmf integrity check above can succeed
             const uint64_t fcheck_flag=stream->get_bits_advance(5);
@@ -203,534 +615,1778 @@ class ZLIBDecoder{
             const uint64_t flevel_flag=stream->get_bits_advance(2);
             discard flevel_flag;
 
-            if(fdict_flag){
-                fprintf(stderr,"TODO unimplemented: using preset dictionary\n");
-                exit(FATAL_UNEXPECTED_ERROR);
-            }
-
-            LiteralTable literal_alphabet;
-            DistanceTable distance_alphabet;
-
-            int out_offset=0;
-            int block_id=0;
-            discard block_id;
-
-            /// used as huffman table values
-            uint8_t values[NUM_CODE_LENGTH_CODES];
-            memset(values,0,sizeof(values));
-            for(uint8_t i=0;i<NUM_CODE_LENGTH_CODES;i++){
-                values[i]=i;
-            }
+            // png does not provide a preset dictionary (the zlib stream in png must not use one), so the data cannot be decoded
+            if(fdict_flag)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png zlib stream uses a preset dictionary");
+        }
 
-            // remaining bitstream is formatted according to RFC 1951 (deflate) (e.g. https://datatracker.ietf.org/doc/html/rfc1951)
-            bool keep_parsing=true;
-            while(keep_parsing){
-                const uint64_t bfinal=stream->get_bits_advance(1);
+        /**
+         * @brief decode blocks into output_buffer, until the stream ends or the output gets close to output_limit
+         *
+         * the remaining bitstream is formatted according to RFC 1951 (deflate) (e.g. https://datatracker.ietf.org/doc/html/rfc1951).
+         * decoding may stop in the middle of a block, and continues there on the next call.
+         *
+         * @param output_limit at most output_buffer_size. decoding stops before the first symbol that may not fit below this
+         * offset, i.e. once less than DEFLATE_MAX_MATCH_LENGTH bytes are left, so the caller must make room (see discard_output)
+         * before the next call.
+         * @param output_limit_is_end the data ends at or before output_limit, i.e. decoding continues to the end of the stream,
+         * and fails with DATA_CORRUPT if the output exceeds output_limit.
+         */
+        void decode_some(const uint64_t output_limit,const bool output_limit_is_end){
+            BitStream* const stream=&this->stream;
+
+            while(!this->finished){
+                if(this->block_state==DEFLATE_BLOCK_STATE_HEADER){
+                    if(!this->last_part && stream->at_end()){
+                        // a serial decode continues with the next bit, i.e. the part only ends here if its last block is the
+                        // empty stored block of a flush, which ends at a byte boundary
+                        if(!this->block_is_flush)
+                            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png zlib stream part does not end with a flush");
+                        this->finish(stream);
+                        return;
+                    }
+                    this->read_block_header(stream);
+                }
 
-                const uint64_t btype=stream->get_bits_advance(2);
-                switch(btype){
-                    case 0:
+                const uint64_t block_start=this->out_offset;
+                bool block_done=true;
+                switch(this->block_state){
+                    case DEFLATE_BLOCK_STATE_STORED:
                         {
-                            bail(FATAL_UNEXPECTED_ERROR,"TODO : uncompressed deflate block");
-                            
-                            printf("using no compression %" PRIu64 "\n",stream->buffer_bits_filled);
-
-                            const uint8_t bits_to_next_byte_boundary=stream->buffer_bits_filled%8;
-                            keep_parsing=false;
-                            if(bits_to_next_byte_boundary>0)
-                                stream->advance_unsafe(bits_to_next_byte_boundary);
-
-                            /// num bytes in this block
-                            const uint32_t len=bitUtil::byteswap((uint32_t)stream->get_bits_advance(16),2);
-                            /// 1's complement of len
-                            const uint32_t nlen=bitUtil::byteswap((uint32_t)stream->get_bits_advance(16),2);
-
-                            if((len+nlen)!=UINT16_MAX)
-                                bail(FATAL_UNEXPECTED_ERROR,"uncompressed png block length integrity check failed\n");
+                            uint64_t num_bytes=this->stored_bytes_left;
+                            if(this->out_offset+num_bytes>output_limit){
+                                if(output_limit_is_end)
+                                    this->fail_output_exceeded(stream);
+                                num_bytes=output_limit-this->out_offset;
+                            }
 
-                            // TODO copy LEN bytes of data to output
+                            if(!stream->read_bytes(this->output_buffer+this->out_offset,num_bytes))
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png zlib stream ends in uncompressed block %d",this->block_id);
+                            this->out_offset+=num_bytes;
+                            this->stored_bytes_left-=(uint32_t)num_bytes;
 
-                            printf("got %d bytes of uncompressed data\n",len);
-                            stream->skip(len*8);
+                            block_done=this->stored_bytes_left==0;
                         }
                         break;
-                    case 1:
-                        bail(FATAL_UNEXPECTED_ERROR,"TODO : compression with fixed huffman codes");
+                    case DEFLATE_BLOCK_STATE_HUFFMAN:
+                        this->out_offset=this->decode_huffman_block(
+                            stream,
+                            this->out_offset,
+                            this->current_literal_table,
+                            this->current_distance_table,
+                            output_limit,
+                            output_limit_is_end,
+                            &block_done
+                        );
                         break;
-                    case 2:
-                        {
-                            const uint64_t num_literal_codes=257+stream->get_bits_advance(5);
-                            if(num_literal_codes>286)
-                                bail(FATAL_UNEXPECTED_ERROR,"too many huffman codes (literals) %" PRIu64 "\n",num_literal_codes);
+                    case DEFLATE_BLOCK_STATE_HEADER:
+                        break;
+                }
 
-                            const uint64_t num_distance_codes=1+stream->get_bits_advance(5);
-                            if(num_distance_codes>30)
-                                bail(FATAL_UNEXPECTED_ERROR,"too many huffman codes (distance) %" PRIu64 "\n",num_distance_codes);
+                // truncated data is decoded as zero bits, and only detected once per block (or part of a block)
+                if(stream->overrun())
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png zlib stream ends in block %d",this->block_id);
 
-                            // the number of elements in this table can be 4-19. the code length codes not present in the table are specified to not occur (i.e. zero bits)
-                            const uint8_t num_huffman_codes=4+(uint8_t)stream->get_bits_advance(4);
+                if(this->adler32)
+                    this->adler=this->adler32(this->adler,this->output_buffer+block_start,this->out_offset-block_start);
+                if(this->verify_segment)
+                    this->verify_read_segments(stream,false);
 
-                            // parse code sizes for each entry in the huffman code table
+                if(!block_done)
+                    return;
 
-                            // parse all code lengths in one go
-                            uint8_t code_length_codes[NUM_CODE_LENGTH_CODES];
-                            memset(code_length_codes,0,sizeof(code_length_codes));
-                            for(int code_size_index=0;code_size_index<num_huffman_codes;code_size_index++){
-                                uint8_t new_code_length_code=(uint8_t)stream->get_bits_advance(3);
-                                code_length_codes[CODE_LENGTH_CODE_CHARACTERS[code_size_index]]=new_code_length_code;
-                            }
+                this->block_state=DEFLATE_BLOCK_STATE_HEADER;
+                if(this->last_block){
+                    if(!this->last_part)
+                        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png zlib stream ends before its last part");
+                    this->finish(stream);
+                }
+                else
+                    this->block_id++;
+            }
+        }
 
-                            CodeLengthTable code_length_code_alphabet;
-                            CodeLengthTable::CodingTable_new(
-                                &code_length_code_alphabet, 
-                                NUM_CODE_LENGTH_CODES,
-                                code_length_codes, 
-                                values
-                            );
-
-                            // then read literal and distance alphabet code lengths in one pass, since they use the same alphabet
-                            uint8_t literal_plus_distance_code_lengths[288+33];
-                            for(uint64_t i=0;i<num_literal_codes+num_distance_codes;){
-                                const auto value=code_length_code_alphabet.lookup(stream);
-                                switch (value) {
-                                    case 16:
-                                        {
-                                            //Copy the previous code length 3 - 6 times.
-                                            //The next 2 bits indicate repeat length
-                                            //        (0 = 3, ... , 3 = 6)
-                                            const uint64_t num_reps=3+stream->get_bits_advance(2);
-                                            for(uint64_t rep=0;rep<num_reps;rep++){
-                                                literal_plus_distance_code_lengths[i+rep]=literal_plus_distance_code_lengths[i-1];
-                                            }
-                                            i+=num_reps;
-                                        }
-                                        break;
-                                    case 17:
-                                        {
-                                            //Repeat a code length of 0 for 3 - 10 times.
-                                            //   (3 bits of length)
-                                            const auto num_reps=3+stream->get_bits_advance(3);
-                                            for(uint64_t rep=0;rep<num_reps;rep++){
-                                                literal_plus_distance_code_lengths[i+rep]=0;
-                                            }
-                                            i+=num_reps;
-                                        }
-                                        break;
-                                    case 18:
-                                        {
-                                            // Repeat a code length of 0 for 11 - 138 times
-                                            //   (7 bits of length)
-                                            const auto num_reps=11+stream->get_bits_advance(7);
-                                            for(uint64_t rep=0;rep<num_reps;rep++){
-                                                literal_plus_distance_code_lengths[i+rep]=0;
-                                            }
-                                            i+=num_reps;
-                                        }
-                                        break;
-                                    default:
-                                        if (value>15) {
-                                            bail(FATAL_UNEXPECTED_ERROR,"unexpected value %d\n",value);
-                                        }
-                                        literal_plus_distance_code_lengths[i]=(uint8_t)value;
-                                        i++;
-                                }
-                            }
+        /// remove the first num_bytes bytes of the decompressed data from output_buffer, i.e. move the others to its start.
+        ///
+        /// matches refer back up to PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE bytes, i.e. at least that many bytes (or all, if
+        /// fewer have been decoded) must be kept.
+        void discard_output(const uint64_t num_bytes){
+            memmove(this->output_buffer,this->output_buffer+num_bytes,this->out_offset-num_bytes);
+            this->out_offset-=num_bytes;
+            this->num_discarded_bytes+=num_bytes;
+        }
+
+    private:
+        BitStream stream;
+
+        DeflateBlockState block_state=DEFLATE_BLOCK_STATE_HEADER;
+        /// whether the current block is the last one (bfinal)
+        bool last_block=false;
+        /// whether the current block is an empty stored block, like the one that ends the data of a flush
+        bool block_is_flush=false;
+        int block_id=0;
+        /// remaining bytes of the current stored block
+        uint32_t stored_bytes_left=0;
+        /// decode tables of the current block with huffman codes (the fixed ones, or literal_table and distance_table)
+        const DeflateTableEntry* current_literal_table=NULL;
+        const DeflateTableEntry* current_distance_table=NULL;
+
+        /// number of input segments passed to verify_segment so far
+        uint64_t num_verified_segments=0;
+
+        /// read the header of the next block (and its code lengths, for dynamic huffman codes)
+        void read_block_header(BitStream* const stream){
+            this->last_block=stream->get_bits_advance(1);
+            this->block_is_flush=false;
+
+            const uint64_t btype=stream->get_bits_advance(2);
+            switch(btype){
+                case 0:
+                    {
+                        // stored block: the bytes are copied as they are, starting at the next byte boundary
+                        stream->align_to_byte();
+
+                        /// num bytes in this block
+                        const uint32_t len=(uint32_t)stream->get_bits_advance(16);
+                        /// 1's complement of len
+                        const uint32_t nlen=(uint32_t)stream->get_bits_advance(16);
+
+                        if((len^nlen)!=UINT16_MAX)
+                            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"uncompressed png block length integrity check failed");
+
+                        this->stored_bytes_left=len;
+                        this->block_is_flush=len==0;
+                        this->block_state=DEFLATE_BLOCK_STATE_STORED;
+                    }
+                    break;
+                case 1:
+                    this->current_literal_table=DEFLATE_FIXED_TABLES.literal;
+                    this->current_distance_table=DEFLATE_FIXED_TABLES.distance;
+                    this->block_state=DEFLATE_BLOCK_STATE_HUFFMAN;
+                    break;
+                case 2:
+                    this->read_dynamic_tables(stream);
+                    this->current_literal_table=this->literal_table;
+                    this->current_distance_table=this->distance_table;
+                    this->block_state=DEFLATE_BLOCK_STATE_HUFFMAN;
+                    break;
+                case 3:
+                default:
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"reserved deflate block type");
+            }
+        }
 
-                            code_length_code_alphabet.destroy();
+        /// after the last block (or at the end of a part): compare the checksum, and verify the remaining input segments
+        void finish(BitStream* const stream){
+            if(this->adler32 && this->last_part){
+                // the checksum follows the last block, starting at the next byte boundary
+                stream->align_to_byte();
+                uint8_t checksum_bytes[4];
+                if(!stream->read_bytes(checksum_bytes,4))
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png zlib stream ends before its adler-32 checksum");
+
+                const uint32_t checksum=((uint32_t)checksum_bytes[0]<<24)|((uint32_t)checksum_bytes[1]<<16)|((uint32_t)checksum_bytes[2]<<8)|checksum_bytes[3];
+                this->stored_adler=checksum;
+                if(this->first_part && checksum!=this->adler)
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png adler-32 checksum mismatch: stored %08x, computed %08x",checksum,this->adler);
+            }
+            if(this->verify_segment)
+                this->verify_read_segments(stream,true);
 
-                            // split combined alphabet
-                            uint8_t literal_code_lengths[288];
-                            for(uint64_t i=0;i<num_literal_codes;i++){
-                                literal_code_lengths[i]=literal_plus_distance_code_lengths[i];
-                            }
-                            for(uint64_t i=num_literal_codes;i<288;i++){
-                                literal_code_lengths[i]=0;
-                            }
+            this->num_bitstream_refills=stream->num_refills;
+            this->finished=true;
+        }
+
+        /// call verify_segment with the segments that stream has moved past (or with all remaining segments if all is set)
+        void verify_read_segments(const BitStream* const stream,const bool all){
+            // the stream moves to the next (non-empty) segment once it has read all bytes of the current one
+            const uint64_t num_read_segments=all?this->num_input_segments:this->num_input_segments-stream->num_next_segments-1;
+            for(;this->num_verified_segments<num_read_segments;this->num_verified_segments++)
+                this->verify_segment(&this->input_segments[this->num_verified_segments],this->verify_segment_user_data);
+        }
+
+        /// decode tables of the current block with dynamic huffman codes
+        DeflateTableEntry literal_table[DEFLATE_LITERAL_TABLE_SIZE];
+        DeflateTableEntry distance_table[DEFLATE_DISTANCE_TABLE_SIZE];
+
+        /// decode one symbol with a table, from a stream that may be anywhere in the data
+        [[gnu::always_inline]]
+        static inline DeflateTableEntry decode_symbol(
+            BitStream* const stream,
+            const DeflateTableEntry* const table,
+            const uint32_t table_bits
+        ){
+            stream->ensure_filled(DEFLATE_MAX_CODE_LENGTH);
+            const DeflateTableEntry entry=DeflateTable_lookup(table,table_bits,&stream->buffer,&stream->buffer_bits_filled);
+            stream->advance_unsafe(entry.code_length);
+            return entry;
+        }
+
+        /// read the code lengths of a block with dynamic huffman codes (btype 2), and build literal_table and distance_table
+        void read_dynamic_tables(BitStream* const stream){
+            const uint64_t num_literal_codes=257+stream->get_bits_advance(5);
+            if(num_literal_codes>286)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"too many huffman codes (literals) %" PRIu64,num_literal_codes);
+
+            const uint64_t num_distance_codes=1+stream->get_bits_advance(5);
+            if(num_distance_codes>30)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"too many huffman codes (distance) %" PRIu64,num_distance_codes);
+
+            // the number of elements in this table can be 4-19. the code length codes not present in the table are specified to not occur (i.e. zero bits)
+            const uint8_t num_huffman_codes=4+(uint8_t)stream->get_bits_advance(4);
+
+            // parse all code lengths in one go
+            uint8_t code_length_codes[NUM_CODE_LENGTH_CODES];
+            memset(code_length_codes,0,sizeof(code_length_codes));
+            for(int code_size_index=0;code_size_index<num_huffman_codes;code_size_index++){
+                uint8_t new_code_length_code=(uint8_t)stream->get_bits_advance(3);
+                code_length_codes[CODE_LENGTH_CODE_CHARACTERS[code_size_index]]=new_code_length_code;
+            }
 
-                            uint8_t distance_code_lengths[33];
-                            for(uint64_t i=0;i<num_distance_codes;i++){
-                                distance_code_lengths[i]=literal_plus_distance_code_lengths[i+num_literal_codes];
+            // code length codes are at most 7 bits long, so the table has no subtables
+            DeflateTableEntry code_length_table[DEFLATE_CODE_LENGTH_TABLE_SIZE];
+            if(!DeflateTable_build(
+                code_length_table,
+                DEFLATE_CODE_LENGTH_TABLE_BITS,
+                DEFLATE_CODE_LENGTH_TABLE_SIZE,
+                code_length_codes,
+                NUM_CODE_LENGTH_CODES,
+                DEFLATE_CODE_LENGTH_SYMBOL_ENTRIES.entries
+            ))
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png code length code");
+
+            // then read literal and distance alphabet code lengths in one pass, since they use the same alphabet
+            const uint64_t num_code_lengths=num_literal_codes+num_distance_codes;
+            uint8_t literal_plus_distance_code_lengths[288+33];
+            for(uint64_t i=0;i<num_code_lengths;){
+                const DeflateTableEntry entry=decode_symbol(stream,code_length_table,DEFLATE_CODE_LENGTH_TABLE_BITS);
+                if(entry.flags&DEFLATE_ENTRY_INVALID)
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png code length symbol");
+
+                const auto value=entry.value;
+                switch (value) {
+                    case 16:
+                        {
+                            //Copy the previous code length 3 - 6 times.
+                            //The next 2 bits indicate repeat length
+                            //        (0 = 3, ... , 3 = 6)
+                            const uint64_t num_reps=3+stream->get_bits_advance(2);
+                            if(i==0 || i+num_reps>num_code_lengths)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png code length repeat");
+                            for(uint64_t rep=0;rep<num_reps;rep++){
+                                literal_plus_distance_code_lengths[i+rep]=literal_plus_distance_code_lengths[i-1];
                             }
-                            for(uint64_t i=num_distance_codes;i<33;i++){
-                                distance_code_lengths[i]=0;
+                            i+=num_reps;
+                        }
+                        break;
+                    case 17:
+                        {
+                            //Repeat a code length of 0 for 3 - 10 times.
+                            //   (3 bits of length)
+                            const auto num_reps=3+stream->get_bits_advance(3);
+                            if(i+num_reps>num_code_lengths)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png code length repeat");
+                            for(uint64_t rep=0;rep<num_reps;rep++){
+                                literal_plus_distance_code_lengths[i+rep]=0;
                             }
-
-                            // construct literal alphabet from compressed alphabet lengths
-                            LiteralTable::VALUE_ literal_alphabet_values[288];
-                            for(LiteralTable::VALUE_ i=0;i<288;i++)
-                                literal_alphabet_values[i]=i;
-
-                            LiteralTable::CodingTable_new(
-                                &literal_alphabet, 
-                                (int)num_literal_codes,
-                                literal_code_lengths, 
-                                literal_alphabet_values
-                            );
-
-                            // construct distance alphabet from compressed alphabet lengths
-                            DistanceTable::VALUE_ distance_alphabet_values[33];
-                            for(DistanceTable::VALUE_ i=0;i<33;i++)
-                                distance_alphabet_values[i]=i;
-
-                            DistanceTable::CodingTable_new(
-                                &distance_alphabet, 
-                                (int)num_distance_codes,
-                                distance_code_lengths, 
-                                distance_alphabet_values
-                            );
+                            i+=num_reps;
                         }
-
                         break;
-                    case 3:
-                        bail(FATAL_UNEXPECTED_ERROR,"reserved");
+                    case 18:
+                        {
+                            // Repeat a code length of 0 for 11 - 138 times
+                            //   (7 bits of length)
+                            const auto num_reps=11+stream->get_bits_advance(7);
+                            if(i+num_reps>num_code_lengths)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png code length repeat");
+                            for(uint64_t rep=0;rep<num_reps;rep++){
+                                literal_plus_distance_code_lengths[i+rep]=0;
+                            }
+                            i+=num_reps;
+                        }
                         break;
                     default:
-                        exit(FATAL_UNEXPECTED_ERROR);
+                        literal_plus_distance_code_lengths[i]=(uint8_t)value;
+                        i++;
                 }
+            }
 
-                bool block_done=false;
-                while(!block_done){
-                    const auto literal_value=literal_alphabet.lookup(stream);
-                    if (literal_value<=255) {
-                        output_buffer[out_offset++]=uint8_t(literal_value);
-                    }else if (literal_value==256) {
-                        break;
-                    // 256 < literal_value < 286
-                    }else{
-                        const auto table_offset=literal_value-257;
-                        auto length=DEFLATE_BASE_LENGTH_OFFSET[table_offset];
-                        const auto extra_bits=DEFLATE_EXTRA_BITS[table_offset];
-                        if (extra_bits>0)
-                            length+=(uint16_t)stream->get_bits_advance(extra_bits);
-
-                        if (length>258)
-                            bail(FATAL_UNEXPECTED_ERROR,"length too large %d\n",length);
-
-                        const auto backward_distance_symbol=distance_alphabet.lookup(stream);
-                        const auto backward_extra_bits=DEFLATE_BACKWARD_EXTRA_BIT[backward_distance_symbol];
-                        auto backward_distance=DEFLATE_BACKWARD_LENGTH_OFFSET[backward_distance_symbol];
-                        if(backward_extra_bits>0){
-                            auto backward_extra_distance=(uint16_t)stream->get_bits_advance(backward_extra_bits);
-                            backward_distance+=backward_extra_distance;
+            const uint8_t* const literal_code_lengths=literal_plus_distance_code_lengths;
+            const uint8_t* const distance_code_lengths=literal_plus_distance_code_lengths+num_literal_codes;
+
+            if(literal_code_lengths[256]==0)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png deflate block has no end of block code");
+
+            if(!DeflateTable_build(
+                this->literal_table,
+                DEFLATE_LITERAL_TABLE_BITS,
+                DEFLATE_LITERAL_TABLE_SIZE,
+                literal_code_lengths,
+                (uint32_t)num_literal_codes,
+                DEFLATE_LITERAL_SYMBOL_ENTRIES.entries
+            ))
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png literal code lengths");
+
+            if(!DeflateTable_build(
+                this->distance_table,
+                DEFLATE_DISTANCE_TABLE_BITS,
+                DEFLATE_DISTANCE_TABLE_SIZE,
+                distance_code_lengths,
+                (uint32_t)num_distance_codes,
+                DEFLATE_DISTANCE_SYMBOL_ENTRIES.entries
+            ))
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png distance code lengths");
+        }
+
+        /**
+         * @brief decode the symbols of a block with huffman codes, returns the output offset after the block (or where decoding stopped)
+         *
+         * the fast loop keeps the bit buffer in registers, refills it with a single 8 byte load, decodes up to three
+         * literals per refill, and copies matches in chunks (see deflate_copy_match_fast). it runs while at least 8 bytes
+         * of the current input segment and DEFLATE_MAX_MATCH_LENGTH+DEFLATE_MATCH_COPY_OVERSHOOT bytes of output are left,
+         * the remaining symbols near the end of a segment or the output are decoded one at a time with bounds checks.
+         *
+         * @param stream
+         * @param out_offset
+         * @param literal_table
+         * @param distance_table
+         * @param output_limit see decode_some
+         * @param output_limit_is_end see decode_some
+         * @param reached_end_of_block set to whether the end of the block was reached, i.e. decoding did not stop at output_limit
+         */
+        [[gnu::hot]]
+        uint64_t decode_huffman_block(
+            BitStream* const stream,
+            uint64_t out_offset,
+            const DeflateTableEntry* const literal_table,
+            const DeflateTableEntry* const distance_table,
+            const uint64_t output_limit,
+            const bool output_limit_is_end,
+            bool* const reached_end_of_block
+        ){
+            uint8_t* const output=this->output_buffer;
+
+            const uint64_t literal_mask=bitUtil::get_mask_u64(DEFLATE_LITERAL_TABLE_BITS);
+
+            // the stream state is held in local variables, which the compiler can keep in registers (the output may alias
+            // anything, so members would be reloaded after every byte written). the fast loop reads from the current
+            // segment of the input only, the slow path continues in the next segment.
+            const uint8_t* input=stream->data;
+            uint64_t input_size=stream->data_size;
+            uint64_t buffer=stream->buffer;
+            uint64_t bits_filled=stream->buffer_bits_filled;
+            uint64_t in_index=stream->next_data_index;
+            uint64_t num_refills=0;
+
+            const auto consume=[&](const uint32_t num_bits){
+                buffer>>=num_bits;
+                bits_filled-=num_bits;
+            };
+
+            for(;;){
+                while(in_index+8<=input_size && out_offset+DEFLATE_MAX_MATCH_LENGTH+DEFLATE_MATCH_COPY_OVERSHOOT<=output_limit){
+                    // add whole bytes until at least 56 bits are buffered. the bits above bits_filled are the following
+                    // bytes of the data, which a later refill adds again at the same position.
+                    if(bits_filled<56){
+                        uint64_t next_bytes;
+                        memcpy(&next_bytes,input+in_index,8);
+                        buffer|=next_bytes<<bits_filled;
+                        in_index+=(63-bits_filled)/8;
+                        bits_filled|=56;
+                        num_refills++;
+                    }
+
+                    DeflateTableEntry entry=literal_table[buffer&literal_mask];
+                    if(entry.flags&DEFLATE_ENTRY_LITERAL){
+                        // up to three literals of at most DEFLATE_LITERAL_TABLE_BITS bits each fit into the buffer. a code
+                        // that is not a literal is looked up again after the next refill.
+                        consume(entry.code_length);
+                        output[out_offset++]=(uint8_t)entry.value;
+
+                        entry=literal_table[buffer&literal_mask];
+                        if(entry.flags&DEFLATE_ENTRY_LITERAL){
+                            consume(entry.code_length);
+                            output[out_offset++]=(uint8_t)entry.value;
+
+                            entry=literal_table[buffer&literal_mask];
+                            if(entry.flags&DEFLATE_ENTRY_LITERAL){
+                                consume(entry.code_length);
+                                output[out_offset++]=(uint8_t)entry.value;
+                            }
                         }
+                        continue;
+                    }
 
-                        for(int l=0;l<length;l++){
-                            const auto base_offset=out_offset+l;
-                            output_buffer[base_offset]=output_buffer[base_offset-backward_distance];
+                    // the buffer holds at least 56 bits, i.e. enough for a length and a distance (DEFLATE_MAX_SYMBOL_BITS)
+                    if(entry.flags&DEFLATE_ENTRY_SUBTABLE){
+                        consume(entry.code_length);
+                        entry=literal_table[entry.value+(buffer&bitUtil::get_mask_u64(entry.flags&DEFLATE_ENTRY_NUM_BITS_MASK))];
+                    }
+                    if(entry.flags&(DEFLATE_ENTRY_LITERAL|DEFLATE_ENTRY_END_OF_BLOCK|DEFLATE_ENTRY_INVALID)){
+                        consume(entry.code_length);
+                        if(entry.flags&DEFLATE_ENTRY_LITERAL){
+                            output[out_offset++]=(uint8_t)entry.value;
+                            continue;
                         }
-                        out_offset+=length;
+                        if(entry.flags&DEFLATE_ENTRY_END_OF_BLOCK)
+                            goto block_done;
+
+                        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid deflate length symbol");
                     }
-                }
 
-                literal_alphabet.destroy();
-                distance_alphabet.destroy();
+                    consume(entry.code_length);
+                    const uint32_t length=entry.value+(uint32_t)(buffer&bitUtil::get_mask_u64(entry.flags));
+                    consume(entry.flags);
 
-                if(bfinal){
-                    break;
+                    const DeflateTableEntry distance_entry=DeflateTable_lookup(distance_table,DEFLATE_DISTANCE_TABLE_BITS,&buffer,&bits_filled);
+                    if(distance_entry.flags&DEFLATE_ENTRY_INVALID)
+                        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid deflate distance symbol");
+                    consume(distance_entry.code_length);
+                    const uint32_t distance=distance_entry.value+(uint32_t)(buffer&bitUtil::get_mask_u64(distance_entry.flags));
+                    consume(distance_entry.flags);
+
+                    if(distance>out_offset)
+                        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"deflate distance %d points before the start of the data",distance);
+
+                    deflate_copy_match_fast(output,out_offset,distance,length);
+                    out_offset+=length;
                 }
-                block_id++;
+
+                // the next symbol may not fit: continue on the next call, once there is room again
+                if(!output_limit_is_end && out_offset+DEFLATE_MAX_MATCH_LENGTH>output_limit)
+                    goto output_limit_reached;
+
+                // slow path: refill through the stream (which appends zero bits past the end of the data), and check the
+                // output size of every symbol
+                stream->buffer=buffer;
+                stream->buffer_bits_filled=bits_filled;
+                stream->next_data_index=in_index;
+                stream->ensure_filled(DEFLATE_MAX_SYMBOL_BITS);
+                input=stream->data;
+                input_size=stream->data_size;
+                buffer=stream->buffer;
+                bits_filled=stream->buffer_bits_filled;
+                in_index=stream->next_data_index;
+
+                const DeflateTableEntry entry=DeflateTable_lookup(literal_table,DEFLATE_LITERAL_TABLE_BITS,&buffer,&bits_filled);
+                consume(entry.code_length);
+                if(entry.flags&DEFLATE_ENTRY_LITERAL){
+                    if(out_offset>=output_limit)
+                        goto output_exceeded;
+
+                    output[out_offset++]=(uint8_t)entry.value;
+                }else if(entry.flags&DEFLATE_ENTRY_END_OF_BLOCK){
+                    goto block_done;
+                }else if(entry.flags&DEFLATE_ENTRY_INVALID){
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid deflate length symbol");
+                }else{
+                    const uint32_t length=entry.value+(uint32_t)(buffer&bitUtil::get_mask_u64(entry.flags));
+                    consume(entry.flags);
+
+                    const DeflateTableEntry distance_entry=DeflateTable_lookup(distance_table,DEFLATE_DISTANCE_TABLE_BITS,&buffer,&bits_filled);
+                    if(distance_entry.flags&DEFLATE_ENTRY_INVALID)
+                        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid deflate distance symbol");
+                    consume(distance_entry.code_length);
+                    const uint32_t distance=distance_entry.value+(uint32_t)(buffer&bitUtil::get_mask_u64(distance_entry.flags));
+                    consume(distance_entry.flags);
+
+                    if(distance>out_offset)
+                        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"deflate distance %d points before the start of the data",distance);
+                    if(out_offset+length>output_limit)
+                        goto output_exceeded;
+
+                    deflate_copy_match(output,out_offset,distance,length);
+                    out_offset+=length;
+                }
+
+                // zero bits past the end of the data decode to some symbol, so the data must not be overrun
+                if(stream->num_padding_bytes*8>bits_filled)
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png zlib stream ends early");
             }
+
+        output_exceeded:
+            stream->buffer=buffer;
+            stream->buffer_bits_filled=bits_filled;
+            stream->next_data_index=in_index;
+            this->fail_output_exceeded(stream);
+
+        output_limit_reached:
+            *reached_end_of_block=false;
+            stream->buffer=buffer;
+            stream->buffer_bits_filled=bits_filled;
+            stream->next_data_index=in_index;
+            stream->num_refills+=num_refills;
+            return out_offset;
+
+        block_done:
+            *reached_end_of_block=true;
+            stream->buffer=buffer;
+            stream->buffer_bits_filled=bits_filled;
+            stream->next_data_index=in_index;
+            stream->num_refills+=num_refills;
+            return out_offset;
+        }
+
+        /// the decompressed data does not fit into the output buffer, which may also be caused by the end of truncated data
+        [[noreturn]]
+        static void fail_output_exceeded(const BitStream* const stream){
+            if(stream->overrun())
+                parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png zlib stream ends early");
+
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png decompressed data is larger than the image");
         }
 };
 
+/// a bgra pixel as 32 bit value, i.e. with the bytes in memory order b,g,r,a
+static inline uint32_t png_bgra(const uint8_t b,const uint8_t g,const uint8_t r,const uint8_t a){
+    const uint8_t bytes[4]={b,g,r,a};
+    uint32_t pixel;
+    memcpy(&pixel,bytes,4);
+    return pixel;
+}
+
 class PngParser:public FileParser{
     public:
         struct IHDR ihdr_data;
 
-        /// bytes per pixel
-        uint32_t bpp;
-        uint32_t scanline_width;
+        /// bgra pixels of the PLTE chunk (with the alpha values of the tRNS chunk), entries that are not in the chunk are opaque black
+        uint32_t palette[256];
+        uint32_t num_palette_entries;
+        /// greyscale or rgb sample values (in the bit depth of the image) of the fully transparent pixels, from the tRNS chunk
+        bool has_transparent_key;
+        uint16_t transparent_key[3];
+        /// data of the rsPT chunk (pairs of first scanline and offset in the zlib stream, see Image_write_png), NULL if there is none
+        const uint8_t* restart_points;
+        uint32_t num_restart_points;
 
         uint8_t* output_buffer;
-        uint8_t* defiltered_output_buffer;
-        uint8_t* in_line;
-        uint8_t* out_line;
-        uint8_t* in_line_prev;
-        uint8_t* out_line_prev;
 
         PngParser(const char* file_path,ImageData*const image_data):FileParser(file_path, image_data){
-            this->bpp=0;
-            this->scanline_width=0;
+            for(uint32_t i=0;i<256;i++)
+                this->palette[i]=png_bgra(0,0,0,0xFF);
+            this->num_palette_entries=0;
+            this->has_transparent_key=false;
+            this->transparent_key[0]=this->transparent_key[1]=this->transparent_key[2]=0;
+            this->restart_points=nullptr;
+            this->num_restart_points=0;
 
             this->output_buffer=nullptr;
-            this->defiltered_output_buffer=nullptr;
-            this->in_line=nullptr;
-            this->out_line=nullptr;
-            this->in_line_prev=nullptr;
-            this->out_line_prev=nullptr;
         }
         void destroy(){
             free(this->file_contents);
             free(this->output_buffer);
-        }
 
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t raw(uint32_t index)const noexcept{
-            return this->in_line[index];
-        }
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t raw_rev(uint32_t index)const noexcept{
-            return this->out_line[index];
+            this->file_contents=nullptr;
+            this->output_buffer=nullptr;
         }
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t previous(uint32_t index)const noexcept{
-            if(index<this->bpp)
-                return 0;
-            return this->in_line[index-this->bpp];
+};
+
+/// the kernels compiled for one instruction set (see png/png_kernels.cpp)
+struct PngKernels{
+    cpu::Isa isa;
+
+    /// undo the filter of one scanline
+    void(*unfilter_scanline)(const uint8_t* in_line,uint8_t* out_line,const uint8_t* out_line_prev,uint64_t num_bytes,uint32_t bpp);
+    /// expand 8 bit samples to bgra pixels (see png/png_expand.cpp). rgba_to_bgra also works in place.
+    void(*rgba_to_bgra)(const uint8_t* in,uint8_t* out,uint64_t num_pixels);
+    void(*rgb_to_bgra)(const uint8_t* in,uint8_t* out,uint64_t num_pixels);
+    void(*grey_to_bgra)(const uint8_t* in,uint8_t* out,uint64_t num_pixels);
+    void(*grey_alpha_to_bgra)(const uint8_t* in,uint8_t* out,uint64_t num_pixels);
+    /// look up palette indices in a palette of 256 bgra pixels. indices_below_16 selects the kernel for indices of at most 4 bits.
+    void(*palette_to_bgra)(const uint8_t* in,uint8_t* out,uint64_t num_pixels,const uint32_t* palette,bool indices_below_16);
+    /// keep the high byte of big endian 16 bit samples
+    void(*narrow_16_to_8)(const uint8_t* in,uint8_t* out,uint64_t num_samples);
+    /// unpack samples of 1, 2 or 4 bits to one byte each
+    void(*unpack_samples)(const uint8_t* in,uint8_t* out,uint64_t num_samples,uint32_t bit_depth);
+    /// write bgra pixels to every step-th pixel of out, leaving the pixels in between unchanged
+    void(*scatter_pixels)(const uint8_t* in,uint8_t* out,uint64_t num_pixels,uint32_t step);
+
+    /// update the crc-32 of png chunks with some data (0 before the first byte)
+    uint32_t(*crc32)(uint32_t crc,const uint8_t* data,uint64_t num_bytes);
+    /// update the adler-32 checksum of a zlib stream with some data (1 before the first byte)
+    uint32_t(*adler32)(uint32_t adler,const uint8_t* data,uint64_t num_bytes);
+};
+
+/// crc-32 lookup tables of the slice-by-16 kernel (see png/png_checksum.cpp): tables[k][b] is the crc of the byte b followed
+/// by k zero bytes (without pre- and post-conditioning), i.e. tables[0] is the classic byte-wise table
+typedef struct Crc32Tables{
+    uint32_t tables[16][256];
+}Crc32Tables;
+constexpr static Crc32Tables crc32_tables(){
+    // the reflected polynomial of ISO 3309
+    const uint32_t CRC32_POLYNOMIAL=0xEDB88320;
+
+    Crc32Tables result{};
+    for(uint32_t byte=0;byte<256;byte++){
+        uint32_t crc=byte;
+        for(uint32_t bit=0;bit<8;bit++)
+            crc=(crc>>1)^((crc&1)?CRC32_POLYNOMIAL:0);
+        result.tables[0][byte]=crc;
+    }
+    for(uint32_t k=1;k<16;k++)
+        for(uint32_t byte=0;byte<256;byte++){
+            const uint32_t previous=result.tables[k-1][byte];
+            result.tables[k][byte]=(previous>>8)^result.tables[0][previous&0xFF];
         }
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t previous_rev(uint32_t index)const noexcept{
-            if(index<this->bpp)
-                return 0;
-            return this->out_line[index-this->bpp];
+    return result;
+}
+constexpr static Crc32Tables CRC32_TABLES=crc32_tables();
+
+/// adler-32 modulus, the largest prime below 2^16
+static const uint32_t ADLER32_BASE=65521;
+/// largest number of bytes after which the adler-32 sums still fit into 32 bits, i.e. must be reduced (from zlib)
+static const uint32_t ADLER32_NMAX=5552;
+
+// the kernels are compiled once per instruction set, and the best set supported by the cpu is selected at runtime.
+// the generic set is available on every architecture.
+namespace png_kernels_generic{
+    #define KERNEL_TARGET
+    #define KERNEL_ISA cpu::Isa::GENERIC
+    #define KERNEL_ISA_GENERIC
+    #include "png/png_kernels.cpp"
+    #undef KERNEL_TARGET
+    #undef KERNEL_ISA
+    #undef KERNEL_ISA_GENERIC
+};
+#if defined(__x86_64__)
+    namespace png_kernels_ssse3{
+        #define KERNEL_TARGET gnu::target("ssse3")
+        #define KERNEL_ISA cpu::Isa::SSSE3
+        #define KERNEL_ISA_SSSE3
+        #include "png/png_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_SSSE3
+    };
+    namespace png_kernels_avx2{
+        #define KERNEL_TARGET gnu::target("avx2,pclmul")
+        #define KERNEL_ISA cpu::Isa::AVX2
+        #define KERNEL_ISA_AVX2
+        #include "png/png_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_AVX2
+    };
+    namespace png_kernels_avx512{
+        #define KERNEL_TARGET gnu::target("avx2,avx512f,avx512bw,pclmul")
+        #define KERNEL_ISA cpu::Isa::AVX512
+        #define KERNEL_ISA_AVX512
+        #include "png/png_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_AVX512
+    };
+#elif defined(__aarch64__)
+    namespace png_kernels_neon{
+        #define KERNEL_TARGET
+        #define KERNEL_ISA cpu::Isa::NEON
+        #define KERNEL_ISA_NEON
+        #include "png/png_kernels.cpp"
+        #undef KERNEL_TARGET
+        #undef KERNEL_ISA
+        #undef KERNEL_ISA_NEON
+    };
+#endif
+
+/// the kernels for the given instruction set (or the best set available below it)
+static const PngKernels* PngKernels_forIsa(const cpu::Isa isa){
+    switch(isa){
+        #if defined(__x86_64__)
+            case cpu::Isa::AVX512:
+                return &png_kernels_avx512::KERNELS;
+            case cpu::Isa::AVX2:
+                return &png_kernels_avx2::KERNELS;
+            case cpu::Isa::SSSE3:
+                return &png_kernels_ssse3::KERNELS;
+        #elif defined(__aarch64__)
+            case cpu::Isa::NEON:
+                return &png_kernels_neon::KERNELS;
+        #endif
+        default:
+            return &png_kernels_generic::KERNELS;
+    }
+}
+
+/// crc-32 of a chunk, which covers the 4 bytes of the chunk type (right before the data) and the data. the crc is stored after the data.
+static bool png_chunk_crc_matches(const PngKernels* const kernels,const uint8_t* const chunk_data,const uint32_t chunk_size){
+    const uint32_t computed_crc=kernels->crc32(0,chunk_data-4,(uint64_t)chunk_size+4);
+
+    uint32_t stored_crc;
+    memcpy(&stored_crc,chunk_data+chunk_size,4);
+    return computed_crc==bitUtil::byteswap(stored_crc,4);
+}
+
+/// ZLIBDecoder::verify_segment for the payloads of the IDAT chunks, with the PngKernels as user data
+static void png_verify_idat_crc(const bitStream::Segment* const segment,const void* const kernels){
+    if(!png_chunk_crc_matches((const PngKernels*)kernels,segment->data,(uint32_t)segment->size))
+        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png IDAT chunk crc mismatch");
+}
+
+/// adler-32 checksum of two pieces of data one after the other, from the checksums of the pieces and the size of the second one
+static uint32_t png_adler32_combine(const uint32_t adler_first,const uint32_t adler_second,const uint64_t second_size){
+    // the sums of each piece start at one. appending n bytes adds their sum to s1, and n times the s1 of the first piece to s2.
+    const uint64_t n=second_size%ADLER32_BASE;
+    const uint64_t s1_first=adler_first&0xFFFF;
+    const uint64_t s2_first=adler_first>>16;
+    const uint64_t s1_second=adler_second&0xFFFF;
+    const uint64_t s2_second=adler_second>>16;
+
+    const uint64_t s1=(s1_first+s1_second+ADLER32_BASE-1)%ADLER32_BASE;
+    const uint64_t s2=(s2_first+s2_second+n*s1_first+ADLER32_BASE-n)%ADLER32_BASE;
+    return (uint32_t)(s1|(s2<<16));
+}
+
+/// fail with DATA_CORRUPT if the filter type of one of the scanlines [scanline_start;scanline_end) is invalid. in points to the
+/// first of them.
+static void png_check_filter_types(const uint8_t* const in,const uint64_t scanline_width,const uint32_t scanline_start,const uint32_t scanline_end){
+    for(uint32_t scanline_index=scanline_start;scanline_index<scanline_end;scanline_index++){
+        const uint8_t filter_type=in[(uint64_t)(scanline_index-scanline_start)*scanline_width];
+        if(filter_type>PNG_SCANLINE_FILTER_PAETH)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png filter type %d in scanline %d",filter_type,scanline_index);
+    }
+}
+
+/// make the pixels whose greyscale or rgb samples (of 8 or 16 bits, before narrowing) equal the transparent key fully transparent
+static void png_apply_transparent_key(
+    const uint8_t* const samples,
+    uint8_t* const out,
+    const uint32_t num_pixels,
+    const uint32_t num_channels,
+    const uint32_t bit_depth,
+    const uint16_t* const transparent_key
+){
+    const uint32_t bytes_per_sample=bit_depth/8;
+    for(uint32_t pix=0;pix<num_pixels;pix++){
+        const uint8_t* const pixel=samples+(uint64_t)pix*num_channels*bytes_per_sample;
+
+        bool matches=true;
+        for(uint32_t c=0;c<num_channels;c++){
+            const uint16_t sample=bytes_per_sample==2?(uint16_t)((pixel[c*2]<<8)|pixel[c*2+1]):pixel[c];
+            matches&=sample==transparent_key[c];
         }
+        if(matches)
+            out[(uint64_t)pix*4+3]=0;
+    }
+}
 
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t above(uint32_t index)const noexcept{
-            if(this->in_line_prev==NULL)
-                return 0;
-            return this->in_line_prev[index];
+/// one of the reduced images that an interlaced image is stored as, which covers the pixels x_start+i*x_step,y_start+j*y_step
+/// of the final image. the image data holds the filtered scanlines of the passes one after the other, and the first scanline
+/// of each pass is filtered without a previous scanline. an image that is not interlaced is a single pass over all pixels.
+typedef struct PngPass{
+    uint32_t x_start;
+    uint32_t y_start;
+    uint32_t x_step;
+    uint32_t y_step;
+    /// size of the reduced image, a pass without pixels is empty (and has no scanlines in the image data)
+    uint32_t width;
+    uint32_t height;
+    /// number of bytes of a filtered scanline, including the filter type byte
+    uint64_t scanline_width;
+    /// offset of the first scanline in the image data
+    uint64_t data_start;
+}PngPass;
+
+/// x_start, y_start, x_step and y_step of the adam7 passes
+static const uint8_t PNG_ADAM7_PASSES[7][4]={
+    {0,0,8,8},
+    {4,0,8,8},
+    {0,4,4,8},
+    {2,0,4,4},
+    {0,2,2,4},
+    {1,0,2,2},
+    {0,1,1,2},
+};
+static const uint32_t PNG_ADAM7_NUM_PASSES=7;
+
+/// fill the pixels of an adam7 interlaced image that the passes up to completed_pass_index have not decoded yet with the decoded
+/// pixel above and to the left of them, i.e. the decoded pixels are shown as blocks (see ImagePassCallback). the pixels of each
+/// block are decoded by the later passes, and the blocks are as large as the steps of the next pass.
+static void png_fill_interlace_blocks(
+    uint8_t* const pixels,
+    const uint32_t width,
+    const uint32_t height,
+    const uint64_t stride,
+    const uint32_t completed_pass_index
+){
+    const uint32_t block_width=PNG_ADAM7_PASSES[completed_pass_index+1][2];
+    const uint32_t block_height=PNG_ADAM7_PASSES[completed_pass_index+1][3];
+
+    for(uint32_t y=0;y<height;y++){
+        uint8_t* const row=pixels+(uint64_t)y*stride;
+
+        // the first row of a block is filled from the decoded pixels, the others are copies of it
+        if(y%block_height==0){
+            for(uint32_t x=0;x<width;x+=block_width){
+                const uint32_t block_end=bitUtil::min(x+block_width,width);
+                for(uint32_t fill_x=x+1;fill_x<block_end;fill_x++)
+                    memcpy(row+(uint64_t)fill_x*4,row+(uint64_t)x*4,4);
+            }
+        }else{
+            memcpy(row,row-(uint64_t)(y%block_height)*stride,(uint64_t)width*4);
         }
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t above_rev(uint32_t index)const noexcept{
-            if(this->out_line_prev==NULL)
-                return 0;
-            return this->out_line_prev[index];
+    }
+}
+
+/// unfilters scanlines of the inflated image data and converts them into the final pixel buffer. the unfiltered samples of
+/// the current and the previous scanline are kept in lines (the filters refer to the previous scanline).
+typedef struct PngScanlineConverter{
+    const PngKernels* kernels;
+    /// the pass whose scanlines are converted
+    const PngPass* pass;
+    uint8_t color_type;
+    uint8_t bit_depth;
+    /// bytes per pixel, as used by the filters (i.e. one for less than 8 bits per pixel)
+    uint32_t bpp;
+    /// bgra pixels that palette indices (and greyscale samples of less than 8 bits) are looked up in
+    const uint32_t* palette;
+    /// NULL if there are no transparent samples besides the ones in palette
+    const uint16_t* transparent_key;
+    uint8_t* lines[2];
+    /// image width*4 bytes for the narrowed or unpacked samples of a scanline
+    uint8_t* samples;
+    /// image width*4 bytes for the bgra pixels of a scanline of a reduced image, before they are scattered into the final image
+    /// (NULL if the image is not interlaced)
+    uint8_t* pass_pixels;
+    /// final bgra pixels, stride bytes per scanline
+    uint8_t* pixels;
+    uint64_t stride;
+
+    /// unfilter and convert the scanlines [scanline_start;scanline_end) of the pass, which must directly follow the scanlines
+    /// converted before. in points to the first of them, their filter types must be valid (see png_check_filter_types).
+    void convert(const uint8_t* const in,const uint32_t scanline_start,const uint32_t scanline_end)const{
+        const PngPass* const pass=this->pass;
+        const uint64_t num_bytes=pass->scanline_width-1;
+        for(uint32_t scanline_index=scanline_start;scanline_index<scanline_end;scanline_index++){
+            uint8_t* const out_line=this->lines[scanline_index%2];
+            const uint8_t* const out_line_prev=scanline_index>0?this->lines[(scanline_index+1)%2]:NULL;
+
+            this->kernels->unfilter_scanline(in+(uint64_t)(scanline_index-scanline_start)*pass->scanline_width,out_line,out_line_prev,num_bytes,this->bpp);
+
+            uint8_t* const out=this->pixels+(uint64_t)(pass->y_start+scanline_index*pass->y_step)*this->stride+(uint64_t)pass->x_start*4;
+            if(pass->x_step==1){
+                this->expand(out_line,out);
+            }else{
+                this->expand(out_line,this->pass_pixels);
+                this->kernels->scatter_pixels(this->pass_pixels,out,pass->width,pass->x_step);
+            }
         }
+    }
 
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t previousAbove(uint32_t index)const noexcept{
-            if(this->in_line_prev==NULL)
-                return 0;
-            if(index<this->bpp)
-                return 0;
-            return this->in_line_prev[index-this->bpp];
+    /// expand the unfiltered samples of a scanline to bgra pixels
+    void expand(const uint8_t* const line,uint8_t* const out)const{
+        const PngKernels* const kernels=this->kernels;
+        const uint32_t num_channels=PNGColorType_numChannels(this->color_type);
+        const uint32_t width=this->pass->width;
+
+        const uint8_t* samples=line;
+        if(this->bit_depth==16){
+            kernels->narrow_16_to_8(line,this->samples,(uint64_t)width*num_channels);
+            samples=this->samples;
+        }else if(this->bit_depth<8){
+            kernels->unpack_samples(line,this->samples,width,this->bit_depth);
+            samples=this->samples;
         }
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t previousAbove_rev(uint32_t index)const noexcept{
-            if(this->out_line_prev==NULL)
-                return 0;
-            if(index<this->bpp)
-                return 0;
-            return this->out_line_prev[index-this->bpp];
+
+        switch(this->color_type){
+            case PNG_COLOR_TYPE_GREYSCALE:
+                // the levels of greyscale samples of less than 8 bits are in palette
+                if(this->bit_depth<8)
+                    kernels->palette_to_bgra(samples,out,width,this->palette,true);
+                else
+                    kernels->grey_to_bgra(samples,out,width);
+                break;
+            case PNG_COLOR_TYPE_RGB:
+                kernels->rgb_to_bgra(samples,out,width);
+                break;
+            case PNG_COLOR_TYPE_PALETTE:
+                kernels->palette_to_bgra(samples,out,width,this->palette,this->bit_depth<8);
+                break;
+            case PNG_COLOR_TYPE_GREYSCALEALPHA:
+                kernels->grey_alpha_to_bgra(samples,out,width);
+                break;
+            case PNG_COLOR_TYPE_RGBA:
+                kernels->rgba_to_bgra(samples,out,width);
+                break;
         }
 
-        [[gnu::hot,gnu::flatten]]
-        inline static int abs_sub(const int a,const int b)noexcept{
-            int diff=a-b;
-            if(diff<0)
-                return -diff;
-            return diff;
+        if(this->transparent_key)
+            png_apply_transparent_key(line,out,width,num_channels,this->bit_depth,this->transparent_key);
+    }
+}PngScanlineConverter;
+
+/// shared state of the inflate thread and the unfilter thread of a pipelined decode
+struct PngUnfilter_Arguments{
+    const PngScanlineConverter* converter;
+    uint32_t num_scanlines;
+    /// start of the inflate window, which holds the inflated data from byte num_discarded_bytes on
+    const uint8_t* window;
+
+    /// written by the inflate thread: number of scanlines that have been inflated (and whose filter types are valid), and
+    /// the matching num_discarded_bytes. the window is only moved while all inflated scanlines have been unfiltered.
+    std::atomic<uint32_t> num_scanlines_inflated{0};
+    std::atomic<uint64_t> num_discarded_bytes{0};
+    /// written by the unfilter thread: number of scanlines that have been unfiltered and converted
+    std::atomic<uint32_t> num_scanlines_unfiltered{0};
+    /// set by the inflate thread if the decode failed, so that the unfilter thread stops waiting for scanlines
+    std::atomic<bool> cancelled{false};
+};
+void* PngUnfilter_pthread(struct PngUnfilter_Arguments* args){
+    Trace_setThreadName("unfilter worker");
+
+    // start of the current wait for scanlines (the sleeps of a wait are recorded as a single event), 0 if not waiting or not tracing
+    uint64_t wait_begin=0;
+
+    uint32_t scanline_start=0;
+    while(scanline_start<args->num_scanlines && !args->cancelled.load()){
+        const uint32_t scanline_end=args->num_scanlines_inflated.load(std::memory_order_acquire);
+
+        if(scanline_end>scanline_start){
+            if(wait_begin){
+                Trace_record("wait for scanlines",wait_begin,scanline_start,scanline_end);
+                wait_begin=0;
+            }
+
+            {
+                const TraceScope unfilter_trace_scope{"unfilter",scanline_start,scanline_end};
+
+                const uint64_t num_discarded_bytes=args->num_discarded_bytes.load(std::memory_order_relaxed);
+                const uint8_t* const in=args->window+(uint64_t)scanline_start*args->converter->pass->scanline_width-num_discarded_bytes;
+                args->converter->convert(in,scanline_start,scanline_end);
+            }
+
+            scanline_start=scanline_end;
+            args->num_scanlines_unfiltered.store(scanline_start,std::memory_order_release);
+        }else{
+            if(!wait_begin && trace_enabled.load(std::memory_order_relaxed))
+                wait_begin=cpu::timestamp();
+
+            struct timespec sleeptime={.tv_sec=0,.tv_nsec=100000};
+            nanosleep(&sleeptime, NULL);
         }
+    }
+
+    if(wait_begin)
+        Trace_record("wait for scanlines",wait_begin);
+
+    return NULL;
+}
+
+/// the image data from one restart point to the next (see Image_write_png), which can be inflated and unfiltered independently of
+/// the other parts
+typedef struct PngPart{
+    /// the compressed data of the part, i.e. the payloads of the IDAT chunks it spans (the first and the last one cut at the
+    /// restart points)
+    const bitStream::Segment* input_segments;
+    uint64_t num_input_segments;
+    bool first;
+    bool last;
+    /// the scanlines of the part, as a pass that starts at its first scanline (and at the start of the data of the part)
+    PngPass pass;
+
+    /// written by the thread that decodes the part: the adler-32 checksum of its data (and the checksum at the end of the
+    /// stream, for the last part), and the number of bit buffer refills
+    uint32_t adler;
+    uint32_t stored_adler;
+    uint64_t num_bitstream_refills;
+}PngPart;
+
+/// shared state of the threads that decode the parts of an image
+struct PngParts_Arguments{
+    PngPart* parts;
+    uint32_t num_parts;
+    /// the converter of the image, whose pass and scanline buffers are replaced by each thread
+    const PngScanlineConverter* converter;
+    /// size of the inflate window of each thread
+    uint64_t window_size;
+    bool verify_checksums;
+
+    /// index of the next part that no thread has started on
+    std::atomic<uint32_t> next_part{0};
+    /// set if a part could not be decoded, which stops the other threads
+    std::atomic<bool> failed{false};
+    /// index of the next worker thread that starts, names the thread in the trace
+    std::atomic<uint32_t> next_worker_index{0};
+};
 
-        [[gnu::hot,gnu::flatten]]
-        inline uint8_t paethPredictor_rev(const uint32_t index)const noexcept{
-            const auto a = this->previous_rev(index);
-            const auto b = this->above_rev(index);
-            const auto c = this->previousAbove_rev(index);
+/// inflate, unfilter and convert the scanlines of part, with a window of window_size bytes (the unfiltered scanlines and samples
+/// are those of converter). throws like the serial decode if the part cannot be decoded.
+static void png_decode_part(PngPart* const part,PngScanlineConverter* const converter,uint8_t* const window,const uint64_t window_size,const bool verify_checksums){
+    const PngPass* const pass=&part->pass;
+    const uint64_t part_data_size=pass->scanline_width*pass->height;
 
-            // from stb_image.h
-            const auto p=a+b-c;
-            const auto pa=abs_sub(p,a);
-            const auto pb=abs_sub(p,b);
-            const auto pc=abs_sub(p,c);
+    ZLIBDecoder zlib_decoder{
+        part->input_segments,
+        part->num_input_segments,
+        window_size,
+        window
+    };
+    zlib_decoder.first_part=part->first;
+    zlib_decoder.last_part=part->last;
+    if(verify_checksums)
+        zlib_decoder.adler32=converter->kernels->adler32;
+    zlib_decoder.begin();
+
+    converter->pass=pass;
+
+    // like the serial decode, with a single pass
+    uint32_t scanline_index=0;
+    while(scanline_index<pass->height){
+        const uint64_t window_end=part_data_size-zlib_decoder.num_discarded_bytes;
+        if(window_end<=window_size)
+            zlib_decoder.decode_some(window_end,true);
+        else
+            zlib_decoder.decode_some(window_size,false);
+
+        const uint32_t scanline_end=(uint32_t)bitUtil::min((zlib_decoder.num_discarded_bytes+zlib_decoder.out_offset)/pass->scanline_width,(uint64_t)pass->height);
+        const uint8_t* const in=window+(uint64_t)scanline_index*pass->scanline_width-zlib_decoder.num_discarded_bytes;
+        png_check_filter_types(in,pass->scanline_width,scanline_index,scanline_end);
+        // the previous scanline is in another part, i.e. the first scanline must not be filtered against it
+        if(!part->first && scanline_index==0 && scanline_end>0 && in[0]!=PNG_SCANLINE_FILTER_NONE && in[0]!=PNG_SCANLINE_FILTER_SUB)
+            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png part at scanline %d is filtered against the previous scanline",pass->y_start);
+        converter->convert(in,scanline_index,scanline_end);
+        scanline_index=scanline_end;
+
+        if(zlib_decoder.finished)
+            break;
+
+        const uint64_t unprocessed_start=(uint64_t)scanline_index*pass->scanline_width-zlib_decoder.num_discarded_bytes;
+        const uint64_t match_window_start=zlib_decoder.out_offset>PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE?zlib_decoder.out_offset-PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE:0;
+        zlib_decoder.discard_output(bitUtil::min(unprocessed_start,match_window_start));
+    }
+    // a part must end exactly at the next restart point
+    if(scanline_index<pass->height || !zlib_decoder.finished)
+        parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png part at scanline %d ends early",pass->y_start);
+
+    part->adler=zlib_decoder.adler;
+    part->stored_adler=zlib_decoder.stored_adler;
+    part->num_bitstream_refills=zlib_decoder.num_bitstream_refills;
+}
 
-            if(pa<=pb && pa<=pc)
-                return a;
+/// decode parts until none are left (or one failed), on the calling thread
+static void PngParts_decode(struct PngParts_Arguments* const args){
+    const PngScanlineConverter* const image_converter=args->converter;
+    const uint64_t defiltered_scanline_width=image_converter->pass->scanline_width-1;
+    const uint64_t samples_size=(uint64_t)image_converter->pass->width*4;
 
-            if(pb<=pc)
-                return b;
+    uint8_t* const buffer=(uint8_t*)malloc(args->window_size+2*defiltered_scanline_width+samples_size);
+    if(!buffer){
+        args->failed.store(true);
+        return;
+    }
 
-            return c;
+    PngScanlineConverter converter=*image_converter;
+    converter.lines[0]=buffer+args->window_size;
+    converter.lines[1]=buffer+args->window_size+defiltered_scanline_width;
+    converter.samples=buffer+args->window_size+2*defiltered_scanline_width;
+
+    while(!args->failed.load(std::memory_order_relaxed)){
+        const uint32_t part_index=args->next_part.fetch_add(1);
+        if(part_index>=args->num_parts)
+            break;
+
+        PngPart* const part=&args->parts[part_index];
+        try{
+            const TraceScope part_trace_scope{"decode part",part->pass.y_start,part->pass.y_start+part->pass.height};
+            png_decode_part(part,&converter,buffer,args->window_size,args->verify_checksums);
+        }catch(const ImageParseResult){
+            args->failed.store(true);
         }
+    }
 
-        [[gnu::hot,gnu::flatten]]
-        inline void process_scanline()noexcept{
-            uint8_t scanline_filter_byte=in_line[0];
-            in_line++;
+    free(buffer);
+}
+void* PngParts_pthread(struct PngParts_Arguments* args){
+    Trace_setThreadName("part worker",args->next_worker_index.fetch_add(1,std::memory_order_relaxed));
+    PngParts_decode(args);
+    return NULL;
+}
 
-            PNGScanlineFilter scanline_filter=(PNGScanlineFilter)scanline_filter_byte;
-            switch(scanline_filter){
-                case PNG_SCANLINE_FILTER_NONE:
-                    for(uint32_t index=0;index<this->scanline_width-1;index++){
-                        out_line[index]=this->raw(index);
-                    }
-                    break;
-                case PNG_SCANLINE_FILTER_SUB:
-                    for(uint32_t index=0;index<this->scanline_width-1;index++){
-                        out_line[index]=this->raw(index) + this->previous_rev(index);
-                    }
-                    break;
-                case PNG_SCANLINE_FILTER_UP:
-                    for(uint32_t index=0;index<this->scanline_width-1;index++){
-                        out_line[index]=this->raw(index) + this->above_rev(index);
-                    }
-                    break;
-                case PNG_SCANLINE_FILTER_AVERAGE:
-                    for(uint32_t index=0;index<this->scanline_width-1;index++){
-                        out_line[index]=this->raw(index) + static_cast<uint8_t>((this->previous_rev(index)+this->above_rev(index))/2);
-                    }
-                    break;
-                case PNG_SCANLINE_FILTER_PAETH:
-                    for(uint32_t index=0;index<this->scanline_width-1;index++){
-                        uint8_t res=this->raw(index) + this->paethPredictor_rev(index);
+/// decode the image data in the parts between the restart points of the rsPT chunk (see Image_write_png) on up to num_threads
+/// threads, with converter (which converts the single pass of a non-interlaced image).
+///
+/// returns false if the parts cannot be decoded independently of each other, e.g. the restart points are not valid, a part
+/// refers to the data of the part before it or does not end with a flush (see ZLIBDecoder::decode_some), or the data is corrupt. the image data must then be decoded serially, which also
+/// reports the error of corrupt data. peak_memory_bytes and num_bitstream_refills receive the stats of the decode.
+static bool png_decode_parts(
+    const uint8_t* const restart_points,
+    const uint32_t num_restart_points,
+    const bitStream::Segment* const idat_segments,
+    const uint64_t num_idat_segments,
+    const uint64_t data_size,
+    const PngScanlineConverter* const converter,
+    const uint32_t num_threads,
+    const bool verify_checksums,
+    uint64_t* const peak_memory_bytes,
+    uint64_t* const num_bitstream_refills
+){
+    const PngPass* const image_pass=converter->pass;
+    const uint32_t num_parts=num_restart_points+1;
+
+    // the parts hold increasing ranges of scanlines and of the compressed data, the first one starts with the zlib header
+    const auto restart_point=[&](const uint32_t part_index,uint32_t* const first_scanline,uint64_t* const data_offset){
+        if(part_index==0){
+            *first_scanline=0;
+            *data_offset=0;
+        }else if(part_index==num_parts){
+            *first_scanline=image_pass->height;
+            *data_offset=data_size;
+        }else{
+            uint32_t entry[2];
+            memcpy(entry,restart_points+(uint64_t)(part_index-1)*8,8);
+            *first_scanline=bitUtil::byteswap(entry[0],4);
+            *data_offset=bitUtil::byteswap(entry[1],4);
+        }
+    };
+    for(uint32_t part_index=0;part_index<num_parts;part_index++){
+        uint32_t first_scanline,next_first_scanline;
+        uint64_t data_offset,next_data_offset;
+        restart_point(part_index,&first_scanline,&data_offset);
+        restart_point(part_index+1,&next_first_scanline,&next_data_offset);
+        if(next_first_scanline<=first_scanline || next_data_offset<=data_offset)
+            return false;
+    }
 
-                        out_line[index]=res;
-                    }
-                    break;
-            }
+    // a part may cut an IDAT payload at each of its ends, i.e. the parts have at most one segment per part more than the image data
+    PngPart* const parts=(PngPart*)malloc(sizeof(PngPart)*num_parts+sizeof(bitStream::Segment)*(num_idat_segments+num_parts));
+    if(!parts)
+        return false;
+    bitStream::Segment* const part_segments=(bitStream::Segment*)(parts+num_parts);
+
+    uint64_t num_part_segments=0;
+    uint64_t max_part_data_size=0;
+    // the IDAT payload that contains the start of the current part, and its offset in the compressed data
+    uint64_t idat_index=0;
+    uint64_t idat_offset=0;
+    for(uint32_t part_index=0;part_index<num_parts;part_index++){
+        PngPart* const part=&parts[part_index];
+
+        uint32_t first_scanline,next_first_scanline;
+        uint64_t data_start,data_end;
+        restart_point(part_index,&first_scanline,&data_start);
+        restart_point(part_index+1,&next_first_scanline,&data_end);
+
+        while(idat_offset+idat_segments[idat_index].size<=data_start){
+            idat_offset+=idat_segments[idat_index].size;
+            idat_index++;
         }
-};
+
+        part->input_segments=part_segments+num_part_segments;
+        for(uint64_t index=idat_index,offset=idat_offset;index<num_idat_segments && offset<data_end;offset+=idat_segments[index].size,index++){
+            const uint64_t segment_start=bitUtil::max(data_start,offset);
+            const uint64_t segment_end=bitUtil::min(data_end,offset+idat_segments[index].size);
+            part_segments[num_part_segments++]={idat_segments[index].data+(segment_start-offset),segment_end-segment_start};
+        }
+        part->num_input_segments=(uint64_t)(part_segments+num_part_segments-part->input_segments);
+        part->first=part_index==0;
+        part->last=part_index==num_parts-1;
+
+        part->pass=*image_pass;
+        part->pass.y_start=first_scanline;
+        part->pass.height=next_first_scanline-first_scanline;
+        part->pass.data_start=0;
+
+        max_part_data_size=bitUtil::max(max_part_data_size,part->pass.scanline_width*part->pass.height);
+    }
+
+    // the window of each thread, see the serial decode
+    const uint64_t window_size=bitUtil::min(
+        bitUtil::max(
+            (uint64_t)PNG_INFLATE_WINDOW_MIN_SIZE,
+            PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE+2*image_pass->scanline_width+DEFLATE_MAX_MATCH_LENGTH+DEFLATE_MATCH_COPY_OVERSHOOT
+        ),
+        max_part_data_size
+    );
+
+    struct PngParts_Arguments args;
+    args.parts=parts;
+    args.num_parts=num_parts;
+    args.converter=converter;
+    args.window_size=window_size;
+    args.verify_checksums=verify_checksums;
+
+    // the calling thread decodes parts as well
+    const uint32_t max_num_workers=bitUtil::min(num_threads,num_parts)-1;
+    pthread_t workers[PNG_MAX_PART_WORKERS];
+    uint32_t num_workers=0;
+    while(num_workers<bitUtil::min(max_num_workers,PNG_MAX_PART_WORKERS) && pthread_create(&workers[num_workers], NULL, (pthread_callback)PngParts_pthread, &args)==0)
+        num_workers++;
+
+    // the crcs of the IDAT chunks are verified as a whole, since the parts may cut their payloads
+    if(verify_checksums)
+        for(uint64_t i=0;i<num_idat_segments;i++)
+            if(!png_chunk_crc_matches(converter->kernels,idat_segments[i].data,(uint32_t)idat_segments[i].size)){
+                args.failed.store(true);
+                break;
+            }
+
+    PngParts_decode(&args);
+
+    for(uint32_t i=0;i<num_workers;i++)
+        pthread_join(workers[i],NULL);
+
+    bool decoded=!args.failed.load();
+    if(decoded && verify_checksums){
+        uint32_t adler=parts[0].adler;
+        for(uint32_t part_index=1;part_index<num_parts;part_index++)
+            adler=png_adler32_combine(adler,parts[part_index].adler,parts[part_index].pass.scanline_width*parts[part_index].pass.height);
+        decoded=adler==parts[num_parts-1].stored_adler;
+    }
+
+    *peak_memory_bytes=(uint64_t)(num_workers+1)*(window_size+2*(image_pass->scanline_width-1)+(uint64_t)image_pass->width*4);
+    *num_bitstream_refills=0;
+    if(decoded)
+        for(uint32_t part_index=0;part_index<num_parts;part_index++)
+            *num_bitstream_refills+=parts[part_index].num_bitstream_refills;
+
+    free(parts);
+    return decoded;
+}
 
 /// spec at http://www.libpng.org/pub/png/spec/1.2/PNG-Compression.html
 ImageParseResult Image_read_png(
     const char* const filepath,
-    ImageData* const  image_data
+    ImageData* const  image_data,
+    const ImageDecodeOptions* const options
 ){
-    double start_time=current_time();
+    const TraceScope trace_scope{"decode png"};
+
+    const ImageDecodeStats* const requested_stats=options?options->stats:NULL;
+    const ImageDecodePerfCounters* const perf_counters=options?options->perf_counters:NULL;
+    const bool verify_checksums=options?options->verify_checksums:true;
+
+    // stats are always collected in debug builds (and printed after the decode)
+    ImageDecodeStats stats{};
+    #ifdef DEBUG
+        ImageDecodeStageTimer timer{&stats,perf_counters};
+    #else
+        ImageDecodeStageTimer timer{requested_stats?&stats:NULL,perf_counters};
+    #endif
+
+    // the payloads of the IDAT chunks, in file order. together they form a single zlib stream (RFC 1950), which is
+    // decoded directly from the file contents.
+    bitStream::Segment* idat_segments=NULL;
+    uint64_t num_idat_segments=0;
+    uint64_t idat_segments_capacity=0;
+    uint64_t data_size=0;
 
-    PngParser parser{filepath,image_data};
+    uint8_t* defiltered_output_buffer=NULL;
 
-    const char* PNG_SIGNATURE="\x89PNG\r\n\x1a\n";
-    parser.expect_signature((const uint8_t*)(PNG_SIGNATURE), 8);
+    try{
+        PngParser parser{filepath,image_data};
 
-    // accumulated IDAT contents
-    uint64_t data_size=0;
-    uint8_t *data_buffer=NULL;
+        try{
+            const PngKernels* const kernels=PngKernels_forIsa(cpu::isa());
 
-    bool parsing_done=false;
-    while(parser.current_file_content_index<parser.file_size && !parsing_done){
-        uint32_t bytes_in_chunk=bitUtil::byteswap(parser.get_mem<uint32_t>(),4);
+            const char* PNG_SIGNATURE="\x89PNG\r\n\x1a\n";
+            parser.expect_signature((const uint8_t*)(PNG_SIGNATURE), 8);
 
-        if(bytes_in_chunk>MAX_CHUNK_SIZE){
-            fprintf(stderr,"png chunk too big. standard only allows up to 2^31 bytes\n");
-            return IMAGE_PARSE_RESULT_PNG_CHUNK_SIZE_EXCEEDED;
-        }
+            bool ihdr_found=false;
+            bool plte_found=false;
+            bool trns_found=false;
+            bool parsing_done=false;
+            while(parser.current_file_content_index<parser.file_size && !parsing_done){
+                uint32_t bytes_in_chunk=bitUtil::byteswap(parser.get_mem<uint32_t>(),4);
 
-        uint32_t chunk_type=parser.get_mem<uint32_t>();
+                if(bytes_in_chunk>MAX_CHUNK_SIZE)
+                    parse_fail(IMAGE_PARSE_RESULT_PNG_CHUNK_SIZE_EXCEEDED,"png chunk too big. standard only allows up to 2^31 bytes");
 
-        switch(chunk_type){
-            case CHUNK_TYPE_IHDR:
-                {
-                    parser.ihdr_data=parser.get_mem<struct IHDR,false>();
-                    parser.ihdr_data.width=bitUtil::byteswap(parser.ihdr_data.width,4);
-                    parser.ihdr_data.height=bitUtil::byteswap(parser.ihdr_data.height,4);
+                uint32_t chunk_type=parser.get_mem<uint32_t>();
 
-                    image_data->height=parser.ihdr_data.height;
-                    image_data->width=parser.ihdr_data.width;
-                    image_data->interleaved=true;
+                // chunk data and crc
+                parser.require_bytes((uint64_t)bytes_in_chunk+4);
+
+                if(!ihdr_found && chunk_type!=CHUNK_TYPE_IHDR)
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"first png chunk is not IHDR");
+
+                // the crc of the IDAT chunks is verified while their data is decompressed (see png_verify_idat_crc)
+                if(verify_checksums && chunk_type!=CHUNK_TYPE_IDAT && !png_chunk_crc_matches(kernels,parser.data_ptr(),bytes_in_chunk)){
+                    uint8_t chunk_name[5];
+                    chunk_name[4]=0;
+                    memcpy(chunk_name,&chunk_type,4);
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png %s chunk crc mismatch",chunk_name);
+                }
 
-                    switch(PNGColorType(parser.ihdr_data.color_type)){
-                        case PNG_COLOR_TYPE_RGBA:
-                            switch(parser.ihdr_data.bit_depth){
-                                case 8:
-                                    image_data->pixel_format=PIXEL_FORMAT_Ru8Gu8Bu8Au8;
+                switch(chunk_type){
+                    case CHUNK_TYPE_IHDR:
+                        {
+                            if(ihdr_found || bytes_in_chunk<sizeof(struct IHDR))
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png IHDR chunk");
+                            ihdr_found=true;
+
+                            parser.ihdr_data=parser.get_mem<struct IHDR,false>();
+                            parser.ihdr_data.width=bitUtil::byteswap(parser.ihdr_data.width,4);
+                            parser.ihdr_data.height=bitUtil::byteswap(parser.ihdr_data.height,4);
+
+                            if(parser.ihdr_data.width==0 || parser.ihdr_data.height==0)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png image size is %dx%d",parser.ihdr_data.width,parser.ihdr_data.height);
+                            if(parser.ihdr_data.compression_method!=PNG_COMPRESSION_METHOD_ZLIB || parser.ihdr_data.filter_method!=PNG_FILTER_METHOD_ADAPTIVE)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png compression method %d or filter method %d",parser.ihdr_data.compression_method,parser.ihdr_data.filter_method);
+                            if(parser.ihdr_data.interlace_method!=PNG_INTERLACE_NONE && parser.ihdr_data.interlace_method!=PNG_INTERLACE_ADAM7)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png interlace method %d",parser.ihdr_data.interlace_method);
+
+                            image_data->height=parser.ihdr_data.height;
+                            image_data->width=parser.ihdr_data.width;
+                            image_data->stride=(uint64_t)parser.ihdr_data.width*4;
+                            image_data->interleaved=true;
+
+                            if(PNGColorType_numChannels(parser.ihdr_data.color_type)==0)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"unknown png colour type %d",parser.ihdr_data.color_type);
+                            if(!PNGColorType_allowsBitDepth(parser.ihdr_data.color_type,parser.ihdr_data.bit_depth))
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png bit depth %d for colour type %s",parser.ihdr_data.bit_depth,PNGColorType_name(parser.ihdr_data.color_type));
+
+                            // all colour types and bit depths are expanded to 8 bit bgra
+                            image_data->pixel_format=PIXEL_FORMAT_Ru8Gu8Bu8Au8;
+                        }
+                        break;
+                    case CHUNK_TYPE_PLTE:
+                        {
+                            if(plte_found || bytes_in_chunk==0 || bytes_in_chunk%3!=0 || bytes_in_chunk/3>256)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png PLTE chunk of %d bytes",bytes_in_chunk);
+                            if(num_idat_segments>0)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png PLTE chunk after IDAT chunk");
+                            plte_found=true;
+
+                            // the palette is only a suggestion for other colour types, i.e. ignored here
+                            if(parser.ihdr_data.color_type!=PNG_COLOR_TYPE_PALETTE)
+                                break;
+
+                            const uint32_t num_entries=bytes_in_chunk/3;
+                            if(num_entries>(1u<<parser.ihdr_data.bit_depth))
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png palette of %d entries for %d bit indices",num_entries,parser.ihdr_data.bit_depth);
+
+                            const uint8_t* const rgb=parser.data_ptr();
+                            for(uint32_t i=0;i<num_entries;i++)
+                                parser.palette[i]=png_bgra(rgb[i*3+2],rgb[i*3+1],rgb[i*3+0],0xFF);
+                            parser.num_palette_entries=num_entries;
+                        }
+                        break;
+                    case CHUNK_TYPE_TRNS:
+                        {
+                            if(trns_found || num_idat_segments>0)
+                                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png tRNS chunk repeated or after IDAT chunk");
+                            trns_found=true;
+
+                            const uint8_t* const data=parser.data_ptr();
+                            switch(parser.ihdr_data.color_type){
+                                case PNG_COLOR_TYPE_PALETTE:
+                                    // one alpha value per palette entry, the entries after the last one are opaque
+                                    if(!plte_found || bytes_in_chunk>parser.num_palette_entries)
+                                        parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png tRNS chunk of %d bytes for %d palette entries",bytes_in_chunk,parser.num_palette_entries);
+                                    for(uint32_t i=0;i<bytes_in_chunk;i++)
+                                        ((uint8_t*)&parser.palette[i])[3]=data[i];
+                                    break;
+                                case PNG_COLOR_TYPE_GREYSCALE:
+                                case PNG_COLOR_TYPE_RGB:
+                                    {
+                                        const uint32_t num_channels=PNGColorType_numChannels(parser.ihdr_data.color_type);
+                                        if(bytes_in_chunk!=num_channels*2)
+                                            parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"invalid png tRNS chunk of %d bytes for colour type %s",bytes_in_chunk,PNGColorType_name(parser.ihdr_data.color_type));
+                                        for(uint32_t c=0;c<num_channels;c++)
+                                            parser.transparent_key[c]=(uint16_t)((data[c*2]<<8)|data[c*2+1]);
+                                        parser.has_transparent_key=true;
+                                    }
                                     break;
                                 default:
-                                    bail(FATAL_UNEXPECTED_ERROR,"TODO unknown bit depth %d",parser.ihdr_data.bit_depth);
+                                    // colour types with an alpha channel must not have a tRNS chunk, which is ignored (like libpng does)
+                                    break;
                             }
-                            break;
-                        case PNG_COLOR_TYPE_RGB:
-                        case PNG_COLOR_TYPE_GREYSCALE:
-                        case PNG_COLOR_TYPE_GREYSCALEALPHA:
-                        case PNG_COLOR_TYPE_PALETTE:
-                            bail(FATAL_UNEXPECTED_ERROR,"TODO pixel format %s",PNGColorType_name(parser.ihdr_data.color_type));
-                        default:
-                            bail(FATAL_UNEXPECTED_ERROR,"unknown pixel format");
-                    }
+                        }
+                        break;
+                    case CHUNK_TYPE_IDAT:
+                        if(num_idat_segments==idat_segments_capacity){
+                            const uint64_t new_capacity=bitUtil::max(idat_segments_capacity*2,(uint64_t)16);
+                            bitStream::Segment* const new_idat_segments=(bitStream::Segment*)realloc(idat_segments,new_capacity*sizeof(bitStream::Segment));
+                            if(!new_idat_segments)
+                                parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+                            idat_segments=new_idat_segments;
+                            idat_segments_capacity=new_capacity;
+                        }
+                        idat_segments[num_idat_segments++]={parser.data_ptr(),bytes_in_chunk};
+                        data_size+=bytes_in_chunk;
+
+                        break;
+                    case CHUNK_TYPE_RSPT:
+                        // ancillary, i.e. a chunk that is repeated, invalid or after the first IDAT chunk is ignored (see
+                        // png_decode_parts), and the image data decoded serially
+                        if(!parser.restart_points && num_idat_segments==0 && bytes_in_chunk>0 && bytes_in_chunk%8==0){
+                            parser.restart_points=parser.data_ptr();
+                            parser.num_restart_points=bytes_in_chunk/8;
+                        }
+                        break;
+                    case CHUNK_TYPE_IEND:
+                        parsing_done=true;
+                        break;
+                    default:
+                        {
+                            uint8_t chunk_name[5];
+                            chunk_name[4]=0;
+                            memcpy(chunk_name,&chunk_type,4);
+                            bool chunk_type_significant=chunk_name[0]&0x80;
+                            printf("unknown chunk type %s (%ssignificant)\n",chunk_name,chunk_type_significant?"":"not ");
+                        }
                 }
-                break;
-            case CHUNK_TYPE_IDAT:
-                if(!data_buffer){
-                    data_buffer=(uint8_t*)malloc(bytes_in_chunk);
+                // skip the data and the crc
+                parser.current_file_content_index+=(uint64_t)bytes_in_chunk+4;
+            }
+
+            if(!ihdr_found)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png file contains no IHDR chunk");
+            if(num_idat_segments==0)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png file contains no IDAT chunk");
+            if(parser.ihdr_data.color_type==PNG_COLOR_TYPE_PALETTE && !plte_found)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_CORRUPT,"png palette image contains no PLTE chunk");
+
+            timer.lap(IMAGE_DECODE_STAGE_PARSE);
+
+            const uint8_t color_type=parser.ihdr_data.color_type;
+            const uint8_t bit_depth=parser.ihdr_data.bit_depth;
+            const uint32_t width=parser.ihdr_data.width;
+            const uint32_t height=parser.ihdr_data.height;
+            const uint64_t bits_per_pixel=(uint64_t)PNGColorType_numChannels(color_type)*bit_depth;
+            // the filters work on whole bytes, i.e. pixels of less than 8 bits are filtered as one byte
+            const uint32_t bytes_per_pixel=(uint32_t)bitUtil::max(bits_per_pixel/8,(uint64_t)1);
+            // samples of less than 8 bits are packed, scanlines start at a byte boundary
+            const uint64_t scanline_width=1+((uint64_t)width*bits_per_pixel+7)/8;
+            const uint64_t defiltered_scanline_width=scanline_width-1;
+            const uint64_t output_scanline_width=(uint64_t)width*4;
+            const bool interlaced=parser.ihdr_data.interlace_method==PNG_INTERLACE_ADAM7;
+
+            // greyscale samples of less than 8 bits are expanded through a palette of their levels, which also holds the
+            // transparent level
+            if(color_type==PNG_COLOR_TYPE_GREYSCALE && bit_depth<8){
+                const uint32_t max_level=(1u<<bit_depth)-1;
+                for(uint32_t level=0;level<=max_level;level++){
+                    const uint8_t grey=(uint8_t)(level*255/max_level);
+                    const bool transparent=parser.has_transparent_key && parser.transparent_key[0]==level;
+                    parser.palette[level]=png_bgra(grey,grey,grey,transparent?0:0xFF);
+                }
+                parser.has_transparent_key=false;
+            }
+
+            // one filter type byte per scanline, followed by the filtered pixels, for the scanlines of each pass
+            PngPass passes[PNG_ADAM7_NUM_PASSES];
+            const uint32_t num_passes=interlaced?PNG_ADAM7_NUM_PASSES:1;
+            uint64_t image_data_size=0;
+            for(uint32_t pass_index=0;pass_index<num_passes;pass_index++){
+                PngPass* const pass=&passes[pass_index];
+                if(interlaced){
+                    pass->x_start=PNG_ADAM7_PASSES[pass_index][0];
+                    pass->y_start=PNG_ADAM7_PASSES[pass_index][1];
+                    pass->x_step=PNG_ADAM7_PASSES[pass_index][2];
+                    pass->y_step=PNG_ADAM7_PASSES[pass_index][3];
                 }else{
-                    data_buffer=(uint8_t*)realloc(data_buffer,data_size+bytes_in_chunk);
+                    pass->x_start=pass->y_start=0;
+                    pass->x_step=pass->y_step=1;
                 }
-                memcpy(data_buffer+data_size,parser.data_ptr(),bytes_in_chunk);
-                data_size+=bytes_in_chunk;
+                pass->width=width>pass->x_start?(width-pass->x_start+pass->x_step-1)/pass->x_step:0;
+                pass->height=height>pass->y_start?(height-pass->y_start+pass->y_step-1)/pass->y_step:0;
+                if(pass->width==0)
+                    pass->height=0;
+                pass->scanline_width=1+((uint64_t)pass->width*bits_per_pixel+7)/8;
+                pass->data_start=image_data_size;
+
+                image_data_size+=pass->scanline_width*pass->height;
+            }
 
-                break;
-            case CHUNK_TYPE_IEND:
-                parsing_done=true;
-                break;
-            default:
-                {
-                    uint8_t chunk_name[5];
-                    chunk_name[4]=0;
-                    memcpy(chunk_name,&chunk_type,4);
-                    bool chunk_type_significant=chunk_name[0]&0x80;
-                    printf("unknown chunk type %s (%ssignificant)\n",chunk_name,chunk_type_significant?"":"not ");
+            // deflate compresses at most 1032:1, i.e. an image that large cannot be stored in the data (and is not allocated)
+            if(image_data_size/1032>data_size)
+                parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png image data of %" PRIu64 " bytes is too short for a %dx%d image",data_size,width,height);
+
+            // with more than one thread, the image data is inflated on the calling thread, and unfiltered on a second thread
+            // as it arrives (small images are not worth starting a thread for). interlaced images are decoded on the calling
+            // thread, since the unfilter thread only follows a single pass.
+            const bool pipelined=options && options->num_threads>1 && image_data_size>PNG_INFLATE_WINDOW_MIN_SIZE && !interlaced;
+
+            const uint64_t total_num_pixels_in_image=(uint64_t)height*width;
+            defiltered_output_buffer=(uint8_t*)malloc(total_num_pixels_in_image*4);
+            if(!defiltered_output_buffer)
+                parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+
+            // hand the pixels decoded up to the end of a pass to the pass callback
+            const auto emit_pass=[&](const uint32_t completed_pass_index){
+                if(!options || !options->pass_callback)
+                    return;
+
+                timer.lap(IMAGE_DECODE_STAGE_RECONSTRUCT);
+
+                if(completed_pass_index+1<num_passes)
+                    png_fill_interlace_blocks(defiltered_output_buffer,width,height,output_scanline_width,completed_pass_index);
+                options->pass_callback(options->pass_callback_user_data,defiltered_output_buffer,width,height,output_scanline_width,completed_pass_index,num_passes);
+
+                timer.lap(IMAGE_DECODE_STAGE_EMIT);
+            };
+
+            // images with restart points (see Image_write_png) are decoded in parts, on up to num_threads threads. if that fails,
+            // e.g. because the restart points are not valid, the image data is decoded serially.
+            bool decoded_in_parts=false;
+            if(options && options->num_threads>1 && parser.restart_points && !interlaced){
+                const PngScanlineConverter part_converter={
+                    kernels,
+                    &passes[0],
+                    color_type,
+                    bit_depth,
+                    bytes_per_pixel,
+                    parser.palette,
+                    parser.has_transparent_key?parser.transparent_key:NULL,
+                    {NULL,NULL},
+                    NULL,
+                    NULL,
+                    defiltered_output_buffer,
+                    output_scanline_width
+                };
+
+                uint64_t parts_memory_bytes=0;
+                uint64_t num_bitstream_refills=0;
+                decoded_in_parts=png_decode_parts(
+                    parser.restart_points,
+                    parser.num_restart_points,
+                    idat_segments,
+                    num_idat_segments,
+                    data_size,
+                    &part_converter,
+                    options->num_threads,
+                    verify_checksums,
+                    &parts_memory_bytes,
+                    &num_bitstream_refills
+                );
+
+                // inflating and unfiltering overlap, like in a pipelined decode
+                timer.lap(IMAGE_DECODE_STAGE_ENTROPY_DECODE);
+
+                if(decoded_in_parts){
+                    emit_pass(0);
+
+                    // the file, the inflate window, unfiltered scanlines and expanded samples of each thread, and the final pixels
+                    stats.file_bytes=parser.file_size;
+                    stats.entropy_coded_bytes=data_size;
+                    stats.num_bitstream_refills=num_bitstream_refills;
+                    stats.peak_memory_bytes=parser.file_size+parts_memory_bytes+total_num_pixels_in_image*4;
                 }
-        }
-        parser.current_file_content_index+=bytes_in_chunk;
+            }
+            if(!decoded_in_parts){
+                // the image data is inflated into a window that slides over it: each round fills the window, unfilters the complete
+                // scanlines and converts them into the final pixel buffer, then discards all but the last 32KB (which later matches
+                // may refer to) and the incomplete scanline. the window holds at least one complete scanline more than that, and
+                // room for the symbol that may not fit (see ZLIBDecoder::decode_some), and for one inflate step when pipelined.
+                uint64_t window_size=bitUtil::max(
+                    (uint64_t)(pipelined?PNG_PIPELINE_WINDOW_MIN_SIZE:PNG_INFLATE_WINDOW_MIN_SIZE),
+                    PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE+2*scanline_width+DEFLATE_MAX_MATCH_LENGTH+DEFLATE_MATCH_COPY_OVERSHOOT
+                        +(pipelined?PNG_PIPELINE_INFLATE_STEP_SIZE:0)
+                );
+                window_size=bitUtil::min(window_size,image_data_size);
+
+                // the window is followed by the unfiltered current and previous scanline, the narrowed or unpacked samples of a
+                // scanline, and (for interlaced images) the pixels of a scanline of a pass, in the same allocation
+                const uint64_t pass_pixels_size=interlaced?output_scanline_width:0;
+                uint8_t *const output_buffer=(uint8_t*)malloc(window_size+2*defiltered_scanline_width+output_scanline_width+pass_pixels_size);
+                if(!output_buffer)
+                    parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to allocate memory");
+                parser.output_buffer=output_buffer;
+
+                uint8_t* const samples=output_buffer+window_size+2*defiltered_scanline_width;
+                PngScanlineConverter converter={
+                    kernels,
+                    &passes[0],
+                    color_type,
+                    bit_depth,
+                    bytes_per_pixel,
+                    parser.palette,
+                    parser.has_transparent_key?parser.transparent_key:NULL,
+                    {output_buffer+window_size,output_buffer+window_size+defiltered_scanline_width},
+                    samples,
+                    interlaced?samples+output_scanline_width:NULL,
+                    defiltered_output_buffer,
+                    output_scanline_width
+                };
+
+                ZLIBDecoder zlib_decoder{
+                    idat_segments,
+                    num_idat_segments,
+                    window_size,
+                    output_buffer
+                };
+                if(verify_checksums){
+                    zlib_decoder.adler32=kernels->adler32;
+                    zlib_decoder.verify_segment=png_verify_idat_crc;
+                    zlib_decoder.verify_segment_user_data=kernels;
+                }
+                zlib_decoder.begin();
+
+                // the current pass, and the number of its scanlines that have been inflated (and are, or are being, unfiltered)
+                uint32_t pass_index=0;
+                uint32_t scanline_index=0;
+
+                // keep the match window and the scanlines from scanline_index on
+                const auto discard_processed_output=[&]{
+                    const uint64_t processed_size=pass_index<num_passes?passes[pass_index].data_start+(uint64_t)scanline_index*passes[pass_index].scanline_width:image_data_size;
+                    const uint64_t unprocessed_start=processed_size-zlib_decoder.num_discarded_bytes;
+                    const uint64_t match_window_start=zlib_decoder.out_offset>PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE?zlib_decoder.out_offset-PNG_BITSTREAM_COMPRESSION_MAX_WINDOW_SIZE:0;
+                    zlib_decoder.discard_output(bitUtil::min(unprocessed_start,match_window_start));
+                };
+                // number of scanlines of pass that are complete in the window
+                const auto num_inflated_scanlines=[&](const PngPass* const pass){
+                    const uint64_t inflated_size=zlib_decoder.num_discarded_bytes+zlib_decoder.out_offset;
+                    if(inflated_size<=pass->data_start)
+                        return (uint32_t)0;
+                    return (uint32_t)bitUtil::min((inflated_size-pass->data_start)/pass->scanline_width,(uint64_t)pass->height);
+                };
+
+                if(!pipelined){
+                    while(pass_index<num_passes){
+                        {
+                            const TraceScope inflate_trace_scope{"inflate"};
+
+                            // the last round decodes to the end of the stream, which must not be longer than the image data
+                            const uint64_t window_end=image_data_size-zlib_decoder.num_discarded_bytes;
+                            if(window_end<=window_size)
+                                zlib_decoder.decode_some(window_end,true);
+                            else
+                                zlib_decoder.decode_some(window_size,false);
+                        }
 
-        uint32_t chunk_crc=bitUtil::byteswap(parser.get_mem<uint32_t>(),4);
-        discard chunk_crc;
-    }
+                        timer.lap(IMAGE_DECODE_STAGE_ENTROPY_DECODE);
 
-    println("done with basic file parsing after %.3fs",current_time()-start_time);
+                        // the passes follow each other in the image data, i.e. a round may complete some of them
+                        while(pass_index<num_passes){
+                            const PngPass* const pass=&passes[pass_index];
 
-    uint64_t output_buffer_size=(parser.ihdr_data.height+1)*parser.ihdr_data.width*4;
-    uint8_t *const output_buffer=(uint8_t*)malloc(output_buffer_size);
+                            const uint32_t scanline_end=num_inflated_scanlines(pass);
+                            if(scanline_end>scanline_index){
+                                const TraceScope unfilter_trace_scope{"unfilter",scanline_index,scanline_end};
 
-    // the data spread across the IDAT chunks is combined into a single bitstream, defined by RFC 1950 (e.g. https://datatracker.ietf.org/doc/html/rfc1950)
+                                const uint8_t* const in=output_buffer+pass->data_start+(uint64_t)scanline_index*pass->scanline_width-zlib_decoder.num_discarded_bytes;
+                                png_check_filter_types(in,pass->scanline_width,scanline_index,scanline_end);
+                                converter.pass=pass;
+                                converter.convert(in,scanline_index,scanline_end);
+                                scanline_index=scanline_end;
+                            }
+                            if(scanline_index<pass->height)
+                                break;
 
-    ZLIBDecoder zlib_decoder{
-        data_size,
-        data_buffer,
-        output_buffer_size,
-        output_buffer
-    };
-    zlib_decoder.decode();
+                            emit_pass(pass_index);
 
-    println("done with DEFLATE after %.3fs",current_time()-start_time);
+                            pass_index++;
+                            scanline_index=0;
+                        }
 
-    const uint32_t bytes_per_pixel=4;
-    const uint32_t scanline_width=1+parser.ihdr_data.width*bytes_per_pixel;
-    const uint32_t num_scanlines=parser.ihdr_data.height;
+                        // the conversion is interleaved with unfiltering, and counted as part of it
+                        timer.lap(IMAGE_DECODE_STAGE_RECONSTRUCT);
 
-    uint8_t* const defiltered_output_buffer=(uint8_t*)malloc(parser.ihdr_data.height*parser.ihdr_data.width*bytes_per_pixel);
+                        if(zlib_decoder.finished)
+                            break;
 
-    parser.scanline_width=scanline_width;
-    parser.bpp=bytes_per_pixel;
-    parser.defiltered_output_buffer=defiltered_output_buffer;
-    parser.output_buffer=output_buffer;
+                        discard_processed_output();
+                    }
+                }else{
+                    const PngPass* const pass=&passes[0];
+
+                    struct PngUnfilter_Arguments unfilter_args;
+                    unfilter_args.converter=&converter;
+                    unfilter_args.num_scanlines=pass->height;
+                    unfilter_args.window=output_buffer;
+
+                    pthread_t unfilter_thread;
+                    if(pthread_create(&unfilter_thread, NULL, (pthread_callback)PngUnfilter_pthread, &unfilter_args)!=0)
+                        parse_fail(IMAGE_PARSE_RESULT_RESOURCE_FAILURE,"failed to launch pthread");
+
+                    try{
+                        const TraceScope inflate_trace_scope{"inflate"};
+
+                        // inflate in small steps, so that the unfilter thread can start on the scanlines right away
+                        while(!zlib_decoder.finished){
+                            const uint64_t window_end=image_data_size-zlib_decoder.num_discarded_bytes;
+
+                            // the window is full: wait until all inflated scanlines have been unfiltered, then move it
+                            if(window_end>window_size && zlib_decoder.out_offset+PNG_PIPELINE_INFLATE_STEP_SIZE>window_size){
+                                const uint64_t wait_begin=trace_enabled.load(std::memory_order_relaxed)?cpu::timestamp():0;
+                                while(unfilter_args.num_scanlines_unfiltered.load(std::memory_order_acquire)<scanline_index){
+                                    struct timespec sleeptime={.tv_sec=0,.tv_nsec=100000};
+                                    nanosleep(&sleeptime, NULL);
+                                }
+                                if(wait_begin)
+                                    Trace_record("wait for unfilter",wait_begin,0,scanline_index);
 
-    for(uint32_t scanline_index=0;scanline_index<num_scanlines;scanline_index++){
-        if(scanline_index>0){
-            parser.in_line_prev=output_buffer+(scanline_index-1)*scanline_width;
-            parser.out_line_prev=defiltered_output_buffer+(scanline_index-1)*(parser.ihdr_data.width*bytes_per_pixel);
-        }else{
-            parser.in_line_prev=NULL;
-            parser.out_line_prev=NULL;
-        }
+                                discard_processed_output();
+                                unfilter_args.num_discarded_bytes.store(zlib_decoder.num_discarded_bytes,std::memory_order_relaxed);
+                            }
 
-        parser.in_line=output_buffer+scanline_index*scanline_width;
-        parser.out_line=defiltered_output_buffer+scanline_index*(parser.ihdr_data.width*bytes_per_pixel);
+                            const uint64_t step_end=bitUtil::min(zlib_decoder.out_offset+PNG_PIPELINE_INFLATE_STEP_SIZE,window_size);
+                            if(window_end<=step_end)
+                                zlib_decoder.decode_some(window_end,true);
+                            else
+                                zlib_decoder.decode_some(step_end,false);
 
-        parser.process_scanline();
-    }
+                            const uint32_t scanline_end=num_inflated_scanlines(pass);
+                            png_check_filter_types(output_buffer+(uint64_t)scanline_index*pass->scanline_width-zlib_decoder.num_discarded_bytes,pass->scanline_width,scanline_index,scanline_end);
+                            scanline_index=scanline_end;
+                            unfilter_args.num_scanlines_inflated.store(scanline_index,std::memory_order_release);
+                        }
+                    }catch(const ImageParseResult){
+                        unfilter_args.cancelled.store(true);
+                        pthread_join(unfilter_thread,NULL);
+                        throw;
+                    }
 
-    println("done with scanline processing after %.3fs",current_time()-start_time);
+                    timer.lap(IMAGE_DECODE_STAGE_ENTROPY_DECODE);
 
-    for(uint32_t pix=0;pix<parser.ihdr_data.height*parser.ihdr_data.width;pix++){
-        const uint8_t red=defiltered_output_buffer[pix*4+0];
-        const uint8_t gre=defiltered_output_buffer[pix*4+1];
-        const uint8_t blu=defiltered_output_buffer[pix*4+2];
-        const uint8_t alp=defiltered_output_buffer[pix*4+3];
+                    // the unfilter thread waits for the missing scanlines of truncated data forever
+                    if(scanline_index<pass->height)
+                        unfilter_args.cancelled.store(true);
+                    pthread_join(unfilter_thread,NULL);
 
-        defiltered_output_buffer[pix*4+0]=blu;
-        defiltered_output_buffer[pix*4+1]=gre;
-        defiltered_output_buffer[pix*4+2]=red;
-        defiltered_output_buffer[pix*4+3]=alp;
-    }
+                    // only the part of unfiltering that did not overlap with inflating
+                    timer.lap(IMAGE_DECODE_STAGE_RECONSTRUCT);
 
-    println("done with BGRA -> RGBA  after %.3fs",current_time()-start_time);
+                    if(scanline_index==pass->height){
+                        pass_index=1;
+                        emit_pass(0);
+                    }
+                }
+                if(pass_index<num_passes){
+                    const uint64_t decoded_size=zlib_decoder.num_discarded_bytes+zlib_decoder.out_offset;
+                    parse_fail(IMAGE_PARSE_RESULT_DATA_TRUNCATED,"png image data ends after %" PRIu64 " of %" PRIu64 " bytes",decoded_size,image_data_size);
+                }
 
-    parser.destroy();
-    free(data_buffer);
+                // the file, the inflate window, the two unfiltered scanlines, the expanded samples (and pixels of a pass) and the
+                // final pixels are held at once
+                stats.file_bytes=parser.file_size;
+                stats.entropy_coded_bytes=data_size;
+                stats.num_bitstream_refills=zlib_decoder.num_bitstream_refills;
+                stats.peak_memory_bytes=parser.file_size+window_size+2*defiltered_scanline_width+output_scanline_width+pass_pixels_size+total_num_pixels_in_image*4;
+            }
+
+            parser.destroy();
+        }catch(const ImageParseResult){
+            parser.destroy();
+            throw;
+        }
+    }catch(const ImageParseResult result){
+        free(idat_segments);
+        free(defiltered_output_buffer);
+
+        ImageData_destroy(image_data);
+        ImageData_initEmpty(image_data);
+        return result;
+    }
+
+    free(idat_segments);
 
     image_data->data=defiltered_output_buffer;
 
+    if(options){
+        // scanlines are filtered against each other, so the whole image is decoded before it is handed out
+        static const uint32_t PNG_CALLBACK_BAND_HEIGHT=16;
+        ImageData_emitToCallbacks(image_data,options,PNG_CALLBACK_BAND_HEIGHT);
+        timer.lap(IMAGE_DECODE_STAGE_EMIT);
+    }
+
+    #ifdef DEBUG
+        println("decoded %s:",filepath);
+        ImageDecodeStats_print(&stats,stdout);
+    #endif
+
+    if(requested_stats)
+        *options->stats=stats;
+
     return IMAGE_PARSE_RESULT_OK;
 }
@@ -0,0 +1,384 @@
+// checksum kernels, included by png_kernels.cpp (i.e. compiled once per instruction set)
+//
+// crc-32 is the checksum of every png chunk, adler-32 the checksum of the decompressed zlib stream. both are updated
+// incrementally, i.e. the checksum of some data can be computed in parts, as the data is read or decoded.
+
+/// crc-32 of data, 16 bytes per iteration with the tables in CRC32_TABLES. crc is the pre- and post-conditioned value, like in crc32.
+[[gnu::hot,gnu::nonnull(2),maybe_unused,KERNEL_TARGET]]
+static uint32_t crc32_slice_by_16(
+    uint32_t crc,
+    const uint8_t* data,
+    uint64_t num_bytes
+){
+    const uint32_t (*const tables)[256]=CRC32_TABLES.tables;
+
+    crc=~crc;
+    for(;num_bytes>=16;num_bytes-=16,data+=16){
+        // the crc is reflected, i.e. the first byte is in the least significant bits of the (little endian) words
+        uint32_t words[4];
+        memcpy(words,data,16);
+        words[0]^=crc;
+
+        crc=tables[15][words[0]&0xFF]^tables[14][(words[0]>>8)&0xFF]^tables[13][(words[0]>>16)&0xFF]^tables[12][words[0]>>24]
+           ^tables[11][words[1]&0xFF]^tables[10][(words[1]>>8)&0xFF]^tables[9][(words[1]>>16)&0xFF]^tables[8][words[1]>>24]
+           ^tables[7][words[2]&0xFF]^tables[6][(words[2]>>8)&0xFF]^tables[5][(words[2]>>16)&0xFF]^tables[4][words[2]>>24]
+           ^tables[3][words[3]&0xFF]^tables[2][(words[3]>>8)&0xFF]^tables[1][(words[3]>>16)&0xFF]^tables[0][words[3]>>24];
+    }
+    for(uint64_t i=0;i<num_bytes;i++)
+        crc=tables[0][(crc^data[i])&0xFF]^(crc>>8);
+
+    return ~crc;
+}
+
+/// adler-32 of data, one byte at a time (the sums are reduced once per ADLER32_NMAX bytes)
+[[gnu::hot,gnu::nonnull(2),maybe_unused,KERNEL_TARGET]]
+static uint32_t adler32_scalar(
+    const uint32_t adler,
+    const uint8_t* data,
+    uint64_t num_bytes
+){
+    uint32_t s1=adler&0xFFFF;
+    uint32_t s2=adler>>16;
+
+    while(num_bytes>0){
+        const uint64_t num_block_bytes=bitUtil::min(num_bytes,(uint64_t)ADLER32_NMAX);
+        for(uint64_t i=0;i<num_block_bytes;i++){
+            s1+=data[i];
+            s2+=s1;
+        }
+        s1%=ADLER32_BASE;
+        s2%=ADLER32_BASE;
+
+        data+=num_block_bytes;
+        num_bytes-=num_block_bytes;
+    }
+
+    return s1|(s2<<16);
+}
+
+#if defined(KERNEL_ISA_SSSE3) || defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+/// sum of the 32 bit lanes of v
+[[gnu::always_inline,KERNEL_TARGET]]
+static inline uint32_t horizontal_sum_u32(__m128i v){
+    v=_mm_add_epi32(v,_mm_shuffle_epi32(v,_MM_SHUFFLE(1,0,3,2)));
+    v=_mm_add_epi32(v,_mm_shuffle_epi32(v,_MM_SHUFFLE(2,3,0,1)));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+#endif
+
+#if defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+
+/// fold the 128 bit crc accumulator over 128 bits, and add the next 16 bytes of data
+[[gnu::always_inline,KERNEL_TARGET]]
+static inline __m128i crc32_fold_16(
+    const __m128i accumulator,
+    const __m128i constants,
+    const __m128i next
+){
+    const __m128i low=_mm_clmulepi64_si128(accumulator,constants,0x00);
+    const __m128i high=_mm_clmulepi64_si128(accumulator,constants,0x11);
+    return _mm_xor_si128(_mm_xor_si128(high,next),low);
+}
+
+/**
+ * @brief crc-32 of data by folding with carry-less multiplication
+ *
+ * from "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" (Gopal et al., intel 2009), with the
+ * constants of the reflected crc-32 polynomial given there. four 128 bit accumulators are folded over 64 bytes per
+ * iteration, then into one, then reduced to the 32 bit crc (barrett reduction). data shorter than 64 bytes and the last
+ * (up to 15) bytes are handled by crc32_slice_by_16.
+ */
+[[gnu::hot,gnu::nonnull(2),KERNEL_TARGET]]
+static uint32_t crc32_pclmul(
+    const uint32_t crc,
+    const uint8_t* data,
+    uint64_t num_bytes
+){
+    if(num_bytes<64)
+        return crc32_slice_by_16(crc,data,num_bytes);
+
+    const __m128i k1k2=_mm_set_epi64x(0x01c6e41596,0x0154442bd4);
+    const __m128i k3k4=_mm_set_epi64x(0x00ccaa009e,0x01751997d0);
+    const __m128i k5k0=_mm_set_epi64x(0x0000000000,0x0163cd6124);
+    const __m128i poly=_mm_set_epi64x(0x01f7011641,0x01db710641);
+    const __m128i mask32=_mm_setr_epi32(-1,0,-1,0);
+
+    const uint64_t num_folded_bytes=num_bytes&~(uint64_t)15;
+    const uint8_t* const end=data+num_folded_bytes;
+
+    __m128i x1=_mm_loadu_si128((const __m128i*)(data+0x00));
+    __m128i x2=_mm_loadu_si128((const __m128i*)(data+0x10));
+    __m128i x3=_mm_loadu_si128((const __m128i*)(data+0x20));
+    __m128i x4=_mm_loadu_si128((const __m128i*)(data+0x30));
+    x1=_mm_xor_si128(x1,_mm_cvtsi32_si128((int)~crc));
+    data+=64;
+
+    // fold 64 bytes per iteration
+    for(;end-data>=64;data+=64){
+        const __m128i x5=_mm_clmulepi64_si128(x1,k1k2,0x00);
+        const __m128i x6=_mm_clmulepi64_si128(x2,k1k2,0x00);
+        const __m128i x7=_mm_clmulepi64_si128(x3,k1k2,0x00);
+        const __m128i x8=_mm_clmulepi64_si128(x4,k1k2,0x00);
+
+        x1=_mm_clmulepi64_si128(x1,k1k2,0x11);
+        x2=_mm_clmulepi64_si128(x2,k1k2,0x11);
+        x3=_mm_clmulepi64_si128(x3,k1k2,0x11);
+        x4=_mm_clmulepi64_si128(x4,k1k2,0x11);
+
+        x1=_mm_xor_si128(_mm_xor_si128(x1,x5),_mm_loadu_si128((const __m128i*)(data+0x00)));
+        x2=_mm_xor_si128(_mm_xor_si128(x2,x6),_mm_loadu_si128((const __m128i*)(data+0x10)));
+        x3=_mm_xor_si128(_mm_xor_si128(x3,x7),_mm_loadu_si128((const __m128i*)(data+0x20)));
+        x4=_mm_xor_si128(_mm_xor_si128(x4,x8),_mm_loadu_si128((const __m128i*)(data+0x30)));
+    }
+
+    // fold the four accumulators into one, then the remaining 16 byte blocks
+    x1=crc32_fold_16(x1,k3k4,x2);
+    x1=crc32_fold_16(x1,k3k4,x3);
+    x1=crc32_fold_16(x1,k3k4,x4);
+    for(;data<end;data+=16)
+        x1=crc32_fold_16(x1,k3k4,_mm_loadu_si128((const __m128i*)data));
+
+    // fold 128 to 64 bits, then to 32+32 bits
+    x2=_mm_clmulepi64_si128(x1,k3k4,0x10);
+    x1=_mm_xor_si128(_mm_srli_si128(x1,8),x2);
+
+    x2=_mm_srli_si128(x1,4);
+    x1=_mm_and_si128(x1,mask32);
+    x1=_mm_clmulepi64_si128(x1,k5k0,0x00);
+    x1=_mm_xor_si128(x1,x2);
+
+    // barrett reduction to 32 bits
+    x2=_mm_and_si128(x1,mask32);
+    x2=_mm_clmulepi64_si128(x2,poly,0x10);
+    x2=_mm_and_si128(x2,mask32);
+    x2=_mm_clmulepi64_si128(x2,poly,0x00);
+    x1=_mm_xor_si128(x1,x2);
+
+    const uint32_t folded_crc=~(uint32_t)_mm_extract_epi32(x1,1);
+
+    return crc32_slice_by_16(folded_crc,data,num_bytes-num_folded_bytes);
+}
+
+/**
+ * @brief adler-32 of data, 32 bytes per iteration
+ *
+ * s1 is the sum of the bytes (horizontal sums with psadbw), s2 the sum of the bytes weighted by their distance from the end of the
+ * 32 byte block (pmaddubsw with the weights 32..1), plus 32 times s1 before each block (accumulated in v_prefix_sums). the
+ * sums are reduced once per ADLER32_NMAX bytes, like in the scalar version.
+ */
+[[gnu::hot,gnu::nonnull(2),KERNEL_TARGET]]
+static uint32_t adler32_avx2(
+    const uint32_t adler,
+    const uint8_t* data,
+    uint64_t num_bytes
+){
+    static const uint32_t BLOCK_SIZE=32;
+
+    uint32_t s1=adler&0xFFFF;
+    uint32_t s2=adler>>16;
+
+    const __m256i weights=_mm256_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1);
+    const __m256i ones=_mm256_set1_epi16(1);
+    const __m256i zero=_mm256_setzero_si256();
+
+    uint64_t num_blocks=num_bytes/BLOCK_SIZE;
+    num_bytes-=num_blocks*BLOCK_SIZE;
+    while(num_blocks>0){
+        uint32_t n=(uint32_t)bitUtil::min(num_blocks,(uint64_t)(ADLER32_NMAX/BLOCK_SIZE));
+        num_blocks-=n;
+
+        __m256i v_prefix_sums=_mm256_setr_epi32((int)(s1*n),0,0,0,0,0,0,0);
+        __m256i v_s1=zero;
+        __m256i v_s2=zero;
+        do{
+            const __m256i bytes=_mm256_loadu_si256((const __m256i*)data);
+
+            v_prefix_sums=_mm256_add_epi32(v_prefix_sums,v_s1);
+            v_s1=_mm256_add_epi32(v_s1,_mm256_sad_epu8(bytes,zero));
+            v_s2=_mm256_add_epi32(v_s2,_mm256_madd_epi16(_mm256_maddubs_epi16(bytes,weights),ones));
+
+            data+=BLOCK_SIZE;
+        }while(--n);
+
+        v_s2=_mm256_add_epi32(v_s2,_mm256_slli_epi32(v_prefix_sums,5));
+
+        s1=(s1+horizontal_sum_u32(_mm_add_epi32(_mm256_castsi256_si128(v_s1),_mm256_extracti128_si256(v_s1,1))))%ADLER32_BASE;
+        s2=(s2+horizontal_sum_u32(_mm_add_epi32(_mm256_castsi256_si128(v_s2),_mm256_extracti128_si256(v_s2,1))))%ADLER32_BASE;
+    }
+
+    return adler32_scalar(s1|(s2<<16),data,num_bytes);
+}
+
+#elif defined(KERNEL_ISA_SSSE3)
+
+/// adler-32 of data, 32 bytes per iteration in two halves, see adler32_avx2
+[[gnu::hot,gnu::nonnull(2),KERNEL_TARGET]]
+static uint32_t adler32_ssse3(
+    const uint32_t adler,
+    const uint8_t* data,
+    uint64_t num_bytes
+){
+    static const uint32_t BLOCK_SIZE=32;
+
+    uint32_t s1=adler&0xFFFF;
+    uint32_t s2=adler>>16;
+
+    const __m128i weights_low=_mm_setr_epi8(32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17);
+    const __m128i weights_high=_mm_setr_epi8(16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1);
+    const __m128i ones=_mm_set1_epi16(1);
+    const __m128i zero=_mm_setzero_si128();
+
+    uint64_t num_blocks=num_bytes/BLOCK_SIZE;
+    num_bytes-=num_blocks*BLOCK_SIZE;
+    while(num_blocks>0){
+        uint32_t n=(uint32_t)bitUtil::min(num_blocks,(uint64_t)(ADLER32_NMAX/BLOCK_SIZE));
+        num_blocks-=n;
+
+        __m128i v_prefix_sums=_mm_setr_epi32((int)(s1*n),0,0,0);
+        __m128i v_s1=zero;
+        __m128i v_s2=zero;
+        do{
+            const __m128i bytes_low=_mm_loadu_si128((const __m128i*)data);
+            const __m128i bytes_high=_mm_loadu_si128((const __m128i*)(data+16));
+
+            v_prefix_sums=_mm_add_epi32(v_prefix_sums,v_s1);
+            v_s1=_mm_add_epi32(v_s1,_mm_add_epi32(_mm_sad_epu8(bytes_low,zero),_mm_sad_epu8(bytes_high,zero)));
+            v_s2=_mm_add_epi32(v_s2,_mm_madd_epi16(_mm_maddubs_epi16(bytes_low,weights_low),ones));
+            v_s2=_mm_add_epi32(v_s2,_mm_madd_epi16(_mm_maddubs_epi16(bytes_high,weights_high),ones));
+
+            data+=BLOCK_SIZE;
+        }while(--n);
+
+        v_s2=_mm_add_epi32(v_s2,_mm_slli_epi32(v_prefix_sums,5));
+
+        s1=(s1+horizontal_sum_u32(v_s1))%ADLER32_BASE;
+        s2=(s2+horizontal_sum_u32(v_s2))%ADLER32_BASE;
+    }
+
+    return adler32_scalar(s1|(s2<<16),data,num_bytes);
+}
+
+#elif defined(KERNEL_ISA_NEON)
+
+#if defined(__ARM_FEATURE_CRC32)
+/// crc-32 of data with the armv8 crc32 instructions, 8 bytes per instruction
+[[gnu::hot,gnu::nonnull(2),KERNEL_TARGET]]
+static uint32_t crc32_arm(
+    uint32_t crc,
+    const uint8_t* data,
+    uint64_t num_bytes
+){
+    crc=~crc;
+    for(;num_bytes>=8;num_bytes-=8,data+=8){
+        uint64_t word;
+        memcpy(&word,data,8);
+        crc=__crc32d(crc,word);
+    }
+    for(uint64_t i=0;i<num_bytes;i++)
+        crc=__crc32b(crc,data[i]);
+    return ~crc;
+}
+#endif
+
+/// adler-32 of data, 32 bytes per iteration, see adler32_avx2. the bytes are summed per column (widening adds), and
+/// weighted once per ADLER32_NMAX bytes.
+[[gnu::hot,gnu::nonnull(2),KERNEL_TARGET]]
+static uint32_t adler32_neon(
+    const uint32_t adler,
+    const uint8_t* data,
+    uint64_t num_bytes
+){
+    static const uint32_t BLOCK_SIZE=32;
+
+    uint32_t s1=adler&0xFFFF;
+    uint32_t s2=adler>>16;
+
+    static const uint16_t WEIGHTS[32]={32,31,30,29,28,27,26,25,24,23,22,21,20,19,18,17,16,15,14,13,12,11,10,9,8,7,6,5,4,3,2,1};
+
+    uint64_t num_blocks=num_bytes/BLOCK_SIZE;
+    num_bytes-=num_blocks*BLOCK_SIZE;
+    while(num_blocks>0){
+        uint32_t n=(uint32_t)bitUtil::min(num_blocks,(uint64_t)(ADLER32_NMAX/BLOCK_SIZE));
+        num_blocks-=n;
+
+        uint32x4_t v_prefix_sums=vsetq_lane_u32(s1*n,vdupq_n_u32(0),0);
+        uint32x4_t v_s1=vdupq_n_u32(0);
+        // at most ADLER32_NMAX/BLOCK_SIZE bytes per column, i.e. the column sums fit into 16 bits
+        uint16x8_t column_sums[4]={vdupq_n_u16(0),vdupq_n_u16(0),vdupq_n_u16(0),vdupq_n_u16(0)};
+        do{
+            const uint8x16_t bytes_low=vld1q_u8(data);
+            const uint8x16_t bytes_high=vld1q_u8(data+16);
+
+            v_prefix_sums=vaddq_u32(v_prefix_sums,v_s1);
+            v_s1=vpadalq_u16(v_s1,vpadalq_u8(vpaddlq_u8(bytes_low),bytes_high));
+
+            column_sums[0]=vaddw_u8(column_sums[0],vget_low_u8(bytes_low));
+            column_sums[1]=vaddw_u8(column_sums[1],vget_high_u8(bytes_low));
+            column_sums[2]=vaddw_u8(column_sums[2],vget_low_u8(bytes_high));
+            column_sums[3]=vaddw_u8(column_sums[3],vget_high_u8(bytes_high));
+
+            data+=BLOCK_SIZE;
+        }while(--n);
+
+        uint32x4_t v_s2=vshlq_n_u32(v_prefix_sums,5);
+        for(uint32_t c=0;c<4;c++){
+            v_s2=vmlal_u16(v_s2,vget_low_u16(column_sums[c]),vld1_u16(WEIGHTS+c*8));
+            v_s2=vmlal_u16(v_s2,vget_high_u16(column_sums[c]),vld1_u16(WEIGHTS+c*8+4));
+        }
+
+        s1=(s1+vaddvq_u32(v_s1))%ADLER32_BASE;
+        s2=(s2+vaddvq_u32(v_s2))%ADLER32_BASE;
+    }
+
+    return adler32_scalar(s1|(s2<<16),data,num_bytes);
+}
+
+#endif
+
+/**
+ * @brief update the crc-32 (the checksum of png chunks, ISO 3309) with data
+ *
+ * @param crc crc-32 of the preceding data, 0 before the first byte
+ * @param data
+ * @param num_bytes
+ * @return crc-32 of the preceding data and data
+ */
+[[gnu::hot,gnu::nonnull(2),KERNEL_TARGET]]
+static uint32_t crc32(
+    const uint32_t crc,
+    const uint8_t* const  data,
+    const uint64_t num_bytes
+){
+    #if defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+        return crc32_pclmul(crc,data,num_bytes);
+    #elif defined(KERNEL_ISA_NEON) && defined(__ARM_FEATURE_CRC32)
+        return crc32_arm(crc,data,num_bytes);
+    #else
+        return crc32_slice_by_16(crc,data,num_bytes);
+    #endif
+}
+
+/**
+ * @brief update the adler-32 checksum (of a zlib stream, RFC 1950) with data
+ *
+ * @param adler adler-32 of the preceding data, 1 before the first byte
+ * @param data
+ * @param num_bytes
+ * @return adler-32 of the preceding data and data
+ */
+[[gnu::hot,gnu::nonnull(2),KERNEL_TARGET]]
+static uint32_t adler32(
+    const uint32_t adler,
+    const uint8_t* const  data,
+    const uint64_t num_bytes
+){
+    #if defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+        return adler32_avx2(adler,data,num_bytes);
+    #elif defined(KERNEL_ISA_SSSE3)
+        return adler32_ssse3(adler,data,num_bytes);
+    #elif defined(KERNEL_ISA_NEON)
+        return adler32_neon(adler,data,num_bytes);
+    #else
+        return adler32_scalar(adler,data,num_bytes);
+    #endif
+}
@@ -0,0 +1,397 @@
+// pixel expansion kernels, included by png_kernels.cpp (i.e. compiled once per instruction set)
+//
+// the unfiltered samples of a scanline are expanded to 8 bit bgra pixels. samples of 16 bits are first narrowed to 8 bits
+// (narrow_16_to_8), and samples of 1, 2 or 4 bits are first unpacked to one byte each (unpack_samples), so that every colour
+// type has a single kernel for 8 bit samples. palette indices (and greyscale samples of less than 8 bits, which have at most
+// 16 levels) are looked up in a table of bgra pixels.
+//
+// the simd kernels on x86 shuffle with pshufb in 128 bit registers, the neon kernels (de-)interleave with the structure loads
+// and stores. each kernel finishes the last pixels of a scanline with the scalar loop.
+//
+// scatter_pixels places the expanded pixels of the reduced images of an adam7 interlaced image into the final scanlines.
+
+#if defined(KERNEL_ISA_SSSE3) || defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+    #define KERNEL_EXPAND_SSSE3
+#endif
+
+/// swap the red and blue channels of num_pixels rgba pixels from in to out (which may be the same buffer)
+[[gnu::hot,gnu::flatten,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void rgba_to_bgra(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_pixels
+){
+    for(uint64_t pix=0;pix<num_pixels;pix++){
+        const uint8_t red=in[pix*4+0];
+        const uint8_t gre=in[pix*4+1];
+        const uint8_t blu=in[pix*4+2];
+        const uint8_t alp=in[pix*4+3];
+
+        out[pix*4+0]=blu;
+        out[pix*4+1]=gre;
+        out[pix*4+2]=red;
+        out[pix*4+3]=alp;
+    }
+}
+
+/// expand num_pixels rgb pixels from in to opaque bgra pixels in out
+[[gnu::hot,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void rgb_to_bgra(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_pixels
+){
+    uint64_t pix=0;
+
+    #if defined(KERNEL_EXPAND_SSSE3)
+        // 4 pixels per step, from a 16 byte load (of which 12 bytes are used, i.e. the loop stops 2 pixels early)
+        const __m128i shuffle=_mm_setr_epi8(2,1,0,-1, 5,4,3,-1, 8,7,6,-1, 11,10,9,-1);
+        const __m128i alpha=_mm_set1_epi32((int32_t)0xFF000000);
+        for(;pix+6<=num_pixels;pix+=4){
+            const __m128i rgb=_mm_loadu_si128((const __m128i*)(in+pix*3));
+            _mm_storeu_si128((__m128i*)(out+pix*4),_mm_or_si128(_mm_shuffle_epi8(rgb,shuffle),alpha));
+        }
+    #elif defined(KERNEL_ISA_NEON)
+        for(;pix+16<=num_pixels;pix+=16){
+            const uint8x16x3_t rgb=vld3q_u8(in+pix*3);
+            const uint8x16x4_t bgra={{rgb.val[2],rgb.val[1],rgb.val[0],vdupq_n_u8(0xFF)}};
+            vst4q_u8(out+pix*4,bgra);
+        }
+    #endif
+
+    for(;pix<num_pixels;pix++){
+        out[pix*4+0]=in[pix*3+2];
+        out[pix*4+1]=in[pix*3+1];
+        out[pix*4+2]=in[pix*3+0];
+        out[pix*4+3]=0xFF;
+    }
+}
+
+/// expand num_pixels greyscale samples from in to opaque bgra pixels in out
+[[gnu::hot,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void grey_to_bgra(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_pixels
+){
+    uint64_t pix=0;
+
+    #if defined(KERNEL_EXPAND_SSSE3)
+        const __m128i alpha=_mm_set1_epi8((char)0xFF);
+        for(;pix+16<=num_pixels;pix+=16){
+            const __m128i grey=_mm_loadu_si128((const __m128i*)(in+pix));
+
+            // (g,g) and (g,a) pairs, interleaved to g,g,g,a
+            const __m128i grey_grey_low=_mm_unpacklo_epi8(grey,grey);
+            const __m128i grey_grey_high=_mm_unpackhi_epi8(grey,grey);
+            const __m128i grey_alpha_low=_mm_unpacklo_epi8(grey,alpha);
+            const __m128i grey_alpha_high=_mm_unpackhi_epi8(grey,alpha);
+
+            _mm_storeu_si128((__m128i*)(out+pix*4+ 0),_mm_unpacklo_epi16(grey_grey_low,grey_alpha_low));
+            _mm_storeu_si128((__m128i*)(out+pix*4+16),_mm_unpackhi_epi16(grey_grey_low,grey_alpha_low));
+            _mm_storeu_si128((__m128i*)(out+pix*4+32),_mm_unpacklo_epi16(grey_grey_high,grey_alpha_high));
+            _mm_storeu_si128((__m128i*)(out+pix*4+48),_mm_unpackhi_epi16(grey_grey_high,grey_alpha_high));
+        }
+    #elif defined(KERNEL_ISA_NEON)
+        for(;pix+16<=num_pixels;pix+=16){
+            const uint8x16_t grey=vld1q_u8(in+pix);
+            const uint8x16x4_t bgra={{grey,grey,grey,vdupq_n_u8(0xFF)}};
+            vst4q_u8(out+pix*4,bgra);
+        }
+    #endif
+
+    for(;pix<num_pixels;pix++){
+        out[pix*4+0]=in[pix];
+        out[pix*4+1]=in[pix];
+        out[pix*4+2]=in[pix];
+        out[pix*4+3]=0xFF;
+    }
+}
+
+/// expand num_pixels greyscale+alpha pixels from in to bgra pixels in out
+[[gnu::hot,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void grey_alpha_to_bgra(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_pixels
+){
+    uint64_t pix=0;
+
+    #if defined(KERNEL_EXPAND_SSSE3)
+        const __m128i shuffle_low=_mm_setr_epi8(0,0,0,1, 2,2,2,3, 4,4,4,5, 6,6,6,7);
+        const __m128i shuffle_high=_mm_setr_epi8(8,8,8,9, 10,10,10,11, 12,12,12,13, 14,14,14,15);
+        for(;pix+8<=num_pixels;pix+=8){
+            const __m128i grey_alpha=_mm_loadu_si128((const __m128i*)(in+pix*2));
+            _mm_storeu_si128((__m128i*)(out+pix*4+ 0),_mm_shuffle_epi8(grey_alpha,shuffle_low));
+            _mm_storeu_si128((__m128i*)(out+pix*4+16),_mm_shuffle_epi8(grey_alpha,shuffle_high));
+        }
+    #elif defined(KERNEL_ISA_NEON)
+        for(;pix+16<=num_pixels;pix+=16){
+            const uint8x16x2_t grey_alpha=vld2q_u8(in+pix*2);
+            const uint8x16x4_t bgra={{grey_alpha.val[0],grey_alpha.val[0],grey_alpha.val[0],grey_alpha.val[1]}};
+            vst4q_u8(out+pix*4,bgra);
+        }
+    #endif
+
+    for(;pix<num_pixels;pix++){
+        out[pix*4+0]=in[pix*2];
+        out[pix*4+1]=in[pix*2];
+        out[pix*4+2]=in[pix*2];
+        out[pix*4+3]=in[pix*2+1];
+    }
+}
+
+/// look up num_pixels palette indices from in in palette (256 bgra pixels) into out
+///
+/// if indices_below_16 is set, all indices are below 16 (e.g. they have at most 4 bits), and the simd kernels look them up
+/// with byte shuffles in the planes of the first 16 palette entries.
+[[gnu::hot,gnu::nonnull(1,2,4),KERNEL_TARGET]]
+static void palette_to_bgra(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_pixels,
+    const uint32_t* const palette,
+    const bool indices_below_16
+){
+    uint64_t pix=0;
+
+    if(indices_below_16){
+        #if defined(KERNEL_EXPAND_SSSE3)
+            // transpose the 16 bgra entries into one register per channel
+            const __m128i deinterleave=_mm_setr_epi8(0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15);
+            const __m128i entries0=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette+ 0)),deinterleave);
+            const __m128i entries1=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette+ 4)),deinterleave);
+            const __m128i entries2=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette+ 8)),deinterleave);
+            const __m128i entries3=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(palette+12)),deinterleave);
+            const __m128i bg01=_mm_unpacklo_epi32(entries0,entries1);
+            const __m128i ra01=_mm_unpackhi_epi32(entries0,entries1);
+            const __m128i bg23=_mm_unpacklo_epi32(entries2,entries3);
+            const __m128i ra23=_mm_unpackhi_epi32(entries2,entries3);
+            const __m128i blue=_mm_unpacklo_epi64(bg01,bg23);
+            const __m128i green=_mm_unpackhi_epi64(bg01,bg23);
+            const __m128i red=_mm_unpacklo_epi64(ra01,ra23);
+            const __m128i alpha=_mm_unpackhi_epi64(ra01,ra23);
+
+            for(;pix+16<=num_pixels;pix+=16){
+                const __m128i indices=_mm_loadu_si128((const __m128i*)(in+pix));
+
+                const __m128i b=_mm_shuffle_epi8(blue,indices);
+                const __m128i g=_mm_shuffle_epi8(green,indices);
+                const __m128i r=_mm_shuffle_epi8(red,indices);
+                const __m128i a=_mm_shuffle_epi8(alpha,indices);
+
+                const __m128i bg_low=_mm_unpacklo_epi8(b,g);
+                const __m128i bg_high=_mm_unpackhi_epi8(b,g);
+                const __m128i ra_low=_mm_unpacklo_epi8(r,a);
+                const __m128i ra_high=_mm_unpackhi_epi8(r,a);
+
+                _mm_storeu_si128((__m128i*)(out+pix*4+ 0),_mm_unpacklo_epi16(bg_low,ra_low));
+                _mm_storeu_si128((__m128i*)(out+pix*4+16),_mm_unpackhi_epi16(bg_low,ra_low));
+                _mm_storeu_si128((__m128i*)(out+pix*4+32),_mm_unpacklo_epi16(bg_high,ra_high));
+                _mm_storeu_si128((__m128i*)(out+pix*4+48),_mm_unpackhi_epi16(bg_high,ra_high));
+            }
+        #elif defined(KERNEL_ISA_NEON)
+            const uint8x16x4_t planes=vld4q_u8((const uint8_t*)palette);
+            for(;pix+16<=num_pixels;pix+=16){
+                const uint8x16_t indices=vld1q_u8(in+pix);
+                const uint8x16x4_t bgra={{
+                    vqtbl1q_u8(planes.val[0],indices),
+                    vqtbl1q_u8(planes.val[1],indices),
+                    vqtbl1q_u8(planes.val[2],indices),
+                    vqtbl1q_u8(planes.val[3],indices),
+                }};
+                vst4q_u8(out+pix*4,bgra);
+            }
+        #endif
+    }else{
+        #if defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+            // a byte shuffle only reaches 16 entries, so the pixels of larger palettes are gathered
+            for(;pix+8<=num_pixels;pix+=8){
+                const __m256i indices=_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in+pix)));
+                _mm256_storeu_si256((__m256i*)(out+pix*4),_mm256_i32gather_epi32((const int*)palette,indices,4));
+            }
+        #endif
+    }
+
+    // four independent lookups per step
+    for(;pix+4<=num_pixels;pix+=4){
+        const uint32_t pixels[4]={palette[in[pix+0]],palette[in[pix+1]],palette[in[pix+2]],palette[in[pix+3]]};
+        memcpy(out+pix*4,pixels,16);
+    }
+    for(;pix<num_pixels;pix++)
+        memcpy(out+pix*4,&palette[in[pix]],4);
+}
+
+/// narrow num_samples big endian 16 bit samples from in to 8 bits (the high byte) in out
+[[gnu::hot,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void narrow_16_to_8(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_samples
+){
+    uint64_t sample=0;
+
+    #if defined(KERNEL_EXPAND_SSSE3)
+        // the high byte is the first one, i.e. the low byte of a little endian 16 bit lane
+        const __m128i low_bytes=_mm_set1_epi16(0x00FF);
+        for(;sample+16<=num_samples;sample+=16){
+            const __m128i samples0=_mm_loadu_si128((const __m128i*)(in+sample*2));
+            const __m128i samples1=_mm_loadu_si128((const __m128i*)(in+sample*2+16));
+            _mm_storeu_si128((__m128i*)(out+sample),_mm_packus_epi16(_mm_and_si128(samples0,low_bytes),_mm_and_si128(samples1,low_bytes)));
+        }
+    #elif defined(KERNEL_ISA_NEON)
+        for(;sample+16<=num_samples;sample+=16)
+            vst1q_u8(out+sample,vld2q_u8(in+sample*2).val[0]);
+    #endif
+
+    for(;sample<num_samples;sample++)
+        out[sample]=in[sample*2];
+}
+
+/// unpack num_samples samples of BIT_DEPTH (1, 2 or 4) bits from in (packed starting at the most significant bit) into one
+/// byte each in out
+template<uint32_t BIT_DEPTH>
+[[gnu::always_inline,KERNEL_TARGET]]
+static inline void unpack_samples_depth(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_samples
+){
+    constexpr uint32_t SAMPLES_PER_BYTE=8/BIT_DEPTH;
+    constexpr uint8_t SAMPLE_MASK=(1<<BIT_DEPTH)-1;
+
+    uint64_t byte=0;
+
+    #if defined(KERNEL_EXPAND_SSSE3)
+        const __m128i sample_mask=_mm_set1_epi8((char)SAMPLE_MASK);
+        for(;(byte+16)*SAMPLES_PER_BYTE<=num_samples;byte+=16){
+            const __m128i packed=_mm_loadu_si128((const __m128i*)(in+byte));
+            __m128i* const unpacked=(__m128i*)(out+byte*SAMPLES_PER_BYTE);
+
+            if constexpr(BIT_DEPTH==4){
+                const __m128i high=_mm_and_si128(_mm_srli_epi16(packed,4),sample_mask);
+                const __m128i low=_mm_and_si128(packed,sample_mask);
+                _mm_storeu_si128(unpacked+0,_mm_unpacklo_epi8(high,low));
+                _mm_storeu_si128(unpacked+1,_mm_unpackhi_epi8(high,low));
+            }else if constexpr(BIT_DEPTH==2){
+                const __m128i s0=_mm_and_si128(_mm_srli_epi16(packed,6),sample_mask);
+                const __m128i s1=_mm_and_si128(_mm_srli_epi16(packed,4),sample_mask);
+                const __m128i s2=_mm_and_si128(_mm_srli_epi16(packed,2),sample_mask);
+                const __m128i s3=_mm_and_si128(packed,sample_mask);
+                const __m128i s01_low=_mm_unpacklo_epi8(s0,s1);
+                const __m128i s01_high=_mm_unpackhi_epi8(s0,s1);
+                const __m128i s23_low=_mm_unpacklo_epi8(s2,s3);
+                const __m128i s23_high=_mm_unpackhi_epi8(s2,s3);
+                _mm_storeu_si128(unpacked+0,_mm_unpacklo_epi16(s01_low,s23_low));
+                _mm_storeu_si128(unpacked+1,_mm_unpackhi_epi16(s01_low,s23_low));
+                _mm_storeu_si128(unpacked+2,_mm_unpacklo_epi16(s01_high,s23_high));
+                _mm_storeu_si128(unpacked+3,_mm_unpackhi_epi16(s01_high,s23_high));
+            }else{
+                // broadcast each byte to 8 lanes, and test one bit per lane
+                const __m128i bits=_mm_setr_epi8(-128,64,32,16,8,4,2,1, -128,64,32,16,8,4,2,1);
+                const __m128i one=_mm_set1_epi8(1);
+                for(int pair=0;pair<8;pair++){
+                    const __m128i broadcast=_mm_shuffle_epi8(packed,_mm_setr_epi8(
+                        (char)(pair*2),(char)(pair*2),(char)(pair*2),(char)(pair*2),(char)(pair*2),(char)(pair*2),(char)(pair*2),(char)(pair*2),
+                        (char)(pair*2+1),(char)(pair*2+1),(char)(pair*2+1),(char)(pair*2+1),(char)(pair*2+1),(char)(pair*2+1),(char)(pair*2+1),(char)(pair*2+1)
+                    ));
+                    const __m128i set=_mm_cmpeq_epi8(_mm_and_si128(broadcast,bits),bits);
+                    _mm_storeu_si128(unpacked+pair,_mm_and_si128(set,one));
+                }
+            }
+        }
+    #elif defined(KERNEL_ISA_NEON)
+        const uint8x16_t sample_mask=vdupq_n_u8(SAMPLE_MASK);
+        for(;(byte+16)*SAMPLES_PER_BYTE<=num_samples;byte+=16){
+            const uint8x16_t packed=vld1q_u8(in+byte);
+            uint8_t* const unpacked=out+byte*SAMPLES_PER_BYTE;
+
+            if constexpr(BIT_DEPTH==4){
+                const uint8x16x2_t samples={{vshrq_n_u8(packed,4),vandq_u8(packed,sample_mask)}};
+                vst2q_u8(unpacked,samples);
+            }else if constexpr(BIT_DEPTH==2){
+                const uint8x16x4_t samples={{
+                    vshrq_n_u8(packed,6),
+                    vandq_u8(vshrq_n_u8(packed,4),sample_mask),
+                    vandq_u8(vshrq_n_u8(packed,2),sample_mask),
+                    vandq_u8(packed,sample_mask),
+                }};
+                vst4q_u8(unpacked,samples);
+            }else{
+                // broadcast each byte to 8 lanes, and test one bit per lane
+                static const uint8_t BITS[16]={128,64,32,16,8,4,2,1, 128,64,32,16,8,4,2,1};
+                const uint8x16_t bits=vld1q_u8(BITS);
+                for(uint8_t pair=0;pair<8;pair++){
+                    const uint8x16_t broadcast=vqtbl1q_u8(packed,vcombine_u8(vdup_n_u8((uint8_t)(pair*2)),vdup_n_u8((uint8_t)(pair*2+1))));
+                    vst1q_u8(unpacked+pair*16,vandq_u8(vtstq_u8(broadcast,bits),vdupq_n_u8(1)));
+                }
+            }
+        }
+    #endif
+
+    for(uint64_t sample=byte*SAMPLES_PER_BYTE;sample<num_samples;sample++){
+        const uint32_t shift=8-BIT_DEPTH*(1+(uint32_t)(sample%SAMPLES_PER_BYTE));
+        out[sample]=(uint8_t)((in[sample/SAMPLES_PER_BYTE]>>shift)&SAMPLE_MASK);
+    }
+}
+/// unpack num_samples samples of bit_depth (1, 2 or 4) bits from in into one byte each in out
+[[gnu::hot,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void unpack_samples(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_samples,
+    const uint32_t bit_depth
+){
+    switch(bit_depth){
+        case 1: unpack_samples_depth<1>(in,out,num_samples); break;
+        case 2: unpack_samples_depth<2>(in,out,num_samples); break;
+        default: unpack_samples_depth<4>(in,out,num_samples); break;
+    }
+}
+
+/// write num_pixels bgra pixels from in to every step-th pixel of out (i.e. to out[0], out[step], ...), as the pixels of the
+/// reduced images of an interlaced image are placed in their scanline of the final image
+///
+/// the pixels in between are left unchanged. the simd kernels may read and rewrite them, but only the ones between the first
+/// and the last written pixel.
+[[gnu::hot,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void scatter_pixels(
+    const uint8_t* const in,
+    uint8_t* const out,
+    const uint64_t num_pixels,
+    const uint32_t step
+){
+    if(step==1){
+        memcpy(out,in,num_pixels*4);
+        return;
+    }
+
+    uint64_t pix=0;
+
+    if(step==2){
+        // 4 pixels per step, merged with the 4 pixels in between them (the last of which lies past the 4th written pixel, i.e.
+        // the loop stops one pixel early)
+        #if defined(KERNEL_EXPAND_SSSE3)
+            for(;pix+5<=num_pixels;pix+=4){
+                const __m128 pixels=_mm_loadu_ps((const float*)(in+pix*4));
+                float* const target=(float*)(out+pix*8);
+                const __m128 between=_mm_shuffle_ps(_mm_loadu_ps(target),_mm_loadu_ps(target+4),_MM_SHUFFLE(3,1,3,1));
+                _mm_storeu_ps(target+0,_mm_unpacklo_ps(pixels,between));
+                _mm_storeu_ps(target+4,_mm_unpackhi_ps(pixels,between));
+            }
+        #elif defined(KERNEL_ISA_NEON)
+            for(;pix+5<=num_pixels;pix+=4){
+                uint32x4x2_t target=vld2q_u32((const uint32_t*)(out+pix*8));
+                target.val[0]=vld1q_u32((const uint32_t*)(in+pix*4));
+                vst2q_u32((uint32_t*)(out+pix*8),target);
+            }
+        #endif
+    }
+    // the wider steps of the early passes write too few pixels per vector to merge them, and a vector scatter
+    // (_mm512_i32scatter_epi32) is no faster than one 32 bit store per pixel
+
+    for(;pix<num_pixels;pix++)
+        memcpy(out+pix*step*4,in+pix*4,4);
+}
+
+#undef KERNEL_EXPAND_SSSE3
@@ -0,0 +1,26 @@
+// the png kernels of one instruction set, included by png.cpp once per instruction set (inside a namespace per set).
+//
+// KERNEL_TARGET is the function attribute that enables the instruction set, KERNEL_ISA is the matching cpu::Isa,
+// and KERNEL_ISA_<name> is defined for conditional compilation of hand-written simd code.
+
+#include "png_unfilter.cpp"
+#include "png_checksum.cpp"
+#include "png_expand.cpp"
+
+static const PngKernels KERNELS={
+    KERNEL_ISA,
+
+    unfilter_scanline,
+
+    rgba_to_bgra,
+    rgb_to_bgra,
+    grey_to_bgra,
+    grey_alpha_to_bgra,
+    palette_to_bgra,
+    narrow_16_to_8,
+    unpack_samples,
+    scatter_pixels,
+
+    crc32,
+    adler32,
+};
@@ -0,0 +1,412 @@
+// scanline unfilter kernels, included by png_kernels.cpp (i.e. compiled once per instruction set)
+//
+// each filter has a kernel per number of bytes per pixel (1, 2, 3, 4, 6 or 8, see unfilter_scanline), and the first scanline
+// (which has no scanline above it) has its own kernels, so the loops have no branches besides the loop condition.
+//
+// up has no dependency between bytes, and is vectorised over whole registers. sub, average and paeth depend on the unfiltered
+// pixel to the left, so their simd kernels unfilter one pixel per step with the bytes of the pixel in the lanes of a register
+// (like libpng's sse2 and neon filters). the left pixel stays in a register, where the scalar loops reload it from the output.
+
+/// scalar unfilter loops, used by the generic kernels (and for numbers of bytes per pixel that png does not have). they are
+/// inlined into the kernels of each number of bytes per pixel, where bpp is a constant.
+namespace unfilter_scalar{
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void sub(const uint8_t* const raw,uint8_t* const out,const uint64_t num_bytes,const uint32_t bpp){
+        const uint64_t num_first_pixel_bytes=bitUtil::min((uint64_t)bpp,num_bytes);
+        for(uint64_t index=0;index<num_first_pixel_bytes;index++)
+            out[index]=raw[index];
+        for(uint64_t index=num_first_pixel_bytes;index<num_bytes;index++)
+            out[index]=raw[index] + out[index-bpp];
+    }
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void up(const uint8_t* const raw,uint8_t* const out,const uint8_t* const prev,const uint64_t num_bytes){
+        for(uint64_t index=0;index<num_bytes;index++)
+            out[index]=raw[index] + prev[index];
+    }
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void average(const uint8_t* const raw,uint8_t* const out,const uint8_t* const prev,const uint64_t num_bytes,const uint32_t bpp){
+        const uint64_t num_first_pixel_bytes=bitUtil::min((uint64_t)bpp,num_bytes);
+        for(uint64_t index=0;index<num_first_pixel_bytes;index++)
+            out[index]=raw[index] + static_cast<uint8_t>(prev[index]/2);
+        for(uint64_t index=num_first_pixel_bytes;index<num_bytes;index++)
+            out[index]=raw[index] + static_cast<uint8_t>((out[index-bpp]+prev[index])/2);
+    }
+    /// average of the first scanline, where the scanline above is all zeros
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void average_first_row(const uint8_t* const raw,uint8_t* const out,const uint64_t num_bytes,const uint32_t bpp){
+        const uint64_t num_first_pixel_bytes=bitUtil::min((uint64_t)bpp,num_bytes);
+        for(uint64_t index=0;index<num_first_pixel_bytes;index++)
+            out[index]=raw[index];
+        for(uint64_t index=num_first_pixel_bytes;index<num_bytes;index++)
+            out[index]=raw[index] + static_cast<uint8_t>(out[index-bpp]/2);
+    }
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void paeth(const uint8_t* const raw,uint8_t* const out,const uint8_t* const prev,const uint64_t num_bytes,const uint32_t bpp){
+        // with a and c zero, the paeth predictor is b
+        const uint64_t num_first_pixel_bytes=bitUtil::min((uint64_t)bpp,num_bytes);
+        for(uint64_t index=0;index<num_first_pixel_bytes;index++)
+            out[index]=raw[index] + prev[index];
+        for(uint64_t index=num_first_pixel_bytes;index<num_bytes;index++){
+            const int a=out[index-bpp];
+            const int b=prev[index];
+            const int c=prev[index-bpp];
+
+            // from stb_image.h
+            const int p=a+b-c;
+            const int pa=abs(p-a);
+            const int pb=abs(p-b);
+            const int pc=abs(p-c);
+
+            int predictor=c;
+            if(pa<=pb && pa<=pc)
+                predictor=a;
+            else if(pb<=pc)
+                predictor=b;
+
+            out[index]=static_cast<uint8_t>(raw[index] + predictor);
+        }
+    }
+};
+
+#if defined(KERNEL_ISA_SSSE3) || defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512) || defined(KERNEL_ISA_NEON)
+    #define KERNEL_UNFILTER_SIMD
+#endif
+
+#ifdef KERNEL_UNFILTER_SIMD
+
+/// the bytes of one pixel (at most 8) in the low lanes of a register, and the operations of the filters on them
+namespace unfilter_pixel{
+    #if defined(__x86_64__)
+        typedef __m128i Pixel;
+
+        /// load num_bytes bytes into the low lanes, the other lanes are zero
+        template<uint32_t NUM_BYTES>
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel load(const uint8_t* const  src){
+            uint64_t bytes=0;
+            memcpy(&bytes,src,NUM_BYTES);
+            return _mm_cvtsi64_si128((long long)bytes);
+        }
+        /// store the num_bytes low lanes
+        template<uint32_t NUM_BYTES>
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline void store(uint8_t* const  dst,const Pixel pixel){
+            const uint64_t bytes=(uint64_t)_mm_cvtsi128_si64(pixel);
+            memcpy(dst,&bytes,NUM_BYTES);
+        }
+
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel zero(){
+            return _mm_setzero_si128();
+        }
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel add(const Pixel x,const Pixel y){
+            return _mm_add_epi8(x,y);
+        }
+        /// (a+b)/2, rounded down (pavgb rounds up)
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel average(const Pixel a,const Pixel b){
+            const Pixel rounding=_mm_and_si128(_mm_xor_si128(a,b),_mm_set1_epi8(1));
+            return _mm_sub_epi8(_mm_avg_epu8(a,b),rounding);
+        }
+        /// a/2
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel half(const Pixel a){
+            return _mm_and_si128(_mm_srli_epi16(a,1),_mm_set1_epi8(0x7F));
+        }
+        /// the paeth predictor (the one of a, b and c closest to a+b-c), computed in 16 bits
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel paeth(const Pixel a,const Pixel b,const Pixel c){
+            const __m128i zero=_mm_setzero_si128();
+            const __m128i a16=_mm_unpacklo_epi8(a,zero);
+            const __m128i b16=_mm_unpacklo_epi8(b,zero);
+            const __m128i c16=_mm_unpacklo_epi8(c,zero);
+
+            // p-a=b-c, p-b=a-c, p-c=(b-c)+(a-c)
+            const __m128i pa_signed=_mm_sub_epi16(b16,c16);
+            const __m128i pb_signed=_mm_sub_epi16(a16,c16);
+            const __m128i pa=_mm_abs_epi16(pa_signed);
+            const __m128i pb=_mm_abs_epi16(pb_signed);
+            const __m128i pc=_mm_abs_epi16(_mm_add_epi16(pa_signed,pb_signed));
+
+            // ties are broken in favour of a, then b
+            const __m128i smallest=_mm_min_epi16(pc,_mm_min_epi16(pa,pb));
+            const __m128i use_a=_mm_cmpeq_epi16(smallest,pa);
+            const __m128i use_b=_mm_cmpeq_epi16(smallest,pb);
+            const __m128i b_or_c=_mm_or_si128(_mm_and_si128(use_b,b16),_mm_andnot_si128(use_b,c16));
+            const __m128i predictor=_mm_or_si128(_mm_and_si128(use_a,a16),_mm_andnot_si128(use_a,b_or_c));
+
+            return _mm_packus_epi16(predictor,predictor);
+        }
+    #elif defined(__aarch64__)
+        typedef uint8x8_t Pixel;
+
+        template<uint32_t NUM_BYTES>
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel load(const uint8_t* const  src){
+            uint64_t bytes=0;
+            memcpy(&bytes,src,NUM_BYTES);
+            return vcreate_u8(bytes);
+        }
+        template<uint32_t NUM_BYTES>
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline void store(uint8_t* const  dst,const Pixel pixel){
+            const uint64_t bytes=vget_lane_u64(vreinterpret_u64_u8(pixel),0);
+            memcpy(dst,&bytes,NUM_BYTES);
+        }
+
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel zero(){
+            return vdup_n_u8(0);
+        }
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel add(const Pixel x,const Pixel y){
+            return vadd_u8(x,y);
+        }
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel average(const Pixel a,const Pixel b){
+            return vhadd_u8(a,b);
+        }
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel half(const Pixel a){
+            return vshr_n_u8(a,1);
+        }
+        /// from libpng's neon filters
+        [[gnu::always_inline,KERNEL_TARGET]]
+        static inline Pixel paeth(const Pixel a,const Pixel b,const Pixel c){
+            const uint16x8_t pa=vabdl_u8(b,c);
+            const uint16x8_t pb=vabdl_u8(a,c);
+            const uint16x8_t pc=vabdq_u16(vaddl_u8(a,b),vaddl_u8(c,c));
+
+            const uint8x8_t use_a=vmovn_u16(vandq_u16(vcleq_u16(pa,pb),vcleq_u16(pa,pc)));
+            const uint8x8_t use_b=vmovn_u16(vcleq_u16(pb,pc));
+
+            return vbsl_u8(use_a,a,vbsl_u8(use_b,b,c));
+        }
+    #endif
+
+    /// bytes loaded per pixel in the main loops: a whole 4 or 8 byte word, which may include bytes of the next pixel (as long
+    /// as they are inside the scanline). the extra lanes are never stored.
+    template<uint32_t BPP>
+    constexpr uint32_t LOAD_BYTES=BPP<=4?4:8;
+
+    template<uint32_t BPP>
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void sub(const uint8_t* const raw,uint8_t* const out,const uint64_t num_bytes){
+        Pixel a=zero();
+        uint64_t index=0;
+        for(;index+LOAD_BYTES<BPP><=num_bytes;index+=BPP){
+            a=add(load<LOAD_BYTES<BPP>>(raw+index),a);
+            store<BPP>(out+index,a);
+        }
+        for(;index<num_bytes;index+=BPP){
+            a=add(load<BPP>(raw+index),a);
+            store<BPP>(out+index,a);
+        }
+    }
+    template<uint32_t BPP>
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void average(const uint8_t* const raw,uint8_t* const out,const uint8_t* const prev,const uint64_t num_bytes){
+        Pixel a=zero();
+        uint64_t index=0;
+        for(;index+LOAD_BYTES<BPP><=num_bytes;index+=BPP){
+            a=add(load<LOAD_BYTES<BPP>>(raw+index),average(a,load<LOAD_BYTES<BPP>>(prev+index)));
+            store<BPP>(out+index,a);
+        }
+        for(;index<num_bytes;index+=BPP){
+            a=add(load<BPP>(raw+index),average(a,load<BPP>(prev+index)));
+            store<BPP>(out+index,a);
+        }
+    }
+    template<uint32_t BPP>
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void average_first_row(const uint8_t* const raw,uint8_t* const out,const uint64_t num_bytes){
+        Pixel a=zero();
+        uint64_t index=0;
+        for(;index+LOAD_BYTES<BPP><=num_bytes;index+=BPP){
+            a=add(load<LOAD_BYTES<BPP>>(raw+index),half(a));
+            store<BPP>(out+index,a);
+        }
+        for(;index<num_bytes;index+=BPP){
+            a=add(load<BPP>(raw+index),half(a));
+            store<BPP>(out+index,a);
+        }
+    }
+    template<uint32_t BPP>
+    [[gnu::always_inline,KERNEL_TARGET]]
+    static inline void paeth(const uint8_t* const raw,uint8_t* const out,const uint8_t* const prev,const uint64_t num_bytes){
+        // the pixels left of the first pixel are zero
+        Pixel a=zero();
+        Pixel c=zero();
+        uint64_t index=0;
+        for(;index+LOAD_BYTES<BPP><=num_bytes;index+=BPP){
+            const Pixel b=load<LOAD_BYTES<BPP>>(prev+index);
+            a=add(load<LOAD_BYTES<BPP>>(raw+index),paeth(a,b,c));
+            c=b;
+            store<BPP>(out+index,a);
+        }
+        for(;index<num_bytes;index+=BPP){
+            const Pixel b=load<BPP>(prev+index);
+            a=add(load<BPP>(raw+index),paeth(a,b,c));
+            c=b;
+            store<BPP>(out+index,a);
+        }
+    }
+};
+
+#endif
+
+/// up, over whole vector registers
+[[gnu::always_inline,KERNEL_TARGET]]
+static inline void unfilter_up(
+    const uint8_t* const  raw,
+    uint8_t* const  out,
+    const uint8_t* const  prev,
+    const uint64_t num_bytes
+){
+    uint64_t index=0;
+    #if defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+        for(;index+32<=num_bytes;index+=32){
+            const __m256i sum=_mm256_add_epi8(_mm256_loadu_si256((const __m256i*)(raw+index)),_mm256_loadu_si256((const __m256i*)(prev+index)));
+            _mm256_storeu_si256((__m256i*)(out+index),sum);
+        }
+    #endif
+    #if defined(KERNEL_ISA_SSSE3) || defined(KERNEL_ISA_AVX2) || defined(KERNEL_ISA_AVX512)
+        for(;index+16<=num_bytes;index+=16){
+            const __m128i sum=_mm_add_epi8(_mm_loadu_si128((const __m128i*)(raw+index)),_mm_loadu_si128((const __m128i*)(prev+index)));
+            _mm_storeu_si128((__m128i*)(out+index),sum);
+        }
+    #elif defined(KERNEL_ISA_NEON)
+        for(;index+16<=num_bytes;index+=16)
+            vst1q_u8(out+index,vaddq_u8(vld1q_u8(raw+index),vld1q_u8(prev+index)));
+    #endif
+    unfilter_scalar::up(raw+index,out+index,prev+index,num_bytes-index);
+}
+
+/**
+ * @brief undo the filter of one scanline, with a number of bytes per pixel that is known at compile time (zero if it is not)
+ *
+ * @param scanline_filter
+ * @param raw filtered bytes of the scanline
+ * @param out output for the num_bytes unfiltered bytes
+ * @param prev the previous unfiltered scanline, NULL for the first scanline
+ * @param num_bytes
+ * @param bpp bytes per pixel (BPP, if it is not zero)
+ */
+template<uint32_t BPP>
+[[gnu::hot,KERNEL_TARGET]]
+static void unfilter_scanline_bpp(
+    const PNGScanlineFilter scanline_filter,
+    const uint8_t* const  raw,
+    uint8_t* const  out,
+    const uint8_t* const  prev,
+    const uint64_t num_bytes,
+    const uint32_t bpp
+){
+    const uint32_t pixel_bytes=BPP?BPP:bpp;
+
+    #ifdef KERNEL_UNFILTER_SIMD
+        constexpr bool PIXEL_SIMD=BPP>0;
+    #endif
+
+    // the scanline above the first one is defined as all zeros
+    if(prev==NULL){
+        switch(scanline_filter){
+            case PNG_SCANLINE_FILTER_NONE:
+            case PNG_SCANLINE_FILTER_UP:
+                // up of zero is none
+                memcpy(out,raw,num_bytes);
+                return;
+            case PNG_SCANLINE_FILTER_SUB:
+            case PNG_SCANLINE_FILTER_PAETH:
+                // with a and c zero, the paeth predictor is a, i.e. paeth is sub
+                #ifdef KERNEL_UNFILTER_SIMD
+                    if constexpr(PIXEL_SIMD){
+                        unfilter_pixel::sub<BPP>(raw,out,num_bytes);
+                        return;
+                    }
+                #endif
+                unfilter_scalar::sub(raw,out,num_bytes,pixel_bytes);
+                return;
+            case PNG_SCANLINE_FILTER_AVERAGE:
+                #ifdef KERNEL_UNFILTER_SIMD
+                    if constexpr(PIXEL_SIMD){
+                        unfilter_pixel::average_first_row<BPP>(raw,out,num_bytes);
+                        return;
+                    }
+                #endif
+                unfilter_scalar::average_first_row(raw,out,num_bytes,pixel_bytes);
+                return;
+        }
+        return;
+    }
+
+    switch(scanline_filter){
+        case PNG_SCANLINE_FILTER_NONE:
+            memcpy(out,raw,num_bytes);
+            return;
+        case PNG_SCANLINE_FILTER_SUB:
+            #ifdef KERNEL_UNFILTER_SIMD
+                if constexpr(PIXEL_SIMD){
+                    unfilter_pixel::sub<BPP>(raw,out,num_bytes);
+                    return;
+                }
+            #endif
+            unfilter_scalar::sub(raw,out,num_bytes,pixel_bytes);
+            return;
+        case PNG_SCANLINE_FILTER_UP:
+            unfilter_up(raw,out,prev,num_bytes);
+            return;
+        case PNG_SCANLINE_FILTER_AVERAGE:
+            #ifdef KERNEL_UNFILTER_SIMD
+                if constexpr(PIXEL_SIMD){
+                    unfilter_pixel::average<BPP>(raw,out,prev,num_bytes);
+                    return;
+                }
+            #endif
+            unfilter_scalar::average(raw,out,prev,num_bytes,pixel_bytes);
+            return;
+        case PNG_SCANLINE_FILTER_PAETH:
+            #ifdef KERNEL_UNFILTER_SIMD
+                if constexpr(PIXEL_SIMD){
+                    unfilter_pixel::paeth<BPP>(raw,out,prev,num_bytes);
+                    return;
+                }
+            #endif
+            unfilter_scalar::paeth(raw,out,prev,num_bytes,pixel_bytes);
+            return;
+    }
+}
+
+/**
+ * @brief undo the filter of one scanline
+ *
+ * @param in_line filtered scanline, starting with the filter type byte (which must be a valid PNGScanlineFilter)
+ * @param out_line output for the num_bytes defiltered bytes
+ * @param out_line_prev the previous defiltered scanline, NULL for the first scanline
+ * @param num_bytes number of bytes in the scanline (without filter type byte)
+ * @param bpp bytes per pixel, rounded up to whole bytes (i.e. one of 1, 2, 3, 4, 6 and 8 for valid png images)
+ */
+[[gnu::hot,gnu::nonnull(1,2),KERNEL_TARGET]]
+static void unfilter_scanline(
+    const uint8_t* const  in_line,
+    uint8_t* const  out_line,
+    const uint8_t* const  out_line_prev,
+    const uint64_t num_bytes,
+    const uint32_t bpp
+){
+    const PNGScanlineFilter scanline_filter=(PNGScanlineFilter)in_line[0];
+    const uint8_t* const raw=in_line+1;
+
+    switch(bpp){
+        case 1: unfilter_scanline_bpp<1>(scanline_filter,raw,out_line,out_line_prev,num_bytes,bpp); break;
+        case 2: unfilter_scanline_bpp<2>(scanline_filter,raw,out_line,out_line_prev,num_bytes,bpp); break;
+        case 3: unfilter_scanline_bpp<3>(scanline_filter,raw,out_line,out_line_prev,num_bytes,bpp); break;
+        case 4: unfilter_scanline_bpp<4>(scanline_filter,raw,out_line,out_line_prev,num_bytes,bpp); break;
+        case 6: unfilter_scanline_bpp<6>(scanline_filter,raw,out_line,out_line_prev,num_bytes,bpp); break;
+        case 8: unfilter_scanline_bpp<8>(scanline_filter,raw,out_line,out_line_prev,num_bytes,bpp); break;
+        default: unfilter_scanline_bpp<0>(scanline_filter,raw,out_line,out_line_prev,num_bytes,bpp); break;
+    }
+}
+
+#undef KERNEL_UNFILTER_SIMD
@@ -0,0 +1,252 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <zlib.h>
+
+#include "app/image.hpp"
+
+/// maximum size of the payload of one IDAT chunk written by Image_write_png
+static const uint32_t PNG_WRITE_IDAT_CHUNK_SIZE=256*1024;
+/// minimum number of free bytes in the output buffer before each call to deflate
+static const uint64_t PNG_WRITE_DEFLATE_STEP_SIZE=64*1024;
+/// written pixels are 8 bit rgba, i.e. colour type 6 with bit depth 8
+static const uint32_t PNG_WRITE_BYTES_PER_PIXEL=4;
+
+/// growing buffer that holds the complete zlib stream of the image data
+typedef struct PngWriteBuffer{
+    uint8_t* data;
+    uint64_t size;
+    uint64_t capacity;
+}PngWriteBuffer;
+
+/// compress the pending input of stream into buffer with the given flush mode, growing the buffer as required
+static bool PngWriteBuffer_deflate(PngWriteBuffer* const buffer,z_stream* const stream,const int flush){
+    while(true){
+        if(buffer->capacity-buffer->size<PNG_WRITE_DEFLATE_STEP_SIZE){
+            const uint64_t new_capacity=buffer->capacity*2+PNG_WRITE_DEFLATE_STEP_SIZE;
+            uint8_t* const new_data=(uint8_t*)realloc(buffer->data,new_capacity);
+            if(!new_data)
+                return false;
+            buffer->data=new_data;
+            buffer->capacity=new_capacity;
+        }
+
+        const uint64_t avail_out=buffer->capacity-buffer->size<UINT32_MAX?buffer->capacity-buffer->size:UINT32_MAX;
+        stream->next_out=buffer->data+buffer->size;
+        stream->avail_out=(uInt)avail_out;
+        const int ret=deflate(stream,flush);
+        buffer->size+=avail_out-stream->avail_out;
+
+        if(ret==Z_STREAM_END)
+            return true;
+        if(ret!=Z_OK && ret!=Z_BUF_ERROR)
+            return false;
+        // deflate is done with the input (and the flush) once it leaves output space unused
+        if(flush!=Z_FINISH && stream->avail_out>0)
+            return true;
+    }
+}
+
+static void png_write_u32(uint8_t* const dst,const uint32_t value){
+    dst[0]=(uint8_t)(value>>24);
+    dst[1]=(uint8_t)(value>>16);
+    dst[2]=(uint8_t)(value>>8);
+    dst[3]=(uint8_t)value;
+}
+
+static bool png_write_chunk(FILE* const f,const char* const chunk_type,const uint8_t* const data,const uint32_t size){
+    uint8_t header[8];
+    png_write_u32(header,size);
+    memcpy(header+4,chunk_type,4);
+
+    // the crc covers the chunk type and the data
+    uLong crc=crc32(0,header+4,4);
+    if(size>0)
+        crc=crc32(crc,data,size);
+    uint8_t footer[4];
+    png_write_u32(footer,(uint32_t)crc);
+
+    return fwrite(header,1,8,f)==8
+        && (size==0 || fwrite(data,1,size,f)==size)
+        && fwrite(footer,1,4,f)==4;
+}
+
+/// convert num_pixels decoded (bgra) pixels to the rgba samples of a png scanline
+static void png_bgra_to_rgba(const uint8_t* const in,uint8_t* const out,const uint32_t num_pixels){
+    for(uint32_t i=0;i<num_pixels;i++){
+        out[i*4+0]=in[i*4+2];
+        out[i*4+1]=in[i*4+1];
+        out[i*4+2]=in[i*4+0];
+        out[i*4+3]=in[i*4+3];
+    }
+}
+
+static uint8_t png_paeth_predictor(const uint8_t a,const uint8_t b,const uint8_t c){
+    const int p=(int)a+(int)b-(int)c;
+    const int pa=abs(p-(int)a);
+    const int pb=abs(p-(int)b);
+    const int pc=abs(p-(int)c);
+    if(pa<=pb && pa<=pc)
+        return a;
+    if(pb<=pc)
+        return b;
+    return c;
+}
+
+/// filter scanline (with prev_scanline above it, NULL for none) with filter_type into filtered (which starts with the filter type byte),
+/// returns the sum of the absolute values of the filtered bytes as signed numbers
+static uint64_t png_filter_scanline(
+    uint8_t* const filtered,
+    const uint8_t* const scanline,
+    const uint8_t* const prev_scanline,
+    const uint32_t scanline_width,
+    const uint8_t filter_type
+){
+    filtered[0]=filter_type;
+    uint64_t sum=0;
+    for(uint32_t i=0;i<scanline_width;i++){
+        const uint8_t left=i>=PNG_WRITE_BYTES_PER_PIXEL?scanline[i-PNG_WRITE_BYTES_PER_PIXEL]:0;
+        const uint8_t up=prev_scanline?prev_scanline[i]:0;
+        const uint8_t up_left=(prev_scanline && i>=PNG_WRITE_BYTES_PER_PIXEL)?prev_scanline[i-PNG_WRITE_BYTES_PER_PIXEL]:0;
+
+        uint8_t value=scanline[i];
+        switch(filter_type){
+            case 1: value=(uint8_t)(value-left); break;
+            case 2: value=(uint8_t)(value-up); break;
+            case 3: value=(uint8_t)(value-(uint8_t)(((uint32_t)left+(uint32_t)up)>>1)); break;
+            case 4: value=(uint8_t)(value-png_paeth_predictor(left,up,up_left)); break;
+            default: break;
+        }
+        filtered[1+i]=value;
+        sum+=(uint64_t)abs((int)(int8_t)value);
+    }
+    return sum;
+}
+
+bool Image_write_png(const char* const filepath,const ImageData* const image_data,uint32_t num_parts){
+    if(!image_data->data || image_data->width==0 || image_data->height==0 || !image_data->interleaved || image_data->pixel_format!=PIXEL_FORMAT_Ru8Gu8Bu8Au8){
+        fprintf(stderr,"cannot write %s: the image has no 8 bit pixels\n",filepath);
+        return false;
+    }
+    // the scanline width (with the filter type byte) must fit into 32 bits
+    if(image_data->width>(UINT32_MAX-1)/PNG_WRITE_BYTES_PER_PIXEL){
+        fprintf(stderr,"cannot write %s: the image is %" PRIu32 " pixels wide\n",filepath,image_data->width);
+        return false;
+    }
+
+    // every part holds at least one scanline
+    if(num_parts<1)
+        num_parts=1;
+    if(num_parts>image_data->height)
+        num_parts=image_data->height;
+
+    const uint32_t scanline_width=image_data->width*PNG_WRITE_BYTES_PER_PIXEL;
+
+    z_stream stream;
+    memset(&stream,0,sizeof(stream));
+    if(deflateInit(&stream,Z_DEFAULT_COMPRESSION)!=Z_OK){
+        fprintf(stderr,"cannot write %s: failed to initialise zlib\n",filepath);
+        return false;
+    }
+
+    PngWriteBuffer compressed={nullptr,0,0};
+    // one candidate scanline per filter type, then the current and the previous scanline in rgba
+    uint8_t* const filtered=(uint8_t*)malloc((uint64_t)(scanline_width+1)*5+(uint64_t)scanline_width*2);
+    // pairs of first scanline and offset in the zlib stream of all parts but the first, big-endian
+    uint8_t* const restart_points=(uint8_t*)malloc((uint64_t)num_parts*8);
+    bool success=filtered && restart_points;
+    uint8_t* scanline=filtered?filtered+(uint64_t)(scanline_width+1)*5:nullptr;
+    uint8_t* prev_scanline=filtered?scanline+scanline_width:nullptr;
+
+    for(uint32_t part_index=0;success && part_index<num_parts;part_index++){
+        const uint32_t first_scanline=(uint32_t)((uint64_t)part_index*image_data->height/num_parts);
+        const uint32_t end_scanline=(uint32_t)((uint64_t)(part_index+1)*image_data->height/num_parts);
+
+        if(part_index>0){
+            // a full flush ends the data of the previous part at a byte boundary, and resets the compressor state, i.e. no match of
+            // this part refers to the data of a previous one
+            success=PngWriteBuffer_deflate(&compressed,&stream,Z_FULL_FLUSH);
+            if(compressed.size>UINT32_MAX)
+                success=false;
+            png_write_u32(restart_points+(uint64_t)(part_index-1)*8,first_scanline);
+            png_write_u32(restart_points+(uint64_t)(part_index-1)*8+4,(uint32_t)compressed.size);
+        }
+
+        for(uint32_t y=first_scanline;success && y<end_scanline;y++){
+            png_bgra_to_rgba(image_data->data+(uint64_t)y*image_data->stride,scanline,image_data->width);
+
+            // pick the filter with the smallest sum of absolute differences. the first scanline of a part does not refer to the
+            // scanline above it (which belongs to the previous part), i.e. it only uses the None or Sub filter.
+            const uint8_t num_filter_types=y==first_scanline?2:5;
+            uint8_t best_filter_type=0;
+            uint64_t best_sum=UINT64_MAX;
+            for(uint8_t filter_type=0;filter_type<num_filter_types;filter_type++){
+                const uint64_t sum=png_filter_scanline(filtered+(uint64_t)filter_type*(scanline_width+1),scanline,y>0?prev_scanline:nullptr,scanline_width,filter_type);
+                if(sum<best_sum){
+                    best_sum=sum;
+                    best_filter_type=filter_type;
+                }
+            }
+
+            stream.next_in=filtered+(uint64_t)best_filter_type*(scanline_width+1);
+            stream.avail_in=scanline_width+1;
+            success=PngWriteBuffer_deflate(&compressed,&stream,Z_NO_FLUSH);
+
+            uint8_t* const next_prev_scanline=scanline;
+            scanline=prev_scanline;
+            prev_scanline=next_prev_scanline;
+        }
+    }
+    if(success)
+        success=PngWriteBuffer_deflate(&compressed,&stream,Z_FINISH);
+    deflateEnd(&stream);
+    free(filtered);
+
+    if(!success){
+        fprintf(stderr,"cannot write %s: failed to compress the image data\n",filepath);
+        free(restart_points);
+        free(compressed.data);
+        return false;
+    }
+
+    FILE* const f=fopen(filepath,"wb");
+    if(!f){
+        fprintf(stderr,"failed to open %s for writing\n",filepath);
+        free(restart_points);
+        free(compressed.data);
+        return false;
+    }
+
+    static const uint8_t png_signature[8]={0x89,'P','N','G','\r','\n',0x1A,'\n'};
+    success=fwrite(png_signature,1,8,f)==8;
+
+    uint8_t ihdr[13];
+    png_write_u32(ihdr,image_data->width);
+    png_write_u32(ihdr+4,image_data->height);
+    ihdr[8]=8; // bit depth
+    ihdr[9]=6; // colour type rgba
+    ihdr[10]=0; // compression method
+    ihdr[11]=0; // filter method
+    ihdr[12]=0; // no interlacing
+    success=success && png_write_chunk(f,"IHDR",ihdr,13);
+
+    if(num_parts>1)
+        success=success && png_write_chunk(f,"rsPT",restart_points,(num_parts-1)*8);
+
+    for(uint64_t offset=0;success && offset<compressed.size;offset+=PNG_WRITE_IDAT_CHUNK_SIZE){
+        const uint64_t chunk_size=compressed.size-offset<PNG_WRITE_IDAT_CHUNK_SIZE?compressed.size-offset:PNG_WRITE_IDAT_CHUNK_SIZE;
+        success=png_write_chunk(f,"IDAT",compressed.data+offset,(uint32_t)chunk_size);
+    }
+    success=success && png_write_chunk(f,"IEND",nullptr,0);
+
+    if(fclose(f)!=0)
+        success=false;
+    if(!success)
+        fprintf(stderr,"failed to write %s\n",filepath);
+
+    free(restart_points);
+    free(compressed.data);
+    return success;
+}
@@ -0,0 +1,303 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+#include <ctime>
+#include <pthread.h>
+
+#include "app/trace.hpp"
+
+std::atomic<bool> trace_enabled{false};
+
+/// events of one thread, or of a sequence of threads with the same name (see Trace_acquireBuffer)
+typedef struct TraceThreadBuffer{
+    char name[32];
+    /// thread id in the trace
+    uint32_t id;
+    /// the name has been set with Trace_setThreadName, i.e. the buffer is only reused by threads with the same name
+    bool named;
+    /// held by a running thread. the buffer of a thread that exited is reused by the next thread that asks for one (with the same name).
+    bool in_use;
+
+    /// number of events recorded by this thread, the buffer holds the last min(num_events,trace_events_per_thread) of them
+    uint64_t num_events;
+    TraceEvent* events;
+
+    struct TraceThreadBuffer* next;
+}TraceThreadBuffer;
+
+/// guards the list of buffers, and their names and use (the events of a buffer are only written by the thread that holds it)
+static pthread_mutex_t trace_mutex=PTHREAD_MUTEX_INITIALIZER;
+static TraceThreadBuffer* trace_buffers=NULL;
+static uint32_t trace_num_buffers=0;
+static uint32_t trace_events_per_thread=TRACE_DEFAULT_EVENTS_PER_THREAD;
+
+/// incremented whenever the buffers are discarded, so that threads that held a buffer of a previous trace (and are idle or exit while
+/// the buffers are discarded) acquire a new one instead of using the freed one
+static std::atomic<uint64_t> trace_generation{0};
+
+static void Trace_releaseBuffer();
+
+/// the buffer held by the calling thread, which is returned to the free buffers when the thread exits
+struct TraceThreadState{
+    TraceThreadBuffer* buffer=NULL;
+    /// trace_generation when the buffer was acquired
+    uint64_t generation=0;
+
+    ~TraceThreadState(){
+        Trace_releaseBuffer();
+    }
+};
+static thread_local TraceThreadState trace_thread;
+
+/// timestamp (see cpu::timestamp) and CLOCK_MONOTONIC nanoseconds at the start and the end of the trace, to convert timestamps to microseconds
+static uint64_t trace_start_timestamp=0;
+static uint64_t trace_start_ns=0;
+static uint64_t trace_stop_timestamp=0;
+static uint64_t trace_stop_ns=0;
+
+static uint64_t Trace_monotonicNs(){
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC,&time);
+    return (uint64_t)time.tv_sec*1000000000ull+(uint64_t)time.tv_nsec;
+}
+
+/// free all buffers, with trace_mutex held. no thread may be recording events (see Trace_start and Trace_destroy).
+static void Trace_freeBuffers(){
+    trace_generation.fetch_add(1,std::memory_order_release);
+
+    TraceThreadBuffer* buffer=trace_buffers;
+    while(buffer){
+        TraceThreadBuffer* const next=buffer->next;
+        free(buffer->events);
+        free(buffer);
+        buffer=next;
+    }
+    trace_buffers=NULL;
+    trace_num_buffers=0;
+}
+
+/// hand the buffer of the calling thread back to the free buffers (if it still belongs to the current trace)
+static void Trace_releaseBuffer(){
+    if(!trace_thread.buffer)
+        return;
+
+    pthread_mutex_lock(&trace_mutex);
+    // the buffer has been freed if the trace has been restarted or destroyed since it was acquired
+    if(trace_thread.generation==trace_generation.load(std::memory_order_relaxed))
+        trace_thread.buffer->in_use=false;
+    pthread_mutex_unlock(&trace_mutex);
+
+    trace_thread.buffer=NULL;
+}
+
+/// let the calling thread hold a buffer of the current trace: a free buffer with the same name (any free unnamed buffer if name is NULL),
+/// or a new one. NULL if it cannot be allocated.
+///
+/// the decoders start their workers anew for each decode, so reusing the buffers of exited threads bounds the memory of the trace (and
+/// the number of threads in the timeline) by the number of threads that run at the same time, and a worker keeps its thread id.
+static TraceThreadBuffer* Trace_acquireBuffer(const char* const name){
+    pthread_mutex_lock(&trace_mutex);
+
+    TraceThreadBuffer* buffer=NULL;
+    for(TraceThreadBuffer* candidate=trace_buffers;candidate;candidate=candidate->next){
+        if(candidate->in_use || candidate->named!=(name!=NULL))
+            continue;
+        if(name && strcmp(candidate->name,name)!=0)
+            continue;
+
+        buffer=candidate;
+        break;
+    }
+
+    if(!buffer){
+        buffer=(TraceThreadBuffer*)calloc(1,sizeof(TraceThreadBuffer));
+        TraceEvent* const events=(TraceEvent*)malloc(sizeof(TraceEvent)*trace_events_per_thread);
+        if(!buffer || !events){
+            pthread_mutex_unlock(&trace_mutex);
+            free(buffer);
+            free(events);
+            return NULL;
+        }
+        buffer->events=events;
+
+        buffer->id=trace_num_buffers++;
+        if(name)
+            snprintf(buffer->name,sizeof(buffer->name),"%s",name);
+        else
+            snprintf(buffer->name,sizeof(buffer->name),"thread %u",buffer->id);
+        buffer->named=name!=NULL;
+        buffer->next=trace_buffers;
+        trace_buffers=buffer;
+    }
+    buffer->in_use=true;
+
+    trace_thread.buffer=buffer;
+    trace_thread.generation=trace_generation.load(std::memory_order_relaxed);
+
+    pthread_mutex_unlock(&trace_mutex);
+    return buffer;
+}
+
+/// the buffer of the calling thread in the current trace, NULL if it holds none
+static TraceThreadBuffer* Trace_currentBuffer(){
+    if(trace_thread.buffer && trace_thread.generation==trace_generation.load(std::memory_order_acquire))
+        return trace_thread.buffer;
+    return NULL;
+}
+
+/// the buffer of the calling thread in the current trace, acquired on first use. NULL if it cannot be allocated.
+static TraceThreadBuffer* Trace_threadBuffer(){
+    TraceThreadBuffer* const buffer=Trace_currentBuffer();
+    if(buffer)
+        return buffer;
+
+    return Trace_acquireBuffer(NULL);
+}
+
+void Trace_start(const uint32_t events_per_thread){
+    pthread_mutex_lock(&trace_mutex);
+    Trace_freeBuffers();
+    trace_events_per_thread=events_per_thread>0?events_per_thread:TRACE_DEFAULT_EVENTS_PER_THREAD;
+    pthread_mutex_unlock(&trace_mutex);
+
+    trace_start_ns=Trace_monotonicNs();
+    trace_start_timestamp=cpu::timestamp();
+
+    trace_enabled.store(true,std::memory_order_relaxed);
+
+    Trace_setThreadName("main");
+}
+void Trace_stop(){
+    if(!trace_enabled.load(std::memory_order_relaxed))
+        return;
+
+    trace_enabled.store(false,std::memory_order_relaxed);
+
+    trace_stop_timestamp=cpu::timestamp();
+    trace_stop_ns=Trace_monotonicNs();
+}
+void Trace_resume(){
+    trace_enabled.store(true,std::memory_order_relaxed);
+}
+void Trace_destroy(){
+    Trace_stop();
+
+    pthread_mutex_lock(&trace_mutex);
+    Trace_freeBuffers();
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+void Trace_setThreadName(const char* const name){
+    if(!trace_enabled.load(std::memory_order_relaxed))
+        return;
+
+    // names are compared as they are stored, i.e. truncated
+    char buffer_name[sizeof(((TraceThreadBuffer*)NULL)->name)];
+    snprintf(buffer_name,sizeof(buffer_name),"%s",name);
+
+    TraceThreadBuffer* const buffer=Trace_currentBuffer();
+    if(buffer){
+        if(buffer->named && strcmp(buffer->name,buffer_name)==0)
+            return;
+
+        // a thread that has recorded events keeps them, under its new name
+        if(buffer->num_events>0){
+            pthread_mutex_lock(&trace_mutex);
+            memcpy(buffer->name,buffer_name,sizeof(buffer_name));
+            buffer->named=true;
+            pthread_mutex_unlock(&trace_mutex);
+            return;
+        }
+
+        Trace_releaseBuffer();
+    }
+
+    Trace_acquireBuffer(buffer_name);
+}
+void Trace_setThreadName(const char* const name,const uint32_t index){
+    if(!trace_enabled.load(std::memory_order_relaxed))
+        return;
+
+    char indexed_name[sizeof(((TraceThreadBuffer*)NULL)->name)];
+    snprintf(indexed_name,sizeof(indexed_name),"%s %u",name,index);
+    Trace_setThreadName(indexed_name);
+}
+
+void Trace_record(const char* const name,const uint64_t begin,const uint32_t range_start,const uint32_t range_end){
+    if(!trace_enabled.load(std::memory_order_relaxed))
+        return;
+
+    TraceThreadBuffer* const buffer=Trace_threadBuffer();
+    if(!buffer)
+        return;
+
+    TraceEvent* const event=&buffer->events[buffer->num_events%trace_events_per_thread];
+    event->name=name;
+    event->begin=begin;
+    event->end=cpu::timestamp();
+    event->range_start=range_start;
+    event->range_end=range_end;
+
+    buffer->num_events++;
+}
+
+/// write str as json string (names are expected to be plain text, quotes and control characters are dropped)
+static void Trace_writeString(FILE* const f,const char* const str){
+    fputc('"',f);
+    for(const char* c=str;*c;c++)
+        if(*c!='"' && *c!='\\' && (unsigned char)*c>=0x20)
+            fputc(*c,f);
+    fputc('"',f);
+}
+
+bool Trace_write(const char* const filepath){
+    FILE* const f=fopen(filepath,"w");
+    if(!f){
+        fprintf(stderr,"failed to open %s for writing\n",filepath);
+        return false;
+    }
+
+    // timestamps are converted to microseconds with the rate measured over the whole trace
+    uint64_t end_timestamp=trace_stop_timestamp;
+    uint64_t end_ns=trace_stop_ns;
+    if(trace_enabled.load(std::memory_order_relaxed)){
+        end_timestamp=cpu::timestamp();
+        end_ns=Trace_monotonicNs();
+    }
+    double ticks_per_us=1e-3;
+    if(end_ns>trace_start_ns && end_timestamp>trace_start_timestamp)
+        ticks_per_us=(double)(end_timestamp-trace_start_timestamp)/((double)(end_ns-trace_start_ns)*1e-3);
+
+    pthread_mutex_lock(&trace_mutex);
+
+    fprintf(f,"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first_event=true;
+    for(const TraceThreadBuffer* buffer=trace_buffers;buffer;buffer=buffer->next){
+        fprintf(f,"%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ",first_event?"":",\n",buffer->id);
+        Trace_writeString(f,buffer->name);
+        fprintf(f,"}}");
+        first_event=false;
+
+        const uint64_t num_kept_events=buffer->num_events<trace_events_per_thread?buffer->num_events:trace_events_per_thread;
+        for(uint64_t i=buffer->num_events-num_kept_events;i<buffer->num_events;i++){
+            const TraceEvent* const event=&buffer->events[i%trace_events_per_thread];
+
+            const double ts=(double)(int64_t)(event->begin-trace_start_timestamp)/ticks_per_us;
+            const double dur=(double)(event->end-event->begin)/ticks_per_us;
+
+            fprintf(f,",\n{\"name\": ");
+            Trace_writeString(f,event->name);
+            fprintf(f,", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f",buffer->id,ts,dur);
+            if(event->range_end>event->range_start)
+                fprintf(f,", \"args\": {\"start\": %u, \"end\": %u}",event->range_start,event->range_end);
+            fprintf(f,"}");
+        }
+    }
+    fprintf(f,"\n]}\n");
+
+    pthread_mutex_unlock(&trace_mutex);
+
+    fclose(f);
+    return true;
+}